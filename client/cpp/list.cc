@@ -11,7 +11,6 @@
 #include <glog/logging.h>
 #include <iostream>
 #include <string>
-#include <set>
 #include "lib/common.h"
 #include "lib/openinstrument.pb.h"
 #include "lib/protobuf.h"
@@ -22,7 +21,8 @@
 using namespace openinstrument;
 using namespace std;
 
-DEFINE_int32(max_variables, 100, "Maximum number of variables to return");
+DEFINE_int32(max_variables, 100, "Maximum number of variables to return, 0 for all of them");
+DEFINE_int32(page_size, 1000, "Number of variables to request from each server at a time");
 
 void usage(char *argv[]) {
   cerr << "\nUsage: \n"
@@ -57,16 +57,16 @@ int main(int argc, char *argv[]) {
   try {
     proto::ListRequest req;
     req.set_max_variables(FLAGS_max_variables);
+    req.set_page_size(FLAGS_page_size);
     Variable(argv[2]).ToProtobuf(req.mutable_prefix());
     StoreClient client;
-    scoped_ptr<proto::ListResponse> response(client.List(req));
-    set<string> variables;
-    for (auto &stream : response->stream()) {
-      Variable var(stream.variable());
-      variables.insert(var.ToString());
-    }
-    for (string var : variables)
-      cout << var << endl;
+    // Variables come back already sorted, and are printed as each page arrives.
+    ListIterator it(&client, req);
+    proto::StreamVariable variable;
+    while (it.Next(&variable))
+      cout << Variable(variable).ToString() << endl;
+    if (!it.success())
+      throw runtime_error(it.errormessage());
   } catch (exception &e) {
     cerr << e.what();
     usage(argv);
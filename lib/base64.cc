@@ -23,97 +23,553 @@
 
    René Nyffenegger rene.nyffenegger@adp-gmbh.ch
 
+   This is an altered version. The codec has been rewritten to be table driven, with SSSE3 and AVX2 versions chosen at
+   runtime, and to read and write Cords.
 */
 
-#include "base64.h"
+#include <string.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "lib/base64.h"
+#include "lib/common.h"
+#include "lib/cord.h"
 
-static const std::string base64_chars =
-             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-             "abcdefghijklmnopqrstuvwxyz"
-             "0123456789+/";
+// The SSSE3 and AVX2 kernels are compiled with target attributes so that the rest of the tree doesn't need -mavx2.
+// Intrinsics can only be used that way from GCC 4.9 and clang 3.8, older compilers only get the scalar version.
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    ((defined(__clang__) && (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))) || \
+     (!defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#include <cpuid.h>
+#include <immintrin.h>
+#define BASE64_X86 1
+#endif
 
+namespace openinstrument {
 
-static inline bool is_base64(unsigned char c) {
-  return (isalnum(c) || (c == '+') || (c == '/'));
+namespace {
+
+const char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Maps each character to its 6-bit value, or -1 if it isn't part of the alphabet.
+struct DecodeTable {
+  DecodeTable() {
+    memset(values, -1, sizeof(values));
+    for (int i = 0; i < 64; ++i)
+      values[static_cast<uint8_t>(kAlphabet[i])] = i;
+  }
+  int8_t values[256];
+};
+
+const DecodeTable kDecodeTable;
+
+// Encode <groups> groups of 3 bytes from <in> to 4 characters each in <out>.
+typedef void (*EncodeFunction)(const uint8_t *in, size_t groups, char *out);
+
+// Decode <groups> groups of 4 characters from <in> to 3 bytes each in <out>, stopping at the first group containing a
+// character which isn't in the alphabet. Returns the number of groups decoded. <out> has room for <out_space> bytes,
+// which may be more than is decoded.
+typedef size_t (*DecodeFunction)(const char *in, size_t groups, uint8_t *out, size_t out_space);
+
+void EncodeScalar(const uint8_t *in, size_t groups, char *out) {
+  for (size_t i = 0; i < groups; ++i, in += 3, out += 4) {
+    uint32_t value = (in[0] << 16) | (in[1] << 8) | in[2];
+    out[0] = kAlphabet[value >> 18];
+    out[1] = kAlphabet[(value >> 12) & 0x3f];
+    out[2] = kAlphabet[(value >> 6) & 0x3f];
+    out[3] = kAlphabet[value & 0x3f];
+  }
 }
 
-std::string Base64Encode(unsigned char const* bytes_to_encode, unsigned int in_len) {
-  std::string ret;
-  int i = 0;
-  int j = 0;
-  unsigned char char_array_3[3];
-  unsigned char char_array_4[4];
-
-  while (in_len--) {
-    char_array_3[i++] = *(bytes_to_encode++);
-    if (i == 3) {
-      char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-      char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-      char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-      char_array_4[3] = char_array_3[2] & 0x3f;
-
-      for (i = 0; (i <4) ; i++)
-        ret += base64_chars[char_array_4[i]];
-      i = 0;
-    }
+size_t DecodeScalar(const char *in, size_t groups, uint8_t *out, size_t out_space) {
+  const int8_t *table = kDecodeTable.values;
+  for (size_t i = 0; i < groups; ++i, in += 4, out += 3) {
+    int32_t a = table[static_cast<uint8_t>(in[0])];
+    int32_t b = table[static_cast<uint8_t>(in[1])];
+    int32_t c = table[static_cast<uint8_t>(in[2])];
+    int32_t d = table[static_cast<uint8_t>(in[3])];
+    if ((a | b | c | d) < 0)
+      return i;
+    uint32_t value = (a << 18) | (b << 12) | (c << 6) | d;
+    out[0] = value >> 16;
+    out[1] = value >> 8;
+    out[2] = value;
   }
+  return groups;
+}
 
-  if (i) {
-    for (j = i; j < 3; j++)
-      char_array_3[j] = '\0';
+#ifdef BASE64_X86
 
-    char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-    char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-    char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-    char_array_4[3] = char_array_3[2] & 0x3f;
+// The vector versions follow the methods described by Wojciech Muła and Daniel Lemire in "Faster Base64 Encoding and
+// Decoding Using AVX2 Instructions". Each group of 3 bytes is spread over a 32-bit lane, split into 6-bit indexes with
+// multiplies, and turned into characters by adding an offset looked up from the range each index falls into.
+// Decoding reverses this, using the high and low nibbles of each character to check it's valid.
 
-    for (j = 0; (j < i + 1); j++)
-      ret += base64_chars[char_array_4[j]];
+__attribute__((target("ssse3")))
+inline __m128i EncodeLookupSsse3(__m128i indexes) {
+  // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+  __m128i result = _mm_subs_epu8(indexes, _mm_set1_epi8(51));
+  __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indexes);
+  result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+  const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, result), indexes);
+}
 
-    while ((i++ < 3))
-      ret += '=';
+__attribute__((target("ssse3")))
+void EncodeSsse3(const uint8_t *in, size_t groups, char *out) {
+  size_t done = 0;
+  // Each step reads 16 bytes but only uses 12.
+  for (; groups - done >= 6; done += 4) {
+    __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done * 3));
+    input = _mm_shuffle_epi8(input, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(input, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(input, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i chars = EncodeLookupSsse3(_mm_or_si128(t1, t3));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + done * 4), chars);
   }
+  EncodeScalar(in + done * 3, groups - done, out + done * 4);
+}
 
-  return ret;
+__attribute__((target("ssse3")))
+size_t DecodeSsse3(const char *in, size_t groups, uint8_t *out, size_t out_space) {
+  const __m128i shift_lut = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_lut = _mm_setr_epi8(0xa8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf0, 0x54, 0x50,
+                                         0x50, 0x50, 0x54);
+  const __m128i bit_lut = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+  size_t done = 0;
+  // Each step writes 16 bytes but only 12 are used.
+  for (; groups - done >= 4 && out_space - done * 3 >= 16; done += 4) {
+    __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done * 4));
+    __m128i hi = _mm_and_si128(_mm_srli_epi32(input, 4), _mm_set1_epi8(0x0f));
+    __m128i lo = _mm_and_si128(input, _mm_set1_epi8(0x0f));
+    // Check each low nibble is allowed with its high nibble.
+    __m128i valid = _mm_and_si128(_mm_shuffle_epi8(mask_lut, lo), _mm_shuffle_epi8(bit_lut, hi));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(valid, _mm_setzero_si128())))
+      break;
+    // '+' and '/' share a high nibble, so '/' needs a different offset.
+    __m128i shift = _mm_shuffle_epi8(shift_lut, hi);
+    shift = _mm_add_epi8(shift, _mm_and_si128(_mm_cmpeq_epi8(input, _mm_set1_epi8('/')), _mm_set1_epi8(-3)));
+    __m128i values = _mm_add_epi8(input, shift);
+    __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + done * 3), packed);
+  }
+  return done + DecodeScalar(in + done * 4, groups - done, out + done * 3, out_space - done * 3);
 }
 
-std::string Base64Decode(std::string const& encoded_string) {
-  int in_len = encoded_string.size();
-  int i = 0;
-  int j = 0;
-  int in_ = 0;
-  unsigned char char_array_4[4], char_array_3[3];
-  std::string ret;
+__attribute__((target("avx2")))
+void EncodeAvx2(const uint8_t *in, size_t groups, char *out) {
+  const __m256i spread = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                          1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                           'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  size_t done = 0;
+  // Each step reads 28 bytes but only uses 24, as 12 bytes from each of two 16 byte loads.
+  for (; groups - done >= 10; done += 8) {
+    const uint8_t *src = in + done * 3;
+    __m256i input = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 12)), 1);
+    input = _mm256_shuffle_epi8(input, spread);
+    __m256i t0 = _mm256_and_si256(input, _mm256_set1_epi32(0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(input, _mm256_set1_epi32(0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    __m256i indexes = _mm256_or_si256(t1, t3);
+    __m256i result = _mm256_subs_epu8(indexes, _mm256_set1_epi8(51));
+    __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indexes);
+    result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    __m256i chars = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, result), indexes);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + done * 4), chars);
+  }
+  EncodeSsse3(in + done * 3, groups - done, out + done * 4);
+}
+
+__attribute__((target("avx2")))
+size_t DecodeAvx2(const char *in, size_t groups, uint8_t *out, size_t out_space) {
+  const __m256i shift_lut = _mm256_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_lut = _mm256_setr_epi8(0xa8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf0, 0x54,
+                                            0x50, 0x50, 0x50, 0x54,
+                                            0xa8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf0, 0x54,
+                                            0x50, 0x50, 0x50, 0x54);
+  const __m256i bit_lut = _mm256_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0, 0, 0, 0, 0, 0, 0, 0,
+                                           0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  size_t done = 0;
+  // Each step writes 32 bytes but only 24 are used.
+  for (; groups - done >= 8 && out_space - done * 3 >= 32; done += 8) {
+    __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + done * 4));
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi32(input, 4), _mm256_set1_epi8(0x0f));
+    __m256i lo = _mm256_and_si256(input, _mm256_set1_epi8(0x0f));
+    __m256i valid = _mm256_and_si256(_mm256_shuffle_epi8(mask_lut, lo), _mm256_shuffle_epi8(bit_lut, hi));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(valid, _mm256_setzero_si256())))
+      break;
+    __m256i shift = _mm256_shuffle_epi8(shift_lut, hi);
+    shift = _mm256_add_epi8(shift, _mm256_and_si256(_mm256_cmpeq_epi8(input, _mm256_set1_epi8('/')),
+                                                    _mm256_set1_epi8(-3)));
+    __m256i values = _mm256_add_epi8(input, shift);
+    __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+    __m256i packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    packed = _mm256_shuffle_epi8(packed, pack);
+    // Bring the 12 bytes from each half together.
+    packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + done * 3), packed);
+  }
+  return done + DecodeSsse3(in + done * 4, groups - done, out + done * 3, out_space - done * 3);
+}
+
+bool CpuHasSsse3() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  return ecx & bit_SSSE3;
+}
+
+bool CpuHasAvx2() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    return false;
+  // The OS must save the AVX registers on context switches.
+  uint32_t xcr0, xcr0_high;
+  __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+  if ((xcr0 & 6) != 6)
+    return false;
+  if (__get_cpuid_max(0, NULL) < 7)
+    return false;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return ebx & bit_AVX2;
+}
+
+#endif  // BASE64_X86
+
+struct Codec {
+  const char *name;
+  EncodeFunction encode;
+  DecodeFunction decode;
+};
+
+const Codec kScalarCodec = { "scalar", EncodeScalar, DecodeScalar };
+#ifdef BASE64_X86
+const Codec kSsse3Codec = { "ssse3", EncodeSsse3, DecodeSsse3 };
+const Codec kAvx2Codec = { "avx2", EncodeAvx2, DecodeAvx2 };
+#endif
+
+const Codec *BestCodec() {
+#ifdef BASE64_X86
+  if (CpuHasAvx2())
+    return &kAvx2Codec;
+  if (CpuHasSsse3())
+    return &kSsse3Codec;
+#endif
+  return &kScalarCodec;
+}
+
+// Set by SetBase64Implementation(), otherwise the best codec for the CPU is used.
+const Codec *volatile selected_codec = NULL;
+
+inline const Codec &GetCodec() {
+  // Chosen once, the first time anything is encoded or decoded. The initialisation of a local static is thread-safe.
+  static const Codec *best_codec = BestCodec();
+  const Codec *selected = selected_codec;
+  return selected ? *selected : *best_codec;
+}
+
+void SelectCodec(const Codec *codec) {
+  selected_codec = codec;
+  __sync_synchronize();
+}
+
+// Writes to output space which may be split into several pieces, such as that returned by Cord::GetAppendBufs().
+class IovecWriter {
+ public:
+  explicit IovecWriter(const std::vector<struct iovec> &iov) : iov_(iov), index_(0), pos_(0), written_(0) {}
+
+  // The contiguous space at the current position.
+  size_t space() const {
+    return index_ < iov_.size() ? iov_[index_].iov_len - pos_ : 0;
+  }
+
+  char *ptr() const {
+    return static_cast<char *>(iov_[index_].iov_base) + pos_;
+  }
+
+  void Advance(size_t size) {
+    pos_ += size;
+    written_ += size;
+    if (pos_ == iov_[index_].iov_len) {
+      ++index_;
+      pos_ = 0;
+    }
+  }
 
-  while (in_len-- && (encoded_string[in_] != '=') && is_base64(encoded_string[in_])) {
-    char_array_4[i++] = encoded_string[in_++];
-    if (i ==4) {
-      for (i = 0; i <4; i++)
-        char_array_4[i] = base64_chars.find(char_array_4[i]);
+  // Copy a few bytes, which may cross into the next piece.
+  void Write(const char *data, size_t size) {
+    while (size) {
+      size_t len = std::min(size, space());
+      memcpy(ptr(), data, len);
+      Advance(len);
+      data += len;
+      size -= len;
+    }
+  }
+
+  uint64_t written() const {
+    return written_;
+  }
+
+ private:
+  const std::vector<struct iovec> &iov_;
+  size_t index_;
+  size_t pos_;
+  uint64_t written_;
+};
 
-      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-      char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-      char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+inline uint64_t EncodedSize(uint64_t size) {
+  return (size + 2) / 3 * 4;
+}
 
-      for (i = 0; (i < 3); i++)
-        ret += char_array_3[i];
-      i = 0;
+void EncodeGroups(const uint8_t *in, size_t groups, IovecWriter *writer) {
+  const Codec &c = GetCodec();
+  while (groups) {
+    size_t space = writer->space();
+    if (space < 4) {
+      // The group straddles two pieces of output.
+      char tmp[4];
+      EncodeScalar(in, 1, tmp);
+      writer->Write(tmp, 4);
+      in += 3;
+      --groups;
+      continue;
     }
+    size_t count = std::min(groups, space / 4);
+    c.encode(in, count, writer->ptr());
+    writer->Advance(count * 4);
+    in += count * 3;
+    groups -= count;
   }
+}
 
-  if (i) {
-    for (j = i; j <4; j++)
-      char_array_4[j] = 0;
+// Encode the last 1 or 2 bytes of input, with padding.
+void EncodeTail(const uint8_t *in, size_t size, IovecWriter *writer) {
+  uint8_t group[3] = { 0, 0, 0 };
+  memcpy(group, in, size);
+  char tmp[4];
+  EncodeScalar(group, 1, tmp);
+  for (size_t i = size + 1; i < 4; ++i)
+    tmp[i] = '=';
+  writer->Write(tmp, 4);
+}
 
-    for (j = 0; j <4; j++)
-      char_array_4[j] = base64_chars.find(char_array_4[j]);
+// Returns the number of groups decoded, which is less than <groups> if one contains an invalid character.
+size_t DecodeGroups(const char *in, size_t groups, IovecWriter *writer) {
+  const Codec &c = GetCodec();
+  size_t done = 0;
+  while (done < groups) {
+    size_t space = writer->space();
+    if (space < 3) {
+      uint8_t tmp[3];
+      if (!DecodeScalar(in, 1, tmp, sizeof(tmp)))
+        return done;
+      writer->Write(reinterpret_cast<char *>(tmp), 3);
+      in += 4;
+      ++done;
+      continue;
+    }
+    size_t count = std::min(groups - done, space / 3);
+    size_t decoded = c.decode(in, count, reinterpret_cast<uint8_t *>(writer->ptr()), space);
+    writer->Advance(decoded * 3);
+    in += decoded * 4;
+    done += decoded;
+    if (decoded < count)
+      return done;
+  }
+  return done;
+}
 
-    char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-    char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-    char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+// Decode whatever follows the last complete group: up to 3 more characters, then padding. Returns false if anything
+// else is found.
+bool DecodeRest(const string &rest, IovecWriter *writer) {
+  size_t i = 0;
+  uint32_t value = 0;
+  for (; i < rest.size() && i < 4; ++i) {
+    int8_t bits = kDecodeTable.values[static_cast<uint8_t>(rest[i])];
+    if (bits < 0)
+      break;
+    value = (value << 6) | bits;
+  }
+  bool valid = i != 1 && i != 4;
+  if (i == 2) {
+    char byte = value >> 4;
+    writer->Write(&byte, 1);
+  } else if (i == 3) {
+    char bytes[2] = { static_cast<char>(value >> 10), static_cast<char>(value >> 2) };
+    writer->Write(bytes, 2);
+  }
+  while (i < rest.size() && rest[i] == '=')
+    ++i;
+  for (; i < rest.size(); ++i) {
+    if (!isspace(rest[i]))
+      valid = false;
+  }
+  return valid;
+}
 
-    for (j = 0; (j < i - 1); j++) ret += char_array_3[j];
+bool Decode(const Cord &input, IovecWriter *writer) {
+  char carry[4];
+  size_t carried = 0;
+  string rest;
+  bool stopped = false;
+  for (Cord::const_iterator i = input.begin(); i != input.end(); ++i) {
+    const char *p = i->buffer(), *end = p + i->size();
+    if (!stopped && carried) {
+      // Complete the group started in the previous buffer.
+      while (carried < 4 && p < end)
+        carry[carried++] = *p++;
+      if (carried < 4)
+        continue;
+      carried = 0;
+      if (!DecodeGroups(carry, 1, writer)) {
+        rest.assign(carry, 4);
+        stopped = true;
+      }
+    }
+    if (!stopped) {
+      size_t groups = (end - p) / 4;
+      size_t done = DecodeGroups(p, groups, writer);
+      p += done * 4;
+      if (done < groups) {
+        stopped = true;
+      } else {
+        carried = end - p;
+        memcpy(carry, p, carried);
+        p = end;
+      }
+    }
+    if (stopped)
+      rest.append(p, end - p);
   }
+  rest.append(carry, carried);
+  return DecodeRest(rest, writer);
+}
+
+void Encode(const uint8_t *in, size_t size, IovecWriter *writer) {
+  EncodeGroups(in, size / 3, writer);
+  if (size % 3)
+    EncodeTail(in + size / 3 * 3, size % 3, writer);
+}
 
+}  // namespace
+
+std::string Base64Encode(unsigned char const *bytes_to_encode, unsigned int in_len) {
+  std::string ret(EncodedSize(in_len), '\0');
+  if (ret.empty())
+    return ret;
+  std::vector<struct iovec> iov(1);
+  iov[0].iov_base = &ret[0];
+  iov[0].iov_len = ret.size();
+  IovecWriter writer(iov);
+  Encode(bytes_to_encode, in_len, &writer);
   return ret;
 }
+
+std::string Base64Decode(std::string const &encoded_string) {
+  Cord input;
+  input.Append(encoded_string);
+  std::string ret;
+  Base64Decode(input, &ret);
+  return ret;
+}
+
+void Base64Encode(const StringPiece &input, Cord *output) {
+  std::vector<struct iovec> iov;
+  uint64_t size = EncodedSize(input.size());
+  output->GetAppendBufs(size, &iov);
+  IovecWriter writer(iov);
+  Encode(reinterpret_cast<const uint8_t *>(input.data()), input.size(), &writer);
+  output->CommitAppend(size);
+}
+
+void Base64Encode(const Cord &input, Cord *output) {
+  std::vector<struct iovec> iov;
+  uint64_t size = EncodedSize(input.size());
+  output->GetAppendBufs(size, &iov);
+  IovecWriter writer(iov);
+  uint8_t carry[3];
+  size_t carried = 0;
+  for (Cord::const_iterator i = input.begin(); i != input.end(); ++i) {
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(i->buffer()), *end = p + i->size();
+    if (carried) {
+      // Complete the group started in the previous buffer.
+      while (carried < 3 && p < end)
+        carry[carried++] = *p++;
+      if (carried < 3)
+        continue;
+      EncodeGroups(carry, 1, &writer);
+      carried = 0;
+    }
+    size_t groups = (end - p) / 3;
+    EncodeGroups(p, groups, &writer);
+    p += groups * 3;
+    carried = end - p;
+    memcpy(carry, p, carried);
+  }
+  if (carried)
+    EncodeTail(carry, carried, &writer);
+  output->CommitAppend(size);
+}
+
+bool Base64Decode(const Cord &input, Cord *output) {
+  std::vector<struct iovec> iov;
+  output->GetAppendBufs(input.size() / 4 * 3 + 3, &iov);
+  IovecWriter writer(iov);
+  bool valid = Decode(input, &writer);
+  output->CommitAppend(writer.written());
+  return valid;
+}
+
+bool Base64Decode(const Cord &input, string *output) {
+  size_t start = output->size();
+  output->resize(start + input.size() / 4 * 3 + 3);
+  std::vector<struct iovec> iov(1);
+  iov[0].iov_base = &(*output)[start];
+  iov[0].iov_len = output->size() - start;
+  IovecWriter writer(iov);
+  bool valid = Decode(input, &writer);
+  output->resize(start + writer.written());
+  return valid;
+}
+
+const char *Base64Implementation() {
+  return GetCodec().name;
+}
+
+bool SetBase64Implementation(const string &name) {
+  if (name == kScalarCodec.name) {
+    SelectCodec(&kScalarCodec);
+    return true;
+  }
+#ifdef BASE64_X86
+  if (name == kSsse3Codec.name && CpuHasSsse3()) {
+    SelectCodec(&kSsse3Codec);
+    return true;
+  }
+  if (name == kAvx2Codec.name && CpuHasAvx2()) {
+    SelectCodec(&kAvx2Codec);
+    return true;
+  }
+#endif
+  return false;
+}
+
+}  // namespace openinstrument
@@ -1,9 +1,47 @@
-#include <string>
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
 
 #ifndef _OPENINSTRUMENT_LIB_BASE64_H_
 #define _OPENINSTRUMENT_LIB_BASE64_H_
 
+#include <string>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/string.h"
+
+namespace openinstrument {
+
+// Base64 encoding and decoding with the standard alphabet and '=' padding.
+// Whole blocks are handled with SSSE3 or AVX2 instructions when the CPU supports them, chosen at runtime.
+
 std::string Base64Encode(unsigned char const *, unsigned int len);
+
+// Decodes up to the first character which isn't valid base64.
 std::string Base64Decode(std::string const &s);
 
+// Append the base64 encoding of <input> to <output>. The output space is allocated once, up front.
+void Base64Encode(const StringPiece &input, Cord *output);
+void Base64Encode(const Cord &input, Cord *output);
+
+// Append the decoded contents of <input> to <output>. Decoding stops at the end of the data, which is either the end
+// of the input or the '=' padding. Returns false if anything other than padding or whitespace follows the data, or the
+// input ends part way through a byte.
+bool Base64Decode(const Cord &input, Cord *output);
+bool Base64Decode(const Cord &input, string *output);
+
+// The implementation in use: "avx2", "ssse3" or "scalar".
+const char *Base64Implementation();
+
+// Use the named implementation instead of the best one available, mainly for tests. This is not thread safe.
+// Returns false if the CPU doesn't support it.
+bool SetBase64Implementation(const string &name);
+
+}  // namespace openinstrument
+
 #endif  // _OPENINSTRUMENT_LIB_BASE64_H_
@@ -0,0 +1,177 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "lib/base64.h"
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/string.h"
+
+namespace openinstrument {
+
+// Straightforward encoder to check the others against.
+string ReferenceEncode(const string &input) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string output;
+  for (size_t i = 0; i < input.size(); i += 3) {
+    uint32_t value = static_cast<uint8_t>(input[i]) << 16;
+    if (i + 1 < input.size())
+      value |= static_cast<uint8_t>(input[i + 1]) << 8;
+    if (i + 2 < input.size())
+      value |= static_cast<uint8_t>(input[i + 2]);
+    output += alphabet[value >> 18];
+    output += alphabet[(value >> 12) & 0x3f];
+    output += i + 1 < input.size() ? alphabet[(value >> 6) & 0x3f] : '=';
+    output += i + 2 < input.size() ? alphabet[value & 0x3f] : '=';
+  }
+  return output;
+}
+
+string RandomString(size_t size) {
+  string output(size, '\0');
+  for (size_t i = 0; i < size; ++i)
+    output[i] = random() & 0xff;
+  return output;
+}
+
+Cord MakeCord(const string &input) {
+  Cord output;
+  output.CopyFrom(input);
+  return output;
+}
+
+class Base64Test : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    const char *names[] = { "scalar", "ssse3", "avx2" };
+    for (size_t i = 0; i < 3; ++i) {
+      if (SetBase64Implementation(names[i]))
+        implementations_.push_back(names[i]);
+    }
+    ASSERT_FALSE(implementations_.empty());
+  }
+
+  virtual void TearDown() {
+    SetBase64Implementation(implementations_.back());
+  }
+
+  vector<string> implementations_;
+};
+
+TEST_F(Base64Test, RoundTrip) {
+  srandom(1);
+  vector<string> inputs;
+  for (size_t size = 0; size <= 200; ++size)
+    inputs.push_back(RandomString(size));
+  inputs.push_back(RandomString(1024 * 1024 + 1));
+
+  for (size_t i = 0; i < implementations_.size(); ++i) {
+    ASSERT_TRUE(SetBase64Implementation(implementations_[i]));
+    EXPECT_EQ(implementations_[i], Base64Implementation());
+    for (size_t j = 0; j < inputs.size(); ++j) {
+      const string &input = inputs[j];
+      string expected = ReferenceEncode(input);
+      string encoded = Base64Encode(reinterpret_cast<const unsigned char *>(input.data()), input.size());
+      ASSERT_EQ(expected, encoded) << implementations_[i] << " size " << input.size();
+
+      Cord cord_encoded;
+      Base64Encode(StringPiece(input), &cord_encoded);
+      ASSERT_EQ(expected, cord_encoded.ToString()) << implementations_[i] << " size " << input.size();
+
+      Cord decoded;
+      ASSERT_TRUE(Base64Decode(cord_encoded, &decoded)) << implementations_[i] << " size " << input.size();
+      ASSERT_EQ(input, decoded.ToString()) << implementations_[i] << " size " << input.size();
+      ASSERT_EQ(input, Base64Decode(encoded)) << implementations_[i] << " size " << input.size();
+    }
+  }
+}
+
+TEST_F(Base64Test, SplitBuffers) {
+  srandom(2);
+  string input = RandomString(10000);
+  string expected = ReferenceEncode(input);
+  for (size_t i = 0; i < implementations_.size(); ++i) {
+    ASSERT_TRUE(SetBase64Implementation(implementations_[i]));
+    // Buffer sizes which aren't a multiple of the group size, so groups are split across input and output buffers.
+    Cord cord_input;
+    cord_input.set_default_buffer_size(101);
+    for (size_t pos = 0; pos < input.size(); pos += 7)
+      cord_input.CopyFrom(input.substr(pos, 7));
+
+    Cord encoded;
+    encoded.set_default_buffer_size(1001);
+    Base64Encode(cord_input, &encoded);
+    ASSERT_EQ(expected, encoded.ToString()) << implementations_[i];
+
+    Cord split_encoded;
+    split_encoded.set_default_buffer_size(103);
+    for (size_t pos = 0; pos < expected.size(); pos += 13)
+      split_encoded.CopyFrom(expected.substr(pos, 13));
+    Cord decoded;
+    decoded.set_default_buffer_size(997);
+    ASSERT_TRUE(Base64Decode(split_encoded, &decoded)) << implementations_[i];
+    EXPECT_EQ(input, decoded.ToString()) << implementations_[i];
+
+    string decoded_string("prefix");
+    ASSERT_TRUE(Base64Decode(split_encoded, &decoded_string)) << implementations_[i];
+    EXPECT_EQ("prefix" + input, decoded_string) << implementations_[i];
+  }
+}
+
+TEST_F(Base64Test, Padding) {
+  Cord input, output;
+  input.CopyFrom("aGVsbG8=");
+  ASSERT_TRUE(Base64Decode(input, &output));
+  EXPECT_EQ("hello", output.ToString());
+
+  // Missing padding and trailing whitespace are accepted.
+  string decoded;
+  ASSERT_TRUE(Base64Decode(MakeCord("aGVsbG8"), &decoded));
+  EXPECT_EQ("hello", decoded);
+  decoded.clear();
+  ASSERT_TRUE(Base64Decode(MakeCord("aGVsbG8h\r\n"), &decoded));
+  EXPECT_EQ("hello!", decoded);
+  decoded.clear();
+  ASSERT_TRUE(Base64Decode(MakeCord(""), &decoded));
+  EXPECT_EQ("", decoded);
+}
+
+TEST_F(Base64Test, Invalid) {
+  for (size_t i = 0; i < implementations_.size(); ++i) {
+    ASSERT_TRUE(SetBase64Implementation(implementations_[i]));
+    // An invalid character deep in the input, after a long run of valid data.
+    string valid = ReferenceEncode(string(300, 'x'));
+    string decoded;
+    string input = valid.substr(0, 200) + "!" + valid.substr(201);
+    EXPECT_FALSE(Base64Decode(MakeCord(input), &decoded)) << implementations_[i];
+    // Whatever came before the invalid group is still decoded.
+    EXPECT_EQ(string(150, 'x'), decoded) << implementations_[i];
+
+    decoded.clear();
+    EXPECT_FALSE(Base64Decode(MakeCord(valid + " garbage"), &decoded)) << implementations_[i];
+    decoded.clear();
+    EXPECT_FALSE(Base64Decode(MakeCord("aGVsbG8=x"), &decoded)) << implementations_[i];
+    decoded.clear();
+    // A single character can't make a whole byte.
+    EXPECT_FALSE(Base64Decode(MakeCord("aGVsb"), &decoded)) << implementations_[i];
+
+    // The string version returns the valid prefix, as it always has.
+    EXPECT_EQ("hello", Base64Decode(string("aGVsbG8=!!!")));
+  }
+}
+
+}  // namespace openinstrument
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
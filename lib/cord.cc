@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <deque>
 #include <string>
+#include <vector>
 #include "lib/common.h"
 #include "lib/cord.h"
 #include "lib/string.h"
@@ -19,26 +20,76 @@ namespace openinstrument {
 using std::deque;
 
 bool Cord::operator==(const Cord &cord) const {
-  deque<CordBuffer>::const_iterator left = buffers_.begin();
-  deque<CordBuffer>::const_iterator right = cord.buffers_.begin();
   if (cord.size() != size())
     return false;
+  // The two Cords may be split into buffers differently.
+  const_iterator left = buffers_.begin(), right = cord.buffers_.begin();
+  uint32_t left_offset = 0, right_offset = 0;
   while (left != buffers_.end() && right != cord.buffers_.end()) {
-    if (left->size() != right->size())
+    uint32_t len = std::min(left->size() - left_offset, right->size() - right_offset);
+    if (memcmp(left->buffer() + left_offset, right->buffer() + right_offset, len) != 0)
       return false;
+    left_offset += len;
+    right_offset += len;
+    if (left_offset == left->size()) {
+      ++left;
+      left_offset = 0;
+    }
+    if (right_offset == right->size()) {
+      ++right;
+      right_offset = 0;
+    }
+  }
+  return true;
+}
 
-    if (strncmp(left->buffer(), right->buffer(), left->size() != 0))
-      return false;
+void Cord::swap(Cord &other) {
+  buffers_.swap(other.buffers_);
+  ends_.swap(other.ends_);
+  std::swap(size_, other.size_);
+  std::swap(start_, other.start_);
+}
+
+void Cord::PushBack(CordBuffer &&buf) {
+  uint32_t size = buf.size();
+  buffers_.push_back(std::move(buf));
+  ends_.push_back((ends_.empty() ? start_ : ends_.back()) + size);
+  size_ += size;
+}
 
-    ++left;
-    ++right;
+void Cord::Reindex(size_t index) {
+  uint64_t position = index ? ends_[index - 1] : start_;
+  for (size_t i = index; i < buffers_.size(); ++i) {
+    position += buffers_[i].size();
+    ends_[i] = position;
   }
-  return true;
+}
+
+void Cord::Find(uint64_t pos, size_t *index, uint32_t *offset) const {
+  uint64_t target = start_ + pos;
+  // The first buffer ending after the target contains it. Empty buffers end where the previous one does, so they're
+  // never chosen.
+  *index = std::upper_bound(ends_.begin(), ends_.end(), target) - ends_.begin();
+  *offset = target - (*index ? ends_[*index - 1] : start_);
+}
+
+void Cord::Splice(Cord *src) {
+  if (empty()) {
+    swap(*src);
+    return;
+  }
+  for (CordBuffer &buf : src->buffers_) {
+    if (buf.size())
+      PushBack(std::move(buf));
+  }
+  src->clear();
 }
 
 void Cord::clear() {
   buffers_.clear();
+  ends_.clear();
   size_ = 0;
+  start_ = 0;
 }
 
 void Cord::CopyFrom(const char *buf, uint32_t size) {
@@ -54,45 +105,80 @@ void Cord::CopyFrom(const char *buf, uint32_t size) {
 
 void Cord::CopyFrom(const Cord &src) {
   for (const CordBuffer &i : src.buffers_) {
-    if (i.dealloc()) {
-      // Duplicate the block
-      for (uint32_t start = 0; start < i.size(); ) {
-        uint32_t bleft = (i.size() - start);
-        uint32_t realsize;
-        char *buffer;
-        GetAppendBuf(bleft, &buffer, &realsize);
-        memcpy(buffer, i.buffer() + start, realsize);
-        start += realsize;
-      }
-    } else {
-      // Point to the same block
-      buffers_.push_back(CordBuffer(i.buffer(), i.size()));
-      size_ += i.size();
-    }
+    if (i.size())
+      PushBack(CordBuffer(i));
   }
 }
 
 void Cord::Append(const char *buf, size_t size) {
-  buffers_.push_back(CordBuffer(buf, size));
-  size_ += size;
+  PushBack(CordBuffer(buf, size));
+}
+
+void Cord::Append(const char *buf, size_t size, const shared_ptr<const void> &owner) {
+  PushBack(CordBuffer(buf, size, owner));
 }
 
 void Cord::GetAppendBuf(uint32_t reqsize, char **buffer, uint32_t *realsize) {
   *realsize = reqsize;
   if (!buffers_.size()) {
-    buffers_.push_back(CordBuffer(std::max(default_buffer_size_, reqsize)));
+    PushBack(CordBuffer(std::max(default_buffer_size_, reqsize)));
   } else if (buffers_.back().Available() >= reqsize) {
     // There's enough space, return a pointer to the existing buffer
   } else if (buffers_.back().Available() >= minimum_append_size_) {
     *realsize = buffers_.back().Available();
   } else {
-    buffers_.push_back(CordBuffer(std::max(default_buffer_size_, reqsize)));
+    PushBack(CordBuffer(std::max(default_buffer_size_, reqsize)));
   }
   *buffer = buffers_.back().mutable_buffer() + buffers_.back().size();
   buffers_.back().Use(*realsize);
+  ends_.back() += *realsize;
   size_ += *realsize;
 }
 
+void Cord::GetAppendBufs(uint64_t reqsize, std::vector<struct iovec> *iov) {
+  // Buffers added here are limited in size so that a large request doesn't need a single huge allocation.
+  const uint64_t kMaxBufferSize = 1024 * 1024;
+  iov->clear();
+  uint64_t available = 0;
+  if (!buffers_.empty() && buffers_.back().Available()) {
+    CordBuffer &buf = buffers_.back();
+    struct iovec vec = { buf.mutable_buffer() + buf.size(), buf.Available() };
+    iov->push_back(vec);
+    available += vec.iov_len;
+  }
+  while (available < reqsize) {
+    uint64_t size = std::min(kMaxBufferSize, std::max(static_cast<uint64_t>(default_buffer_size_), reqsize - available));
+    PushBack(CordBuffer(static_cast<uint32_t>(size)));
+    CordBuffer &buf = buffers_.back();
+    struct iovec vec = { buf.mutable_buffer(), buf.Available() };
+    iov->push_back(vec);
+    available += vec.iov_len;
+  }
+}
+
+void Cord::CommitAppend(uint64_t size) {
+  // The space handed out by GetAppendBufs() starts in the last buffer containing any data, if it has room, and
+  // continues through the empty buffers after it.
+  size_t first = buffers_.size();
+  while (first > 0 && buffers_[first - 1].size() == 0)
+    --first;
+  if (first > 0 && buffers_[first - 1].Available())
+    --first;
+  for (size_t i = first; i < buffers_.size() && size; ++i) {
+    uint32_t used = std::min(size, static_cast<uint64_t>(buffers_[i].Available()));
+    buffers_[i].Use(used);
+    size_ += used;
+    size -= used;
+  }
+  Reindex(first);
+  if (size)
+    throw out_of_range("Cord::CommitAppend() called with more data than was made available");
+  while (!buffers_.empty() && buffers_.back().size() == 0) {
+    buffers_.pop_back();
+    ends_.pop_back();
+  }
+}
+
 void Cord::AppendTo(string *str) const {
   for (const CordBuffer &i : buffers_)
     str->append(i.buffer(), i.size());
@@ -107,16 +193,10 @@ string Cord::ToString() const {
 char Cord::at(uint64_t start) const {
   if (start >= size_)
     throw out_of_range("Out of range");
-  for (const CordBuffer &i : buffers_) {
-    if (start > i.size()) {
-      // Start position is not inside this block
-      start -= i.size();
-      continue;
-    }
-    // Found a block containing the character
-    return *(i.buffer() + start);
-  }
-  throw runtime_error("Cord::at() failed to find a character");
+  size_t index;
+  uint32_t offset;
+  Find(start, &index, &offset);
+  return buffers_[index].buffer()[offset];
 }
 
 void Cord::Substr(uint64_t start, uint64_t len, string *out) const {
@@ -124,19 +204,14 @@ void Cord::Substr(uint64_t start, uint64_t len, string *out) const {
     throw out_of_range("Out of range");
   uint64_t reallen = std::min(size_ - start, len);
   out->reserve(out->size() + reallen);
-  for (const CordBuffer &i : buffers_) {
-    if (start > i.size()) {
-      // Start position is not inside this block
-      start -= i.size();
-      continue;
-    }
-    // Found a block containing some of the data we want
-    uint32_t num_b = std::min(reallen, i.size() - start);
-    out->append(i.buffer() + start, num_b);
+  size_t index;
+  uint32_t offset;
+  Find(start, &index, &offset);
+  for (; reallen; ++index, offset = 0) {
+    const CordBuffer &buf = buffers_[index];
+    uint32_t num_b = std::min(reallen, static_cast<uint64_t>(buf.size() - offset));
+    out->append(buf.buffer() + offset, num_b);
     reallen -= num_b;
-    if (reallen <= 0)
-      break;
-    start = 0;
   }
 }
 
@@ -146,50 +221,55 @@ string Cord::Substr(uint64_t start, uint64_t len) const {
   return out;
 }
 
+void Cord::Substr(uint64_t start, uint64_t len, Cord *out) const {
+  if (start >= size_)
+    throw out_of_range("Out of range");
+  uint64_t reallen = std::min(size_ - start, len);
+  size_t index;
+  uint32_t offset;
+  Find(start, &index, &offset);
+  for (; reallen; ++index, offset = 0) {
+    const CordBuffer &buf = buffers_[index];
+    uint32_t num_b = std::min(reallen, static_cast<uint64_t>(buf.size() - offset));
+    if (num_b)
+      out->PushBack(CordBuffer(buf, offset, num_b));
+    reallen -= num_b;
+  }
+}
+
 void Cord::pop_back() {
   size_ -= buffers_.back().size();
   buffers_.pop_back();
+  ends_.pop_back();
+  if (buffers_.empty())
+    start_ = 0;
 }
 
 void Cord::pop_front() {
   size_ -= buffers_.front().size();
+  start_ = ends_.front();
   buffers_.pop_front();
+  ends_.pop_front();
 }
 
 void Cord::ConsumeLine(string *output) {
   if (!size_)
     throw out_of_range("Empty Cord");
   uint64_t bytes_used = 0;
-  bool found_newline = 0;
-  for (CordBuffer &buf : buffers_) {
-    if (!buf.size()) {
-      buffers_.pop_front();
-      continue;
-    }
-    for (const char *p = buf.buffer(); p < buf.buffer() + buf.size(); p++) {
-      if (*p == '\n') {
-        // End of line
-        if (output)
-          output->append(buf.buffer(), p - buf.buffer() + 1);
-        bytes_used += p - buf.buffer() + 1;
-        found_newline = true;
-        break;
-      }
-    }
-    if (found_newline)
+  bool found_newline = false;
+  for (const CordBuffer &buf : buffers_) {
+    const char *p = static_cast<const char *>(memchr(buf.buffer(), '\n', buf.size()));
+    if (p) {
+      bytes_used += p - buf.buffer() + 1;
+      found_newline = true;
       break;
-    if (output)
-      output->append(buf.buffer(), buf.size());
+    }
     bytes_used += buf.size();
   }
   if (!found_newline)
     throw out_of_range("No entire line found");
 
-  try {
-    Consume(bytes_used, NULL);
-  } catch (exception) {
-    // Ignore
-  }
+  Consume(bytes_used, output);
 
   if (output) {
     int trim_chars = 0;
@@ -217,29 +297,56 @@ void Cord::Consume(uint64_t bytes, string *output) {
   uint64_t bytes_left = bytes;
   if (output)
     output->reserve(output->size() + bytes);
-  for (CordBuffer &buf : buffers_) {
-    if (bytes_left == 0 || bytes_left > bytes)
-      break;
-    if (buf.size() >= bytes_left) {
+  // Blocks are removed from the front as they are used up, so always work on the first one.
+  while (bytes_left && !buffers_.empty()) {
+    CordBuffer &buf = buffers_.front();
+    if (buf.size() > bytes_left) {
       // There's enough left in this block
       if (output)
         output->append(buf.buffer(), bytes_left);
       buf.Consume(bytes_left);
       size_ -= bytes_left;
-      if (buf.size() == 0)
-        buffers_.pop_front();
+      start_ += bytes_left;
       bytes_left = 0;
       break;
-    } else {
-      // There's not enough bytes in this block, append what we have and move on
-      if (output)
-        output->append(buf.buffer(), buf.size());
-      bytes_left -= buf.size();
-      buffers_.pop_front();
     }
+    // Use up the whole block and move on
+    if (output)
+      output->append(buf.buffer(), buf.size());
+    bytes_left -= buf.size();
+    pop_front();
   }
   if (bytes_left != 0)
     throw runtime_error("Something went wrong, wrong number of bytes were returned from Cord::Consume");
 }
 
+void Cord::ConsumeInto(uint64_t bytes, Cord *output) {
+  if (bytes > size_)
+    throw out_of_range("Empty Cord");
+  if (bytes == size_) {
+    output->Splice(this);
+    return;
+  }
+  while (bytes) {
+    CordBuffer &buf = buffers_.front();
+    if (buf.size() > bytes) {
+      // Share the start of this block, leaving the rest here.
+      output->PushBack(CordBuffer(buf, 0, bytes));
+      buf.Consume(bytes);
+      size_ -= bytes;
+      start_ += bytes;
+      break;
+    }
+    // Move the whole block
+    uint32_t size = buf.size();
+    bytes -= size;
+    size_ -= size;
+    start_ = ends_.front();
+    if (size)
+      output->PushBack(std::move(buf));
+    buffers_.pop_front();
+    ends_.pop_front();
+  }
+}
+
 }  // namespace openinstrument
@@ -10,8 +10,12 @@
 #ifndef _OPENINSTRUMENT_LIB_CORD_H_
 #define _OPENINSTRUMENT_LIB_CORD_H_
 
+#include <sys/uio.h>
+#include <boost/checked_delete.hpp>
+#include <algorithm>
 #include <deque>
 #include <string>
+#include <vector>
 #include "lib/common.h"
 #include "lib/string.h"
 
@@ -20,6 +24,8 @@ namespace openinstrument {
 class CordBuffer;
 using std::deque;
 
+// A string made up of a list of buffers, which can be appended to and consumed from the front without copying.
+// Buffers are reference counted, so copies and slices of a Cord share the same memory.
 class Cord : public noncopyable {
  public:
   typedef deque<CordBuffer>::iterator iterator;
@@ -28,13 +34,15 @@ class Cord : public noncopyable {
   Cord()
     : default_buffer_size_(1024),
       minimum_append_size_(16),
-      size_(0) {
+      size_(0),
+      start_(0) {
   }
 
   Cord(const Cord &src)
     : default_buffer_size_(src.default_buffer_size_),
       minimum_append_size_(src.minimum_append_size_),
-      size_(0) {
+      size_(0),
+      start_(0) {
     CopyFrom(src);
   }
 
@@ -66,6 +74,7 @@ class Cord : public noncopyable {
 
   // Append a copy of the supplied data to the Cord
   void CopyFrom(const char *buf, uint32_t size);
+  // Append the contents of <src>. The data is not copied, both Cords refer to the same buffers.
   void CopyFrom(const Cord &src);
   inline void CopyFrom(const string &str) {
     CopyFrom(str.data(), str.size());
@@ -81,7 +90,21 @@ class Cord : public noncopyable {
     Append(str.data(), str.size());
   }
 
+  // Append a block to the Cord without copying it. <owner> is kept alive for as long as any Cord refers to the block,
+  // so the data stays valid without the caller having to track when it has been used.
+  void Append(const char *buf, size_t size, const shared_ptr<const void> &owner);
+
   void GetAppendBuf(uint32_t reqsize, char **buffer, uint32_t *realsize);
+
+  // Make at least <reqsize> bytes of space available at the end of the Cord and fill <iov> with where it is, in order,
+  // ready to be passed to readv(). This includes any free space in the last buffer. The space does not become part of
+  // the Cord until CommitAppend() is called, and no other changes may be made to the Cord before then.
+  void GetAppendBufs(uint64_t reqsize, std::vector<struct iovec> *iov);
+
+  // Add the first <size> bytes of the space returned by GetAppendBufs() to the Cord. Any buffers which are still empty
+  // are released.
+  void CommitAppend(uint64_t size);
+
   inline uint64_t size() const {
     return size_;
   }
@@ -96,6 +119,8 @@ class Cord : public noncopyable {
 
   void Substr(uint64_t start, uint64_t len, string *out) const;
   string Substr(uint64_t start, uint64_t len) const;
+  // Append up to <len> bytes starting at <start> to <out>, sharing the data rather than copying it.
+  void Substr(uint64_t start, uint64_t len, Cord *out) const;
 
   // Return a string containing the first full line (terminated by [\r\n]) in the Cord.
   // Throws out_of_range if there is no complete line available.
@@ -105,6 +130,16 @@ class Cord : public noncopyable {
   // Throws out_of_range if there are not enough bytes available.
   void Consume(uint64_t bytes, string *output);
 
+  // Move the first <bytes> bytes of the Cord to the end of <output> without copying them.
+  // Throws out_of_range if there are not enough bytes available.
+  void ConsumeInto(uint64_t bytes, Cord *output);
+
+  // Exchange the contents of two Cords without copying any data.
+  void swap(Cord &other);
+
+  // Move all the data in <src> to the end of this Cord without copying it, leaving <src> empty.
+  void Splice(Cord *src);
+
   // STL container methods
   void clear();
   void pop_back();
@@ -134,14 +169,42 @@ class Cord : public noncopyable {
     return buffers_.end();
   }
 
+  inline const_iterator begin() const {
+    return buffers_.begin();
+  }
+
+  inline const_iterator end() const {
+    return buffers_.end();
+  }
+
  private:
+  // Add <buf> to the end of the Cord.
+  void PushBack(CordBuffer &&buf);
+
+  // Find the buffer containing byte <pos>, and the offset of the byte in that buffer. <pos> must be less than size().
+  void Find(uint64_t pos, size_t *index, uint32_t *offset) const;
+
+  // Recalculate ends_ for every buffer from <index> onwards, after their sizes have changed.
+  void Reindex(size_t index);
+
   deque<CordBuffer> buffers_;
   uint32_t default_buffer_size_;
   uint32_t minimum_append_size_;
   uint64_t size_;
+  // Index for finding the buffer containing a position in O(log n). Positions only ever grow: start_ is the position of
+  // the first byte, and ends_[i] is the position just after the end of buffers_[i], so consuming from the front
+  // doesn't change the positions of the other buffers.
+  uint64_t start_;
+  deque<uint64_t> ends_;
 };
 
 
+// A block of data in a Cord.
+//
+// Memory allocated by a CordBuffer is reference counted, and copying a CordBuffer makes another reference to the same
+// bytes rather than copying them. Bytes are never changed once they are part of a buffer, so copies and slices can be
+// shared freely between Cords. Only the buffer which allocated the memory can append to it, and only into the space
+// after its own data, which nothing else can refer to.
 class CordBuffer {
  public:
   CordBuffer()
@@ -149,50 +212,64 @@ class CordBuffer {
       mutable_buffer_(NULL),
       size_(0),
       capacity_(0),
-      used_(0),
-      dealloc_(false) {}
+      used_(0) {}
 
   explicit CordBuffer(uint32_t size)
     : buffer_(NULL),
       mutable_buffer_(NULL),
       size_(0),
       capacity_(0),
-      used_(0),
-      dealloc_(true) {
+      used_(0) {
     Alloc(size);
   }
 
   explicit CordBuffer(const char *ptr, uint32_t size)
+    : buffer_(ptr),
+      mutable_buffer_(NULL),
+      size_(size),
+      capacity_(size),
+      used_(0) {}
+
+  CordBuffer(const char *ptr, uint32_t size, const shared_ptr<const void> &owner)
     : buffer_(ptr),
       mutable_buffer_(NULL),
       size_(size),
       capacity_(size),
       used_(0),
-      dealloc_(false) {}
+      owner_(owner) {}
 
-  explicit CordBuffer(const CordBuffer &src)
-    : buffer_(src.buffer_),
+  // Make a read-only reference to the data in <src>.
+  CordBuffer(const CordBuffer &src)
+    : buffer_(src.buffer()),
       mutable_buffer_(NULL),
-      size_(src.size_),
-      capacity_(src.capacity_),
-      used_(src.used_),
-      dealloc_(src.dealloc_) {
-    if (src.mutable_buffer_) {
-      Alloc(src.capacity_);
-      if (src.size_) {
-        memcpy(mutable_buffer_, src.mutable_buffer_, src.size_);
-      }
-    }
-  }
+      size_(src.size()),
+      capacity_(src.size()),
+      used_(0),
+      owner_(src.owner_) {}
 
-  virtual ~CordBuffer() {
-    if (dealloc_ && mutable_buffer_) {
-      delete[] mutable_buffer_;
-    }
+  // Make a read-only reference to <size> bytes of <src>, starting at <offset>.
+  CordBuffer(const CordBuffer &src, uint32_t offset, uint32_t size)
+    : buffer_(src.buffer() + offset),
+      mutable_buffer_(NULL),
+      size_(size),
+      capacity_(size),
+      used_(0),
+      owner_(src.owner_) {}
+
+  CordBuffer(CordBuffer &&src)
+    : buffer_(NULL),
+      mutable_buffer_(NULL),
+      size_(0),
+      capacity_(0),
+      used_(0) {
+    swap(src);
   }
 
-  virtual bool dealloc() const {
-    return dealloc_;
+  virtual ~CordBuffer() {}
+
+  // Returns true if data can be appended to this buffer.
+  virtual bool writable() const {
+    return mutable_buffer_ != NULL;
   }
 
   virtual void Alloc(uint32_t size) {
@@ -204,7 +281,9 @@ class CordBuffer {
     capacity_ |= (capacity_ >> 16);
     capacity_++;
     mutable_buffer_ = new char[capacity_];
-    dealloc_ = true;
+    buffer_ = mutable_buffer_;
+    owner_.reset(mutable_buffer_, boost::checked_array_deleter<char>());
+    size_ = used_ = 0;
   }
 
   virtual uint32_t size() const {
@@ -212,15 +291,15 @@ class CordBuffer {
   }
 
   virtual uint32_t Available() const {
-    return capacity_ - size_;
+    return writable() ? capacity_ - size_ : 0;
   }
 
   virtual const char *buffer() const {
-    return dealloc_ ? mutable_buffer_ + used_ : buffer_ + used_;
+    return buffer_ + used_;
   }
 
   virtual char *mutable_buffer() const {
-    return dealloc_ ? mutable_buffer_ + used_ : NULL;
+    return mutable_buffer_ ? mutable_buffer_ + used_ : NULL;
   }
 
   uint32_t capacity() const {
@@ -233,13 +312,30 @@ class CordBuffer {
       used_ = size_;
   }
 
+  // Exchange the contents of two buffers, including the right to append to any allocated memory.
+  void swap(CordBuffer &other) {
+    std::swap(buffer_, other.buffer_);
+    std::swap(mutable_buffer_, other.mutable_buffer_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(used_, other.used_);
+    owner_.swap(other.owner_);
+  }
+
+  // The object keeping the data valid. This is the memory itself if the buffer allocated it, or NULL if the data was
+  // appended without an owner.
+  const shared_ptr<const void> &owner() const {
+    return owner_;
+  }
+
  protected:
   const char *buffer_;
+  // Set only in the buffer which allocated the memory.
   char *mutable_buffer_;
   uint32_t size_;
   uint32_t capacity_;
   uint32_t used_;
-  bool dealloc_;
+  shared_ptr<const void> owner_;
 
   virtual bool Use(uint32_t size) {
     if (size_ + size > capacity_)
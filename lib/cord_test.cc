@@ -30,6 +30,37 @@ TEST_F(CordTest, GetAppendBuf) {
   EXPECT_EQ(420UL, cord.size());
 }
 
+TEST_F(CordTest, GetAppendBufs) {
+  Cord cord;
+  cord.set_default_buffer_size(16);
+  cord.CopyFrom("abc");
+  vector<struct iovec> iov;
+  cord.GetAppendBufs(40, &iov);
+  ASSERT_EQ(2UL, iov.size());
+  // The rest of the existing buffer comes first
+  EXPECT_EQ(13UL, iov[0].iov_len);
+  EXPECT_LE(27UL, iov[1].iov_len);
+  EXPECT_EQ(3UL, cord.size());
+
+  string data("defghijklmnopqrstuvwxyz");
+  memcpy(iov[0].iov_base, data.data(), iov[0].iov_len);
+  memcpy(iov[1].iov_base, data.data() + iov[0].iov_len, data.size() - iov[0].iov_len);
+  cord.CommitAppend(data.size());
+  EXPECT_EQ(26UL, cord.size());
+  EXPECT_EQ("abcdefghijklmnopqrstuvwxyz", cord.ToString());
+
+  // Nothing is added if none of the space is used, and empty buffers aren't kept
+  cord.GetAppendBufs(1000, &iov);
+  cord.CommitAppend(0);
+  EXPECT_EQ(26UL, cord.size());
+  int buffers = 0;
+  for (Cord::iterator i = cord.begin(); i != cord.end(); ++i) {
+    EXPECT_LT(0U, i->size());
+    buffers++;
+  }
+  EXPECT_EQ(2, buffers);
+}
+
 TEST_F(CordTest, Append) {
   Cord cord;
   string teststring("jfdkjasxxxxhilfuhawelsuehfliwnevlkasuhvjnvkjlawekrnlkasuhiawhvkjahlkjskljhflwkevcnlkjsZNLDvsdx\n");
@@ -233,6 +264,97 @@ TEST_F(CordTest, ConsumeLine) {
   EXPECT_THROW(cord.ConsumeLine(&output), out_of_range);
 }
 
+TEST_F(CordTest, SharedCopy) {
+  Cord cord;
+  cord.set_default_buffer_size(16);
+  cord.CopyFrom("1234567890");
+  Cord copy(cord);
+  // The copy refers to the same memory.
+  EXPECT_EQ(cord.front().buffer(), copy.front().buffer());
+  EXPECT_TRUE(cord.front().writable());
+  EXPECT_FALSE(copy.front().writable());
+
+  // Appending to the original uses the free space in its buffer, which the copy can't see.
+  cord.CopyFrom("abc");
+  EXPECT_EQ("1234567890abc", cord.ToString());
+  EXPECT_EQ("1234567890", copy.ToString());
+  copy.CopyFrom("xyz");
+  EXPECT_EQ("1234567890abc", cord.ToString());
+  EXPECT_EQ("1234567890xyz", copy.ToString());
+
+  // The memory stays valid after the original has gone.
+  const char *data = cord.front().buffer();
+  cord.clear();
+  EXPECT_EQ(data, copy.front().buffer());
+  EXPECT_EQ("1234567890xyz", copy.ToString());
+}
+
+TEST_F(CordTest, SubstrCord) {
+  Cord cord;
+  cord.set_default_buffer_size(16);
+  string teststring("1234567890");
+  for (int i = 0; i < 20; i++)
+    cord.CopyFrom(teststring);
+
+  Cord slice;
+  cord.Substr(33, 30, &slice);
+  EXPECT_EQ("456789012345678901234567890123", slice.ToString());
+  EXPECT_EQ(cord.Substr(33, 30), slice.ToString());
+  EXPECT_EQ('4', slice[0]);
+  EXPECT_EQ('3', slice[29]);
+
+  Cord tail;
+  cord.Substr(195, 10, &tail);
+  EXPECT_EQ("67890", tail.ToString());
+  EXPECT_THROW(cord.Substr(200, 1, &tail), out_of_range);
+}
+
+TEST_F(CordTest, ConsumeInto) {
+  Cord cord;
+  cord.set_default_buffer_size(16);
+  cord.CopyFrom("GET / HTTP/1.1\r\n\r\nThis is the body of the request");
+  cord.Consume(18, NULL);
+  Cord body;
+  cord.ConsumeInto(16, &body);
+  EXPECT_EQ("This is the body", body.ToString());
+  EXPECT_EQ(" of the request", cord.ToString());
+  EXPECT_EQ(' ', cord[0]);
+  EXPECT_EQ('t', cord[14]);
+  cord.ConsumeInto(cord.size(), &body);
+  EXPECT_TRUE(cord.empty());
+  EXPECT_EQ("This is the body of the request", body.ToString());
+  EXPECT_THROW(cord.ConsumeInto(1, &body), out_of_range);
+}
+
+TEST_F(CordTest, RandomAccessAfterConsume) {
+  Cord cord;
+  cord.set_default_buffer_size(4);
+  cord.set_minimum_append_size(1);
+  string expected;
+  for (int i = 0; i < 100; i++) {
+    string str = StringPrintf("%d,", i);
+    cord.CopyFrom(str);
+    expected += str;
+  }
+  for (int consumed = 0; consumed < 50; consumed += 7) {
+    for (uint64_t i = 0; i < cord.size(); i++)
+      ASSERT_EQ(expected[consumed + i], cord[i]) << consumed << " " << i;
+    cord.Consume(7, NULL);
+  }
+}
+
+TEST_F(CordTest, EqualsDifferentBuffers) {
+  Cord a, b;
+  a.set_default_buffer_size(4);
+  a.set_minimum_append_size(1);
+  a.CopyFrom("abcdefghij");
+  b.Append("abcdefghij");
+  EXPECT_TRUE(a == b);
+  Cord c;
+  c.Append("abcdefghiX");
+  EXPECT_FALSE(a == c);
+}
+
 }  // namespace
 
 int main(int argc, char **argv) {
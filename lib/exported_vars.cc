@@ -67,9 +67,7 @@ void VariableExporter::ExportToString(string *output) {
     proto::ValueStream stream;
     i->ExportToValueStream(&stream);
     Variable var(stream.variable());
-    for (unordered_map<string, string>::iterator j = extra_labels_.begin(); j != extra_labels_.end(); ++j) {
-      var.SetLabel(j->first, j->second);
-    }
+    var.SetLabels(extra_labels_.begin(), extra_labels_.end());
     output->append(var.ToString());
     output->append("\t");
     int c = 0;
@@ -85,20 +83,18 @@ void VariableExporter::ExportToString(string *output) {
   }
 }
 
-void VariableExporter::ExportToStore(StoreClient *client) {
+void VariableExporter::ExportToStore(AddSession *session) {
   proto::AddRequest req;
   RunCallbacks();
   for (ExportedVariable *i : all_exported_vars_) {
     proto::ValueStream *stream = req.add_stream();
     i->ExportToValueStream(stream);
     Variable var(stream->variable());
-    for (unordered_map<string, string>::iterator j = extra_labels_.begin(); j != extra_labels_.end(); ++j) {
-      var.SetLabel(j->first, j->second);
-    }
+    var.SetLabels(extra_labels_.begin(), extra_labels_.end());
     var.ToProtobuf(stream->mutable_variable());
   }
   try {
-    scoped_ptr<proto::AddResponse> response(client->Add(req));
+    session->Add(req);
   } catch (exception &e) {
     LOG(WARNING) << "Unable to export vars to the datastore: " << e.what();
   }
@@ -112,7 +108,8 @@ void VariableExporter::ExportToStore(string server) {
     return;
   }
   StoreClient client(server);
-  return ExportToStore(&client);
+  AddSession session(&client);
+  return ExportToStore(&session);
 }
 
 VariableExporter *VariableExporter::GetGlobalExporter() {
@@ -132,6 +129,8 @@ void VariableExporter::StartExportThread(const string &server, uint64_t interval
 
 void VariableExporter::ExportThread(const string &server, uint64_t interval) {
   StoreClient client(server);
+  // Keep the session for the life of the thread, so each variable only has to be registered once.
+  AddSession session(&client);
   while (true) {
     try {
       sleep(interval);
@@ -140,7 +139,7 @@ void VariableExporter::ExportThread(const string &server, uint64_t interval) {
       return;
     }
     boost::this_thread::disable_interruption di;
-    ExportToStore(&client);
+    ExportToStore(&session);
   }
 }
 
@@ -21,6 +21,7 @@
 namespace openinstrument {
 
 class StoreClient;
+class AddSession;
 
 // Abstract class which is the parent of all exported values.
 // This superclass takes care of adding the new object to the global variable exporter, but not much else.
@@ -201,7 +202,7 @@ class VariableExporter : private noncopyable {
 
  private:
   void ExportThread(const string &server, uint64_t interval);
-  void ExportToStore(StoreClient *client);
+  void ExportToStore(AddSession *session);
   void RunCallbacks();
 
   vector<ExportedVariable *> all_exported_vars_;
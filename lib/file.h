@@ -151,6 +151,11 @@ class FilesystemWatcher : private noncopyable {
     FILE_WRITTEN = IN_CLOSE_WRITE,
     FILE_RENAMED = IN_MOVED_TO,
     FILE_DELETED = IN_DELETE,
+    FILE_CREATED = IN_CREATE,
+    FILE_MOVED_AWAY = IN_MOVED_FROM,
+    // The watched path itself was deleted or moved away. The callback is given an empty name.
+    WATCH_DELETED = IN_DELETE_SELF,
+    WATCH_MOVED = IN_MOVE_SELF,
   };
 
   FilesystemWatcher()
@@ -187,11 +192,13 @@ class FilesystemWatcher : private noncopyable {
     struct watch_callback cb;
     cb.path = path;
     cb.callback = callback;
+    MutexLock lock(mutex_);
     watches_[wd] = cb;
     return true;
   }
 
   void RemoveWatch(const string &path) {
+    MutexLock lock(mutex_);
     for (auto watch : watches_) {
       if (watch.second.path == path) {
         inotify_rm_watch(fd_, watch.first);
@@ -218,20 +225,25 @@ class FilesystemWatcher : private noncopyable {
         LOG(WARNING) << "FilesystemWatcher::Watcher read returned " << strerror(errno);
         break;
       }
-      struct inotify_event *event = reinterpret_cast<struct inotify_event *>(buf);
-      while (event < reinterpret_cast<struct inotify_event *>(buf + bytes)) {
+      for (char *p = buf; p < buf + bytes; ) {
+        struct inotify_event *event = reinterpret_cast<struct inotify_event *>(p);
+        p += sizeof(struct inotify_event) + event->len;
         VLOG(2) << "FilesystemWatcher event.wd: " << event->wd;
         VLOG(2) << "FilesystemWatcher event.mask: " << event->mask;
         VLOG(2) << "FilesystemWatcher event.cookie: " << event->cookie;
         if (event->len)
           VLOG(2) << "FilesystemWatcher event.name: " << event->name;
-        for (auto watch : watches_) {
-          if (watch.first == event->wd) {
-            string filename(event->name, event->len);
-            watch.second.callback(filename);
-          }
+        // The name is padded with NULs to event->len.
+        string filename(event->len ? event->name : "");
+        EventCallback callback;
+        {
+          MutexLock lock(mutex_);
+          unordered_map<int, watch_callback>::iterator it = watches_.find(event->wd);
+          if (it == watches_.end())
+            continue;
+          callback = it->second.callback;
         }
-        event += event->len + sizeof(struct inotify_event);
+        callback(filename);
       }
     }
   }
@@ -241,6 +253,8 @@ class FilesystemWatcher : private noncopyable {
     EventCallback callback;
   };
   int fd_;
+  // Protects watches_, which is used by the background thread.
+  Mutex mutex_;
   unordered_map<int, watch_callback> watches_;
   thread background_thread_;
 };
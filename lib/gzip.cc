@@ -0,0 +1,121 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/gzip.h"
+
+namespace openinstrument {
+
+namespace {
+
+// Adding 16 to the window bits makes zlib write a gzip header and trailer rather than a zlib one.
+const int kGzipWindowBits = 15 + 16;
+
+// Amount of output space made available to zlib at a time.
+const uint64_t kChunkSize = 16 * 1024;
+
+// Run <fn> (deflate or inflate) over the input already set in <stream>, appending everything it produces to <output>.
+// Returns once zlib needs more input or reaches the end of the stream. Throws runtime_error if <max_output> is non-zero
+// and <output> grows beyond it.
+int RunZlib(z_stream *stream, int (*fn)(z_streamp, int), int flush, Cord *output, uint64_t max_output = 0) {
+  std::vector<struct iovec> iov;
+  while (true) {
+    output->GetAppendBufs(kChunkSize, &iov);
+    uint64_t produced = 0;
+    bool output_full = true;
+    int ret = Z_OK;
+    for (size_t i = 0; i < iov.size(); ++i) {
+      stream->next_out = reinterpret_cast<Bytef *>(iov[i].iov_base);
+      stream->avail_out = iov[i].iov_len;
+      ret = fn(stream, flush);
+      produced += iov[i].iov_len - stream->avail_out;
+      if (stream->avail_out || ret != Z_OK) {
+        output_full = false;
+        break;
+      }
+    }
+    output->CommitAppend(produced);
+    if (max_output && output->size() > max_output)
+      throw runtime_error("Decompressed data is too large");
+    if (ret == Z_STREAM_END)
+      return ret;
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+      throw runtime_error(StringPrintf("zlib error %d: %s", ret, stream->msg ? stream->msg : "unknown"));
+    if (!output_full)
+      return ret;
+  }
+}
+
+}  // namespace
+
+void GzipCompress(const StringPiece &input, string *output, int level) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, level, Z_DEFLATED, kGzipWindowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw runtime_error("Can't initialize zlib");
+  size_t start = output->size();
+  output->resize(start + deflateBound(&stream, input.size()));
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+  stream.avail_in = input.size();
+  stream.next_out = reinterpret_cast<Bytef *>(&(*output)[start]);
+  stream.avail_out = output->size() - start;
+  int ret = deflate(&stream, Z_FINISH);
+  output->resize(start + stream.total_out);
+  deflateEnd(&stream);
+  if (ret != Z_STREAM_END)
+    throw runtime_error(StringPrintf("gzip compression failed: %d", ret));
+}
+
+void GzipCompress(const Cord &input, Cord *output, int level) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, level, Z_DEFLATED, kGzipWindowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw runtime_error("Can't initialize zlib");
+  try {
+    for (Cord::const_iterator i = input.begin(); i != input.end(); ++i) {
+      stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(i->buffer()));
+      stream.avail_in = i->size();
+      RunZlib(&stream, deflate, Z_NO_FLUSH, output);
+    }
+    stream.avail_in = 0;
+    RunZlib(&stream, deflate, Z_FINISH, output);
+  } catch (exception) {
+    deflateEnd(&stream);
+    throw;
+  }
+  deflateEnd(&stream);
+}
+
+void GzipDecompress(const Cord &input, Cord *output, uint64_t max_size) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, kGzipWindowBits) != Z_OK)
+    throw runtime_error("Can't initialize zlib");
+  uint64_t max_output = max_size ? output->size() + max_size : 0;
+  int ret = Z_OK;
+  try {
+    for (Cord::const_iterator i = input.begin(); i != input.end() && ret != Z_STREAM_END; ++i) {
+      stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(i->buffer()));
+      stream.avail_in = i->size();
+      ret = RunZlib(&stream, inflate, Z_NO_FLUSH, output, max_output);
+    }
+  } catch (exception) {
+    inflateEnd(&stream);
+    throw;
+  }
+  inflateEnd(&stream);
+  if (ret != Z_STREAM_END)
+    throw runtime_error("Truncated gzip data");
+}
+
+}  // namespace openinstrument
@@ -0,0 +1,34 @@
+/*
+ * gzip compression using zlib.
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef OPENINSTRUMENT_LIB_GZIP_H_
+#define OPENINSTRUMENT_LIB_GZIP_H_
+
+#include <string>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/string.h"
+
+namespace openinstrument {
+
+// Compress <input> in gzip format and append it to <output>. <level> is a zlib compression level from 1 (fastest) to 9
+// (smallest). Throws runtime_error if zlib fails.
+void GzipCompress(const StringPiece &input, string *output, int level = 6);
+
+// Compress <input> in gzip format, appending the result to <output>. Each buffer of <input> is compressed in turn
+// straight into buffers of <output>, so neither is ever flattened into a single string.
+void GzipCompress(const Cord &input, Cord *output, int level = 6);
+
+// Decompress gzip data from <input>, appending the result to <output>. Throws runtime_error if the data is invalid or
+// incomplete, or if <max_size> is non-zero and the data decompresses to more than <max_size> bytes.
+void GzipDecompress(const Cord &input, Cord *output, uint64_t max_size = 0);
+
+}  // namespace openinstrument
+
+#endif  // OPENINSTRUMENT_LIB_GZIP_H_
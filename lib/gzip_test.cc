@@ -0,0 +1,90 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <iterator>
+#include <string>
+#include <gtest/gtest.h>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/gzip.h"
+#include "lib/string.h"
+
+namespace openinstrument {
+
+class GzipTest : public ::testing::Test {};
+
+TEST_F(GzipTest, CordRoundTrip) {
+  // Spread the input over many small buffers, and make it big enough to need several output buffers.
+  Cord input;
+  input.set_default_buffer_size(100);
+  string expected;
+  for (int i = 0; i < 20000; i++) {
+    string line = StringPrintf("/openinstrument/test/%d value=%d\n", i % 37, i * 7919);
+    input.CopyFrom(line);
+    expected += line;
+  }
+  ASSERT_LT(10, std::distance(input.begin(), input.end()));
+
+  Cord compressed;
+  GzipCompress(input, &compressed);
+  EXPECT_LT(compressed.size(), input.size() / 2);
+
+  Cord output;
+  GzipDecompress(compressed, &output);
+  EXPECT_EQ(expected, output.ToString());
+
+  // Output of the string version can be decompressed too.
+  string flat;
+  GzipCompress(StringPiece(expected), &flat);
+  Cord flat_cord, flat_output;
+  flat_cord.CopyFrom(flat);
+  GzipDecompress(flat_cord, &flat_output);
+  EXPECT_EQ(expected, flat_output.ToString());
+}
+
+TEST_F(GzipTest, Empty) {
+  Cord input, compressed, output;
+  GzipCompress(input, &compressed);
+  EXPECT_LT(0UL, compressed.size());
+  GzipDecompress(compressed, &output);
+  EXPECT_TRUE(output.empty());
+}
+
+TEST_F(GzipTest, InvalidInput) {
+  Cord input, compressed, output;
+  input.CopyFrom(string(5000, 'x'));
+  GzipCompress(input, &compressed);
+
+  string truncated = compressed.Substr(0, compressed.size() - 10);
+  Cord partial;
+  partial.CopyFrom(truncated);
+  EXPECT_THROW(GzipDecompress(partial, &output), runtime_error);
+
+  Cord garbage;
+  garbage.CopyFrom("This is not gzip data");
+  EXPECT_THROW(GzipDecompress(garbage, &output), runtime_error);
+}
+
+TEST_F(GzipTest, MaxSize) {
+  Cord input, compressed, output;
+  input.CopyFrom(string(100000, 'x'));
+  GzipCompress(input, &compressed);
+  EXPECT_THROW(GzipDecompress(compressed, &output, 50000), runtime_error);
+
+  output.clear();
+  GzipDecompress(compressed, &output, 100000);
+  EXPECT_EQ(100000UL, output.size());
+}
+
+}  // namespace openinstrument
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
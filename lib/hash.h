@@ -60,9 +60,13 @@ class HashRing {
 
   // Get appropriate node for <data>.
   const Node &GetNode(const Data &data) const {
+    return GetNodeForHash(Hash::Hash32(data));
+  }
+
+  // Get appropriate node for data which has already been hashed with Hash::Hash32().
+  const Node &GetNodeForHash(uint32_t hash) const {
     if (ring_.empty())
       throw std::out_of_range("Empty ring in consistent hash");
-    uint32_t hash = Hash::Hash32(data);
     typename NodeMap::const_iterator it;
     // Look for the first node >= hash
     it = ring_.lower_bound(hash);
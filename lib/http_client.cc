@@ -9,114 +9,278 @@
 
 #include <string>
 #include "lib/common.h"
+#include "lib/gzip.h"
 #include "lib/http_client.h"
+#include "lib/http_parser.h"
+
+DEFINE_int32(http_client_max_connections_per_host, 16, "Maximum number of HTTP client connections in use to each host");
+DEFINE_int32(http_client_idle_timeout, 60, "Seconds an idle HTTP client connection is kept for reuse");
+DEFINE_int32(http_client_max_body_size, 256 * 1024 * 1024, "Largest compressed HTTP reply body to decompress");
 
 namespace openinstrument {
 namespace http {
 
+namespace {
+
+// Requests which can safely be sent again if it's not known whether the server received them.
+bool IsIdempotent(const string &method) {
+  return method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE" || method == "OPTIONS" ||
+         method == "TRACE";
+}
+
+}  // namespace
+
+HttpConnectionPool::~HttpConnectionPool() {
+  for (auto &i : hosts_) {
+    for (IdleConnection &conn : i.second.idle)
+      delete conn.sock;
+  }
+}
+
+HttpConnectionPool *HttpConnectionPool::Default() {
+  static HttpConnectionPool *pool = new HttpConnectionPool();
+  return pool;
+}
+
+string HttpConnectionPool::HostKey(const string &hostname, uint16_t port) {
+  return StringPrintf("%s:%u", hostname.c_str(), port);
+}
+
+void HttpConnectionPool::ExpireIdle(Host *host, uint64_t now) {
+  uint64_t timeout = static_cast<uint64_t>(FLAGS_http_client_idle_timeout) * 1000;
+  // The oldest connections are at the front.
+  while (!host->idle.empty() && now - host->idle.front().idle_since > timeout) {
+    delete host->idle.front().sock;
+    host->idle.pop_front();
+  }
+}
+
+Socket *HttpConnectionPool::Get(const string &hostname, uint16_t port, uint64_t timeout, bool *reused) {
+  Deadline deadline(timeout);
+  string key = HostKey(hostname, port);
+  *reused = false;
+  MutexLock lock(mutex_);
+  Host &host = hosts_[key];
+  while (true) {
+    ExpireIdle(&host, Timestamp::Now());
+    if (!host.idle.empty()) {
+      scoped_ptr<Socket> sock(host.idle.back().sock);
+      host.idle.pop_back();
+      // The connection counts as active while it's checked, without the lock so that other requests aren't held up by
+      // the read.
+      host.active++;
+      lock.unlock();
+      // An idle connection should have nothing to read. If it has, the server has closed it or sent something
+      // unexpected, and it can't be used.
+      bool usable = true;
+      try {
+        sock->Read(0);
+      } catch (exception) {
+        usable = false;
+      }
+      if (usable && sock->fd() && sock->read_buffer()->empty()) {
+        *reused = true;
+        return sock.release();
+      }
+      sock.reset();
+      lock.lock();
+      host.active--;
+      continue;
+    }
+    if (host.active < FLAGS_http_client_max_connections_per_host)
+      break;
+    if (!deadline)
+      throw runtime_error(StringPrintf("Timed out waiting for a connection to %s", key.c_str()));
+    released_.timed_wait(lock, boost::posix_time::milliseconds(static_cast<uint64_t>(deadline)));
+  }
+
+  // Connect without holding the lock, other hosts shouldn't have to wait.
+  host.active++;
+  lock.unlock();
+  scoped_ptr<Socket> sock(new Socket());
+  try {
+    sock->Connect(hostname, port, deadline);
+  } catch (exception) {
+    lock.lock();
+    hosts_[key].active--;
+    lock.unlock();
+    released_.notify_all();
+    throw;
+  }
+  return sock.release();
+}
+
+void HttpConnectionPool::Release(const string &hostname, uint16_t port, Socket *sock, bool reusable) {
+  {
+    MutexLock lock(mutex_);
+    Host &host = hosts_[HostKey(hostname, port)];
+    host.active--;
+    if (reusable && sock->fd() && sock->read_buffer()->empty()) {
+      IdleConnection conn;
+      conn.sock = sock;
+      conn.idle_since = Timestamp::Now();
+      host.idle.push_back(conn);
+      sock = NULL;
+    }
+  }
+  released_.notify_all();
+  delete sock;
+}
+
 HttpReply *HttpClient::SendRequest(HttpRequest &request) {
-  scoped_ptr<HttpReply> reply(new HttpReply());
   VLOG(1) << "Requesting " << request.uri.Assemble();
   Deadline deadline(deadline_time_);
-  Socket sock;
-  sock.Connect(request.uri.hostname, request.uri.port, deadline);
+  bool keep_alive = request.headers().GetHeader("Connection").find("close") == string::npos;
+  Cord output;
+  request.Serialize(&output);
 
-  try {
-    // Send request
-    request.Write(&sock);
+  while (true) {
+    bool reused = false;
+    scoped_ptr<Socket> sock(pool_->Get(request.uri.hostname, request.uri.port, deadline, &reused));
+    scoped_ptr<HttpReply> reply(new HttpReply());
+    bool sent = false;
+    bool received = false;
+    bool reusable = false;
+    try {
+      // Send request. A reused connection may have to be retried, so keep a copy of the request in that case.
+      if (reused)
+        sock->Write(output);
+      else
+        sock->Write(&output);
+      sock->Flush();
+      sent = true;
 
-    // Wait for response
-    Cord response;
-    string output;
-    for (int i = 0; i < 20; ++i) {
-      try {
-        output.clear();
-        sock.read_buffer()->ConsumeLine(&output);
-      } catch (out_of_range) {
-        try {
-          sock.Read(deadline);
-          continue;
-        } catch (exception) {
-          throw runtime_error(StringPrintf("No response received from %s", sock.remote().ToString().c_str()));
-        }
+      // Wait for response
+      if (!ReadReply(sock.get(), deadline, reply.get(), &received, &reusable)) {
+        pool_->Release(request.uri.hostname, request.uri.port, sock.release(), false);
+        return NULL;
       }
-
+    } catch (exception& e) {
+      pool_->Release(request.uri.hostname, request.uri.port, sock.release(), false);
+      if (reused && !received && (!sent || IsIdempotent(request.method()))) {
+        // The server closed the idle connection before getting the request. If the request was written, the server
+        // may have acted on it anyway, so only requests which can safely be repeated are sent again.
+        VLOG(1) << "Reused connection failed, retrying on a new connection: " << e.what();
+        continue;
+      }
+      LOG(ERROR) << "Exception: " << e.what() << "\n";
+    }
+    if (sock.get())
+      pool_->Release(request.uri.hostname, request.uri.port, sock.release(), keep_alive && reusable);
+    if (reply->headers().GetHeader(HttpHeaders::CONTENT_ENCODING) == "gzip") {
+      Cord body;
       try {
-        reply->set_http_version(ConsumeFirstWord(&output));
-        reply->SetStatus(static_cast<HttpReply::status_type>(lexical_cast<uint16_t>(ConsumeFirstWord(&output))));
-      } catch (exception) {
-        LOG(WARNING) << "Invalid HTTP response";
+        GzipDecompress(reply->body(), &body, FLAGS_http_client_max_body_size);
+        reply->mutable_body()->swap(body);
+        reply->mutable_headers()->RemoveHeader("Content-Encoding");
+      } catch (exception &e) {
+        LOG(ERROR) << "Invalid compressed response: " << e.what();
         reply->SetStatus(HttpReply::INTERNAL_SERVER_ERROR);
-        return NULL;
+        reply->mutable_body()->clear();
       }
-      break;
     }
+    reply->mutable_headers()->SetHeader("Content-Length", reply->body().size());
+    return reply.release();
+  }
+}
 
-    reply->ReadAndParseHeaders(&sock, deadline);
+void HttpClient::ReadMore(Socket *sock, const Deadline &deadline) {
+  try {
+    if (sock->Read(deadline) > 0)
+      return;
+  } catch (exception) {
+  }
+  if (!sock->fd())
+    throw runtime_error(StringPrintf("Connection closed by %s", sock->remote().ToString().c_str()));
+  if (!deadline)
+    throw runtime_error(StringPrintf("No response received from %s", sock->remote().ToString().c_str()));
+}
 
-    if (reply->chunked_encoding()) {
-      VLOG(2) << "Reading chunked encoding response";
-      while (true) {
+bool HttpClient::ReadReply(Socket *sock, Deadline deadline, HttpReply *reply, bool *received, bool *reusable) {
+  *received = false;
+  *reusable = false;
+  HttpParser parser;
+  Cord *input = sock->read_buffer();
+  while (true) {
+    if (!input->empty())
+      *received = true;
+    try {
+      if (parser.Parse(input, reply))
+        break;
+    } catch (exception &e) {
+      LOG(WARNING) << "Invalid HTTP response: " << e.what();
+      reply->SetStatus(HttpReply::INTERNAL_SERVER_ERROR);
+      return false;
+    }
+    ReadMore(sock, deadline);
+  }
+
+  if (!reply->HasBody()) {
+    // 204 and 304 replies never have a body, whatever their headers say.
+    VLOG(2) << "Response has no body";
+  } else if (reply->chunked_encoding()) {
+    VLOG(2) << "Reading chunked encoding response";
+    while (true) {
+      try {
+        string str;
+        // Chunk header should be a hex length then \r\n
+        input->ConsumeLine(&str);
+        VLOG(2) << "  read length (" << str << ")";
+        uint32_t len = 0;
         try {
-          string str;
-          // Chunk header should be a hex length then \r\n
-          sock.read_buffer()->ConsumeLine(&str);
-          VLOG(2) << "  read length (" << str << ")";
-          uint32_t len = 0;
-          try {
-            len = HexToUint32(str);
-          } catch (std::out_of_range) {
-            throw runtime_error(StringPrintf("Invalid chunk header reading HTTP response: %s", str.c_str()));
-          }
-          if (len == 0) {
-            // Last chunk
-            VLOG(2) << "  last chunk";
-            sock.read_buffer()->ConsumeLine(&str);
-            break;
-          }
-          // Body is terminated by a newline
-          while (sock.read_buffer()->size() < len + 2) {
+          len = HexToUint32(str);
+        } catch (std::out_of_range) {
+          throw runtime_error(StringPrintf("Invalid chunk header reading HTTP response: %s", str.c_str()));
+        }
+        if (len == 0) {
+          // Last chunk
+          VLOG(2) << "  last chunk";
+          while (true) {
             try {
-              sock.Read(deadline);
-            } catch (exception) {
-              throw runtime_error(StringPrintf("No response received from %s", sock.remote().ToString().c_str()));
+              input->ConsumeLine(&str);
+              break;
+            } catch (std::out_of_range) {
+              ReadMore(sock, deadline);
             }
           }
-          string tmp;
-          sock.read_buffer()->Consume(len, &tmp);
-          reply->mutable_body()->CopyFrom(tmp);
-          VLOG(2) << "  got " << len << " bytes of body, total body size is now " << reply->body().size();
-          // Throw away the next newline
-          sock.read_buffer()->ConsumeLine(NULL);
-        } catch (std::out_of_range) {
-          sock.Read(deadline);
+          break;
         }
+        // Body is terminated by a newline
+        if (input->size() < len + 2)
+          sock->ExpectRead(len + 2 - input->size());
+        while (input->size() < len + 2)
+          ReadMore(sock, deadline);
+        input->ConsumeInto(len, reply->mutable_body());
+        VLOG(2) << "  got " << len << " bytes of body, total body size is now " << reply->body().size();
+        // Throw away the next newline
+        input->ConsumeLine(NULL);
+      } catch (std::out_of_range) {
+        ReadMore(sock, deadline);
       }
-    } else if (reply->GetContentLength()) {
-      VLOG(2) << "Reading response with content-length";
-      while (sock.read_buffer()->size() < reply->GetContentLength()) {
-        try {
-          sock.Read(deadline);
-        } catch (exception) {
-          throw runtime_error(StringPrintf("No response received from %s", sock.remote().ToString().c_str()));
-        }
-      }
-      reply->mutable_body()->CopyFrom(*(sock.read_buffer()));
-    } else {
-      VLOG(2) << "Reading entire response";
-      try {
-        while (sock.Read(deadline) > 0);
-      } catch (exception) {
-        throw runtime_error(StringPrintf("No response received from %s", sock.remote().ToString().c_str()));
-      }
-      reply->mutable_body()->CopyFrom(*(sock.read_buffer()));
     }
-  } catch (exception& e) {
-    LOG(ERROR) << "Exception: " << e.what() << "\n";
+  } else if (reply->headers().HeaderExists(HttpHeaders::CONTENT_LENGTH)) {
+    VLOG(2) << "Reading response with content-length";
+    uint64_t length = reply->GetContentLength();
+    if (input->size() < length)
+      sock->ExpectRead(length - input->size());
+    while (input->size() < length)
+      ReadMore(sock, deadline);
+    input->ConsumeInto(length, reply->mutable_body());
+  } else {
+    VLOG(2) << "Reading entire response";
+    try {
+      while (sock->Read(deadline) > 0) {}
+    } catch (exception) {
+      throw runtime_error(StringPrintf("No response received from %s", sock->remote().ToString().c_str()));
+    }
+    reply->mutable_body()->Splice(input);
+    // The end of the reply is only known because the connection was closed.
+    return true;
   }
-  reply->mutable_headers()->SetHeader("Content-Length", reply->body().size());
 
-  return reply.release();
+  *reusable = reply->http_version() >= "HTTP/1.1" &&
+              reply->headers().GetHeader("Connection").find("close") == string::npos;
+  return true;
 }
 
 HttpRequest *HttpClient::NewRequest(const string &url) {
@@ -126,7 +290,8 @@ HttpRequest *HttpClient::NewRequest(const string &url) {
   request->set_method("GET");
   request->SetHeader("Host", request->uri.hostname.c_str());
   request->SetHeader("Accept", "*/*");
-  request->SetHeader("Connection", "close");
+  request->SetHeader("Accept-Encoding", "gzip");
+  request->SetHeader("Connection", "keep-alive");
   return request;
 }
 
@@ -10,6 +10,7 @@
 #ifndef OPENINSTRUMENT_LIB_HTTP_HTTPCLIENT_
 #define OPENINSTRUMENT_LIB_HTTP_HTTPCLIENT_
 
+#include <deque>
 #include <string>
 #include "lib/common.h"
 #include "lib/http_reply.h"
@@ -22,11 +23,60 @@
 namespace openinstrument {
 namespace http {
 
+// Keeps idle keep-alive connections to HTTP servers so that later requests to the same host can reuse them instead of
+// resolving the name and connecting again. Connections which have been idle for longer than --http_client_idle_timeout
+// are closed, and idle connections are checked before being reused in case the server has closed them. No more than
+// --http_client_max_connections_per_host connections to each host are in use at once.
+class HttpConnectionPool : private noncopyable {
+ public:
+  HttpConnectionPool() {}
+  ~HttpConnectionPool();
+
+  // The pool used by every HttpClient which isn't given another one.
+  static HttpConnectionPool *Default();
+
+  // Get a connection to <hostname>:<port>, reusing an idle one if possible. Sets <reused> if the connection has been
+  // used before. If the host already has the maximum number of connections in use, waits up to <timeout> ms for one to
+  // be released. Throws runtime_error if no connection can be made.
+  Socket *Get(const string &hostname, uint16_t port, uint64_t timeout, bool *reused);
+
+  // Return a connection from Get(). If <reusable> is set, it is kept for another request, otherwise it is closed.
+  void Release(const string &hostname, uint16_t port, Socket *sock, bool reusable);
+
+ private:
+  struct IdleConnection {
+    Socket *sock;
+    uint64_t idle_since;
+  };
+
+  struct Host {
+    Host() : active(0) {}
+    // Most recently used last.
+    std::deque<IdleConnection> idle;
+    int active;
+  };
+
+  static string HostKey(const string &hostname, uint16_t port);
+
+  // Close connections to <host> which have been idle for too long. The caller must hold mutex_.
+  void ExpireIdle(Host *host, uint64_t now);
+
+  Mutex mutex_;
+  boost::condition_variable released_;
+  unordered_map<string, Host> hosts_;
+};
+
 class HttpClient : private noncopyable {
  public:
-  HttpClient() : deadline_time_(30000) {
+  HttpClient() : deadline_time_(30000), pool_(HttpConnectionPool::Default()) {
   }
 
+  explicit HttpClient(HttpConnectionPool *pool) : deadline_time_(30000), pool_(pool) {
+  }
+
+  // Send <request> and wait for the reply. Connections are taken from the pool and returned to it afterwards if the
+  // server allows the connection to be kept alive. If a reused connection turns out to have been closed by the server,
+  // the request is sent again on a new connection.
   HttpReply *SendRequest(HttpRequest &request);
   HttpRequest *NewRequest(const string &url);
 
@@ -35,7 +85,16 @@ class HttpClient : private noncopyable {
   }
 
  private:
+  // Read a complete reply from <sock>. Returns false if the reply is not valid HTTP. Sets <received> once any part of
+  // the reply has arrived, and <reusable> if the connection can be used for another request afterwards. Throws
+  // runtime_error if the connection fails.
+  bool ReadReply(Socket *sock, Deadline deadline, HttpReply *reply, bool *received, bool *reusable);
+
+  // Wait for more data on <sock>. Throws runtime_error if the connection is closed or the deadline passes.
+  void ReadMore(Socket *sock, const Deadline &deadline);
+
   uint64_t deadline_time_;
+  HttpConnectionPool *pool_;
 };
 
 }  // namespace http
@@ -10,9 +10,16 @@
 #ifndef OPENINSTRUMENT_LIB_HTTP_HTTPHEADERS_H_
 #define OPENINSTRUMENT_LIB_HTTP_HTTPHEADERS_H_
 
+#include <strings.h>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include "lib/common.h"
+#include "lib/string.h"
 
 namespace openinstrument {
 namespace http {
@@ -22,21 +29,107 @@ class HttpHeader {
   HttpHeader(const string &name, const string &value)
     : name(name),
       value(value) {}
+  HttpHeader(const StringPiece &name, const StringPiece &value)
+    : name(name.data(), name.size()),
+      value(value.data(), value.size()) {}
   string name;
   string value;
 };
 
+// A set of headers. Header names are compared without regard to case. The headers which are looked at for most
+// messages are indexed, so looking them up doesn't require a search.
 class HttpHeaders {
  public:
-  // Sets the value of a header "name" to "value". If the header already exists, its value is replaced.
-  void SetHeader(const string &name, const string &value) {
-    for (size_t i = 0; i < headers_.size(); ++i) {
-      if (headers_[i].name == name) {
-        headers_[i].value = value;
-        return;
+  enum KnownHeader {
+    HOST,
+    CONNECTION,
+    CONTENT_TYPE,
+    CONTENT_LENGTH,
+    ACCEPT_ENCODING,
+    CONTENT_ENCODING,
+    TRANSFER_ENCODING,
+    UNKNOWN_HEADER
+  };
+
+  HttpHeaders() {
+    ClearIndex();
+  }
+
+  // Returns which of the indexed headers <name> is, or UNKNOWN_HEADER.
+  static KnownHeader Lookup(const char *name, size_t size) {
+    switch (size) {
+      case 4:
+        if (!strncasecmp(name, "Host", size))
+          return HOST;
+        break;
+      case 10:
+        if (!strncasecmp(name, "Connection", size))
+          return CONNECTION;
+        break;
+      case 12:
+        if (!strncasecmp(name, "Content-Type", size))
+          return CONTENT_TYPE;
+        break;
+      case 14:
+        if (!strncasecmp(name, "Content-Length", size))
+          return CONTENT_LENGTH;
+        break;
+      case 15:
+        if (!strncasecmp(name, "Accept-Encoding", size))
+          return ACCEPT_ENCODING;
+        break;
+      case 16:
+        if (!strncasecmp(name, "Content-Encoding", size))
+          return CONTENT_ENCODING;
+        break;
+      case 17:
+        if (!strncasecmp(name, "Transfer-Encoding", size))
+          return TRANSFER_ENCODING;
+        break;
+    }
+    return UNKNOWN_HEADER;
+  }
+
+  static KnownHeader Lookup(const string &name) {
+    return Lookup(name.data(), name.size());
+  }
+
+  // Returns true if an Accept-Encoding header value allows <encoding>, either by name or with "*". Encodings given a
+  // quality of 0 are refused.
+  static bool AcceptsEncoding(const string &header, const string &encoding) {
+    bool wildcard = false;
+    vector<string> tokens;
+    boost::split(tokens, header, boost::is_any_of(","));
+    for (string &token : tokens) {
+      vector<string> params;
+      boost::split(params, token, boost::is_any_of(";"));
+      boost::trim(params[0]);
+      bool accepted = true;
+      for (size_t i = 1; i < params.size(); ++i) {
+        boost::trim(params[i]);
+        if (params[i].substr(0, 2) != "q=")
+          continue;
+        try {
+          accepted = lexical_cast<double>(params[i].substr(2)) > 0;
+        } catch (exception) {
+          accepted = false;
+        }
       }
+      if (boost::iequals(params[0], encoding))
+        return accepted;
+      if (params[0] == "*")
+        wildcard = accepted;
     }
-    AddHeader(name, value);
+    return wildcard;
+  }
+
+  // Sets the value of a header "name" to "value". If the header already exists, its value is replaced.
+  void SetHeader(const string &name, const string &value) {
+    ssize_t i = Find(name);
+    if (i < 0)
+      AddHeader(name, value);
+    else
+      headers_[i].value = value;
   }
 
   void SetHeader(const string &name, uint64_t value) {
@@ -47,6 +140,12 @@ class HttpHeaders {
   // exists, another header will be added with the new value.
   void AddHeader(const string &name, const string &value) {
     headers_.push_back(HttpHeader(name, value));
+    AddToIndex(name.data(), name.size());
+  }
+
+  void AddHeader(const StringPiece &name, const StringPiece &value) {
+    headers_.push_back(HttpHeader(name, value));
+    AddToIndex(name.data(), name.size());
   }
 
   void AddHeader(const string &name, uint64_t value) {
@@ -54,46 +153,50 @@ class HttpHeaders {
   }
 
   void AppendLastHeader(const string append) {
-    HttpHeader last = headers_.back();
-    headers_.pop_back();
-    last.value += append;
-    headers_.push_back(last);
+    headers_.back().value += append;
   }
 
   // Checks whether the header is set at all. Does not check how many instances of a header are set.
   bool HeaderExists(const string &name) const {
-    for (size_t i = 0; i < headers_.size(); ++i) {
-      if (headers_[i].name == name)
-        return true;
-    }
-    return false;
+    return Find(name) >= 0;
+  }
+
+  bool HeaderExists(KnownHeader header) const {
+    return index_[header] >= 0;
   }
 
   void RemoveHeader(const string &name) {
-    for (vector<HttpHeader>::iterator i = headers_.begin(); i != headers_.end(); ++i) {
-      if (i->name == name) {
-        headers_.erase(i);
-        i = headers_.begin();
+    size_t out = 0;
+    for (size_t i = 0; i < headers_.size(); ++i) {
+      if (NameEquals(headers_[i].name, name))
         continue;
-      }
+      if (out != i)
+        std::swap(headers_[out], headers_[i]);
+      ++out;
     }
+    if (out == headers_.size())
+      return;
+    headers_.erase(headers_.begin() + out, headers_.end());
+    ClearIndex();
+    for (const HttpHeader &header : headers_)
+      AddToIndex(header.name.data(), header.name.size());
   }
 
   // Gets the first value of a header from the set.
   const string &GetHeader(const string &name) const {
-    static string emptystring;
-    for (size_t i = 0; i < headers_.size(); ++i) {
-      if (headers_[i].name == name)
-        return headers_[i].value;
-    }
-    return emptystring;
+    ssize_t i = Find(name);
+    return i < 0 ? emptystring() : headers_[i].value;
+  }
+
+  const string &GetHeader(KnownHeader header) const {
+    return index_[header] < 0 ? emptystring() : headers_[index_[header]].value;
   }
 
   // Gets every value of a set header.
   vector<string> GetHeaderValues(const string &name) const {
     vector<string> values;
     for (size_t i = 0; i < headers_.size(); ++i) {
-      if (headers_[i].name == name)
+      if (NameEquals(headers_[i].name, name))
         values.push_back(headers_[i].value);
     }
     return values;
@@ -116,7 +219,42 @@ class HttpHeaders {
   }
 
  private:
+  static bool NameEquals(const string &a, const string &b) {
+    return a.size() == b.size() && !strncasecmp(a.data(), b.data(), a.size());
+  }
+
+  static const string &emptystring() {
+    static string empty;
+    return empty;
+  }
+
+  // Returns the position of the first header called <name>, or -1.
+  ssize_t Find(const string &name) const {
+    KnownHeader known = Lookup(name);
+    if (known != UNKNOWN_HEADER)
+      return index_[known];
+    for (size_t i = 0; i < headers_.size(); ++i) {
+      if (NameEquals(headers_[i].name, name))
+        return i;
+    }
+    return -1;
+  }
+
+  void ClearIndex() {
+    for (int i = 0; i < UNKNOWN_HEADER; ++i)
+      index_[i] = -1;
+  }
+
+  // Index the header just added to the end of the list, if it's the first of its name.
+  void AddToIndex(const char *name, size_t size) {
+    KnownHeader known = Lookup(name, size);
+    if (known != UNKNOWN_HEADER && index_[known] < 0)
+      index_[known] = headers_.size() - 1;
+  }
+
   vector<HttpHeader> headers_;
+  // Position in headers_ of the first instance of each known header, or -1.
+  ssize_t index_[UNKNOWN_HEADER];
 };
 
 }  // namespace http
@@ -7,6 +7,9 @@
  *
  */
 
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
 #include <string>
 #include "lib/common.h"
 #include "lib/http_message.h"
@@ -20,33 +23,54 @@ const char *HttpMessage::header_sep_ = ": ";
 const char *HttpMessage::crlf_ = "\r\n";
 
 void HttpMessage::WriteHeader(Socket *sock) {
+  Cord output;
+  WriteHeader(&output);
+  sock->Write(output);
+}
+
+void HttpMessage::WriteHeader(Cord *output) {
   if (!status_written_)
-    WriteFirstline(sock);
+    WriteFirstline(output);
   if (!header_written_) {
     for (size_t i = 0; i < headers_.size(); ++i) {
-      if (chunked_encoding() && headers_[i].name == "Content-Length")
+      if (chunked_encoding() && HttpHeaders::Lookup(headers_[i].name) == HttpHeaders::CONTENT_LENGTH)
         continue;
-      sock->Write(headers_[i].name);
-      sock->Write(header_sep_);
-      sock->Write(headers_[i].value);
-      sock->Write(crlf_);
+      output->CopyFrom(headers_[i].name);
+      output->CopyFrom(header_sep_, strlen(header_sep_));
+      output->CopyFrom(headers_[i].value);
+      output->CopyFrom(crlf_, strlen(crlf_));
       VLOG(2) << "        " << headers_[i].name << ": " << headers_[i].value;
     }
-    sock->Write(crlf_);
+    output->CopyFrom(crlf_, strlen(crlf_));
   }
   status_written_ = true;
   header_written_ = true;
 }
 
 void HttpMessage::set_http_version(const string &version) {
-  boost::regex regex("(?i)HTTP/(\\d+)\\.(\\d+)");
-  boost::smatch what;
-  if (!boost::regex_match(version, what, regex) || what.size() != 3) {
-    version_major_ = version_minor_ = 0;
-  } else {
-    version_major_ = atoi(string(what[1]).c_str());
-    version_minor_ = atoi(string(what[2]).c_str());
-  }
+  set_http_version(StringPiece(version));
+}
+
+void HttpMessage::set_http_version(const StringPiece &version) {
+  // Versions look like HTTP/<major>.<minor>, anything else is stored as 0.0
+  version_major_ = version_minor_ = 0;
+  const char *p = version.data(), *end = p + version.size();
+  if (version.size() < 8 || strncasecmp(p, "HTTP/", 5))
+    return;
+  p += 5;
+  unsigned int major = 0, minor = 0;
+  const char *start = p;
+  for (; p < end && isdigit(*p); ++p)
+    major = major * 10 + (*p - '0');
+  if (p == start || p == end || *p++ != '.')
+    return;
+  start = p;
+  for (; p < end && isdigit(*p); ++p)
+    minor = minor * 10 + (*p - '0');
+  if (p == start || p != end)
+    return;
+  version_major_ = major;
+  version_minor_ = minor;
 }
 
 string HttpMessage::http_version() const {
@@ -68,7 +92,7 @@ void HttpMessage::SetContentLength(size_t length) {
 }
 
 uint64_t HttpMessage::GetContentLength() const {
-  const string &header = headers_.GetHeader("Content-Length");
+  const string &header = headers_.GetHeader(HttpHeaders::CONTENT_LENGTH);
   if (!header.size())
     return 0;
   return lexical_cast<uint64_t>(header);
@@ -80,74 +104,80 @@ void HttpMessage::SetContentType(const char *type) {
 
 const string &HttpMessage::GetContentType() {
   static string unknown_type = "application/unknown";
-  const string &header = headers_.GetHeader("Content-Type");
+  const string &header = headers_.GetHeader(HttpHeaders::CONTENT_TYPE);
   if (!header.size())
     return unknown_type;
   return header;
 }
 
 void HttpMessage::Write(Socket *sock) {
-  WriteHeader(sock);
+  Cord output;
+  Serialize(&output);
+  sock->Write(&output);
+  sock->Flush();
+}
+
+void HttpMessage::Serialize(Cord *output) {
+  WriteHeader(output);
   if (chunked_encoding_) {
-    for (auto &buffer : body_)
-      WriteChunk(sock, StringPiece(buffer.buffer(), buffer.size()));
-    WriteLastChunk(sock);
+    // The whole body is already available, so send it as a single chunk.
+    if (body_.size()) {
+      output->CopyFrom(HexToBuffer(body_.size()));
+      output->Append(crlf_, strlen(crlf_));
+      output->Splice(&body_);
+      output->Append(crlf_, strlen(crlf_));
+    }
+    WriteLastChunk(output);
   } else {
-    if (body_.size())
-      sock->Write(body_);
+    output->Splice(&body_);
   }
 }
 
-void HttpMessage::WriteChunk(Socket *sock, const StringPiece &chunk) {
-  if (chunk.size() == 0)
-    return;
-  sock->Write(HexToBuffer(chunk.size()));
-  sock->Write("\r\n");
-  sock->Write(chunk);
-  sock->Write("\r\n");
+void HttpMessage::WriteLastChunk(Cord *output) {
+  output->Append("0\r\n\r\n", 5);
 }
 
-void HttpMessage::WriteLastChunk(Socket *sock) {
-  sock->Write("0\r\n\r\n");
+StringPiece HttpMessage::ConsumeWord(StringPiece *line) {
+  const char *p = line->data(), *end = p + line->size();
+  while (p < end && *p == ' ')
+    ++p;
+  const char *start = p;
+  while (p < end && *p != ' ')
+    ++p;
+  StringPiece word(start, p - start);
+  if (p)
+    line->Reset(p, end - p);
+  return word;
 }
 
-void HttpMessage::ReadAndParseHeaders(Socket *sock, Deadline deadline) {
-  for (size_t i = 0; i < 5000; ++i) {
-    string output;
-    try {
-      sock->read_buffer()->ConsumeLine(&output);
-    } catch (out_of_range) {
-      try {
-        sock->Read(deadline);
-        continue;
-      } catch (exception) {
-        throw runtime_error(StringPrintf("No response received from %s", sock->remote().ToString().c_str()));
-      }
-    }
+namespace {
 
-    // End of headers
-    if (output.empty())
-      break;
-
-    if (output.at(0) == ' ' || output.at(0) == '\t') {
-      // continuation of last output
-      headers_.AppendLastHeader(StringTrim(output));
-    } else {
-      // new output
-      string::size_type pos = output.find(":");
-      if (pos == string::npos) {
-        LOG(WARNING) << "Invalid output line: " << output;
-        continue;
-      }
-      headers_.AddHeader(output.substr(0, pos), StringTrim(output.substr(pos + 1)));
-    }
-  }
+StringPiece TrimPiece(const char *start, const char *end) {
+  while (start < end && (*start == ' ' || *start == '\t'))
+    ++start;
+  while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+    --end;
+  return StringPiece(start, end - start);
+}
 
-  if (headers_.GetHeader("Transfer-Encoding").find("chunked") != string::npos) {
-    set_chunked_encoding(true);
-  } else {
-    set_chunked_encoding(false);
+}  // namespace
+
+void HttpMessage::ParseHeaderLine(const StringPiece &line) {
+  if (!line.size())
+    return;
+  const char *start = line.data(), *end = start + line.size();
+  if (*start == ' ' || *start == '\t') {
+    // Continuation of the last header
+    if (!headers_.empty())
+      headers_.AppendLastHeader(TrimPiece(start, end).ToString());
+    return;
+  }
+  const char *colon = static_cast<const char *>(memchr(start, ':', line.size()));
+  if (!colon) {
+    LOG(WARNING) << "Invalid header line: " << line.ToString();
+    return;
   }
+  headers_.AddHeader(TrimPiece(start, colon), TrimPiece(colon + 1, end));
 }
 
 }  // namespace http
@@ -33,6 +33,7 @@ class HttpMessage {
 
   void WriteHeader(Socket *sock);
   void set_http_version(const string &version);
+  void set_http_version(const StringPiece &version);
   string http_version() const;
   void SetHeader(const char *key, const char *value);
   const HttpHeaders &headers() const;
@@ -41,7 +42,16 @@ class HttpMessage {
   void SetContentType(const char *type);
   const string &GetContentType();
   void Write(Socket *sock);
-  void ReadAndParseHeaders(Socket *sock, Deadline deadline);
+
+  // Append the complete message (first line, headers and body) to <output>, as it would be written by Write().
+  // The body buffers are moved into <output> rather than copied, so the body is empty afterwards.
+  void Serialize(Cord *output);
+
+  // Parse the first line of a message, throwing runtime_error if it's invalid.
+  virtual void ParseFirstLine(const StringPiece &line) = 0;
+
+  // Parse a single header line, which may be a continuation of the previous header.
+  void ParseHeaderLine(const StringPiece &line);
 
   const Cord &body() const {
     return body_;
@@ -79,10 +89,13 @@ class HttpMessage {
   Cord body_;
 
   // Override this for subclasses. This is the first line that is written.
-  virtual void WriteFirstline(Socket *sock) = 0;
+  virtual void WriteFirstline(Cord *output) = 0;
+
+  void WriteHeader(Cord *output);
+  void WriteLastChunk(Cord *output);
 
-  void WriteChunk(Socket *sock, const StringPiece &chunk);
-  void WriteLastChunk(Socket *sock);
+  // Remove and return the first space-separated word of <line>.
+  static StringPiece ConsumeWord(StringPiece *line);
 
   inline HttpHeaders *mutable_headers() {
     return &headers_;
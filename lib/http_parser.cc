@@ -0,0 +1,100 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <string.h>
+#include <string>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/http_parser.h"
+#include "lib/string.h"
+
+namespace openinstrument {
+namespace http {
+
+HttpParser::HttpParser(uint64_t max_header_size)
+  : state_(FIRST_LINE),
+    scanned_(0),
+    header_size_(0),
+    max_header_size_(max_header_size) {}
+
+void HttpParser::Reset() {
+  state_ = FIRST_LINE;
+  scanned_ = 0;
+  header_size_ = 0;
+}
+
+uint64_t HttpParser::FindLineEnd(const Cord &input) {
+  uint64_t position = 0;
+  for (Cord::const_iterator buf = input.begin(); buf != input.end(); ++buf) {
+    if (scanned_ >= position + buf->size()) {
+      position += buf->size();
+      continue;
+    }
+    const char *start = buf->buffer() + (scanned_ - position);
+    const char *end = buf->buffer() + buf->size();
+    const char *newline = static_cast<const char *>(memchr(start, '\n', end - start));
+    if (newline) {
+      scanned_ = 0;
+      return position + (newline - buf->buffer()) + 1;
+    }
+    position += buf->size();
+    scanned_ = position;
+  }
+  return 0;
+}
+
+bool HttpParser::Parse(Cord *input, HttpMessage *message) {
+  while (state_ != COMPLETE) {
+    uint64_t length = FindLineEnd(*input);
+    if (!length) {
+      if (header_size_ + input->size() > max_header_size_)
+        throw runtime_error("HTTP headers are too large");
+      return false;
+    }
+    header_size_ += length;
+    if (header_size_ > max_header_size_)
+      throw runtime_error("HTTP headers are too large");
+
+    // Use the line where it is if it's all in the first buffer, which it nearly always is.
+    const char *data;
+    bool consumed = false;
+    if (input->begin()->size() >= length) {
+      data = input->begin()->buffer();
+    } else {
+      line_.clear();
+      input->Consume(length, &line_);
+      data = line_.data();
+      consumed = true;
+    }
+    uint64_t size = length - 1;
+    if (size && data[size - 1] == '\r')
+      --size;
+    StringPiece line(data, size);
+
+    if (state_ == HEADERS) {
+      if (size) {
+        message->ParseHeaderLine(line);
+      } else {
+        message->set_chunked_encoding(
+            message->headers().GetHeader(HttpHeaders::TRANSFER_ENCODING).find("chunked") != string::npos);
+        state_ = COMPLETE;
+      }
+    } else if (size) {
+      // Blank lines before the first line are ignored.
+      message->ParseFirstLine(line);
+      state_ = HEADERS;
+    }
+    if (!consumed)
+      input->Consume(length, NULL);
+  }
+  return true;
+}
+
+}  // namespace http
+}  // namespace openinstrument
@@ -0,0 +1,67 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef OPENINSTRUMENT_LIB_HTTP_PARSER_H_
+#define OPENINSTRUMENT_LIB_HTTP_PARSER_H_
+
+#include <string>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/http_message.h"
+
+namespace openinstrument {
+namespace http {
+
+// Incremental parser for the first line and headers of an HTTP request or reply.
+//
+// Lines are found by searching the buffers of the input Cord in place, and each is passed to the message as a
+// StringPiece pointing into the buffer it arrived in. Only a line split across two buffers is copied. The parser
+// remembers how far it has searched, so a message arriving in many small reads is only scanned once.
+class HttpParser {
+ public:
+  explicit HttpParser(uint64_t max_header_size = 64 * 1024);
+
+  // Parse and consume as many complete lines as are available from the front of <input> into <message>. Returns true
+  // once the blank line ending the headers has been consumed, leaving any body in <input>. Returns false if more data
+  // is needed.
+  // Throws runtime_error if the message is invalid or its headers are larger than the maximum size.
+  bool Parse(Cord *input, HttpMessage *message);
+
+  // Start parsing a new message.
+  void Reset();
+
+  // Returns true if the headers of the current message have all been parsed.
+  bool complete() const {
+    return state_ == COMPLETE;
+  }
+
+ private:
+  enum State {
+    FIRST_LINE,
+    HEADERS,
+    COMPLETE
+  };
+
+  // Returns the length of the first line of <input> including its newline, or 0 if there isn't a complete line.
+  uint64_t FindLineEnd(const Cord &input);
+
+  State state_;
+  // Number of bytes at the start of the input which have already been searched for a newline.
+  uint64_t scanned_;
+  // Total size of the lines consumed so far.
+  uint64_t header_size_;
+  uint64_t max_header_size_;
+  // Holds a line which is split across buffers.
+  string line_;
+};
+
+}  // namespace http
+}  // namespace openinstrument
+
+#endif  // OPENINSTRUMENT_LIB_HTTP_PARSER_H_
@@ -0,0 +1,149 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <string>
+#include <gtest/gtest.h>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/http_headers.h"
+#include "lib/http_parser.h"
+#include "lib/http_reply.h"
+#include "lib/http_request.h"
+
+namespace openinstrument {
+namespace http {
+
+class HttpParserTest : public ::testing::Test {};
+
+TEST_F(HttpParserTest, Request) {
+  Cord input;
+  input.CopyFrom("GET /add?v=1 HTTP/1.1\r\nHost: localhost\r\ncontent-length: 4\r\nX-Test:  a value \r\n\r\nbody");
+  HttpParser parser;
+  HttpRequest request;
+  ASSERT_TRUE(parser.Parse(&input, &request));
+  EXPECT_TRUE(parser.complete());
+  EXPECT_EQ("GET", request.method());
+  EXPECT_EQ("/add", request.uri.path);
+  EXPECT_EQ("1", request.GetParam("v"));
+  EXPECT_EQ("HTTP/1.1", request.http_version());
+  EXPECT_EQ("localhost", request.headers().GetHeader("host"));
+  EXPECT_EQ("4", request.headers().GetHeader(HttpHeaders::CONTENT_LENGTH));
+  EXPECT_EQ(4U, request.GetContentLength());
+  EXPECT_EQ("a value", request.headers().GetHeader("x-test"));
+  // The body is left for the caller.
+  EXPECT_EQ("body", input.ToString());
+}
+
+TEST_F(HttpParserTest, OneByteAtATime) {
+  string data("\r\nPOST /add HTTP/1.0\r\nConnection: close\r\nX-Long: first\r\n  second\r\n\r\n");
+  Cord input;
+  HttpParser parser;
+  HttpRequest request;
+  for (size_t i = 0; i < data.size(); ++i) {
+    EXPECT_FALSE(parser.Parse(&input, &request)) << i;
+    // Each byte goes into its own buffer, so every line is split across buffers.
+    input.Append(data.data() + i, 1);
+  }
+  ASSERT_TRUE(parser.Parse(&input, &request));
+  EXPECT_TRUE(input.empty());
+  EXPECT_EQ("POST", request.method());
+  EXPECT_EQ("HTTP/1.0", request.http_version());
+  EXPECT_EQ("close", request.headers().GetHeader("CONNECTION"));
+  EXPECT_EQ("firstsecond", request.headers().GetHeader("X-Long"));
+}
+
+TEST_F(HttpParserTest, Pipelined) {
+  Cord input;
+  input.CopyFrom("GET /first HTTP/1.1\r\n\r\nGET /second HTTP/1.1\r\n\r\n");
+  HttpParser parser;
+  HttpRequest first, second;
+  ASSERT_TRUE(parser.Parse(&input, &first));
+  parser.Reset();
+  ASSERT_TRUE(parser.Parse(&input, &second));
+  EXPECT_EQ("/first", first.uri.path);
+  EXPECT_EQ("/second", second.uri.path);
+  EXPECT_TRUE(input.empty());
+}
+
+TEST_F(HttpParserTest, Reply) {
+  Cord input;
+  input.CopyFrom("HTTP/1.1 404 Not Found\r\nTransfer-Encoding: chunked\r\n\r\n");
+  HttpParser parser;
+  HttpReply reply;
+  ASSERT_TRUE(parser.Parse(&input, &reply));
+  EXPECT_EQ(HttpReply::NOT_FOUND, reply.status());
+  EXPECT_TRUE(reply.chunked_encoding());
+}
+
+TEST_F(HttpParserTest, ChunkedReplyDropsContentLength) {
+  // The header is dropped whatever case its name was set in.
+  HttpReply reply;
+  reply.SetStatus(HttpReply::OK);
+  reply.SetHeader("content-length", "5");
+  reply.set_chunked_encoding();
+  reply.mutable_body()->CopyFrom("hello");
+  Cord output;
+  reply.Serialize(&output);
+  string str = output.ToString();
+  EXPECT_EQ(string::npos, str.find("content-length"));
+  EXPECT_NE(string::npos, str.find("\r\n\r\n5\r\nhello\r\n0\r\n\r\n"));
+}
+
+TEST_F(HttpParserTest, Invalid) {
+  {
+    Cord input;
+    input.CopyFrom("GET /\r\n\r\n");
+    HttpParser parser;
+    HttpRequest request;
+    EXPECT_THROW(parser.Parse(&input, &request), runtime_error);
+  }
+  {
+    Cord input;
+    input.CopyFrom("HTTP/1.1 abc OK\r\n\r\n");
+    HttpParser parser;
+    HttpReply reply;
+    EXPECT_THROW(parser.Parse(&input, &reply), runtime_error);
+  }
+  {
+    // Headers larger than the limit are rejected, whether or not the end of the line has arrived.
+    Cord input;
+    input.CopyFrom("GET / HTTP/1.1\r\nX-Big: " + string(200, 'x'));
+    HttpParser parser(100);
+    HttpRequest request;
+    EXPECT_THROW(parser.Parse(&input, &request), runtime_error);
+  }
+}
+
+TEST_F(HttpParserTest, Headers) {
+  HttpHeaders headers;
+  headers.AddHeader("X-One", "0");
+  headers.AddHeader("Content-Type", "text/plain");
+  headers.AddHeader("X-One", "1");
+  headers.AddHeader("x-one", "2");
+  headers.SetHeader("content-type", "text/html");
+  EXPECT_EQ("text/html", headers.GetHeader(HttpHeaders::CONTENT_TYPE));
+  EXPECT_EQ(4U, headers.size());
+  EXPECT_EQ(3U, headers.GetHeaderValues("X-ONE").size());
+  headers.RemoveHeader("X-One");
+  EXPECT_EQ(1U, headers.size());
+  EXPECT_FALSE(headers.HeaderExists("x-one"));
+  // The index still points at the right header after the others were removed.
+  EXPECT_EQ("text/html", headers.GetHeader("Content-Type"));
+  headers.RemoveHeader("Content-Type");
+  EXPECT_FALSE(headers.HeaderExists(HttpHeaders::CONTENT_TYPE));
+  EXPECT_EQ("", headers.GetHeader("Content-Type"));
+}
+
+}  // namespace http
+}  // namespace openinstrument
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -7,6 +7,7 @@
  *
  */
 
+#include <ctype.h>
 #include <string>
 #include "lib/common.h"
 #include "lib/http_message.h"
@@ -113,9 +114,25 @@ void HttpReply::StockReply(HttpReply::status_type status) {
   SetContentType("text/html; charset=UTF-8");
 }
 
-void HttpReply::WriteFirstline(Socket *sock) {
+void HttpReply::ParseFirstLine(const StringPiece &line) {
+  StringPiece rest(line);
+  StringPiece version = ConsumeWord(&rest);
+  StringPiece status = ConsumeWord(&rest);
+  set_http_version(version);
+  if (!version_major_ || status.size() != 3)
+    throw runtime_error("Invalid HTTP status line");
+  uint16_t code = 0;
+  for (uint64_t i = 0; i < status.size(); ++i) {
+    if (!isdigit(status.data()[i]))
+      throw runtime_error("Invalid HTTP status line");
+    code = code * 10 + (status.data()[i] - '0');
+  }
+  SetStatus(static_cast<status_type>(code));
+}
+
+void HttpReply::WriteFirstline(Cord *output) {
   VLOG(2) << StatusToResponse(status_);
-  sock->Write(StatusToResponse(status_));
+  output->CopyFrom(StatusToResponse(status_));
 }
 
 }  // namespace http
@@ -23,8 +23,8 @@ namespace http {
 // A reply to be sent to a client.
 class HttpReply : public HttpMessage {
  public:
-  HttpReply() : status_(INTERNAL_SERVER_ERROR), complete_callback_(NULL) {}
-  HttpReply(const HttpReply &copy) : HttpMessage(copy), status_(copy.status_) {}
+  HttpReply() : status_(INTERNAL_SERVER_ERROR), complete_callback_(NULL), compressible_(false) {}
+  HttpReply(const HttpReply &copy) : HttpMessage(copy), status_(copy.status_), compressible_(copy.compressible_) {}
 
   virtual ~HttpReply() {
     if (complete_callback_)
@@ -65,6 +65,11 @@ class HttpReply : public HttpMessage {
     return status_;
   }
 
+  // Replies with some statuses never have a body, whatever their headers say.
+  inline bool HasBody() const {
+    return status_ != NO_CONTENT && status_ != NOT_MODIFIED;
+  }
+
   inline bool success() {
     return static_cast<uint16_t>(status_) >= 200 && static_cast<uint16_t>(status_) < 400;
   }
@@ -77,16 +82,30 @@ class HttpReply : public HttpMessage {
     status_ = status;
   }
 
+  // Parse the status line, setting the version and status.
+  void ParseFirstLine(const StringPiece &line);
+
   void AddCompleteCallback(Callback done) {
     complete_callback_ = done;
   }
 
+  // Mark the body as worth compressing. The server will compress it if the client accepts a supported encoding and
+  // the body is large enough.
+  inline void set_compressible(bool newval = true) {
+    compressible_ = newval;
+  }
+
+  inline bool compressible() const {
+    return compressible_;
+  }
+
  protected:
   // The status of the reply.
   status_type status_;
   Callback complete_callback_;
+  bool compressible_;
 
-  void WriteFirstline(Socket *sock);
+  void WriteFirstline(Cord *output);
 
   friend class HttpClient;
 };
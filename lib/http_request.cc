@@ -35,12 +35,20 @@ const string &HttpRequest::GetParam(const string &key) const {
   return empty_string;
 }
 
-void HttpRequest::WriteFirstline(Socket *sock) {
-  Cord firstline;
-  firstline.CopyFrom(StringPrintf("%s %s %s\r\n", method().c_str(), uri.Assemble().c_str(),
-                                  http_version().c_str()));
-  sock->Write(firstline);
-  sock->Flush();
+void HttpRequest::ParseFirstLine(const StringPiece &line) {
+  StringPiece rest(line);
+  StringPiece method = ConsumeWord(&rest);
+  StringPiece path = ConsumeWord(&rest);
+  StringPiece version = ConsumeWord(&rest);
+  set_http_version(version);
+  if (!method.size() || !path.size() || !version_major_)
+    throw runtime_error("Invalid HTTP request line");
+  method_.assign(method.data(), method.size());
+  uri = Uri(path.ToString());
+}
+
+void HttpRequest::WriteFirstline(Cord *output) {
+  output->CopyFrom(StringPrintf("%s %s %s\r\n", method().c_str(), uri.Assemble().c_str(), http_version().c_str()));
 }
 
 }  // namespace http
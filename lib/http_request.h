@@ -29,8 +29,11 @@ class HttpRequest : public HttpMessage {
   Uri uri;
   Socket::Address source;
 
+  // Parse the request line, setting the method, uri and version.
+  void ParseFirstLine(const StringPiece &line);
+
  private:
-  void WriteFirstline(Socket *sock);
+  void WriteFirstline(Cord *output);
 };
 
 }  // namespace http
@@ -7,173 +7,566 @@
  *
  */
 
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/gzip.h"
+#include "lib/http_parser.h"
 #include "lib/http_server.h"
+#include "lib/timer.h"
+
+DEFINE_int32(http_reactor_threads, 0, "Number of threads handling HTTP connections, 0 for one per CPU core");
+DEFINE_int32(http_idle_timeout, 600, "Seconds before an idle HTTP connection is closed");
+DEFINE_int32(http_compression_min_size, 1024, "Smallest reply body in bytes which will be compressed");
+DEFINE_int32(http_compression_level, 6, "zlib compression level (1-9) used for compressed replies");
+DEFINE_bool(http_reuseport, false, "Give each HTTP reactor its own SO_REUSEPORT socket, which hides port conflicts");
 
 namespace openinstrument {
 namespace http {
 
+namespace {
+
+// Requests with more header data than this are rejected.
+const uint64_t kMaxHeaderSize = 64 * 1024;
+
+// Maximum number of events handled for each call to epoll_wait().
+const int kMaxEvents = 256;
+
+// While a request is being handled, no more than this is read ahead from its connection.
+const uint64_t kMaxBusyReadSize = 1024 * 1024;
+
+}  // namespace
+
 const char *HttpServer::RFC112Format = "%a, %d %b %Y %H:%M:%S %Z";
 
-HttpServer::HttpServer(const string &address, const uint16_t port, Executor *executor)
-  : shutdown_(false),
-    address_(address),
-    listen_thread_(new thread(bind(&HttpServer::Start, this))),
-    executor_(executor),
-    request_handler_(new RequestHandler()),
-    stats_("/openinstrument/httpserver") {
-  address_.set_port(port);
-  listen_socket_.Listen(address_);
+// A client connection, which belongs to the reactor that accepted it. Only that reactor reads and writes the socket.
+// Requests on a connection are handled one at a time, so replies to pipelined requests are sent in order.
+class HttpServer::Connection : private noncopyable {
+ public:
+  explicit Connection(Socket *sock)
+    : sock(sock),
+      busy(false),
+      eof(false),
+      close_after_write(false),
+      closed(false),
+      read_paused(false),
+      parser(kMaxHeaderSize),
+      last_active(Timestamp::Now()) {}
+
+  scoped_ptr<Socket> sock;
+  // Set while a request is being handled on the executor.
+  bool busy;
+  // Set once the client has closed its side of the connection.
+  bool eof;
+  // Close the connection once everything in the write buffer has been sent.
+  bool close_after_write;
+  // Set once the reactor has closed the connection. Replies still being built for it are dropped.
+  bool closed;
+  // Set when reading stopped at kMaxBusyReadSize. The socket is edge-triggered, so it won't be reported as readable
+  // again for data which has already arrived, and must be read once the current request is done.
+  bool read_paused;
+  // The request being read.
+  shared_ptr<HttpRequest> request;
+  // Parses the headers of <request> as they arrive.
+  HttpParser parser;
+  uint64_t last_active;
+};
+
+// A thread with its own epoll set, which owns every connection it accepts.
+class HttpServer::Reactor : public enable_shared_from_this<Reactor>, private noncopyable {
+ public:
+  // Accept connections on <listen_socket>, which may be shared with other reactors.
+  Reactor(HttpServer *server, shared_ptr<Socket> listen_socket);
+  ~Reactor();
+
+  void Start();
+  void Stop();
+
+  // Queue the serialized reply to the request on <connection>. This may be called from any thread.
+  void Complete(shared_ptr<Connection> connection, shared_ptr<Cord> output, bool close_connection);
+
+  const Socket::Address &address() const {
+    return listen_socket_->local();
+  }
+
+ private:
+  struct Completion {
+    shared_ptr<Connection> connection;
+    shared_ptr<Cord> output;
+    bool close_connection;
+  };
+
+  void Run();
+  void Wake();
+  void AcceptConnections();
+  void Read(const shared_ptr<Connection> &connection);
+  void Write(const shared_ptr<Connection> &connection);
+  void Close(const shared_ptr<Connection> &connection);
+
+  // Start handling the next request on <connection>, if a complete one has arrived and no other is in progress.
+  void Dispatch(const shared_ptr<Connection> &connection);
+
+  // Take the next complete request from the read buffer of <connection>. Returns NULL if more data is needed, and
+  // throws runtime_error if the request is invalid.
+  shared_ptr<HttpRequest> ParseRequest(Connection *connection, bool *close_connection);
+
+  void ProcessCompletions();
+  void CloseIdle(uint64_t now);
+
+  HttpServer *server_;
+  shared_ptr<Socket> listen_socket_;
+  int epoll_fd_;
+  // eventfd used to wake the reactor when replies are ready.
+  int wake_fd_;
+  volatile bool stopped_;
+  scoped_ptr<thread> thread_;
+  unordered_map<int, shared_ptr<Connection>> connections_;
+
+  Mutex completions_mutex_;
+  vector<Completion> completions_;
+};
+
+HttpServer::Reactor::Reactor(HttpServer *server, shared_ptr<Socket> listen_socket)
+  : server_(server),
+    listen_socket_(listen_socket),
+    epoll_fd_(-1),
+    wake_fd_(-1),
+    stopped_(false),
+    thread_(NULL) {
+  if ((epoll_fd_ = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    throw runtime_error(StringPrintf("Can't create epoll set: %s", strerror(errno)));
+  if ((wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    throw runtime_error(StringPrintf("Can't create eventfd: %s", strerror(errno)));
+
+  // The listening socket and eventfd are level-triggered, so anything not handled in one pass is seen again.
+  int fds[] = { listen_socket_->fd(), wake_fd_ };
+  for (int fd : fds) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    // Only wake one of the reactors sharing a listening socket for each new connection.
+    if (fd == listen_socket_->fd() && !FLAGS_http_reuseport)
+      event.events |= EPOLLEXCLUSIVE;
+#endif
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+      throw runtime_error(StringPrintf("Can't add to epoll set: %s", strerror(errno)));
+  }
 }
 
-HttpServer::~HttpServer() {
+HttpServer::Reactor::~Reactor() {
   Stop();
+  if (epoll_fd_ >= 0)
+    ::close(epoll_fd_);
+  if (wake_fd_ >= 0)
+    ::close(wake_fd_);
 }
 
-void HttpServer::Start() {
+void HttpServer::Reactor::Start() {
+  if (!thread_.get())
+    thread_.reset(new thread(bind(&Reactor::Run, this)));
+}
+
+void HttpServer::Reactor::Stop() {
+  stopped_ = true;
+  Wake();
+  if (thread_.get()) {
+    thread_->join();
+    thread_.reset();
+  }
+}
+
+void HttpServer::Reactor::Wake() {
+  uint64_t one = 1;
+  if (::write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    LOG(WARNING) << "Can't wake HTTP reactor: " << strerror(errno);
+}
+
+void HttpServer::Reactor::Complete(shared_ptr<Connection> connection, shared_ptr<Cord> output,
+                                   bool close_connection) {
+  Completion completion;
+  completion.connection = connection;
+  completion.output = output;
+  completion.close_connection = close_connection;
+  {
+    MutexLock lock(completions_mutex_);
+    completions_.push_back(completion);
+  }
+  Wake();
+}
+
+void HttpServer::Reactor::Run() {
   // Block all signals
   sigset_t new_mask;
   sigfillset(&new_mask);
   sigset_t old_mask;
   pthread_sigmask(SIG_BLOCK, &new_mask, &old_mask);
 
-  LOG(INFO) << "HttpServer listening on " << address_.ToString();
+  epoll_event events[kMaxEvents];
+  uint64_t last_idle_check = Timestamp::Now();
+  while (!stopped_) {
+    int num_events = epoll_wait(epoll_fd_, events, kMaxEvents, 1000);
+    if (num_events < 0) {
+      if (errno == EINTR)
+        continue;
+      LOG(ERROR) << "epoll_wait() returned error: " << strerror(errno);
+      break;
+    }
+    for (int i = 0; i < num_events; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == listen_socket_->fd()) {
+        AcceptConnections();
+        continue;
+      }
+      if (fd == wake_fd_) {
+        uint64_t count;
+        if (::read(wake_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          LOG(WARNING) << "Can't read HTTP reactor eventfd: " << strerror(errno);
+        continue;
+      }
+      unordered_map<int, shared_ptr<Connection>>::iterator it = connections_.find(fd);
+      if (it == connections_.end())
+        continue;
+      shared_ptr<Connection> connection = it->second;
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        Read(connection);
+      if (!connection->closed && (events[i].events & EPOLLOUT))
+        Write(connection);
+      if (!connection->closed)
+        Dispatch(connection);
+    }
+    ProcessCompletions();
 
-  while (!shutdown_) {
-    scoped_ptr<Socket> client(listen_socket_.Accept(1000));
-    if (!client.get())
-      continue;
-    ++stats_["/connections-received"];
-    VLOG(1) << "Accepted new connection from " << client->remote().ToString();
+    uint64_t now = Timestamp::Now();
+    if (now - last_idle_check >= 1000) {
+      CloseIdle(now);
+      last_idle_check = now;
+    }
+  }
+
+  for (auto &i : connections_) {
+    i.second->closed = true;
+    i.second->sock->Abort();
+  }
+  server_->stats_["/open-connections"] += -static_cast<int64_t>(connections_.size());
+  connections_.clear();
+}
+
+void HttpServer::Reactor::AcceptConnections() {
+  while (true) {
+    scoped_ptr<Socket> sock(NULL);
     try {
-      executor_->Add(bind(&HttpServer::HandleClient, this, client.release()));
+      sock.reset(listen_socket_->Accept(0));
     } catch (exception &e) {
       LOG(WARNING) << e.what();
+      return;
     }
+    if (!sock.get())
+      return;
+    ++server_->stats_["/connections-received"];
+
+    // Client connections are edge-triggered, so every read and write continues until the socket would block.
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = sock->fd();
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, sock->fd(), &event) < 0) {
+      LOG(WARNING) << "Can't add connection to epoll set: " << strerror(errno);
+      continue;
+    }
+    VLOG(1) << "Accepted new connection from " << sock->remote().ToString();
+    shared_ptr<Connection> connection(new Connection(sock.release()));
+    connections_[connection->sock->fd()] = connection;
+    ++server_->stats_["/open-connections"];
   }
 }
 
-void HttpServer::Stop() {
-  LOG(INFO) << "Stopping HttpServer";
-  shutdown_ = true;
-  if (listen_thread_.get())
-    listen_thread_->join();
+void HttpServer::Reactor::Read(const shared_ptr<Connection> &connection) {
+  bool eof = false;
+  // Pipelined requests can't be handled until the current one is done, so don't buffer an unlimited amount of them.
+  uint64_t limit = connection->busy ? kMaxBusyReadSize : 0;
+  try {
+    if (connection->sock->ReadAvailable(&eof, limit))
+      connection->last_active = Timestamp::Now();
+  } catch (exception &e) {
+    VLOG(1) << "Error reading from " << connection->sock->remote().ToString() << ": " << e.what();
+    Close(connection);
+    return;
+  }
+  if (eof)
+    connection->eof = true;
+  connection->read_paused = limit && !eof && connection->sock->read_buffer()->size() >= limit;
+}
+
+void HttpServer::Reactor::Write(const shared_ptr<Connection> &connection) {
+  try {
+    if (!connection->sock->WriteAvailable())
+      return;
+  } catch (exception &e) {
+    VLOG(1) << "Error writing to " << connection->sock->remote().ToString() << ": " << e.what();
+    Close(connection);
+    return;
+  }
+  connection->last_active = Timestamp::Now();
+  if (connection->close_after_write)
+    Close(connection);
+}
+
+void HttpServer::Reactor::Close(const shared_ptr<Connection> &connection) {
+  if (connection->closed)
+    return;
+  connection->closed = true;
+  // Closing the socket also removes it from the epoll set.
+  connections_.erase(connection->sock->fd());
+  connection->sock->Abort();
+  --server_->stats_["/open-connections"];
 }
 
-void HttpServer::HandleClient(Socket *client) {
-  scoped_ptr<Socket> sock(client);
+void HttpServer::Reactor::Dispatch(const shared_ptr<Connection> &connection) {
+  if (connection->busy || connection->close_after_write)
+    return;
+  shared_ptr<HttpRequest> request;
   bool close_connection = false;
-  while (!close_connection) {
-    Deadline deadline(30000);
-    HttpRequest request;
-    request.source = sock->remote();
-    for (int i = 0; i < 20; ++i) {
-      string output;
-      try {
-        sock->read_buffer()->ConsumeLine(&output);
-      } catch (out_of_range) {
-        try {
-          if (sock->Read(deadline) == 0)
-            return;
-          continue;
-        } catch (exception) {
-          return;
-        }
-      }
+  try {
+    request = ParseRequest(connection.get(), &close_connection);
+  } catch (exception &e) {
+    LOG(WARNING) << "Invalid HTTP request: " << e.what();
+    HttpReply reply;
+    reply.set_http_version("HTTP/1.1");
+    reply.StockReply(HttpReply::BAD_REQUEST);
+    reply.SetHeader("Connection", "close");
+    reply.Serialize(connection->sock->write_buffer());
+    ++server_->stats_["/request-failure"];
+    connection->close_after_write = true;
+    Write(connection);
+    return;
+  }
 
-      try {
-        request.set_method(ConsumeFirstWord(&output));
-        request.uri = Uri(ConsumeFirstWord(&output));
-        request.set_http_version(ConsumeFirstWord(&output));
-        if (request.http_version() == "HTTP/0.0")
-          return;
-        request.ReadAndParseHeaders(sock.get(), deadline);
-      } catch (exception &e) {
-        LOG(WARNING) << "Invalid HTTP request: " << e.what();
-        HttpReply reply;
-        reply.StockReply(HttpReply::BAD_REQUEST);
-        reply.Write(sock.get());
-        return;
-      }
-      break;
+  if (!request.get()) {
+    if (connection->eof) {
+      // The client won't be sending any more requests.
+      if (connection->sock->write_buffer()->empty())
+        Close(connection);
+      else
+        connection->close_after_write = true;
     }
+    return;
+  }
 
-    if (!request.headers().GetHeader("Content-Length").empty()) {
-      // There has been some POST data
-      while (sock->read_buffer()->size() < request.GetContentLength()) {
-        try {
-          if (sock->Read(deadline) == 0)
-            return;
-        } catch (exception) {
-          return;
-        }
-      }
-    } else if (request.method() == "POST") {
-      if (request.headers().GetHeader("Connection") != "close") {
-        LOG(WARNING) << "POST request with no Content-Length and Connection != close";
-        close_connection = true;
-      }
-      while (sock->Read(deadline) > 0);
+  request->source = connection->sock->remote();
+  connection->busy = true;
+  try {
+    server_->executor_->Add(bind(&HttpServer::HandleRequest, server_, shared_from_this(), connection, request,
+                                 close_connection));
+  } catch (exception &e) {
+    LOG(WARNING) << e.what();
+    Close(connection);
+  }
+}
+
+shared_ptr<HttpRequest> HttpServer::Reactor::ParseRequest(Connection *connection, bool *close_connection) {
+  Cord *input = connection->sock->read_buffer();
+  if (!connection->request.get()) {
+    if (input->empty())
+      return shared_ptr<HttpRequest>();
+    connection->request.reset(new HttpRequest());
+  }
+  HttpRequest *request = connection->request.get();
+  if (!connection->parser.complete() && !connection->parser.Parse(input, request))
+    return shared_ptr<HttpRequest>();
+
+  uint64_t length = 0;
+  if (request->headers().HeaderExists(HttpHeaders::CONTENT_LENGTH)) {
+    length = request->GetContentLength();
+    if (input->size() < length) {
+      // Read the rest of the body in as few calls as possible.
+      connection->sock->ExpectRead(length - input->size());
+      return shared_ptr<HttpRequest>();
+    }
+  } else if (request->method() == "POST") {
+    // Without a Content-Length the body is everything until the client closes the connection.
+    if (!connection->eof)
+      return shared_ptr<HttpRequest>();
+    length = input->size();
+    *close_connection = true;
+  }
+  if (length)
+    input->ConsumeInto(length, request->mutable_body());
+  connection->parser.Reset();
+  shared_ptr<HttpRequest> output;
+  output.swap(connection->request);
+  return output;
+}
+
+void HttpServer::Reactor::ProcessCompletions() {
+  vector<Completion> completions;
+  {
+    MutexLock lock(completions_mutex_);
+    completions.swap(completions_);
+  }
+  for (Completion &completion : completions) {
+    const shared_ptr<Connection> &connection = completion.connection;
+    if (connection->closed)
+      continue;
+    connection->busy = false;
+    connection->last_active = Timestamp::Now();
+    if (completion.close_connection)
+      connection->close_after_write = true;
+    connection->sock->write_buffer()->Splice(completion.output.get());
+    Write(connection);
+    if (!connection->closed)
+      Dispatch(connection);
+    if (!connection->closed && connection->read_paused) {
+      // Pick up whatever arrived while reading was paused, up to the limit again if another request is now running.
+      Read(connection);
+      if (!connection->closed)
+        Dispatch(connection);
     }
+  }
+}
 
-    if (sock->read_buffer()->size())
-      request.mutable_body()->CopyFrom(*sock->read_buffer());
+void HttpServer::Reactor::CloseIdle(uint64_t now) {
+  uint64_t timeout = static_cast<uint64_t>(FLAGS_http_idle_timeout) * 1000;
+  vector<shared_ptr<Connection>> idle;
+  for (auto &i : connections_) {
+    if (!i.second->busy && now - i.second->last_active > timeout)
+      idle.push_back(i.second);
+  }
+  for (auto &connection : idle) {
+    VLOG(1) << "Closing idle connection from " << connection->sock->remote().ToString();
+    Close(connection);
+  }
+}
 
-    HttpReply reply;
-    reply.set_http_version(request.http_version());
+HttpServer::HttpServer(const string &address, const uint16_t port, Executor *executor)
+  : shutdown_(false),
+    address_(address),
+    executor_(executor),
+    request_handler_(new RequestHandler()),
+    stats_("/openinstrument/httpserver") {
+  address_.set_port(port);
+  // Create every counter up front, as the reactor threads update them concurrently.
+  stats_["/connections-received"];
+  stats_["/open-connections"];
+  stats_["/request-success"];
+  stats_["/request-failure"];
 
-    if (request.http_version() == "HTTP/1.1" ||
-        request.headers().GetHeader("Accept-Encoding").find("chunked") != string::npos) {
-      reply.set_chunked_encoding(true);
+  int num_reactors = FLAGS_http_reactor_threads;
+  if (num_reactors <= 0)
+    num_reactors = std::max(1U, boost::thread::hardware_concurrency());
+  shared_ptr<Socket> listen_socket;
+  for (int i = 0; i < num_reactors; ++i) {
+    if (!listen_socket.get() || FLAGS_http_reuseport) {
+      listen_socket.reset(new Socket());
+      listen_socket->Listen(address_, FLAGS_http_reuseport);
+      listen_socket->SetNonblocking(true);
+      // If any port was allowed, the rest of the reactors share the one chosen for the first.
+      if (!address_.port())
+        address_.set_port(listen_socket->local().port());
     }
+    reactors_.push_back(shared_ptr<Reactor>(new Reactor(this, listen_socket)));
+  }
+  Start();
+}
 
-    request_handler_->HandleRequest(request, &reply);
+HttpServer::~HttpServer() {
+  Stop();
+}
 
-    try {
-      // Set default required headers in the reply
-      if (reply.chunked_encoding()) {
-        reply.mutable_headers()->RemoveHeader("Content-Length");
-        reply.mutable_headers()->AddHeader("Transfer-Encoding", "chunked");
-      } else {
-        if (!reply.headers().HeaderExists("Content-Length"))
-          reply.SetContentLength(reply.body().size());
-        reply.mutable_headers()->RemoveHeader("Transfer-Encoding");
-      }
-      if (!reply.headers().HeaderExists("Content-Type"))
-        reply.SetContentType("text/html; charset=UTF-8");
-      if (!reply.headers().HeaderExists("Date"))
-        reply.mutable_headers()->AddHeader("Date", Timestamp().GmTime(RFC112Format));
-      if (!reply.headers().HeaderExists("Last-Modified"))
-        reply.mutable_headers()->AddHeader("Last-Modified", Timestamp().GmTime(RFC112Format));
-      if (!reply.headers().HeaderExists("Server"))
-        reply.mutable_headers()->AddHeader("Server", "OpenInstrument/1.0");
-      if (!reply.headers().HeaderExists("X-Frame-Options"))
-        reply.mutable_headers()->AddHeader("X-Frame-Options", "SAMEORIGIN");
-      if (!reply.headers().HeaderExists("X-XSS-Protection"))
-        reply.mutable_headers()->AddHeader("X-XSS-Protection", "1; mode=block");
-      if (!reply.headers().HeaderExists("X-Frame-Options"))
-        reply.mutable_headers()->AddHeader("X-Frame-Options", "deny");
-      if (!close_connection && request.http_version() >= "HTTP/1.1" &&
-          request.headers().GetHeader("Connection").find("close") == string::npos) {
-        reply.mutable_headers()->SetHeader("Connection", "keep-alive");
-      } else {
-        close_connection = true;
-        reply.mutable_headers()->SetHeader("Connection", "close");
-      }
-    } catch (exception &e) {
-      LOG(WARNING) << e.what();
-      // Ignore errors
+void HttpServer::Start() {
+  for (auto &reactor : reactors_)
+    reactor->Start();
+  LOG(INFO) << "HttpServer listening on " << address_.ToString() << " with " << reactors_.size() << " reactors";
+}
+
+void HttpServer::Stop() {
+  if (shutdown_)
+    return;
+  LOG(INFO) << "Stopping HttpServer";
+  shutdown_ = true;
+  for (auto &reactor : reactors_)
+    reactor->Stop();
+}
+
+void HttpServer::HandleRequest(shared_ptr<Reactor> reactor, shared_ptr<Connection> connection,
+                               shared_ptr<HttpRequest> request, bool close_connection) {
+  HttpReply reply;
+  reply.set_http_version(request->http_version());
+  if (request->http_version() == "HTTP/1.1" ||
+      request->headers().GetHeader(HttpHeaders::ACCEPT_ENCODING).find("chunked") != string::npos) {
+    reply.set_chunked_encoding(true);
+  }
+
+  request_handler_->HandleRequest(*request, &reply);
+  FinishReply(*request, &reply, &close_connection);
+
+  shared_ptr<Cord> output(new Cord());
+  reply.Serialize(output.get());
+  if (reply.IsSuccess())
+    ++stats_["/request-success"];
+  else
+    ++stats_["/request-failure"];
+  reactor->Complete(connection, output, close_connection);
+}
+
+void HttpServer::FinishReply(const HttpRequest &request, HttpReply *reply, bool *close_connection) {
+  try {
+    if (!reply->HasBody()) {
+      // Not even an empty chunked body may be sent, or the client would read it as the start of the next reply.
+      reply->set_chunked_encoding(false);
+      reply->mutable_body()->clear();
+      reply->mutable_headers()->RemoveHeader("Content-Length");
+      reply->mutable_headers()->RemoveHeader("Transfer-Encoding");
     }
-    try {
-      reply.Write(sock.get());
-      sock->Flush();
-      if (reply.IsSuccess())
-        ++stats_["/request-success"];
-      else
-        ++stats_["/request-failure"];
-    } catch (exception &e) {
-      LOG(WARNING) << e.what();
-      ++stats_["/request-failure"];
+    if (reply->compressible() && reply->body().size() >= static_cast<uint64_t>(FLAGS_http_compression_min_size) &&
+        !reply->headers().HeaderExists("Content-Encoding") &&
+        HttpHeaders::AcceptsEncoding(request.headers().GetHeader(HttpHeaders::ACCEPT_ENCODING), "gzip")) {
+      Cord compressed;
+      GzipCompress(reply->body(), &compressed, FLAGS_http_compression_level);
+      VLOG(2) << "Compressed " << reply->body().size() << " byte reply to " << compressed.size() << " bytes";
+      reply->mutable_body()->swap(compressed);
+      reply->mutable_headers()->RemoveHeader("Content-Length");
+      reply->mutable_headers()->SetHeader("Content-Encoding", "gzip");
+      reply->mutable_headers()->SetHeader("Vary", "Accept-Encoding");
     }
+    // Set default required headers in the reply
+    if (reply->chunked_encoding()) {
+      reply->mutable_headers()->RemoveHeader("Content-Length");
+      reply->mutable_headers()->AddHeader("Transfer-Encoding", "chunked");
+    } else {
+      if (!reply->headers().HeaderExists("Content-Length") && reply->HasBody())
+        reply->SetContentLength(reply->body().size());
+      reply->mutable_headers()->RemoveHeader("Transfer-Encoding");
+    }
+    if (!reply->headers().HeaderExists("Content-Type"))
+      reply->SetContentType("text/html; charset=UTF-8");
+    if (!reply->headers().HeaderExists("Date"))
+      reply->mutable_headers()->AddHeader("Date", Timestamp().GmTime(RFC112Format));
+    if (!reply->headers().HeaderExists("Last-Modified"))
+      reply->mutable_headers()->AddHeader("Last-Modified", Timestamp().GmTime(RFC112Format));
+    if (!reply->headers().HeaderExists("Server"))
+      reply->mutable_headers()->AddHeader("Server", "OpenInstrument/1.0");
+    if (!reply->headers().HeaderExists("X-Frame-Options"))
+      reply->mutable_headers()->AddHeader("X-Frame-Options", "SAMEORIGIN");
+    if (!reply->headers().HeaderExists("X-XSS-Protection"))
+      reply->mutable_headers()->AddHeader("X-XSS-Protection", "1; mode=block");
+    if (!*close_connection && request.http_version() >= "HTTP/1.1" &&
+        request.headers().GetHeader(HttpHeaders::CONNECTION).find("close") == string::npos) {
+      reply->mutable_headers()->SetHeader("Connection", "keep-alive");
+    } else {
+      *close_connection = true;
+      reply->mutable_headers()->SetHeader("Connection", "close");
+    }
+  } catch (exception &e) {
+    LOG(WARNING) << e.what();
+    // Ignore errors
   }
 }
 
@@ -181,10 +574,6 @@ RequestHandler *HttpServer::request_handler() {
   return request_handler_.get();
 }
 
-thread *HttpServer::listen_thread() const {
-  return listen_thread_.get();
-}
-
 void HttpServer::AddExportHandler() {
   request_handler()->AddPath("/export_vars$", &HttpServer::HandleExportVars, this);
 }
@@ -195,6 +584,7 @@ bool HttpServer::HandleExportVars(const HttpRequest &request, HttpReply *reply)
   string c;
   VariableExporter::GetGlobalExporter()->ExportToString(&c);
   reply->mutable_body()->CopyFrom(c);
+  reply->set_compressible();
   return true;
 }
 
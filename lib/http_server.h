@@ -1,5 +1,11 @@
 /*
- *  -
+ * HTTP server.
+ *
+ * Connections are handled by a set of reactor threads, one per core by default. The reactors share one listening
+ * socket, or with --http_reuseport each has its own bound to the same address with SO_REUSEPORT, so the kernel spreads
+ * new connections across them. Each reactor has its own edge-triggered epoll set. Reactors do all socket reads and
+ * writes without blocking, and only hand complete requests to the Executor, so an idle keep-alive connection costs a
+ * file descriptor and its buffers rather than a thread.
  *
  * Copyright 2011 David Parrish <david@dparrish.com>
  *
@@ -25,15 +31,16 @@ namespace http {
 // The top-level class of the HTTP server.
 class HttpServer : private noncopyable {
  public:
-  // Construct the server to listen on the specified TCP address and port, with a given thread pool size.
+  // Construct the server to listen on the specified TCP address and port. Requests are run on <executor>.
+  // If <port> is 0, a port is chosen and returned by address().
   explicit HttpServer(const string &address, const uint16_t port, Executor *executor);
 
   ~HttpServer();
 
-  // Run the event loop.
+  // Start the reactor threads. This is called by the constructor.
   void Start();
 
-  // Stop the server.
+  // Stop the server, closing all connections.
   void Stop();
 
   // Use a given RequestHandler object to handle requests.
@@ -47,22 +54,30 @@ class HttpServer : private noncopyable {
   }
 
   RequestHandler *request_handler();
-  thread *listen_thread() const;
   void AddExportHandler();
 
   static const char *RFC112Format;
 
  private:
-  void Acceptor();
+  class Connection;
+  class Reactor;
+
+  // Run a request through the request handler and return the serialized reply to the reactor. This runs on the
+  // executor.
+  void HandleRequest(shared_ptr<Reactor> reactor, shared_ptr<Connection> connection, shared_ptr<HttpRequest> request,
+                     bool close_connection);
+
+  // Fill in the default headers of a reply. Sets <close_connection> if the connection should be closed after the reply
+  // has been sent.
+  void FinishReply(const HttpRequest &request, HttpReply *reply, bool *close_connection);
+
   bool HandleExportVars(const HttpRequest &request, HttpReply *reply);
-  void HandleClient(Socket *sock);
 
-  // Set to true to cause all the listening threads to shut down once they complete the in-progress request
-  bool shutdown_;
+  // Set to true to cause all the reactor threads to shut down.
+  volatile bool shutdown_;
 
   Socket::Address address_;
-  Socket listen_socket_;
-  scoped_ptr<thread> listen_thread_;
+  vector<shared_ptr<Reactor>> reactors_;
 
   Executor *executor_;
 
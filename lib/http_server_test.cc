@@ -0,0 +1,385 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/http_client.h"
+#include "lib/http_server.h"
+#include "lib/socket.h"
+#include "lib/threadpool.h"
+
+DECLARE_int32(http_idle_timeout);
+
+namespace openinstrument {
+namespace http {
+
+class HttpServerTest : public ::testing::Test {
+ protected:
+  HttpServerTest()
+    : policy_(2, 4),
+      thread_pool_("http_server_test", policy_),
+      server_("127.0.0.1", 0, &thread_pool_) {
+    server_.request_handler()->AddPath("/echo$", &HttpServerTest::HandleEcho, this);
+    server_.request_handler()->AddPath("/size$", &HttpServerTest::HandleSize, this);
+    server_.request_handler()->AddPath("/large$", &HttpServerTest::HandleLarge, this);
+    server_.request_handler()->AddPath("/slow$", &HttpServerTest::HandleSlow, this);
+    server_.request_handler()->AddPath("/notmodified$", &HttpServerTest::HandleNotModified, this);
+  }
+
+  bool HandleEcho(const HttpRequest &request, HttpReply *reply) {
+    reply->SetStatus(HttpReply::OK);
+    reply->SetContentType("text/plain");
+    string body = request.uri.path;
+    if (request.HasParam("q"))
+      body += " " + request.GetParam("q");
+    reply->mutable_body()->CopyFrom(body);
+    return true;
+  }
+
+  bool HandleSize(const HttpRequest &request, HttpReply *reply) {
+    reply->SetStatus(HttpReply::OK);
+    reply->SetContentType("text/plain");
+    reply->mutable_body()->CopyFrom(StringPrintf("size=%lu", request.body().size()));
+    return true;
+  }
+
+  bool HandleLarge(const HttpRequest &request, HttpReply *reply) {
+    reply->SetStatus(HttpReply::OK);
+    reply->SetContentType("text/plain");
+    reply->mutable_body()->CopyFrom(LargeBody());
+    reply->set_compressible();
+    return true;
+  }
+
+  bool HandleSlow(const HttpRequest &request, HttpReply *reply) {
+    usleep(200000);
+    return HandleEcho(request, reply);
+  }
+
+  bool HandleNotModified(const HttpRequest &request, HttpReply *reply) {
+    reply->SetStatus(HttpReply::NOT_MODIFIED);
+    return true;
+  }
+
+  static string LargeBody() {
+    string body;
+    for (int i = 0; i < 1000; i++)
+      body += StringPrintf("/openinstrument/test value=%d\n", i);
+    return body;
+  }
+
+  // Read from <sock> until <count> complete replies have arrived and return everything read.
+  string ReadReplies(Socket *sock, int count) {
+    string output;
+    Deadline deadline(5000);
+    while (true) {
+      output = sock->read_buffer()->ToString();
+      int found = 0;
+      for (string::size_type pos = 0; (pos = output.find("\r\n0\r\n\r\n", pos)) != string::npos; ++pos)
+        ++found;
+      if (found >= count || !deadline)
+        return output;
+      sock->Read(100);
+    }
+  }
+
+  // Wait up to <timeout> ms for the other end to close <sock>.
+  static bool WaitForClose(Socket *sock, int timeout) {
+    sock->SetNonblocking(true);
+    Deadline deadline(timeout);
+    while (deadline) {
+      bool eof = false;
+      sock->ReadAvailable(&eof);
+      if (eof)
+        return true;
+      usleep(100000);
+    }
+    return false;
+  }
+
+  // Read from <sock> until the end of the request headers has arrived.
+  static bool ReadRequestHeaders(Socket *sock) {
+    Deadline deadline(5000);
+    while (sock->read_buffer()->ToString().find("\r\n\r\n") == string::npos) {
+      if (!deadline || !sock->fd())
+        return false;
+      sock->Read(100);
+    }
+    sock->read_buffer()->clear();
+    return true;
+  }
+
+  // Answer one request on a connection to <listener>, then close the connection when the next request arrives without
+  // answering it. If the client tries again on a new connection, that request is answered. Every connection accepted is
+  // counted in <accepted>.
+  static void DropSecondRequest(Socket *listener, int *accepted) {
+    const string reply("HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: keep-alive\r\n\r\nok");
+    scoped_ptr<Socket> sock(listener->Accept(5000));
+    if (!sock.get() || !ReadRequestHeaders(sock.get()))
+      return;
+    ++*accepted;
+    sock->Write(reply);
+    sock->Flush();
+    if (!ReadRequestHeaders(sock.get()))
+      return;
+    sock->Abort();
+
+    sock.reset(listener->Accept(1000));
+    if (!sock.get() || !ReadRequestHeaders(sock.get()))
+      return;
+    ++*accepted;
+    sock->Write(reply);
+    sock->Flush();
+  }
+
+  DefaultThreadPoolPolicy policy_;
+  ThreadPool thread_pool_;
+  HttpServer server_;
+};
+
+TEST_F(HttpServerTest, Request) {
+  ASSERT_NE(0, server_.address().port());
+  HttpClient client;
+  scoped_ptr<HttpRequest> request(client.NewRequest(
+      StringPrintf("http://127.0.0.1:%d/echo?q=test", server_.address().port())));
+  scoped_ptr<HttpReply> reply(client.SendRequest(*request));
+  ASSERT_TRUE(reply.get());
+  EXPECT_EQ(HttpReply::OK, reply->status());
+  EXPECT_EQ("/echo test", reply->body().ToString());
+
+  // Requests can only be sent once.
+  request.reset(client.NewRequest(StringPrintf("http://127.0.0.1:%d/missing", server_.address().port())));
+  reply.reset(client.SendRequest(*request));
+  ASSERT_TRUE(reply.get());
+  EXPECT_EQ(HttpReply::NOT_FOUND, reply->status());
+}
+
+TEST_F(HttpServerTest, ConnectionReuse) {
+  HttpConnectionPool pool;
+  HttpClient client(&pool);
+  string url = StringPrintf("http://127.0.0.1:%d/echo?q=reuse", server_.address().port());
+  scoped_ptr<HttpRequest> request(client.NewRequest(url));
+  scoped_ptr<HttpReply> reply(client.SendRequest(*request));
+  ASSERT_TRUE(reply.get());
+  EXPECT_EQ("/echo reuse", reply->body().ToString());
+
+  // The connection was kept for the next request
+  bool reused = false;
+  Socket *sock = pool.Get("127.0.0.1", server_.address().port(), 1000, &reused);
+  EXPECT_TRUE(reused);
+  pool.Release("127.0.0.1", server_.address().port(), sock, true);
+
+  request.reset(client.NewRequest(url));
+  reply.reset(client.SendRequest(*request));
+  ASSERT_TRUE(reply.get());
+  EXPECT_EQ("/echo reuse", reply->body().ToString());
+}
+
+TEST_F(HttpServerTest, RetryOnlyIdempotentRequests) {
+  const char *methods[] = { "GET", "POST" };
+  for (const char *method : methods) {
+    Socket listener;
+    listener.Listen(Socket::Address("127.0.0.1", 0));
+    int accepted = 0;
+    thread server(bind(&HttpServerTest::DropSecondRequest, &listener, &accepted));
+    HttpConnectionPool pool;
+    HttpClient client(&pool);
+    string url = StringPrintf("http://127.0.0.1:%d/test", listener.local().port());
+    for (int i = 0; i < 2; ++i) {
+      scoped_ptr<HttpRequest> request(client.NewRequest(url));
+      request->set_method(method);
+      scoped_ptr<HttpReply> reply(client.SendRequest(*request));
+      if (!i || string(method) == "GET") {
+        ASSERT_TRUE(reply.get());
+        EXPECT_EQ("ok", reply->body().ToString());
+      }
+    }
+    server.join();
+    // The GET is sent again on a new connection, but the server may have acted on the POST so it isn't repeated.
+    EXPECT_EQ(string(method) == "GET" ? 2 : 1, accepted) << method;
+  }
+}
+
+TEST_F(HttpServerTest, ReplyWithoutBody) {
+  HttpConnectionPool pool;
+  HttpClient client(&pool);
+  // The 304 has no Content-Length, but the client mustn't wait for the connection to close to find the end of it.
+  Timestamp start;
+  scoped_ptr<HttpRequest> request(client.NewRequest(
+      StringPrintf("http://127.0.0.1:%d/notmodified", server_.address().port())));
+  scoped_ptr<HttpReply> reply(client.SendRequest(*request));
+  ASSERT_TRUE(reply.get());
+  EXPECT_EQ(HttpReply::NOT_MODIFIED, reply->status());
+  EXPECT_TRUE(reply->body().empty());
+  EXPECT_GT(1000U, Timestamp::Now() - start.ms());
+
+  bool reused = false;
+  Socket *sock = pool.Get("127.0.0.1", server_.address().port(), 1000, &reused);
+  EXPECT_TRUE(reused);
+  pool.Release("127.0.0.1", server_.address().port(), sock, true);
+}
+
+TEST_F(HttpServerTest, ServerClosesIdleConnection) {
+  HttpConnectionPool pool;
+  HttpClient client(&pool);
+  string url = StringPrintf("http://127.0.0.1:%d/echo?q=idle", server_.address().port());
+  scoped_ptr<HttpRequest> request(client.NewRequest(url));
+  scoped_ptr<HttpReply> reply(client.SendRequest(*request));
+  ASSERT_TRUE(reply.get());
+  Socket sock;
+  sock.Connect("127.0.0.1", server_.address().port(), 5000);
+  sock.Write(string("GET /echo?q=idle HTTP/1.1\r\nHost: localhost\r\n\r\n"));
+  sock.Flush();
+  ASSERT_NE(string::npos, ReadReplies(&sock, 1).find("/echo idle"));
+
+  // Wait for the server to close both connections, the next request must use a new one.
+  int old_timeout = FLAGS_http_idle_timeout;
+  FLAGS_http_idle_timeout = 0;
+  bool closed = WaitForClose(&sock, 5000);
+  FLAGS_http_idle_timeout = old_timeout;
+  EXPECT_TRUE(closed);
+  request.reset(client.NewRequest(url));
+  reply.reset(client.SendRequest(*request));
+  ASSERT_TRUE(reply.get());
+  EXPECT_EQ(HttpReply::OK, reply->status());
+  EXPECT_EQ("/echo idle", reply->body().ToString());
+}
+
+TEST_F(HttpServerTest, MoreIdleConnectionsThanThreads) {
+  // Idle keep-alive connections don't hold a thread, so there can be many more of them than the pool has threads.
+  vector<shared_ptr<Socket>> socks;
+  for (int i = 0; i < 32; ++i) {
+    shared_ptr<Socket> sock(new Socket());
+    sock->Connect("127.0.0.1", server_.address().port(), 5000);
+    socks.push_back(sock);
+  }
+  for (int round = 0; round < 2; ++round) {
+    for (auto &sock : socks) {
+      sock->read_buffer()->clear();
+      sock->Write(StringPrintf("GET /echo?q=%d HTTP/1.1\r\nHost: localhost\r\n\r\n", round));
+      sock->Flush();
+    }
+    for (auto &sock : socks)
+      EXPECT_NE(string::npos, ReadReplies(sock.get(), 1).find(StringPrintf("/echo %d", round)));
+  }
+}
+
+TEST_F(HttpServerTest, PortInUse) {
+  EXPECT_THROW(HttpServer("127.0.0.1", server_.address().port(), &thread_pool_), runtime_error);
+}
+
+TEST_F(HttpServerTest, Compression) {
+  // The client asks for gzip and decompresses the reply.
+  HttpClient client;
+  scoped_ptr<HttpRequest> request(client.NewRequest(
+      StringPrintf("http://127.0.0.1:%d/large", server_.address().port())));
+  scoped_ptr<HttpReply> reply(client.SendRequest(*request));
+  ASSERT_TRUE(reply.get());
+  EXPECT_EQ(HttpReply::OK, reply->status());
+  EXPECT_EQ(LargeBody(), reply->body().ToString());
+  EXPECT_FALSE(reply->headers().HeaderExists("Content-Encoding"));
+
+  Socket sock;
+  sock.Connect("127.0.0.1", server_.address().port(), 5000);
+  sock.Write(string("GET /large HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: deflate, gzip;q=0.5\r\n\r\n"));
+  sock.Flush();
+  string output = ReadReplies(&sock, 1);
+  EXPECT_NE(string::npos, output.find("Content-Encoding: gzip"));
+  EXPECT_NE(string::npos, output.find("Vary: Accept-Encoding"));
+  EXPECT_LT(output.size(), LargeBody().size());
+
+  // Nothing is compressed for clients that don't ask for it, or refuse gzip.
+  sock.read_buffer()->clear();
+  sock.Write(string("GET /large HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip;q=0\r\n\r\n"));
+  sock.Flush();
+  output = ReadReplies(&sock, 1);
+  EXPECT_EQ(string::npos, output.find("Content-Encoding"));
+  EXPECT_NE(string::npos, output.find(LargeBody()));
+
+  // Small replies are sent as they are.
+  sock.read_buffer()->clear();
+  sock.Write(string("GET /echo HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip\r\n\r\n"));
+  sock.Flush();
+  EXPECT_EQ(string::npos, ReadReplies(&sock, 1).find("Content-Encoding"));
+}
+
+TEST_F(HttpServerTest, PipelinedRequests) {
+  Socket sock;
+  sock.Connect("127.0.0.1", server_.address().port(), 5000);
+  // Both requests arrive in one packet, and the replies must come back in the same order.
+  sock.Write(string("GET /echo?q=first HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                    "GET /echo?q=second HTTP/1.1\r\nHost: localhost\r\n\r\n"));
+  sock.Flush();
+  string output = ReadReplies(&sock, 2);
+  string::size_type first = output.find("/echo first");
+  string::size_type second = output.find("/echo second");
+  ASSERT_NE(string::npos, first);
+  ASSERT_NE(string::npos, second);
+  EXPECT_LT(first, second);
+  EXPECT_NE(string::npos, output.find("Connection: keep-alive"));
+}
+
+TEST_F(HttpServerTest, PipelinedBodyWhileBusy) {
+  Socket sock;
+  sock.Connect("127.0.0.1", server_.address().port(), 5000);
+  // Reading stops part way through the body while the first request is handled, and carries on afterwards.
+  string body(3 * 1024 * 1024, 'x');
+  sock.Write(string("GET /slow?q=first HTTP/1.1\r\nHost: localhost\r\n\r\n"));
+  sock.Write(StringPrintf("POST /size HTTP/1.1\r\nHost: localhost\r\nContent-Length: %lu\r\n\r\n", body.size()));
+  sock.Write(body);
+  sock.Flush();
+  string output = ReadReplies(&sock, 2);
+  EXPECT_NE(string::npos, output.find("/slow first"));
+  EXPECT_NE(string::npos, output.find(StringPrintf("size=%lu", body.size())));
+}
+
+TEST_F(HttpServerTest, PartialRequest) {
+  Socket sock;
+  sock.Connect("127.0.0.1", server_.address().port(), 5000);
+  // Nothing is handled until the end of the headers arrives.
+  sock.Write(string("GET /echo?q=partial HTTP/1.1\r\nHost: local"));
+  sock.Flush();
+  sock.Read(200);
+  EXPECT_TRUE(sock.read_buffer()->empty());
+  sock.Write(string("host\r\n\r\n"));
+  sock.Flush();
+  EXPECT_NE(string::npos, ReadReplies(&sock, 1).find("/echo partial"));
+}
+
+TEST_F(HttpServerTest, LargeBody) {
+  Socket sock;
+  sock.Connect("127.0.0.1", server_.address().port(), 5000);
+  string body(3 * 1024 * 1024, 'x');
+  sock.Write(StringPrintf("POST /size HTTP/1.1\r\nHost: localhost\r\nContent-Length: %lu\r\n\r\n", body.size()));
+  sock.Write(body);
+  sock.Flush();
+  EXPECT_NE(string::npos, ReadReplies(&sock, 1).find(StringPrintf("size=%lu", body.size())));
+}
+
+TEST_F(HttpServerTest, InvalidRequest) {
+  Socket sock;
+  sock.Connect("127.0.0.1", server_.address().port(), 5000);
+  sock.Write(string("GET /echo HTTP/0.0\r\n\r\n"));
+  sock.Flush();
+  Deadline deadline(5000);
+  while (sock.read_buffer()->ToString().find("\r\n\r\n") == string::npos && deadline)
+    sock.Read(100);
+  EXPECT_EQ(0U, sock.read_buffer()->ToString().find("HTTP/1.1 400"));
+}
+
+}  // namespace http
+}  // namespace openinstrument
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -11,20 +11,45 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "lib/common.h"
 #include "lib/file.h"
+#include "lib/gzip.h"
 #include "lib/http_reply.h"
 #include "lib/http_request.h"
 #include "lib/http_server.h"
 #include "lib/http_static_dir.h"
 #include "lib/mime_types.h"
 
+DEFINE_int32(http_static_cache_max_file_size, 16 * 1024 * 1024, "Largest static file which is kept in memory");
+DEFINE_int32(http_static_cache_max_size, 256 * 1024 * 1024, "Total size of the static files kept in memory");
+
 namespace openinstrument {
 namespace http {
 
+namespace {
+
+// Files smaller than this aren't worth compressing.
+const uint64_t kMinCompressSize = 256;
+
+bool IsCompressible(const string &content_type) {
+  return content_type.find("text/") == 0 || content_type.find("javascript") != string::npos ||
+         content_type.find("json") != string::npos || content_type.find("xml") != string::npos;
+}
+
+// Returns the directory containing <path>, which is "." for a relative path with no directory.
+string ParentDir(const string &path) {
+  string::size_type pos = path.rfind('/');
+  if (pos == string::npos)
+    return ".";
+  if (pos == 0)
+    return "/";
+  return path.substr(0, pos);
+}
+
+}  // namespace
+
 scoped_ptr<MimeTypes> http_static_mime_types_(NULL);
 
 void ReadMimeTypes() {
@@ -39,39 +64,193 @@ const string &MimeType(const string &filename) {
   return http_static_mime_types_->Lookup(filename);
 }
 
+StaticFile::StaticFile(const string &filename, bool compress)
+  : mtime_(0) {
+  File fh(filename, "r");
+  // Use the open file, in case it is replaced after being opened.
+  struct stat sb;
+  if (fstat(fh.fd(), &sb) < 0)
+    throw runtime_error(StringPrintf("Can't stat %s: %s", filename.c_str(), strerror(errno)));
+  if (!S_ISREG(sb.st_mode))
+    throw runtime_error(StringPrintf("%s is not a regular file", filename.c_str()));
+  mtime_ = sb.st_mtime;
+  // The file is copied rather than mapped, as a mapping would fault if the file were truncated while being sent.
+  data_.resize(sb.st_size);
+  uint64_t done = 0;
+  while (done < data_.size()) {
+    int32_t ret = fh.Read(&data_[done], std::min(data_.size() - done, static_cast<uint64_t>(1 << 30)));
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0)
+      throw runtime_error(StringPrintf("Can't read %s: %s", filename.c_str(), strerror(errno)));
+    if (ret == 0)
+      break;
+    done += ret;
+  }
+  data_.resize(done);
+
+  // A weak ETag, as the same one is used whether or not the file is compressed.
+  etag_ = StringPrintf("W/\"%lx-%lx\"", static_cast<unsigned long>(data_.size()), static_cast<unsigned long>(mtime_));
+  last_modified_ = Timestamp(mtime_ * 1000).GmTime(HttpServer::RFC112Format);
+  content_type_ = MimeType(filename);
+  if (compress && data_.size() >= kMinCompressSize && IsCompressible(content_type_)) {
+    GzipCompress(data(), &gzip_data_);
+    if (gzip_data_.size() >= data_.size())
+      gzip_data_.clear();
+  }
+}
+
+StaticFileCache *StaticFileCache::Default() {
+  static StaticFileCache *cache = new StaticFileCache();
+  return cache;
+}
+
+shared_ptr<const StaticFile> StaticFileCache::Get(const string &filename) {
+  {
+    MutexLock lock(mutex_);
+    MapType::iterator it = files_.find(filename);
+    if (it != files_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.lru);
+      return it->second.file;
+    }
+  }
+
+  FileStat fs(filename);
+  if (!fs.exists())
+    throw runtime_error(StringPrintf("Can't stat %s: %s", filename.c_str(), fs.error().c_str()));
+  if (fs.size() > FLAGS_http_static_cache_max_file_size)
+    return shared_ptr<const StaticFile>(new StaticFile(filename, false));
+
+  uint64_t generation;
+  {
+    MutexLock lock(mutex_);
+    if (!WatchPath(ParentDir(filename))) {
+      lock.unlock();
+      return shared_ptr<const StaticFile>(new StaticFile(filename, false));
+    }
+    generation = generation_;
+  }
+  // The file is loaded after the watches are in place, so a change made while loading it can't be missed. It is read
+  // and compressed without holding the lock so that other requests, and the watcher, aren't held up.
+  shared_ptr<const StaticFile> file(new StaticFile(filename, true));
+
+  MutexLock lock(mutex_);
+  if (generation != generation_)
+    return file;
+  MapType::iterator it = files_.find(filename);
+  if (it != files_.end())
+    return it->second.file;
+  lru_.push_front(filename);
+  Entry &entry = files_[filename];
+  entry.file = file;
+  entry.lru = lru_.begin();
+  size_ += file->memory_size();
+  while (size_ > static_cast<uint64_t>(FLAGS_http_static_cache_max_size) && !lru_.empty())
+    Erase(files_.find(lru_.back()));
+  return file;
+}
+
+uint64_t StaticFileCache::size() {
+  MutexLock lock(mutex_);
+  return size_;
+}
+
+bool StaticFileCache::WatchPath(const string &dir) {
+  // Watch the directories rather than the file, so files which are replaced by renaming over them are noticed too.
+  // Watching every directory above catches a deploy which swaps a whole directory or a symlink to one.
+  FilesystemWatcher::EventType events = static_cast<FilesystemWatcher::EventType>(
+      FilesystemWatcher::FILE_WRITTEN | FilesystemWatcher::FILE_RENAMED | FilesystemWatcher::FILE_DELETED |
+      FilesystemWatcher::FILE_CREATED | FilesystemWatcher::FILE_MOVED_AWAY | FilesystemWatcher::WATCH_DELETED |
+      FilesystemWatcher::WATCH_MOVED);
+  for (string path = dir; ; path = ParentDir(path)) {
+    if (!watched_dirs_.count(path)) {
+      if (!watcher_.AddWatch(path, events, bind(&StaticFileCache::PathChanged, this, path, _1)))
+        return false;
+      watched_dirs_.insert(path);
+    }
+    if (path == "." || path == "/")
+      return true;
+  }
+}
+
+void StaticFileCache::PathChanged(const string &dir, const string &name) {
+  string path;
+  if (name.empty())
+    path = dir;
+  else if (dir == ".")
+    path = name;
+  else if (dir == "/")
+    path = dir + name;
+  else
+    path = dir + "/" + name;
+  VLOG(1) << "Static path " << path << " changed, removing it from the cache";
+  MutexLock lock(mutex_);
+  Invalidate(path);
+}
+
+void StaticFileCache::Invalidate(const string &path) {
+  ++generation_;
+  MapType::iterator it = files_.find(path);
+  if (it != files_.end())
+    Erase(it);
+  if (!watched_dirs_.count(path))
+    return;
+  string prefix = path == "." ? "" : path == "/" ? path : path + "/";
+  for (it = files_.begin(); it != files_.end(); ) {
+    if (it->first.compare(0, prefix.size(), prefix) == 0)
+      Erase(it++);
+    else
+      ++it;
+  }
+  for (set<string>::iterator dir = watched_dirs_.begin(); dir != watched_dirs_.end(); ) {
+    if (*dir == path || dir->compare(0, prefix.size(), prefix) == 0) {
+      watcher_.RemoveWatch(*dir);
+      watched_dirs_.erase(dir++);
+    } else {
+      ++dir;
+    }
+  }
+}
+
+void StaticFileCache::Erase(MapType::iterator it) {
+  size_ -= it->second.file->memory_size();
+  lru_.erase(it->second.lru);
+  files_.erase(it);
+}
+
 void HttpStaticHandler::ServeLocalFile(const string &filename, const HttpRequest &request, HttpReply *reply) const {
-  if (request.headers().HeaderExists("If-Modified-Since")) {
+  shared_ptr<const StaticFile> file = StaticFileCache::Default()->Get(filename);
+  reply->SetHeader("ETag", file->etag().c_str());
+  reply->SetHeader("Last-Modified", file->last_modified().c_str());
+  if (!file->gzip_data().empty())
+    reply->SetHeader("Vary", "Accept-Encoding");
+
+  bool not_modified = false;
+  if (request.headers().HeaderExists("If-None-Match")) {
+    const string &etags = request.headers().GetHeader("If-None-Match");
+    not_modified = etags == "*" || etags.find(file->etag()) != string::npos;
+  } else if (request.headers().HeaderExists("If-Modified-Since")) {
     Timestamp ifs(Timestamp::FromGmTime(request.headers().GetHeader("If-Modified-Since"), HttpServer::RFC112Format));
-    FileStat fs(filename);
-    if (fs.mtime() <= ifs.seconds()) {
-      reply->SetStatus(HttpReply::NOT_MODIFIED);
-      reply->SetHeader("Last-Modified", Timestamp(fs.mtime() * 1000).GmTime(HttpServer::RFC112Format).c_str());
-      reply->SetContentLength(0);
-      return;
-    }
+    not_modified = file->mtime() <= ifs.seconds();
+  }
+  if (not_modified) {
+    // The server sends this without a body.
+    reply->SetStatus(HttpReply::NOT_MODIFIED);
+    return;
   }
 
   VLOG(1) << "Serving local file " << filename;
-  File fh(filename, "r");
   reply->SetStatus(HttpReply::OK);
-  reply->SetContentLength(fh.stat().size());
-  reply->SetContentType(MimeType(filename).c_str());
-  reply->SetHeader("Last-Modified", Timestamp(fh.stat().mtime() * 1000).GmTime(HttpServer::RFC112Format).c_str());
-  for (int64_t done = 0; done < fh.stat().size(); ) {
-    uint32_t avail = 4096;
-    char *buf;
-    if (fh.stat().size() - done < 4096)
-      avail = fh.stat().size() - done;
-    reply->mutable_body()->GetAppendBuf(avail, &buf, &avail);
-    if (!avail)
-      continue;
-    int32_t readbytes = fh.Read(buf, avail);
-    if (readbytes < 0)
-      continue;
-    if (readbytes == 0)
-      break;
-    done += readbytes;
+  reply->SetContentType(file->content_type().c_str());
+  // The body refers to the cached contents without copying them, and keeps them alive until the reply has been sent.
+  if (!file->gzip_data().empty() &&
+      HttpHeaders::AcceptsEncoding(request.headers().GetHeader(HttpHeaders::ACCEPT_ENCODING), "gzip")) {
+    reply->SetHeader("Content-Encoding", "gzip");
+    reply->mutable_body()->Append(file->gzip_data().data(), file->gzip_data().size(), file);
+  } else if (file->data().size()) {
+    reply->mutable_body()->Append(file->data().data(), file->data().size(), file);
   }
+  reply->SetContentLength(reply->body().size());
 }
 
 HttpStaticDir::HttpStaticDir(const string &http_path, const string &local_path, HttpServer *server)
@@ -82,12 +261,6 @@ HttpStaticDir::HttpStaticDir(const string &http_path, const string &local_path,
   server_->request_handler()->AddPath(http_path_, &HttpStaticDir::HandleGet, this);
 }
 
-void HttpStaticDir::GetComplete(void *ptr, uint64_t size) {
-  CHECK(ptr);
-  CHECK(size);
-  munmap(ptr, size);
-}
-
 bool HttpStaticDir::HandleGet(const HttpRequest &request, HttpReply *reply) {
   string localfile = request.uri.path;
   if (request.uri.path.find(http_path_) != 0) {
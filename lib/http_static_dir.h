@@ -10,9 +10,12 @@
 #ifndef OPENINSTRUMENT_LIB_HTTP_STATIC_DIR_H_
 #define OPENINSTRUMENT_LIB_HTTP_STATIC_DIR_H_
 
+#include <list>
 #include <string>
 #include "lib/common.h"
+#include "lib/file.h"
 #include "lib/mime_types.h"
+#include "lib/string.h"
 
 namespace openinstrument {
 namespace http {
@@ -21,6 +24,98 @@ class HttpServer;
 class HttpRequest;
 class HttpReply;
 
+// A local file read into memory, with the headers needed to serve it worked out in advance.
+class StaticFile : private noncopyable {
+ public:
+  // Read <filename> into memory. If <compress> is set and the file is a compressible type, a gzip copy is made as well.
+  // Throws runtime_error if the file can't be read.
+  StaticFile(const string &filename, bool compress);
+
+  inline StringPiece data() const {
+    return StringPiece(data_);
+  }
+
+  // The gzip-compressed contents, or an empty string if compression wasn't worthwhile.
+  inline const string &gzip_data() const {
+    return gzip_data_;
+  }
+
+  inline const string &etag() const {
+    return etag_;
+  }
+
+  inline const string &last_modified() const {
+    return last_modified_;
+  }
+
+  inline time_t mtime() const {
+    return mtime_;
+  }
+
+  inline const string &content_type() const {
+    return content_type_;
+  }
+
+  // Bytes of memory used by the contents.
+  inline uint64_t memory_size() const {
+    return data_.size() + gzip_data_.size();
+  }
+
+ private:
+  string data_;
+  string gzip_data_;
+  string etag_;
+  string last_modified_;
+  time_t mtime_;
+  string content_type_;
+};
+
+// Keeps recently served static files in memory, up to --http_static_cache_max_size bytes. The directory containing
+// each cached file and every directory above it are watched with a FilesystemWatcher, and a file is dropped from the
+// cache as soon as it, or any directory or symlink on its path, is written, replaced or deleted. Cache hits don't
+// touch the filesystem at all.
+class StaticFileCache : private noncopyable {
+ public:
+  StaticFileCache() : size_(0), generation_(0) {}
+
+  // The cache shared by every static file handler.
+  static StaticFileCache *Default();
+
+  // Return <filename>, loading it if it isn't cached. Files larger than --http_static_cache_max_file_size, or in
+  // directories which can't be watched, are loaded every time. Throws runtime_error if the file can't be read.
+  shared_ptr<const StaticFile> Get(const string &filename);
+
+  // Total memory used by the cached files.
+  uint64_t size();
+
+ private:
+  struct Entry {
+    shared_ptr<const StaticFile> file;
+    list<string>::iterator lru;
+  };
+  typedef unordered_map<string, Entry> MapType;
+
+  // Watch <dir> and every directory above it. The caller must hold mutex_.
+  // Returns false if any of them can't be watched.
+  bool WatchPath(const string &dir);
+  void PathChanged(const string &dir, const string &name);
+  // Drop <path> from the cache. If it is a watched directory, every file below it is dropped and the directories are
+  // watched again when next used, as they may no longer be the ones being watched. The caller must hold mutex_.
+  void Invalidate(const string &path);
+  void Erase(MapType::iterator it);
+
+  Mutex mutex_;
+  MapType files_;
+  // Cached filenames, most recently used first.
+  list<string> lru_;
+  uint64_t size_;
+  // Incremented on every change to a watched directory, so that a file which changed while it was being loaded isn't
+  // cached.
+  uint64_t generation_;
+  set<string> watched_dirs_;
+  FilesystemWatcher watcher_;
+};
+
 class HttpStaticHandler {
  public:
   HttpStaticHandler() {}
@@ -34,8 +129,6 @@ class HttpStaticDir : public HttpStaticHandler {
   bool HandleGet(const HttpRequest &request, HttpReply *reply);
 
  private:
-  void GetComplete(void *ptr, uint64_t size);
-
   string http_path_;
   string local_path_;
   HttpServer *server_;
@@ -0,0 +1,255 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/file.h"
+#include "lib/http_server.h"
+#include "lib/http_static_dir.h"
+#include "lib/socket.h"
+#include "lib/threadpool.h"
+
+DECLARE_int32(http_static_cache_max_size);
+
+namespace openinstrument {
+namespace http {
+
+class StaticFileCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    char dir[] = "/tmp/static_file_cache_testXXXXXX";
+    ASSERT_TRUE(mkdtemp(dir));
+    dir_ = dir;
+  }
+
+  void TearDown() {
+    unlink(Filename().c_str());
+    // Anything else the test created is removed in reverse order, so directories are empty when they are removed.
+    for (vector<string>::reverse_iterator it = created_.rbegin(); it != created_.rend(); ++it) {
+      if (unlink(it->c_str()) < 0)
+        rmdir(it->c_str());
+    }
+    rmdir(dir_.c_str());
+  }
+
+  string Filename() const {
+    return dir_ + "/test.html";
+  }
+
+  void WriteFile(const string &contents) {
+    WriteFile(Filename(), contents);
+  }
+
+  void WriteFile(const string &filename, const string &contents) {
+    File fh(filename, "w");
+    fh.Write(contents);
+  }
+
+  string MakeDir(const string &name) {
+    string path = dir_ + "/" + name;
+    EXPECT_EQ(0, mkdir(path.c_str(), 0755));
+    created_.push_back(path);
+    return path;
+  }
+
+  string MakeFile(const string &name, const string &contents) {
+    string path = dir_ + "/" + name;
+    WriteFile(path, contents);
+    created_.push_back(path);
+    return path;
+  }
+
+  // Point the symlink <name> at <target>, replacing it the way a deploy would.
+  void Symlink(const string &target, const string &name) {
+    string path = dir_ + "/" + name;
+    string tmp = path + ".tmp";
+    ASSERT_EQ(0, symlink(target.c_str(), tmp.c_str()));
+    ASSERT_EQ(0, rename(tmp.c_str(), path.c_str()));
+    if (std::find(created_.begin(), created_.end(), path) == created_.end())
+      created_.push_back(path);
+  }
+
+  static string CompressibleContents() {
+    string contents;
+    for (int i = 0; i < 100; ++i)
+      contents += "<p>This is a line of a compressible file</p>\n";
+    return contents;
+  }
+
+  string dir_;
+  vector<string> created_;
+};
+
+TEST_F(StaticFileCacheTest, CachedUntilChanged) {
+  StaticFileCache cache;
+  string contents = CompressibleContents();
+  WriteFile(contents);
+
+  shared_ptr<const StaticFile> file = cache.Get(Filename());
+  EXPECT_EQ(contents, file->data().ToString());
+  EXPECT_FALSE(file->etag().empty());
+  EXPECT_FALSE(file->gzip_data().empty());
+  EXPECT_LT(file->gzip_data().size(), contents.size());
+  EXPECT_EQ(file.get(), cache.Get(Filename()).get());
+
+  // Writing the file drops it from the cache
+  WriteFile("changed");
+  for (int i = 0; i < 50 && cache.Get(Filename()).get() == file.get(); ++i)
+    usleep(100000);
+  shared_ptr<const StaticFile> changed = cache.Get(Filename());
+  EXPECT_NE(file.get(), changed.get());
+  EXPECT_EQ("changed", changed->data().ToString());
+  // Too small to be worth compressing
+  EXPECT_TRUE(changed->gzip_data().empty());
+
+  // The original contents are still usable while something refers to them
+  EXPECT_EQ(contents, file->data().ToString());
+}
+
+TEST_F(StaticFileCacheTest, ReplacedDirectory) {
+  StaticFileCache cache;
+  MakeDir("v1");
+  MakeFile("v1/test.js", "version 1");
+  MakeDir("v2");
+  MakeFile("v2/test.js", "version 2");
+  Symlink("v1", "current");
+  string filename = dir_ + "/current/test.js";
+  EXPECT_EQ("version 1", cache.Get(filename)->data().ToString());
+
+  // Nothing in v1 changes, but the path now leads somewhere else.
+  Symlink("v2", "current");
+  for (int i = 0; i < 50 && cache.Get(filename)->data().ToString() == "version 1"; ++i)
+    usleep(100000);
+  EXPECT_EQ("version 2", cache.Get(filename)->data().ToString());
+
+  // The new directory is watched in turn.
+  WriteFile(dir_ + "/v2/test.js", "version 3");
+  for (int i = 0; i < 50 && cache.Get(filename)->data().ToString() == "version 2"; ++i)
+    usleep(100000);
+  EXPECT_EQ("version 3", cache.Get(filename)->data().ToString());
+}
+
+TEST_F(StaticFileCacheTest, SizeLimit) {
+  int32_t old_max_size = FLAGS_http_static_cache_max_size;
+  FLAGS_http_static_cache_max_size = 1500;
+  StaticFileCache cache;
+  string first = MakeFile("first.txt", string(1000, 'a'));
+  string second = MakeFile("second.txt", string(1000, 'b'));
+  shared_ptr<const StaticFile> file = cache.Get(first);
+  EXPECT_EQ(file.get(), cache.Get(first).get());
+  EXPECT_EQ(file->memory_size(), cache.size());
+
+  // Loading the second file pushes out the least recently used one.
+  EXPECT_EQ(cache.Get(second)->memory_size(), cache.size());
+  EXPECT_NE(file.get(), cache.Get(first).get());
+  FLAGS_http_static_cache_max_size = old_max_size;
+}
+
+TEST_F(StaticFileCacheTest, MissingFile) {
+  StaticFileCache cache;
+  EXPECT_THROW(cache.Get(dir_ + "/missing.html"), runtime_error);
+}
+
+class HttpStaticFileTest : public StaticFileCacheTest {
+ protected:
+  HttpStaticFileTest()
+    : policy_(2, 4),
+      thread_pool_("http_static_file_test", policy_),
+      server_("127.0.0.1", 0, &thread_pool_),
+      handler_(NULL) {}
+
+  void SetUp() {
+    StaticFileCacheTest::SetUp();
+    WriteFile(CompressibleContents());
+    handler_.reset(new HttpStaticFile("/test.html", Filename(), &server_));
+    sock_.Connect("127.0.0.1", server_.address().port(), 5000);
+  }
+
+  // Send a request for the file on the test connection, with any extra <headers>, and return the whole reply.
+  string Request(const string &headers) {
+    sock_.read_buffer()->clear();
+    sock_.Write("GET /test.html HTTP/1.1\r\nHost: localhost\r\n" + headers + "\r\n");
+    sock_.Flush();
+    string output;
+    Deadline deadline(5000);
+    while (deadline) {
+      output = sock_.read_buffer()->ToString();
+      string::size_type end = output.find("\r\n\r\n");
+      // A 304 ends with its headers, everything else is sent chunked.
+      if (end != string::npos && (output.find(" 304 ") != string::npos || output.find("\r\n0\r\n\r\n") != string::npos))
+        break;
+      sock_.Read(100);
+    }
+    // Anything sent after the end of the reply would be there by now.
+    sock_.Read(100);
+    return sock_.read_buffer()->ToString();
+  }
+
+  static string Header(const string &reply, const string &name) {
+    string::size_type pos = reply.find("\r\n" + name + ": ");
+    if (pos == string::npos)
+      return "";
+    pos += name.size() + 4;
+    return reply.substr(pos, reply.find("\r\n", pos) - pos);
+  }
+
+  DefaultThreadPoolPolicy policy_;
+  ThreadPool thread_pool_;
+  HttpServer server_;
+  scoped_ptr<HttpStaticFile> handler_;
+  Socket sock_;
+};
+
+TEST_F(HttpStaticFileTest, Gzip) {
+  string reply = Request("Accept-Encoding: gzip, deflate\r\n");
+  EXPECT_EQ(0U, reply.find("HTTP/1.1 200"));
+  EXPECT_EQ("gzip", Header(reply, "Content-Encoding"));
+  EXPECT_EQ("Accept-Encoding", Header(reply, "Vary"));
+  EXPECT_EQ(string::npos, reply.find(CompressibleContents()));
+
+  // A client which refuses gzip gets the file as it is.
+  reply = Request("Accept-Encoding: gzip;q=0, deflate\r\n");
+  EXPECT_EQ(0U, reply.find("HTTP/1.1 200"));
+  EXPECT_EQ("", Header(reply, "Content-Encoding"));
+  EXPECT_NE(string::npos, reply.find(CompressibleContents()));
+}
+
+TEST_F(HttpStaticFileTest, NotModified) {
+  string reply = Request("");
+  string etag = Header(reply, "ETag");
+  ASSERT_NE("", etag);
+
+  // The 304 has no body at all, so the connection can be used for the next request.
+  reply = Request("If-None-Match: " + etag + "\r\n");
+  EXPECT_EQ(0U, reply.find("HTTP/1.1 304"));
+  EXPECT_EQ(reply.size() - 4, reply.find("\r\n\r\n"));
+  EXPECT_EQ("", Header(reply, "Transfer-Encoding"));
+  EXPECT_EQ("", Header(reply, "Content-Length"));
+  EXPECT_EQ("keep-alive", Header(reply, "Connection"));
+
+  reply = Request("If-None-Match: \"other\"\r\n");
+  EXPECT_EQ(0U, reply.find("HTTP/1.1 200"));
+  EXPECT_NE(string::npos, reply.find(CompressibleContents()));
+
+  reply = Request("If-Modified-Since: " + Header(reply, "Last-Modified") + "\r\n");
+  EXPECT_EQ(0U, reply.find("HTTP/1.1 304"));
+}
+
+}  // namespace http
+}  // namespace openinstrument
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
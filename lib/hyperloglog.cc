@@ -0,0 +1,95 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <math.h>
+#include <string>
+#include "lib/common.h"
+#include "lib/hash.h"
+#include "lib/hyperloglog.h"
+#include "lib/string.h"
+
+namespace openinstrument {
+
+HyperLogLog::HyperLogLog(uint8_t precision) : precision_(precision) {
+  if (precision < 4 || precision > 16)
+    throw runtime_error(StringPrintf("Invalid HyperLogLog precision %u", precision));
+  registers_.assign(1 << precision, '\0');
+}
+
+uint64_t HyperLogLog::HashItem(const string &item) {
+  // Finish with the MurmurHash3 mixer, as HyperLogLog relies on every bit of the hash being uniformly distributed.
+  uint64_t hash = Hash::Hash64(item);
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+void HyperLogLog::Add(uint64_t hash) {
+  // The top bits choose the register, which records the longest run of leading zeros seen in the remaining bits.
+  uint32_t index = hash >> (64 - precision_);
+  uint64_t rest = (hash << precision_) | (1ULL << (precision_ - 1));
+  uint8_t rank = __builtin_clzll(rest) + 1;
+  if (static_cast<uint8_t>(registers_[index]) < rank)
+    registers_[index] = rank;
+}
+
+void HyperLogLog::Merge(const HyperLogLog &other) {
+  if (other.precision_ != precision_)
+    throw runtime_error(StringPrintf("Can't merge HyperLogLog with precision %u into precision %u", other.precision_,
+                                     precision_));
+  for (size_t i = 0; i < registers_.size(); ++i) {
+    if (static_cast<uint8_t>(registers_[i]) < static_cast<uint8_t>(other.registers_[i]))
+      registers_[i] = other.registers_[i];
+  }
+}
+
+uint64_t HyperLogLog::Estimate() const {
+  double m = registers_.size();
+  double sum = 0;
+  uint32_t zeros = 0;
+  for (size_t i = 0; i < registers_.size(); ++i) {
+    uint8_t value = registers_[i];
+    sum += ldexp(1.0, -value);
+    if (!value)
+      ++zeros;
+  }
+  double alpha;
+  if (registers_.size() == 16)
+    alpha = 0.673;
+  else if (registers_.size() == 32)
+    alpha = 0.697;
+  else if (registers_.size() == 64)
+    alpha = 0.709;
+  else
+    alpha = 0.7213 / (1 + 1.079 / m);
+  double estimate = alpha * m * m / sum;
+  // Small cardinalities are much more accurately estimated by linear counting of the empty registers.
+  if (estimate <= 2.5 * m && zeros)
+    estimate = m * log(m / zeros);
+  return static_cast<uint64_t>(estimate + 0.5);
+}
+
+void HyperLogLog::Clear() {
+  registers_.assign(registers_.size(), '\0');
+}
+
+void HyperLogLog::FromString(const string &registers) {
+  uint8_t precision = 4;
+  while (precision <= 16 && (1U << precision) != registers.size())
+    ++precision;
+  if (precision > 16)
+    throw runtime_error(StringPrintf("Invalid HyperLogLog register size %lu", registers.size()));
+  precision_ = precision;
+  registers_ = registers;
+}
+
+}  // namespace openinstrument
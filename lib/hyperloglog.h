@@ -0,0 +1,64 @@
+/*
+ * HyperLogLog distinct value estimator.
+ *
+ * Estimates the number of distinct items added to it using a fixed 2^precision bytes of memory, with a standard error
+ * of about 1.04 / sqrt(2^precision). Sketches with the same precision can be merged, so the distinct count across
+ * several servers can be estimated without sending every item to one place.
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef OPENINSTRUMENT_LIB_HYPERLOGLOG_H_
+#define OPENINSTRUMENT_LIB_HYPERLOGLOG_H_
+
+#include <string>
+#include "lib/common.h"
+
+namespace openinstrument {
+
+class HyperLogLog {
+ public:
+  // <precision> must be between 4 and 16.
+  explicit HyperLogLog(uint8_t precision = 12);
+
+  // Add an item which has already been hashed with a well mixed 64-bit hash such as Hash::Hash64().
+  void Add(uint64_t hash);
+
+  inline void Add(const string &item) {
+    Add(HashItem(item));
+  }
+
+  // Combine the items in <other> into this sketch. Throws runtime_error if the precisions differ.
+  void Merge(const HyperLogLog &other);
+
+  // Estimated number of distinct items added.
+  uint64_t Estimate() const;
+
+  void Clear();
+
+  inline uint8_t precision() const {
+    return precision_;
+  }
+
+  // The raw register values, which can be sent to another server and loaded with FromString() to be merged.
+  inline const string &registers() const {
+    return registers_;
+  }
+
+  // Replace the sketch with registers previously returned by registers(). The precision is taken from the size of
+  // <registers>, which must be a power of two between 16 and 65536 bytes, otherwise runtime_error is thrown.
+  void FromString(const string &registers);
+
+  static uint64_t HashItem(const string &item);
+
+ private:
+  uint8_t precision_;
+  string registers_;
+};
+
+}  // namespace openinstrument
+
+#endif  // OPENINSTRUMENT_LIB_HYPERLOGLOG_H_
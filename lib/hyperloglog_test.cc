@@ -0,0 +1,70 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <math.h>
+#include <string>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "lib/common.h"
+#include "lib/hyperloglog.h"
+#include "lib/string.h"
+
+namespace openinstrument {
+
+class HyperLogLogTest : public ::testing::Test {};
+
+TEST_F(HyperLogLogTest, Empty) {
+  HyperLogLog hll;
+  EXPECT_EQ(0UL, hll.Estimate());
+}
+
+TEST_F(HyperLogLogTest, Estimate) {
+  HyperLogLog hll(12);
+  uint64_t counts[] = { 10, 100, 1000, 10000, 100000, 1000000 };
+  uint64_t added = 0;
+  for (uint64_t count : counts) {
+    for (; added < count; ++added)
+      hll.Add(StringPrintf("host%lu.example.com", added));
+    // Standard error is 1.6% at this precision, allow a few times that.
+    double error = fabs(static_cast<double>(hll.Estimate()) - count) / count;
+    EXPECT_LT(error, 0.05) << "Estimated " << hll.Estimate() << " for " << count;
+  }
+
+  // Adding the same items again should make no difference.
+  uint64_t estimate = hll.Estimate();
+  for (uint64_t i = 0; i < 1000; ++i)
+    hll.Add(StringPrintf("host%lu.example.com", i));
+  EXPECT_EQ(estimate, hll.Estimate());
+}
+
+TEST_F(HyperLogLogTest, Merge) {
+  HyperLogLog a, b;
+  for (int i = 0; i < 20000; ++i)
+    a.Add(StringPrintf("%d", i));
+  for (int i = 10000; i < 30000; ++i)
+    b.Add(StringPrintf("%d", i));
+
+  HyperLogLog copy;
+  copy.FromString(b.registers());
+  EXPECT_EQ(b.Estimate(), copy.Estimate());
+
+  a.Merge(copy);
+  EXPECT_NEAR(30000, a.Estimate(), 1500);
+
+  HyperLogLog other(10);
+  EXPECT_THROW(a.Merge(other), runtime_error);
+  EXPECT_THROW(other.FromString("abc"), runtime_error);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
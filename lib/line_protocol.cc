@@ -0,0 +1,153 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <stdlib.h>
+#include "lib/common.h"
+#include "lib/line_protocol.h"
+#include "lib/string.h"
+#include "lib/variable.h"
+
+namespace openinstrument {
+
+namespace {
+
+inline bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool IsNameChar(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '_' ||
+         c == '-' || c == '/' || c == '*' || c == ',';
+}
+
+// Parse a number which ends at <end>, temporarily terminating it so that strtod / strtoull can be used.
+template<typename T>
+bool ParseNumber(char *start, char *end, T (*convert)(const char *, char **), T *output) {
+  if (start == end)
+    return false;
+  char saved = *end;
+  *end = '\0';
+  char *parse_end;
+  *output = convert(start, &parse_end);
+  *end = saved;
+  return parse_end == end;
+}
+
+unsigned long long ParseUnsigned(const char *str, char **end) {
+  return strtoull(str, end, 10);
+}
+
+}  // namespace
+
+void LineProtocolLine::ToVariable(Variable *variable) const {
+  if (!escaped) {
+    // The key is already in the form Variable parses, so a single pass over it is cheapest.
+    variable->FromString(key);
+    return;
+  }
+  variable->set_variable(name.ToString());
+  for (int i = 0; i < num_labels; i++)
+    variable->SetLabel(labels[i].label.ToString(), labels[i].value.ToString());
+}
+
+bool ParseLineProtocol(char *buffer, uint64_t size, LineProtocolLine *line) {
+  char *p = buffer;
+  char *end = buffer + size;
+  line->num_labels = 0;
+  line->escaped = false;
+  line->timestamp = 0;
+
+  while (p < end && IsSpace(*p))
+    p++;
+  char *key_start = p;
+  if (p == end || *p != '/')
+    return false;
+  while (p < end && IsNameChar(*p))
+    p++;
+  line->name.Reset(key_start, p - key_start);
+
+  if (p < end && *p == '{') {
+    p++;
+    while (true) {
+      if (p == end)
+        return false;
+      if (*p == '}')
+        break;
+      if (line->num_labels == LineProtocolLine::kMaxLabels)
+        return false;
+      char *label_start = p;
+      while (p < end && *p != '=' && *p != ',' && *p != '}')
+        p++;
+      if (p == end || *p != '=' || p == label_start)
+        return false;
+      LineProtocolLine::Label &label = line->labels[line->num_labels++];
+      label.label.Reset(label_start, p - label_start);
+      p++;
+
+      // Values are copied down over any quote and escape characters, so that the unescaped value is contiguous.
+      char *value_start = p;
+      char *out = p;
+      bool quoted = false;
+      while (p < end) {
+        if (*p == '\\') {
+          // Only the escapes Variable::FromString() accepts, so a line is stored the same way as it would be by /add.
+          if (++p == end || (*p != 'n' && *p != '"' && *p != ',' && *p != '\\'))
+            return false;
+          *out++ = *p == 'n' ? '\n' : *p;
+          p++;
+          line->escaped = true;
+        } else if (*p == '"') {
+          quoted = !quoted;
+          p++;
+          line->escaped = true;
+        } else if (!quoted && (*p == ',' || *p == '}')) {
+          break;
+        } else {
+          *out++ = *p++;
+        }
+      }
+      if (p == end)
+        return false;
+      label.value.Reset(value_start, out - value_start);
+      if (*p == ',')
+        p++;
+    }
+    p++;
+  }
+  line->key.Reset(key_start, p - key_start);
+  if (p == end || !IsSpace(*p))
+    return false;
+
+  while (p < end && IsSpace(*p))
+    p++;
+  char *value_start = p;
+  while (p < end && !IsSpace(*p))
+    p++;
+  if (!ParseNumber(value_start, p, strtod, &line->value))
+    return false;
+
+  while (p < end && IsSpace(*p))
+    p++;
+  if (p < end) {
+    char *timestamp_start = p;
+    while (p < end && !IsSpace(*p))
+      p++;
+    unsigned long long timestamp;
+    if (!ParseNumber(timestamp_start, p, ParseUnsigned, &timestamp))
+      return false;
+    line->timestamp = timestamp;
+    while (p < end && IsSpace(*p))
+      p++;
+    if (p < end)
+      return false;
+  }
+  return true;
+}
+
+}  // namespace openinstrument
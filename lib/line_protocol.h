@@ -0,0 +1,61 @@
+/*
+ * Parser for the plaintext line protocol.
+ *
+ * Each line contains a single value:
+ *    <variable> <value> [<timestamp>]
+ * where <variable> is in the format accepted by Variable::FromString(), <value> is a number and <timestamp> is an
+ * optional number of milliseconds since the epoch. For example:
+ *    /openinstrument/cron/runtime{job=backup,hostname=db1} 35.2 1325376000000
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef _OPENINSTRUMENT_LIB_LINE_PROTOCOL_H_
+#define _OPENINSTRUMENT_LIB_LINE_PROTOCOL_H_
+
+#include "lib/common.h"
+#include "lib/string.h"
+#include "lib/variable.h"
+
+namespace openinstrument {
+
+// A single parsed line. Every StringPiece points into the buffer that was parsed, nothing is allocated.
+class LineProtocolLine {
+ public:
+  static const int kMaxLabels = 32;
+
+  struct Label {
+    StringPiece label;
+    StringPiece value;
+  };
+
+  LineProtocolLine() : num_labels(0), escaped(false), value(0), timestamp(0) {}
+
+  // Build a Variable from the parsed name and labels.
+  void ToVariable(Variable *variable) const;
+
+  // The complete variable, including labels, exactly as it appeared in the input.
+  StringPiece key;
+  StringPiece name;
+  Label labels[kMaxLabels];
+  int num_labels;
+  // True if any label values were quoted or escaped. These are unescaped in place, so <key> no longer contains the
+  // original input.
+  bool escaped;
+  double value;
+  // Milliseconds since the epoch, or 0 if the line did not contain a timestamp.
+  uint64_t timestamp;
+};
+
+// Parse a single line of <size> bytes, not including the trailing newline.
+// Quoted and escaped label values are unescaped in place, and buffer[size] may be temporarily overwritten, so it must
+// be writable.
+// Returns false if the line is not valid.
+bool ParseLineProtocol(char *buffer, uint64_t size, LineProtocolLine *line);
+
+}  // namespace openinstrument
+
+#endif  // _OPENINSTRUMENT_LIB_LINE_PROTOCOL_H_
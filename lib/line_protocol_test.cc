@@ -0,0 +1,111 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <string>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "lib/common.h"
+#include "lib/line_protocol.h"
+#include "lib/string.h"
+#include "lib/variable.h"
+
+namespace openinstrument {
+
+class LineProtocolTest : public ::testing::Test {
+ protected:
+  bool Parse(const string &input) {
+    // Keep a copy, as the parser modifies its input.
+    buffer_ = input;
+    return ParseLineProtocol(&buffer_[0], buffer_.size(), &line_);
+  }
+
+  string buffer_;
+  LineProtocolLine line_;
+};
+
+TEST_F(LineProtocolTest, NameAndValue) {
+  ASSERT_TRUE(Parse("/openinstrument/test 10.5"));
+  EXPECT_EQ("/openinstrument/test", line_.name.ToString());
+  EXPECT_EQ("/openinstrument/test", line_.key.ToString());
+  EXPECT_EQ(0, line_.num_labels);
+  EXPECT_DOUBLE_EQ(10.5, line_.value);
+  EXPECT_EQ(0UL, line_.timestamp);
+}
+
+TEST_F(LineProtocolTest, LabelsAndTimestamp) {
+  ASSERT_TRUE(Parse("/openinstrument/test{job=backup,hostname=db1}  -3e2\t1325376000000\r"));
+  EXPECT_EQ("/openinstrument/test", line_.name.ToString());
+  EXPECT_EQ("/openinstrument/test{job=backup,hostname=db1}", line_.key.ToString());
+  ASSERT_EQ(2, line_.num_labels);
+  EXPECT_EQ("job", line_.labels[0].label.ToString());
+  EXPECT_EQ("backup", line_.labels[0].value.ToString());
+  EXPECT_EQ("hostname", line_.labels[1].label.ToString());
+  EXPECT_EQ("db1", line_.labels[1].value.ToString());
+  EXPECT_FALSE(line_.escaped);
+  EXPECT_DOUBLE_EQ(-300, line_.value);
+  EXPECT_EQ(1325376000000UL, line_.timestamp);
+}
+
+TEST_F(LineProtocolTest, QuotedValues) {
+  ASSERT_TRUE(Parse("/test{a=\"x, y\",b=foo\\,bar,c=\"say \\\"hi\\\"\"} 1"));
+  EXPECT_TRUE(line_.escaped);
+  ASSERT_EQ(3, line_.num_labels);
+  EXPECT_EQ("x, y", line_.labels[0].value.ToString());
+  EXPECT_EQ("foo,bar", line_.labels[1].value.ToString());
+  EXPECT_EQ("say \"hi\"", line_.labels[2].value.ToString());
+}
+
+TEST_F(LineProtocolTest, MatchesVariableParser) {
+  const char *inputs[] = {
+    "/test",
+    "/test{a=b}",
+    "/openinstrument/test{job=backup,hostname=db1}",
+    "/test{a=\"x, y\",b=foo\\,bar}",
+  };
+  for (const char *input : inputs) {
+    ASSERT_TRUE(Parse(StringPrintf("%s 1", input))) << input;
+    Variable var;
+    line_.ToVariable(&var);
+    EXPECT_EQ(Variable(input), var) << input;
+  }
+}
+
+TEST_F(LineProtocolTest, Invalid) {
+  EXPECT_FALSE(Parse(""));
+  EXPECT_FALSE(Parse("test 1"));
+  EXPECT_FALSE(Parse("/test"));
+  EXPECT_FALSE(Parse("/test "));
+  EXPECT_FALSE(Parse("/test abc"));
+  EXPECT_FALSE(Parse("/test 1 2 3"));
+  EXPECT_FALSE(Parse("/test 1 -"));
+  EXPECT_FALSE(Parse("/test{a=b 1"));
+  EXPECT_FALSE(Parse("/test{a} 1"));
+  EXPECT_FALSE(Parse("/test{a=\"b} 1"));
+  EXPECT_FALSE(Parse("/test{a=b}1"));
+}
+
+TEST_F(LineProtocolTest, Escapes) {
+  ASSERT_TRUE(Parse("/test{a=x\\\\y\\ny,b=\\\"q\\\"} 1"));
+  ASSERT_EQ(2, line_.num_labels);
+  EXPECT_EQ("x\\y\ny", line_.labels[0].value.ToString());
+  EXPECT_EQ("\"q\"", line_.labels[1].value.ToString());
+
+  // Unknown escapes are rejected, as they are by Variable::FromString().
+  EXPECT_FALSE(Parse("/test{a=b\\q} 1"));
+  EXPECT_THROW(Variable("/test{a=b\\q}"), runtime_error);
+  EXPECT_FALSE(Parse("/test{a=\"b\\t\"} 1"));
+  EXPECT_FALSE(Parse("/test{a=b\\"));
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -36,14 +36,27 @@ bool SerializeProtobuf(const google::protobuf::Message &proto, Cord *output) {
   string temp;
   if (!proto.SerializeToString(&temp))
     return false;
-  output->CopyFrom(Base64Encode(reinterpret_cast<const unsigned char *>(temp.c_str()), temp.length()));
+  Base64Encode(StringPiece(temp), output);
   return true;
 }
 
 bool UnserializeProtobuf(const Cord &input, google::protobuf::Message *proto) {
-  string c;
-  input.AppendTo(&c);
-  return proto->ParseFromString(Base64Decode(c));
+  string decoded;
+  if (!Base64Decode(input, &decoded))
+    return false;
+  return proto->ParseFromString(decoded);
+}
+
+bool SerializeProtobufBinary(const google::protobuf::Message &proto, Cord *output) {
+  string temp;
+  if (!proto.SerializeToString(&temp))
+    return false;
+  output->CopyFrom(temp);
+  return true;
+}
+
+bool UnserializeProtobufBinary(const Cord &input, google::protobuf::Message *proto) {
+  return proto->ParseFromString(input.ToString());
 }
 
 void ValueStreamCalculation(const vector<proto::ValueStream> &input, uint64_t sample_interval,
@@ -152,6 +165,45 @@ uint32_t Crc(const string &str) {
 }
 
 
+namespace {
+
+bool ValueTimestampLess(const proto::Value &a, const proto::Value &b) {
+  return a.timestamp() < b.timestamp();
+}
+
+bool SameValue(const proto::Value &a, const proto::Value &b) {
+  if (a.has_double_value())
+    return b.has_double_value() && a.double_value() == b.double_value();
+  if (a.has_string_value())
+    return b.has_string_value() && a.string_value() == b.string_value();
+  return false;
+}
+
+}  // namespace
+
+void SortValueStream(proto::ValueStream *stream) {
+  vector<proto::Value> values(stream->value().begin(), stream->value().end());
+  std::stable_sort(values.begin(), values.end(), ValueTimestampLess);
+  stream->clear_value();
+  for (size_t i = 0; i < values.size(); i++) {
+    const proto::Value &value = values[i];
+    if (i + 1 < values.size() && values[i + 1].timestamp() == value.timestamp()) {
+      // A later value for the same timestamp replaces this one.
+      continue;
+    }
+    if (stream->value_size()) {
+      proto::Value *last = stream->mutable_value(stream->value_size() - 1);
+      if (SameValue(*last, value)) {
+        // The merged run ends at whichever of the two ends last.
+        uint64_t end = std::max(value.timestamp(), value.end_timestamp());
+        last->set_end_timestamp(std::max(end, last->end_timestamp()));
+        continue;
+      }
+    }
+    stream->add_value()->CopyFrom(value);
+  }
+}
+
 bool ProtoStreamReader::Skip(int count) {
   for (int i = 0; i < count; i++) {
     magic_type magic;
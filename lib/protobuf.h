@@ -29,12 +29,23 @@ bool SerializeProtobuf(const google::protobuf::Message &proto, Cord *output);
 // Base64 decode and write the de-serialized result to <proto>
 bool UnserializeProtobuf(const Cord &input, google::protobuf::Message *proto);
 
+// Serialize a protobuf message without base64 encoding it, as RPC requests and replies carry it. Appends the result to
+// <output>.
+bool SerializeProtobufBinary(const google::protobuf::Message &proto, Cord *output);
+
+// Write the de-serialized result of <input>, which isn't base64 encoded, to <proto>.
+bool UnserializeProtobufBinary(const Cord &input, google::protobuf::Message *proto);
+
 void ValueStreamAverage(const vector<proto::ValueStream> &input, uint64_t sample_interval, proto::ValueStream *output);
 void ValueStreamMin(const vector<proto::ValueStream> &input, uint64_t sample_interval, proto::ValueStream *output);
 void ValueStreamMax(const vector<proto::ValueStream> &input, uint64_t sample_interval, proto::ValueStream *output);
 void ValueStreamMedian(const vector<proto::ValueStream> &input, uint64_t sample_interval, proto::ValueStream *output);
 void ValueStreamSum(const vector<proto::ValueStream> &input, uint64_t sample_interval, proto::ValueStream *output);
 
+// Sort the values in <stream> by timestamp. Where several values have the same timestamp only the last one is kept,
+// and consecutive identical values are run-length encoded into a single value with end_timestamp set.
+void SortValueStream(proto::ValueStream *stream);
+
 class ProtoStreamReader : private noncopyable {
  public:
   explicit ProtoStreamReader(const string &filename) : fh_(filename) {}
@@ -62,6 +62,45 @@ TEST_F(ProtobufTest, WriteCorruptRead) {
   EXPECT_GE(num_res, 1);
 }
 
+TEST_F(ProtobufTest, SortValueStream) {
+  proto::ValueStream stream;
+  uint64_t timestamps[] = { 5, 1, 3, 2, 3, 6, 4 };
+  double values[] = { 5, 1, 30, 2, 3, 5, 4 };
+  for (int i = 0; i < 7; i++) {
+    proto::Value *value = stream.add_value();
+    value->set_timestamp(timestamps[i]);
+    value->set_double_value(values[i]);
+  }
+  SortValueStream(&stream);
+  // The second value at timestamp 3 replaces the first.
+  ASSERT_EQ(5, stream.value_size());
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(static_cast<uint64_t>(i + 1), stream.value(i).timestamp());
+    EXPECT_FALSE(stream.value(i).has_end_timestamp());
+  }
+  EXPECT_EQ(3.0, stream.value(2).double_value());
+  // 6 has the same value as 5 so is run-length encoded
+  EXPECT_EQ(5UL, stream.value(4).timestamp());
+  EXPECT_EQ(6UL, stream.value(4).end_timestamp());
+}
+
+TEST_F(ProtobufTest, SortValueStreamKeepsLongestRun) {
+  proto::ValueStream stream;
+  proto::Value *value = stream.add_value();
+  value->set_timestamp(10);
+  value->set_end_timestamp(50);
+  value->set_double_value(1);
+  // A shorter run of the same value inside the first doesn't shorten it.
+  value = stream.add_value();
+  value->set_timestamp(20);
+  value->set_end_timestamp(30);
+  value->set_double_value(1);
+  SortValueStream(&stream);
+  ASSERT_EQ(1, stream.value_size());
+  EXPECT_EQ(10UL, stream.value(0).timestamp());
+  EXPECT_EQ(50UL, stream.value(0).end_timestamp());
+}
+
 }  // namespace
 
 int main(int argc, char **argv) {
@@ -14,19 +14,47 @@
 #include "lib/variable.h"
 #include "lib/retention_policy_manager.h"
 #include "lib/store_config.h"
+#include "lib/variable_matcher.h"
 
 namespace openinstrument {
 
-const proto::RetentionPolicyItem &RetentionPolicyManager::GetPolicy(const Variable &variable, uint64_t age) const {
-  static proto::RetentionPolicyItem default_policy;
-  default_policy.set_policy(proto::RetentionPolicyItem::DROP);
+shared_ptr<const RetentionPolicyManager::Snapshot> RetentionPolicyManager::snapshot() const {
+  auto &manager = StoreConfig::get_manager();
+  shared_ptr<const Snapshot> current = boost::atomic_load(&snapshot_);
+  if (current.get() && current->generation == manager.generation())
+    return current;
+
+  MutexLock lock(rebuild_mutex_);
+  // Another thread may have built it while this one was waiting for the lock.
+  current = boost::atomic_load(&snapshot_);
+  if (current.get() && current->generation == manager.generation())
+    return current;
+  // The generation is read before the config, so if the config changes while it is being copied the next call builds
+  // another snapshot.
+  shared_ptr<Snapshot> snapshot(new Snapshot());
+  snapshot->generation = manager.generation();
+  snapshot->default_policy.set_policy(proto::RetentionPolicyItem::DROP);
+  for (auto &item : manager.config().retention_policy().policy()) {
+    snapshot->policies.push_back(Policy());
+    Policy &policy = snapshot->policies.back();
+    policy.item.CopyFrom(item);
+    for (int j = 0; j < policy.item.variable_size(); j++)
+      policy.matchers.push_back(VariableMatcher(Variable(policy.item.variable(j))));
+  }
+  boost::atomic_store(&snapshot_, shared_ptr<const Snapshot>(snapshot));
+  return snapshot;
+}
+
+shared_ptr<const proto::RetentionPolicyItem> RetentionPolicyManager::GetPolicy(const Variable &variable,
+                                                                               uint64_t age) const {
   VLOG(4) << "Looking for policy matches for " << variable.ToString() << " that is " << Duration(age)
           << " old";
-  auto &config = StoreConfig::get();
-  for (auto &item : config.retention_policy().policy()) {
-    for (int j = 0; j < item.variable_size(); j++) {
-      Variable match(item.variable(j));
-      if (!variable.Matches(match)) {
+  shared_ptr<const Snapshot> policies = snapshot();
+  for (const Policy &policy : policies->policies) {
+    auto &item = policy.item;
+    for (const VariableMatcher &matcher : policy.matchers) {
+      const Variable &match = matcher.search();
+      if (!matcher.Matches(variable)) {
         VLOG(4) << "  No match for " << match.ToString();
         continue;
       }
@@ -40,18 +68,18 @@ const proto::RetentionPolicyItem &RetentionPolicyManager::GetPolicy(const Variab
       }
       VLOG(4) << "  Match for " << match.ToString() << " " << Duration(item.min_age()) << " < " << Duration(age)
               << " < " << Duration(item.max_age());
-      return item;
+      // Shares ownership of the snapshot, so the item outlives a config reload.
+      return shared_ptr<const proto::RetentionPolicyItem>(policies, &item);
     }
   }
-  return default_policy;
+  return shared_ptr<const proto::RetentionPolicyItem>(policies, &policies->default_policy);
 }
 
 bool RetentionPolicyManager::HasPolicyForVariable(const Variable &variable) const {
-  auto &config = StoreConfig::get();
-  for (auto &item : config.retention_policy().policy()) {
-    for (int j = 0; j < item.variable_size(); j++) {
-      Variable match(item.variable(j));
-      if (variable.Matches(match))
+  shared_ptr<const Snapshot> policies = snapshot();
+  for (const Policy &policy : policies->policies) {
+    for (const VariableMatcher &matcher : policy.matchers) {
+      if (matcher.Matches(variable))
         return true;
     }
   }
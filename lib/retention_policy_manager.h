@@ -10,25 +10,51 @@
 #ifndef _OPENINSTRUMENT_LIB_RETENTION_POLICY_MANAGER_H_
 #define _OPENINSTRUMENT_LIB_RETENTION_POLICY_MANAGER_H_
 
+#include <vector>
 #include <boost/function.hpp>
 #include <boost/timer.hpp>
 #include "lib/common.h"
 #include "lib/protobuf.h"
+#include "lib/variable_matcher.h"
 
 namespace openinstrument {
 
 class Variable;
 
-class RetentionPolicyManager {
+class RetentionPolicyManager : private noncopyable {
  public:
   RetentionPolicyManager() {}
 
-  const proto::RetentionPolicyItem &GetPolicy(const Variable &variable, uint64_t age) const;
+  // Returns the first policy item matching <variable> at <age>, or a DROP policy if there is none.
+  // The item is kept valid by the returned pointer even if the config is reloaded.
+  shared_ptr<const proto::RetentionPolicyItem> GetPolicy(const Variable &variable, uint64_t age) const;
   bool HasPolicyForVariable(const Variable &variable) const;
   bool ShouldDrop(const proto::RetentionPolicyItem &policy) const;
+
+ private:
+  // A policy item from the config, with one matcher for each of its variables.
+  struct Policy {
+    proto::RetentionPolicyItem item;
+    vector<VariableMatcher> matchers;
+  };
+
+  // Every policy item from one generation of the config. This is never modified once it has been published, so it can
+  // be read without a lock.
+  struct Snapshot {
+    uint64_t generation;
+    vector<Policy> policies;
+    proto::RetentionPolicyItem default_policy;
+  };
+
+  // Returns the policies for the current config, compiling them again if the config has changed.
+  shared_ptr<const Snapshot> snapshot() const;
+
+  // Only held while a new snapshot is built, so that it is only built once for each config change.
+  mutable Mutex rebuild_mutex_;
+  // Always read and replaced with atomic_load() and atomic_store().
+  mutable shared_ptr<const Snapshot> snapshot_;
 };
 
 }  // namespace openinstrument
 
 #endif  // _OPENINSTRUMENT_LIB_RETENTION_POLICY_MANAGER_H_
-
@@ -26,37 +26,64 @@ TEST_F(RetentionPolicyManagerTest, DefaultPolicy) {
   StoreConfig::get_manager().SetConfigFilename("../config.txt");
   RetentionPolicyManager manager;
   {
-    auto &policy = manager.GetPolicy(Variable("/openinstrument/test/test1"), 1);
-    EXPECT_EQ(1, policy.policy());
-    EXPECT_EQ(0, policy.mutation_size());
+    auto policy = manager.GetPolicy(Variable("/openinstrument/test/test1"), 1);
+    EXPECT_EQ(1, policy->policy());
+    EXPECT_EQ(0, policy->mutation_size());
   }
 
   {
     auto policy = manager.GetPolicy(Variable("/openinstrument/test/test1"), 2419200001);
-    EXPECT_EQ(1, policy.policy());
-    EXPECT_EQ(1, policy.mutation_size());
-    EXPECT_EQ(1, policy.mutation(0).sample_type());
+    EXPECT_EQ(1, policy->policy());
+    EXPECT_EQ(1, policy->mutation_size());
+    EXPECT_EQ(1, policy->mutation(0).sample_type());
   }
 
   {
     auto policy = manager.GetPolicy(Variable("/openinstrument/test/test1{retain=forever}"), 2419200001);
-    EXPECT_EQ(1, policy.policy());
-    EXPECT_EQ(0, policy.mutation_size());
+    EXPECT_EQ(1, policy->policy());
+    EXPECT_EQ(0, policy->mutation_size());
   }
 
   {
     auto policy = manager.GetPolicy(Variable("/openinstrument/test/test1"), 86400LL * 1000 * 365 * 6);
-    EXPECT_EQ(2, policy.policy());
-    EXPECT_EQ(0, policy.mutation_size());
+    EXPECT_EQ(2, policy->policy());
+    EXPECT_EQ(0, policy->mutation_size());
   }
 
   {
     auto policy = manager.GetPolicy(Variable("/openinstrument/test/test1{retain=forever}"), 86400LL * 1000 * 365 * 6);
-    EXPECT_EQ(1, policy.policy());
-    EXPECT_EQ(0, policy.mutation_size());
+    EXPECT_EQ(1, policy->policy());
+    EXPECT_EQ(0, policy->mutation_size());
   }
 }
 
+TEST_F(RetentionPolicyManagerTest, Reload) {
+  auto &config_manager = StoreConfig::get_manager();
+  proto::StoreConfig config;
+  config.CopyFrom(config_manager.config());
+  config.clear_retention_policy();
+  proto::RetentionPolicyItem *item = config.mutable_retention_policy()->add_policy();
+  Variable("/test/reload").ToProtobuf(item->add_variable());
+  item->set_policy(proto::RetentionPolicyItem::KEEP);
+  config_manager.set_config(config);
+
+  RetentionPolicyManager manager;
+  auto policy = manager.GetPolicy(Variable("/test/reload"), 1);
+  EXPECT_EQ(proto::RetentionPolicyItem::KEEP, policy->policy());
+  EXPECT_TRUE(manager.HasPolicyForVariable(Variable("/test/reload")));
+
+  // The new config is used as soon as it is loaded, and the old item is still valid.
+  config.mutable_retention_policy()->mutable_policy(0)->set_policy(proto::RetentionPolicyItem::DROP);
+  config_manager.set_config(config);
+  EXPECT_EQ(proto::RetentionPolicyItem::DROP, manager.GetPolicy(Variable("/test/reload"), 1)->policy());
+  EXPECT_EQ(proto::RetentionPolicyItem::KEEP, policy->policy());
+  EXPECT_EQ(1, policy->variable_size());
+
+  config.clear_retention_policy();
+  config_manager.set_config(config);
+  EXPECT_FALSE(manager.HasPolicyForVariable(Variable("/test/reload")));
+}
+
 }  // namespace
 
 int main(int argc, char **argv) {
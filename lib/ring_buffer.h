@@ -0,0 +1,132 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef _OPENINSTRUMENT_LIB_RING_BUFFER_H_
+#define _OPENINSTRUMENT_LIB_RING_BUFFER_H_
+
+#include <algorithm>
+#include <vector>
+#include "lib/common.h"
+
+namespace openinstrument {
+
+// Bounded lock-free multiple-producer single-consumer ring buffer.
+//
+// Any number of threads may call TryPush() concurrently, but only a single thread may call TryPop() or PopBatch().
+// Each slot carries a sequence number which tells producers and the consumer whether the slot is free or full, so the
+// only contended operation is the compare-and-swap that claims the next write position.
+//
+// The capacity is rounded up to the next power of two.
+template<typename T>
+class MpscRingBuffer : private noncopyable {
+ public:
+  explicit MpscRingBuffer(uint64_t capacity)
+    : enqueue_pos_(0),
+      dequeue_pos_(0) {
+    uint64_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+    mask_ = size - 1;
+    cells_.reset(new Cell[size]);
+    for (uint64_t i = 0; i < size; ++i)
+      cells_[i].sequence = i;
+  }
+
+  // Add an item to the buffer.
+  // Returns false without blocking if the buffer is full.
+  bool TryPush(const T &value) {
+    Cell *cell;
+    uint64_t pos = enqueue_pos_;
+    while (true) {
+      cell = &cells_[pos & mask_];
+      uint64_t seq = cell->sequence;
+      __sync_synchronize();
+      int64_t diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+      if (diff == 0) {
+        if (__sync_bool_compare_and_swap(&enqueue_pos_, pos, pos + 1))
+          break;
+      } else if (diff < 0) {
+        // The consumer has not yet freed this slot, the buffer is full.
+        return false;
+      }
+      pos = enqueue_pos_;
+    }
+    cell->data = value;
+    __sync_synchronize();
+    cell->sequence = pos + 1;
+    return true;
+  }
+
+  // Remove the oldest item from the buffer and swap it into <value>.
+  // Returns false if there are no items available.
+  // Must only be called from the single consumer thread.
+  bool TryPop(T *value) {
+    Cell *cell = &cells_[dequeue_pos_ & mask_];
+    uint64_t seq = cell->sequence;
+    __sync_synchronize();
+    if (static_cast<int64_t>(seq) - static_cast<int64_t>(dequeue_pos_ + 1) < 0)
+      return false;
+    using std::swap;
+    swap(*value, cell->data);
+    __sync_synchronize();
+    cell->sequence = dequeue_pos_ + mask_ + 1;
+    ++dequeue_pos_;
+    return true;
+  }
+
+  // Remove up to <max_items> items from the buffer, appending them to <output>.
+  // Returns the number of items removed.
+  // Must only be called from the single consumer thread.
+  uint64_t PopBatch(vector<T> *output, uint64_t max_items) {
+    uint64_t count = 0;
+    while (count < max_items) {
+      output->push_back(T());
+      if (!TryPop(&output->back())) {
+        output->pop_back();
+        break;
+      }
+      ++count;
+    }
+    return count;
+  }
+
+  // Approximate number of items in the buffer. This is only a hint, it may be out of date by the time it is returned.
+  uint64_t size() const {
+    uint64_t enqueue = enqueue_pos_;
+    uint64_t dequeue = dequeue_pos_;
+    return enqueue > dequeue ? enqueue - dequeue : 0;
+  }
+
+  inline bool empty() const {
+    return size() == 0;
+  }
+
+  inline uint64_t capacity() const {
+    return mask_ + 1;
+  }
+
+ private:
+  struct Cell {
+    volatile uint64_t sequence;
+    T data;
+  };
+
+  scoped_array<Cell> cells_;
+  uint64_t mask_;
+  // Keep the producer and consumer positions on separate cache lines so they don't bounce between cores.
+  char pad0_[64];
+  volatile uint64_t enqueue_pos_;
+  char pad1_[64];
+  volatile uint64_t dequeue_pos_;
+  char pad2_[64];
+};
+
+}  // namespace openinstrument
+
+#endif  // _OPENINSTRUMENT_LIB_RING_BUFFER_H_
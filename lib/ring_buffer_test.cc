@@ -0,0 +1,115 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <vector>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "lib/common.h"
+#include "lib/ring_buffer.h"
+
+namespace openinstrument {
+
+class RingBufferTest : public ::testing::Test {};
+
+TEST_F(RingBufferTest, PushPop) {
+  MpscRingBuffer<int> buffer(4);
+  EXPECT_EQ(4UL, buffer.capacity());
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_TRUE(buffer.TryPush(1));
+  EXPECT_TRUE(buffer.TryPush(2));
+  EXPECT_TRUE(buffer.TryPush(3));
+  EXPECT_EQ(3UL, buffer.size());
+  int value;
+  EXPECT_TRUE(buffer.TryPop(&value));
+  EXPECT_EQ(1, value);
+  EXPECT_TRUE(buffer.TryPop(&value));
+  EXPECT_EQ(2, value);
+  EXPECT_TRUE(buffer.TryPop(&value));
+  EXPECT_EQ(3, value);
+  EXPECT_FALSE(buffer.TryPop(&value));
+  EXPECT_TRUE(buffer.empty());
+}
+
+TEST_F(RingBufferTest, CapacityRoundedUp) {
+  MpscRingBuffer<int> buffer(5);
+  EXPECT_EQ(8UL, buffer.capacity());
+}
+
+TEST_F(RingBufferTest, Full) {
+  MpscRingBuffer<int> buffer(4);
+  for (int i = 0; i < 4; i++)
+    EXPECT_TRUE(buffer.TryPush(i));
+  EXPECT_FALSE(buffer.TryPush(4));
+  int value;
+  EXPECT_TRUE(buffer.TryPop(&value));
+  EXPECT_EQ(0, value);
+  // Popping frees a slot, and wrapping around the end of the buffer keeps ordering.
+  EXPECT_TRUE(buffer.TryPush(4));
+  for (int i = 1; i <= 4; i++) {
+    EXPECT_TRUE(buffer.TryPop(&value));
+    EXPECT_EQ(i, value);
+  }
+}
+
+TEST_F(RingBufferTest, PopBatch) {
+  MpscRingBuffer<string> buffer(16);
+  for (int i = 0; i < 10; i++)
+    buffer.TryPush(StringPrintf("value %d", i));
+  vector<string> output;
+  EXPECT_EQ(4UL, buffer.PopBatch(&output, 4));
+  EXPECT_EQ(4UL, output.size());
+  EXPECT_EQ("value 0", output[0]);
+  EXPECT_EQ(6UL, buffer.PopBatch(&output, 100));
+  EXPECT_EQ(10UL, output.size());
+  EXPECT_EQ("value 9", output[9]);
+  EXPECT_EQ(0UL, buffer.PopBatch(&output, 100));
+  EXPECT_EQ(10UL, output.size());
+}
+
+void ProduceValues(MpscRingBuffer<uint64_t> *buffer, uint64_t producer, uint64_t count) {
+  for (uint64_t i = 0; i < count; i++) {
+    while (!buffer->TryPush(producer << 32 | i))
+      boost::this_thread::yield();
+  }
+}
+
+TEST_F(RingBufferTest, MultipleProducers) {
+  const uint64_t num_producers = 4;
+  const uint64_t num_values = 20000;
+  MpscRingBuffer<uint64_t> buffer(64);
+  vector<shared_ptr<thread> > producers;
+  for (uint64_t i = 0; i < num_producers; i++)
+    producers.push_back(shared_ptr<thread>(new thread(bind(ProduceValues, &buffer, i, num_values))));
+
+  // Every value must arrive exactly once, and values from a single producer must arrive in order.
+  vector<uint64_t> next(num_producers, 0);
+  uint64_t received = 0;
+  while (received < num_producers * num_values) {
+    uint64_t value;
+    if (!buffer.TryPop(&value)) {
+      boost::this_thread::yield();
+      continue;
+    }
+    uint64_t producer = value >> 32;
+    ASSERT_LT(producer, num_producers);
+    ASSERT_EQ(next[producer], value & 0xffffffff);
+    next[producer]++;
+    received++;
+  }
+  for (uint64_t i = 0; i < num_producers; i++)
+    producers[i]->join();
+  EXPECT_TRUE(buffer.empty());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
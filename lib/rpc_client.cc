@@ -0,0 +1,178 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <google/protobuf/message.h>
+#include <string>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/exported_vars.h"
+#include "lib/http_reply.h"
+#include "lib/protobuf.h"
+#include "lib/rpc_client.h"
+#include "lib/rpc_connection.h"
+#include "lib/socket.h"
+#include "lib/string.h"
+#include "lib/timer.h"
+
+namespace openinstrument {
+namespace rpc {
+
+RpcClient::RpcClient(const Socket::Address &address)
+  : address_(address),
+    next_id_(1),
+    call_timer_("/openinstrument/rpc/client/calls"),
+    connections_made_("/openinstrument/rpc/client/connections-made"),
+    failed_calls_("/openinstrument/rpc/client/failed-calls") {}
+
+RpcClient::~RpcClient() {
+  MutexLock lock(mutex_);
+  if (connection_.get())
+    connection_->Close();
+  // The connection thread uses this object until it has finished closing.
+  while (connection_.get())
+    closed_cond_.wait(lock);
+}
+
+RpcClient *RpcClient::Get(const Socket::Address &address) {
+  static Mutex mutex;
+  static unordered_map<string, RpcClient *> *clients = new unordered_map<string, RpcClient *>();
+  MutexLock lock(mutex);
+  RpcClient *&client = (*clients)[address.ToString()];
+  if (!client)
+    client = new RpcClient(address);
+  return client;
+}
+
+shared_ptr<RpcConnection> RpcClient::Connect(const Deadline &deadline) {
+  {
+    MutexLock lock(mutex_);
+    if (connection_.get())
+      return connection_;
+  }
+  // Connecting may take a while, so it's done without the lock to avoid holding up other calls and the callbacks from
+  // the connection thread.
+  uint64_t timeout = deadline;
+  if (!timeout)
+    throw runtime_error(StringPrintf("Timeout connecting to %s", address_.ToString().c_str()));
+  scoped_ptr<Socket> sock(new Socket());
+  sock->Connect(address_, static_cast<int>(timeout));
+  shared_ptr<RpcConnection> connection(new RpcConnection(sock.release(),
+                                                         bind(&RpcClient::HandleFrame, this, _1, _2, _3),
+                                                         bind(&RpcClient::ConnectionClosed, this, _1)));
+  MutexLock lock(mutex_);
+  // Another call may have connected at the same time, in which case its connection is used and this one dropped.
+  if (connection_.get())
+    return connection_;
+  ++connections_made_;
+  connection_ = connection;
+  connection_->Start();
+  return connection_;
+}
+
+uint16_t RpcClient::Call(const string &path, const Cord &body, Cord *reply, uint64_t timeout) {
+  ScopedExportTimer t(&call_timer_);
+  if (path.size() > 0xffff)
+    throw runtime_error("RPC path is too long");
+  Cord payload;
+  char length[2];
+  EncodeUint16(path.size(), length);
+  payload.CopyFrom(length, sizeof(length));
+  payload.CopyFrom(path);
+  payload.CopyFrom(body);
+
+  Deadline deadline(timeout);
+  shared_ptr<RpcConnection> connection;
+  try {
+    connection = Connect(deadline);
+  } catch (...) {
+    ++failed_calls_;
+    throw;
+  }
+  PendingCall call;
+  call.connection = connection.get();
+  MutexLock lock(mutex_);
+  uint64_t id = next_id_++;
+  try {
+    pending_[id] = &call;
+    // If the connection closes after this, the call is failed when the close is handled.
+    if (!connection->Send(id, &payload))
+      throw runtime_error(StringPrintf("RPC connection to %s closed", address_.ToString().c_str()));
+    while (!call.done) {
+      if (!deadline)
+        throw runtime_error(StringPrintf("Timeout waiting for RPC reply from %s", address_.ToString().c_str()));
+      call.cond.timed_wait(lock, boost::posix_time::milliseconds(static_cast<uint64_t>(deadline)));
+    }
+  } catch (...) {
+    pending_.erase(id);
+    ++failed_calls_;
+    throw;
+  }
+  pending_.erase(id);
+  if (!call.error.empty()) {
+    ++failed_calls_;
+    throw runtime_error(call.error);
+  }
+  reply->Splice(&call.body);
+  return call.status;
+}
+
+void RpcClient::Call(const string &path, const google::protobuf::Message &request, google::protobuf::Message *response,
+                     uint64_t timeout) {
+  // Protobufs are sent as they are, the server knows not to expect base64 from an RPC.
+  Cord body;
+  if (!SerializeProtobufBinary(request, &body))
+    throw runtime_error("Error serializing protobuf");
+  Cord reply;
+  uint16_t status = Call(path, body, &reply, timeout);
+  if (status != http::HttpReply::OK) {
+    throw runtime_error(StringPrintf("RPC %s to %s returned status %u", path.c_str(), address_.ToString().c_str(),
+                                     status));
+  }
+  if (!UnserializeProtobufBinary(reply, response))
+    throw runtime_error("Invalid response from the server");
+}
+
+void RpcClient::HandleFrame(RpcConnection *connection, uint64_t id, Cord *payload) {
+  string status;
+  MutexLock lock(mutex_);
+  unordered_map<uint64_t, PendingCall *>::iterator it = pending_.find(id);
+  if (it == pending_.end()) {
+    // The call has already timed out.
+    VLOG(1) << "Discarding RPC reply " << id << " from " << address_.ToString();
+    return;
+  }
+  PendingCall *call = it->second;
+  try {
+    payload->Consume(2, &status);
+    call->status = DecodeUint16(status.data());
+    call->body.Splice(payload);
+  } catch (out_of_range &e) {
+    call->error = StringPrintf("Invalid RPC reply from %s", address_.ToString().c_str());
+  }
+  call->done = true;
+  call->cond.notify_one();
+}
+
+void RpcClient::ConnectionClosed(RpcConnection *connection) {
+  MutexLock lock(mutex_);
+  for (auto &i : pending_) {
+    PendingCall *call = i.second;
+    if (call->connection != connection || call->done)
+      continue;
+    call->error = StringPrintf("RPC connection to %s closed", address_.ToString().c_str());
+    call->done = true;
+    call->cond.notify_one();
+  }
+  if (connection_.get() == connection)
+    connection_.reset();
+  closed_cond_.notify_all();
+}
+
+}  // namespace rpc
+}  // namespace openinstrument
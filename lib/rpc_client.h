@@ -1,5 +1,8 @@
 /*
- *  -
+ * Client for RpcServer (see lib/rpc_connection.h for the protocol).
+ *
+ * A single persistent connection to the server is shared by every call, and any number of calls may be waiting for
+ * replies on it at once. The connection is made on the first call and made again by the next call if it's lost.
  *
  * Copyright 2011 David Parrish <david@dparrish.com>
  *
@@ -10,21 +13,77 @@
 #ifndef OPENINSTRUMENT_LIB_RPC_CLIENT_H_
 #define OPENINSTRUMENT_LIB_RPC_CLIENT_H_
 
+#include <google/protobuf/message.h>
+#include <string>
 #include "lib/common.h"
+#include "lib/cord.h"
 #include "lib/exported_vars.h"
-#include "lib/http_client.h"
-#include "lib/request_handler.h"
+#include "lib/rpc_connection.h"
 #include "lib/socket.h"
+#include "lib/timer.h"
 
 namespace openinstrument {
 namespace rpc {
 
-class RpcClient {
+class RpcClient : private noncopyable {
  public:
-  RpcClient() {}
+  explicit RpcClient(const Socket::Address &address);
+  ~RpcClient();
+
+  // The client for <address> used by everything in the process.
+  static RpcClient *Get(const Socket::Address &address);
+
+  // Send <body> to the handler for <path> and wait up to <timeout> ms for the reply. Returns the HTTP status of the
+  // reply and appends its body to <reply>. This is safe to call from many threads at once.
+  // Throws runtime_error if the server can't be reached, the connection is lost or no reply arrives in time.
+  uint16_t Call(const string &path, const Cord &body, Cord *reply, uint64_t timeout = 30000);
+
+  // Send <request> to the handler for <path> and parse the reply into <response>, the same as StoreClient does over
+  // HTTP but without base64 encoding. Throws runtime_error if the call fails, the reply isn't successful or the
+  // response can't be parsed.
+  void Call(const string &path, const google::protobuf::Message &request, google::protobuf::Message *response,
+            uint64_t timeout = 30000);
+
+  const Socket::Address &address() const {
+    return address_;
+  }
+
+ private:
+  struct PendingCall {
+    PendingCall() : connection(NULL), done(false), status(0) {}
+    // The connection the request was sent on.
+    RpcConnection *connection;
+    bool done;
+    // Set if the call failed.
+    string error;
+    uint16_t status;
+    Cord body;
+    // Signalled when done is set, so that only the caller waiting for this call is woken.
+    boost::condition_variable cond;
+  };
+
+  // Return the connection to the server, connecting if there isn't one. A new connection must be made before
+  // <deadline>. The caller must not hold mutex_.
+  shared_ptr<RpcConnection> Connect(const Deadline &deadline);
+
+  void HandleFrame(RpcConnection *connection, uint64_t id, Cord *payload);
+  void ConnectionClosed(RpcConnection *connection);
+
+  Socket::Address address_;
+  Mutex mutex_;
+  // Signalled when the connection is closed.
+  boost::condition_variable closed_cond_;
+  shared_ptr<RpcConnection> connection_;
+  uint64_t next_id_;
+  // Calls waiting for a reply, by request ID.
+  unordered_map<uint64_t, PendingCall *> pending_;
+
+  ExportedTimer call_timer_;
+  ExportedInteger connections_made_;
+  ExportedInteger failed_calls_;
 };
 
 }  // namespace rpc
 }  // namespace openinstrument
 
-#endif  // _OPENINSTRUMENT_LIB_RPC_CLIENT_H_
+#endif  // OPENINSTRUMENT_LIB_RPC_CLIENT_H_
@@ -0,0 +1,158 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <string>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/rpc_connection.h"
+#include "lib/socket.h"
+#include "lib/string.h"
+
+DEFINE_int32(rpc_max_frame_size, 64 * 1024 * 1024, "Maximum size of a single RPC request or reply");
+
+namespace openinstrument {
+namespace rpc {
+
+RpcConnection::RpcConnection(Socket *socket, const FrameCallback &frame_callback, const CloseCallback &close_callback)
+  : socket_(socket),
+    remote_(socket->remote()),
+    frame_callback_(frame_callback),
+    close_callback_(close_callback),
+    wake_fd_(-1),
+    closed_(false) {
+  if ((wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    throw runtime_error(StringPrintf("Can't create eventfd: %s", strerror(errno)));
+}
+
+RpcConnection::~RpcConnection() {
+  if (wake_fd_ >= 0)
+    ::close(wake_fd_);
+}
+
+void RpcConnection::Start() {
+  thread(bind(&RpcConnection::Run, this, shared_from_this())).detach();
+}
+
+bool RpcConnection::Send(uint64_t id, Cord *payload) {
+  char header[kFrameHeaderSize];
+  EncodeUint32(payload->size() + 8, header);
+  EncodeUint64(id, header + 4);
+  bool wake;
+  {
+    MutexLock lock(mutex_);
+    if (closed_)
+      return false;
+    // The thread only needs waking for the first frame, it takes everything queued when it wakes.
+    wake = output_.empty();
+    output_.CopyFrom(header, sizeof(header));
+    output_.Splice(payload);
+  }
+  if (wake)
+    Wake();
+  return true;
+}
+
+void RpcConnection::Close() {
+  {
+    MutexLock lock(mutex_);
+    closed_ = true;
+  }
+  Wake();
+}
+
+void RpcConnection::Wake() {
+  uint64_t one = 1;
+  if (::write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    LOG(WARNING) << "Can't wake RPC connection: " << strerror(errno);
+}
+
+void RpcConnection::Run(shared_ptr<RpcConnection> self) {
+  // Block all signals
+  sigset_t new_mask;
+  sigfillset(&new_mask);
+  sigset_t old_mask;
+  pthread_sigmask(SIG_BLOCK, &new_mask, &old_mask);
+
+  try {
+    while (true) {
+      {
+        MutexLock lock(mutex_);
+        if (closed_)
+          break;
+        socket_->write_buffer()->Splice(&output_);
+      }
+      bool flushed = socket_->WriteAvailable();
+
+      struct pollfd fds[2] = {
+        { socket_->fd(), static_cast<int16_t>(POLLIN | (flushed ? 0 : POLLOUT)), 0 },
+        { wake_fd_, POLLIN, 0 },
+      };
+      int ret = ::poll(fds, 2, 1000);
+      if (ret < 0) {
+        if (errno == EINTR)
+          continue;
+        throw runtime_error(StringPrintf("poll() returned error: %s", strerror(errno)));
+      }
+      if (fds[1].revents & POLLIN) {
+        uint64_t count;
+        if (::read(wake_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          LOG(WARNING) << "Can't read RPC connection eventfd: " << strerror(errno);
+      }
+      if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+        bool eof;
+        socket_->ReadAvailable(&eof);
+        ReadFrames();
+        if (eof)
+          break;
+      }
+    }
+  } catch (exception &e) {
+    LOG(WARNING) << "RPC connection to " << remote_.ToString() << " failed: " << e.what();
+  }
+
+  {
+    MutexLock lock(mutex_);
+    closed_ = true;
+    output_.clear();
+  }
+  socket_->Abort();
+  close_callback_(this);
+}
+
+void RpcConnection::ReadFrames() {
+  Cord *input = socket_->read_buffer();
+  string header;
+  while (input->size() >= kFrameHeaderSize) {
+    header.clear();
+    input->Substr(0, 4, &header);
+    uint32_t length = DecodeUint32(header.data());
+    if (length < kFrameHeaderSize - 4 || length > static_cast<uint32_t>(FLAGS_rpc_max_frame_size))
+      throw runtime_error(StringPrintf("Invalid RPC frame length %u", length));
+    if (input->size() < length + 4ULL) {
+      // Read the rest of a large frame in as few calls as possible.
+      socket_->ExpectRead(length + 4ULL - input->size());
+      return;
+    }
+    header.clear();
+    input->Consume(kFrameHeaderSize, &header);
+    uint64_t id = DecodeUint64(header.data() + 4);
+    Cord payload;
+    input->ConsumeInto(length - (kFrameHeaderSize - 4), &payload);
+    frame_callback_(this, id, &payload);
+  }
+}
+
+}  // namespace rpc
+}  // namespace openinstrument
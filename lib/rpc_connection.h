@@ -0,0 +1,114 @@
+/*
+ * A persistent TCP connection carrying length-prefixed RPC frames, used by both RpcServer and RpcClient.
+ *
+ * Every frame is:
+ *   uint32  length of the rest of the frame
+ *   uint64  request ID
+ *   payload
+ * All integers are big-endian. A request payload is a uint16 path length, the path, then the request body. A reply
+ * payload is a uint16 HTTP status code, then the reply body. The bodies are the same as those of the HTTP endpoint with
+ * that path, so the same handlers can serve both, except that protobufs are not base64 encoded.
+ *
+ * Replies carry the ID of the request they answer and may be sent in any order, so many calls can be in progress on a
+ * single connection at once.
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef OPENINSTRUMENT_LIB_RPC_CONNECTION_H_
+#define OPENINSTRUMENT_LIB_RPC_CONNECTION_H_
+
+#include <string>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/socket.h"
+
+namespace openinstrument {
+namespace rpc {
+
+// Size of the length and request ID at the start of every frame.
+static const uint32_t kFrameHeaderSize = 12;
+
+inline void EncodeUint16(uint16_t value, char *output) {
+  output[0] = value >> 8;
+  output[1] = value;
+}
+
+inline uint16_t DecodeUint16(const char *input) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(input);
+  return (p[0] << 8) | p[1];
+}
+
+inline void EncodeUint32(uint32_t value, char *output) {
+  for (int i = 3; i >= 0; --i, value >>= 8)
+    output[i] = value;
+}
+
+inline uint32_t DecodeUint32(const char *input) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(input);
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+inline void EncodeUint64(uint64_t value, char *output) {
+  for (int i = 7; i >= 0; --i, value >>= 8)
+    output[i] = value;
+}
+
+inline uint64_t DecodeUint64(const char *input) {
+  return (static_cast<uint64_t>(DecodeUint32(input)) << 32) | DecodeUint32(input + 4);
+}
+
+// A thread owns the socket and does all reads and writes on it, so frames may be sent from any thread without waiting
+// for the network, and received frames are handed to a callback on that thread.
+class RpcConnection : public enable_shared_from_this<RpcConnection>, private noncopyable {
+ public:
+  // Called on the connection thread with the ID and payload of each frame received. The payload may be modified.
+  typedef boost::function<void(RpcConnection *connection, uint64_t id, Cord *payload)> FrameCallback;
+  // Called on the connection thread once the connection has closed, after the last FrameCallback.
+  typedef boost::function<void(RpcConnection *connection)> CloseCallback;
+
+  // Takes ownership of <socket>, which must be connected and non-blocking.
+  RpcConnection(Socket *socket, const FrameCallback &frame_callback, const CloseCallback &close_callback);
+  ~RpcConnection();
+
+  // Start the connection thread. The thread holds a reference to the connection until it exits, so the connection must
+  // be owned by a shared_ptr.
+  void Start();
+
+  // Queue a frame to be sent, taking the contents of <payload>. Returns false if the connection has closed.
+  bool Send(uint64_t id, Cord *payload);
+
+  // Close the connection without waiting for it. Queued frames which haven't been sent are dropped.
+  void Close();
+
+  const Socket::Address &remote() const {
+    return remote_;
+  }
+
+ private:
+  void Run(shared_ptr<RpcConnection> self);
+  void Wake();
+
+  // Pass every complete frame in the read buffer to the frame callback. Throws runtime_error if a frame is too large.
+  void ReadFrames();
+
+  scoped_ptr<Socket> socket_;
+  Socket::Address remote_;
+  FrameCallback frame_callback_;
+  CloseCallback close_callback_;
+  // eventfd used to wake the connection thread when there is something to send.
+  int wake_fd_;
+
+  Mutex mutex_;
+  // Frames waiting to be passed to the socket.
+  Cord output_;
+  bool closed_;
+};
+
+}  // namespace rpc
+}  // namespace openinstrument
+
+#endif  // OPENINSTRUMENT_LIB_RPC_CONNECTION_H_
@@ -0,0 +1,168 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <string>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/exported_vars.h"
+#include "lib/http_reply.h"
+#include "lib/http_request.h"
+#include "lib/protobuf.h"
+#include "lib/request_handler.h"
+#include "lib/rpc_connection.h"
+#include "lib/rpc_server.h"
+#include "lib/socket.h"
+#include "lib/uri.h"
+
+DEFINE_int32(rpc_max_calls_per_connection, 64, "Requests which may run at once for each RPC connection");
+
+namespace openinstrument {
+namespace rpc {
+
+using http::HttpReply;
+using http::HttpRequest;
+
+const char *kRpcContentType = "application/x-protobuf";
+
+bool ParseRequest(const HttpRequest &request, google::protobuf::Message *proto) {
+  if (request.headers().GetHeader(http::HttpHeaders::CONTENT_TYPE) == kRpcContentType)
+    return UnserializeProtobufBinary(request.body(), proto);
+  return UnserializeProtobuf(request.body(), proto);
+}
+
+bool SerializeReply(const HttpRequest &request, const google::protobuf::Message &proto, HttpReply *reply) {
+  if (request.headers().GetHeader(http::HttpHeaders::CONTENT_TYPE) == kRpcContentType) {
+    reply->SetContentType(kRpcContentType);
+    return SerializeProtobufBinary(proto, reply->mutable_body());
+  }
+  reply->SetContentType("application/base64");
+  return SerializeProtobuf(proto, reply->mutable_body());
+}
+
+RpcServer::RpcServer(http::RequestHandler *handler, Executor *executor)
+  : handler_(handler),
+    executor_(executor),
+    shutdown_(false),
+    accept_thread_(NULL),
+    calls_in_progress_(0),
+    connections_accepted_("/openinstrument/rpc/server/connections-accepted"),
+    requests_received_("/openinstrument/rpc/server/requests-received"),
+    invalid_requests_("/openinstrument/rpc/server/invalid-requests") {}
+
+RpcServer::~RpcServer() {
+  Shutdown();
+}
+
+void RpcServer::Listen(const Socket::Address &address) {
+  socket_.Listen(address);
+  LOG(INFO) << "Listening for RPC connections on " << socket_.local().ToString();
+  accept_thread_.reset(new thread(bind(&RpcServer::AcceptThread, this)));
+}
+
+void RpcServer::Shutdown() {
+  if (shutdown_)
+    return;
+  shutdown_ = true;
+  if (accept_thread_.get())
+    accept_thread_->join();
+  MutexLock lock(mutex_);
+  for (auto &i : connections_)
+    i.second->Close();
+  while (!connections_.empty() || calls_in_progress_)
+    cond_.wait(lock);
+}
+
+void RpcServer::AcceptThread() {
+  while (!shutdown_) {
+    try {
+      Socket *client = socket_.Accept(1000);
+      if (!client)
+        continue;
+      ++connections_accepted_;
+      shared_ptr<RpcConnection> connection(new RpcConnection(client, bind(&RpcServer::HandleFrame, this, _1, _2, _3),
+                                                             bind(&RpcServer::ConnectionClosed, this, _1)));
+      {
+        MutexLock lock(mutex_);
+        connections_[connection.get()] = connection;
+      }
+      connection->Start();
+    } catch (exception &e) {
+      LOG(WARNING) << "Error accepting RPC connection: " << e.what();
+    }
+  }
+  socket_.Abort();
+}
+
+void RpcServer::HandleFrame(RpcConnection *connection, uint64_t id, Cord *payload) {
+  ++requests_received_;
+  string path;
+  try {
+    string length;
+    payload->Consume(2, &length);
+    payload->Consume(DecodeUint16(length.data()), &path);
+  } catch (out_of_range &e) {
+    // Without a path there's nothing to reply with but an error.
+    ++invalid_requests_;
+    LOG(WARNING) << "Invalid RPC request from " << connection->remote().ToString();
+    Cord reply;
+    char status[2];
+    EncodeUint16(HttpReply::BAD_REQUEST, status);
+    reply.CopyFrom(status, sizeof(status));
+    connection->Send(id, &reply);
+    return;
+  }
+
+  shared_ptr<HttpRequest> request(new HttpRequest());
+  request->set_method("POST");
+  request->uri = http::Uri(path);
+  request->source = connection->remote();
+  request->SetContentType(kRpcContentType);
+  request->mutable_body()->Splice(payload);
+  {
+    MutexLock lock(mutex_);
+    // This runs on the connection's thread, so waiting here stops any more requests being read from the connection
+    // until one of its calls finishes. Replies are still queued in the meantime.
+    uint32_t &calls = connection_calls_[connection];
+    while (calls >= static_cast<uint32_t>(FLAGS_rpc_max_calls_per_connection))
+      cond_.wait(lock);
+    ++calls;
+    ++calls_in_progress_;
+  }
+  executor_->Add(bind(&RpcServer::HandleCall, this, connection->shared_from_this(), id, request));
+}
+
+void RpcServer::HandleCall(shared_ptr<RpcConnection> connection, uint64_t id, shared_ptr<HttpRequest> request) {
+  HttpReply reply;
+  handler_->HandleRequest(*request, &reply);
+
+  Cord output;
+  char status[2];
+  EncodeUint16(reply.status(), status);
+  output.CopyFrom(status, sizeof(status));
+  output.Splice(reply.mutable_body());
+  if (!connection->Send(id, &output))
+    VLOG(1) << "RPC connection to " << connection->remote().ToString() << " closed before the reply was sent";
+
+  MutexLock lock(mutex_);
+  --calls_in_progress_;
+  unordered_map<RpcConnection *, uint32_t>::iterator it = connection_calls_.find(connection.get());
+  if (it != connection_calls_.end())
+    --it->second;
+  cond_.notify_all();
+}
+
+void RpcServer::ConnectionClosed(RpcConnection *connection) {
+  MutexLock lock(mutex_);
+  connections_.erase(connection);
+  connection_calls_.erase(connection);
+  cond_.notify_all();
+}
+
+}  // namespace rpc
+}  // namespace openinstrument
@@ -1,5 +1,13 @@
 /*
- *  -
+ * Serves the handlers of an HTTP server over persistent RPC connections (see lib/rpc_connection.h for the protocol).
+ *
+ * Each request is passed to the same RequestHandler as HTTP requests, with the path and body from the frame, and run
+ * on an Executor. Requests on one connection run concurrently and their replies are sent as each finishes, so a slow
+ * request doesn't hold up the others. Once a connection has --rpc_max_calls_per_connection requests running, no more
+ * are read from it until one finishes.
+ *
+ * Protobufs are sent over RPC without base64 encoding. Handlers which can be called over RPC should use ParseRequest()
+ * and SerializeReply(), which use whichever encoding the request arrived with.
  *
  * Copyright 2011 David Parrish <david@dparrish.com>
  *
@@ -10,51 +18,73 @@
 #ifndef OPENINSTRUMENT_LIB_RPC_SERVER_H_
 #define OPENINSTRUMENT_LIB_RPC_SERVER_H_
 
+#include <google/protobuf/message.h>
 #include <string>
 #include "lib/common.h"
+#include "lib/cord.h"
 #include "lib/exported_vars.h"
-#include "lib/http_server.h"
-#include "lib/protobuf.h"
+#include "lib/http_reply.h"
+#include "lib/http_request.h"
 #include "lib/request_handler.h"
+#include "lib/rpc_connection.h"
 #include "lib/socket.h"
 
 namespace openinstrument {
 namespace rpc {
 
-class RpcServer {
+// Content type given to requests which arrived over RPC.
+extern const char *kRpcContentType;
+
+// Parse the body of <request> into <proto>. The body is a binary protobuf if the request arrived over RPC, otherwise
+// it is base64 encoded. Returns false if it can't be parsed.
+bool ParseRequest(const http::HttpRequest &request, google::protobuf::Message *proto);
+
+// Serialize <proto> into the body of <reply>, encoded the same way as <request>. Returns false on error.
+bool SerializeReply(const http::HttpRequest &request, const google::protobuf::Message &proto, http::HttpReply *reply);
+
+class RpcServer : private noncopyable {
  public:
-  explicit RpcServer(http::HttpServer *server)
-    : server_(server) {
-    server_->request_handler()->AddPath("/__START_RPC__", &RpcServer::HandleRpc, this);
-  }
+  // Requests are handled by <handler> and run on <executor>, which must both outlive the server.
+  RpcServer(http::RequestHandler *handler, Executor *executor);
+  ~RpcServer();
 
-  template<typename RQ, typename RP>
-  void AddHandler(const string &request_name, boost::function<void(const RQ &, RP *)> handler) {
+  // Start accepting connections on <address>. If the port is 0, a port is chosen and returned by address().
+  void Listen(const Socket::Address &address);
+
+  // Stop accepting connections, close every open connection and wait for requests in progress to finish.
+  void Shutdown();
+
+  const Socket::Address &address() const {
+    return socket_.local();
   }
 
  private:
-  bool HandleRpc(const http::HttpRequest &request, http::HttpReply *reply) {
-    google::protobuf::Message req;
-    if (!UnserializeProtobuf(request.body(), &req)) {
-      reply->SetStatus(HttpReply::BAD_REQUEST);
-      reply->mutable_body()->clear();
-      reply->mutable_body()->CopyFrom("Invalid request.\n");
-      return true;
-    }
-    if (req.GetDescriptor()->full_name() != "openinstrument.proto.GetRequest")
-      throw runtime_error("Invalid request");
-
-    if (!SerializeProtobuf(response, reply->mutable_body())) {
-      reply->SetStatus(HttpReply::INTERNAL_SERVER_ERROR);
-      reply->mutable_body()->clear();
-      reply->mutable_body()->CopyFrom("Error serializing protobuf\n");
-    }
-  }
+  void AcceptThread();
+  void HandleFrame(RpcConnection *connection, uint64_t id, Cord *payload);
+  void ConnectionClosed(RpcConnection *connection);
+
+  // Run a request through the request handler and send the reply. This runs on the executor.
+  void HandleCall(shared_ptr<RpcConnection> connection, uint64_t id, shared_ptr<http::HttpRequest> request);
+
+  http::RequestHandler *handler_;
+  Executor *executor_;
+  volatile bool shutdown_;
+  Socket socket_;
+  scoped_ptr<thread> accept_thread_;
+
+  Mutex mutex_;
+  boost::condition_variable cond_;
+  unordered_map<RpcConnection *, shared_ptr<RpcConnection>> connections_;
+  // Requests passed to the executor which haven't finished yet, in total and for each open connection.
+  uint64_t calls_in_progress_;
+  unordered_map<RpcConnection *, uint32_t> connection_calls_;
 
-  http::HttpServer *server_;
+  ExportedInteger connections_accepted_;
+  ExportedInteger requests_received_;
+  ExportedInteger invalid_requests_;
 };
 
 }  // namespace rpc
 }  // namespace openinstrument
 
-#endif  // _OPENINSTRUMENT_LIB_RPC_SERVER_H_
+#endif  // OPENINSTRUMENT_LIB_RPC_SERVER_H_
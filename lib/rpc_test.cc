@@ -0,0 +1,265 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/cord.h"
+#include "lib/http_reply.h"
+#include "lib/http_request.h"
+#include "lib/openinstrument.pb.h"
+#include "lib/protobuf.h"
+#include "lib/request_handler.h"
+#include "lib/rpc_client.h"
+#include "lib/rpc_connection.h"
+#include "lib/rpc_server.h"
+#include "lib/socket.h"
+#include "lib/store_client.h"
+#include "lib/threadpool.h"
+
+DECLARE_int32(rpc_max_calls_per_connection);
+
+namespace openinstrument {
+namespace rpc {
+
+using http::HttpReply;
+using http::HttpRequest;
+
+void SleepCall(RpcClient *client, uint32_t ms, string *result) {
+  Cord reply;
+  client->Call(StringPrintf("/sleep?ms=%u", ms), Cord(), &reply);
+  *result = reply.ToString();
+}
+
+class RpcTest : public ::testing::Test {
+ protected:
+  RpcTest()
+    : policy_(4, 16),
+      thread_pool_("rpc_test", policy_),
+      server_(&handler_, &thread_pool_),
+      running_(0),
+      max_running_(0) {
+    handler_.AddPath("/echo$", &RpcTest::HandleEcho, this);
+    handler_.AddPath("/sleep$", &RpcTest::HandleSleep, this);
+    handler_.AddPath("/config$", &RpcTest::HandleConfig, this);
+    handler_.AddPath("/get_config$", &RpcTest::HandleConfig, this);
+    server_.Listen(Socket::Address("127.0.0.1", 0));
+  }
+
+  bool HandleEcho(const HttpRequest &request, HttpReply *reply) {
+    reply->SetStatus(HttpReply::OK);
+    reply->mutable_body()->CopyFrom(request.uri.path + " " + request.GetParam("q") + " ");
+    reply->mutable_body()->CopyFrom(request.body());
+    return true;
+  }
+
+  bool HandleSleep(const HttpRequest &request, HttpReply *reply) {
+    {
+      MutexLock lock(mutex_);
+      max_running_ = std::max(max_running_, ++running_);
+    }
+    usleep(lexical_cast<uint32_t>(request.GetParam("ms")) * 1000);
+    {
+      MutexLock lock(mutex_);
+      --running_;
+    }
+    reply->SetStatus(HttpReply::OK);
+    reply->mutable_body()->CopyFrom(request.GetParam("ms"));
+    return true;
+  }
+
+  bool HandleConfig(const HttpRequest &request, HttpReply *reply) {
+    proto::StoreConfig config;
+    if (!ParseRequest(request, &config)) {
+      reply->SetStatus(HttpReply::BAD_REQUEST);
+      return true;
+    }
+    config.add_server()->set_address("added");
+    reply->SetStatus(HttpReply::OK);
+    SerializeReply(request, config, reply);
+    return true;
+  }
+
+  http::RequestHandler handler_;
+  DefaultThreadPoolPolicy policy_;
+  ThreadPool thread_pool_;
+  RpcServer server_;
+  Mutex mutex_;
+  int running_;
+  // Most /sleep requests running at once.
+  int max_running_;
+};
+
+TEST_F(RpcTest, Call) {
+  RpcClient client(server_.address());
+  Cord body, reply;
+  body.CopyFrom("request body");
+  EXPECT_EQ(HttpReply::OK, client.Call("/echo?q=x", body, &reply));
+  EXPECT_EQ("/echo x request body", reply.ToString());
+
+  // A large body is split across many reads.
+  string large(5 * 1024 * 1024, 'x');
+  body.clear();
+  body.CopyFrom(large);
+  reply.clear();
+  EXPECT_EQ(HttpReply::OK, client.Call("/echo", body, &reply));
+  EXPECT_EQ("/echo  " + large, reply.ToString());
+
+  reply.clear();
+  EXPECT_EQ(HttpReply::NOT_FOUND, client.Call("/missing", Cord(), &reply));
+}
+
+TEST_F(RpcTest, Protobuf) {
+  RpcClient client(server_.address());
+  proto::StoreConfig request, response;
+  request.add_server()->set_address("first");
+  client.Call("/config", request, &response);
+  ASSERT_EQ(2, response.server_size());
+  EXPECT_EQ("first", response.server(0).address());
+  EXPECT_EQ("added", response.server(1).address());
+  EXPECT_THROW(client.Call("/missing", request, &response), runtime_error);
+
+  // The protobuf is sent without base64 encoding.
+  Cord body, reply;
+  ASSERT_TRUE(SerializeProtobufBinary(request, &body));
+  EXPECT_EQ(HttpReply::OK, client.Call("/config", body, &reply));
+  proto::StoreConfig binary;
+  EXPECT_TRUE(UnserializeProtobufBinary(reply, &binary));
+  EXPECT_EQ(2, binary.server_size());
+}
+
+TEST_F(RpcTest, StoreClientResolvesHostname) {
+  // A server in the store config may be given by name, whether or not it has an RPC port.
+  proto::StoreServer server;
+  server.set_address(StringPrintf("localhost:%u", server_.address().port()));
+  server.set_rpc_port(server_.address().port());
+  StoreClient client(server);
+  scoped_ptr<proto::StoreConfig> config(client.GetStoreConfig());
+  ASSERT_EQ(1, config->server_size());
+  EXPECT_EQ("added", config->server(0).address());
+
+  proto::StoreConfig request, response;
+  client.SendRequestToServer(server, "/config", request, &response);
+  EXPECT_EQ(1, response.server_size());
+
+  server.set_address("localhost");
+  EXPECT_THROW(client.SendRequestToServer(server, "/config", request, &response), runtime_error);
+}
+
+TEST_F(RpcTest, CallsPerConnectionLimit) {
+  int32_t old_limit = FLAGS_rpc_max_calls_per_connection;
+  FLAGS_rpc_max_calls_per_connection = 2;
+  RpcClient client(server_.address());
+  vector<string> results(6);
+  vector<shared_ptr<thread>> threads;
+  for (size_t i = 0; i < results.size(); ++i)
+    threads.push_back(shared_ptr<thread>(new thread(bind(&SleepCall, &client, 100, &results[i]))));
+  for (auto &t : threads)
+    t->join();
+  FLAGS_rpc_max_calls_per_connection = old_limit;
+  // Every call completes, but no more than the limit ran at once.
+  for (auto &result : results)
+    EXPECT_EQ("100", result);
+  EXPECT_EQ(2, max_running_);
+}
+
+TEST_F(RpcTest, ConcurrentCalls) {
+  // Calls share one connection, and the replies come back as each finishes rather than in the order they were sent.
+  RpcClient client(server_.address());
+  string slow, fast;
+  thread slow_thread(bind(&SleepCall, &client, 500, &slow));
+  usleep(50000);
+  Timer timer;
+  timer.Start();
+  SleepCall(&client, 1, &fast);
+  timer.Stop();
+  EXPECT_EQ("1", fast);
+  EXPECT_LT(timer.ms(), 400);
+  slow_thread.join();
+  EXPECT_EQ("500", slow);
+
+  vector<shared_ptr<thread>> threads;
+  vector<string> results(20);
+  for (size_t i = 0; i < results.size(); ++i)
+    threads.push_back(shared_ptr<thread>(new thread(bind(&SleepCall, &client, i, &results[i]))));
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->join();
+    EXPECT_EQ(lexical_cast<string>(i), results[i]);
+  }
+}
+
+TEST_F(RpcTest, Timeout) {
+  RpcClient client(server_.address());
+  Cord reply;
+  // The timeout covers making the connection as well as waiting for the reply.
+  EXPECT_THROW(client.Call("/echo", Cord(), &reply, 0), runtime_error);
+  EXPECT_THROW(client.Call("/sleep?ms=500", Cord(), &reply, 50), runtime_error);
+  // The late reply is discarded and the connection is still usable.
+  EXPECT_EQ(HttpReply::OK, client.Call("/echo", Cord(), &reply));
+  EXPECT_EQ("/echo  ", reply.ToString());
+}
+
+TEST_F(RpcTest, Reconnect) {
+  RpcClient client(server_.address());
+  Cord reply;
+  EXPECT_EQ(HttpReply::OK, client.Call("/echo", Cord(), &reply));
+
+  // Restart the server on the same port. The first call after that notices the old connection has gone, and the one
+  // after connects again.
+  Socket::Address address(server_.address());
+  server_.Shutdown();
+  RpcServer server(&handler_, &thread_pool_);
+  server.Listen(address);
+  bool succeeded = false;
+  for (int i = 0; i < 3 && !succeeded; ++i) {
+    try {
+      reply.clear();
+      succeeded = client.Call("/echo", Cord(), &reply) == HttpReply::OK;
+    } catch (runtime_error &e) {
+      usleep(10000);
+    }
+  }
+  EXPECT_TRUE(succeeded);
+  EXPECT_EQ("/echo  ", reply.ToString());
+}
+
+TEST_F(RpcTest, InvalidFrame) {
+  // A frame too short to hold a path gets an error reply, and a frame with an impossible length closes the connection.
+  Socket sock;
+  sock.Connect(server_.address());
+  char frame[kFrameHeaderSize + 1];
+  EncodeUint32(9, frame);
+  EncodeUint64(42, frame + 4);
+  frame[kFrameHeaderSize] = 0;
+  sock.Write(StringPiece(frame, sizeof(frame)));
+  Deadline deadline(5000);
+  while (sock.read_buffer()->size() < kFrameHeaderSize + 2 && deadline)
+    sock.Read(100);
+  string reply = sock.read_buffer()->ToString();
+  ASSERT_EQ(kFrameHeaderSize + 2, reply.size());
+  EXPECT_EQ(10U, DecodeUint32(reply.data()));
+  EXPECT_EQ(42U, DecodeUint64(reply.data() + 4));
+  EXPECT_EQ(HttpReply::BAD_REQUEST, DecodeUint16(reply.data() + kFrameHeaderSize));
+
+  EncodeUint32(0xffffffff, frame);
+  sock.Write(StringPiece(frame, kFrameHeaderSize));
+  while (sock.fd() && deadline)
+    sock.Read(100);
+  EXPECT_FALSE(sock.fd());
+}
+
+}  // namespace rpc
+}  // namespace openinstrument
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
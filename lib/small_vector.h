@@ -0,0 +1,264 @@
+/*
+ * Vector with inline storage for a small number of elements.
+ *
+ * The first N elements are stored inside the object itself, so short vectors need no heap allocation and copying one
+ * is a single contiguous copy. Once the vector grows past N elements it moves to the heap like a std::vector.
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef _OPENINSTRUMENT_LIB_SMALL_VECTOR_H_
+#define _OPENINSTRUMENT_LIB_SMALL_VECTOR_H_
+
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include "lib/common.h"
+
+namespace openinstrument {
+
+template<typename T, uint32_t N>
+class SmallVector {
+ public:
+  typedef T value_type;
+  typedef T *iterator;
+  typedef const T *const_iterator;
+  typedef uint32_t size_type;
+
+  SmallVector() : data_(inline_data()), size_(0), capacity_(N) {}
+
+  SmallVector(const SmallVector &other) : data_(inline_data()), size_(0), capacity_(N) {
+    reserve(other.size_);
+    std::uninitialized_copy(other.begin(), other.end(), data_);
+    size_ = other.size_;
+  }
+
+  SmallVector(SmallVector &&other) : data_(inline_data()), size_(0), capacity_(N) {
+    MoveFrom(&other);
+  }
+
+  ~SmallVector() {
+    clear();
+    FreeStorage();
+  }
+
+  SmallVector &operator=(const SmallVector &other) {
+    if (this == &other)
+      return *this;
+    if (other.size_ <= size_) {
+      std::copy(other.begin(), other.end(), data_);
+      Destroy(data_ + other.size_, end());
+    } else {
+      if (other.size_ > capacity_) {
+        clear();
+        reserve(other.size_);
+      }
+      std::copy(other.begin(), other.begin() + size_, data_);
+      std::uninitialized_copy(other.begin() + size_, other.end(), data_ + size_);
+    }
+    size_ = other.size_;
+    return *this;
+  }
+
+  SmallVector &operator=(SmallVector &&other) {
+    if (this == &other)
+      return *this;
+    clear();
+    MoveFrom(&other);
+    return *this;
+  }
+
+  inline iterator begin() {
+    return data_;
+  }
+
+  inline iterator end() {
+    return data_ + size_;
+  }
+
+  inline const_iterator begin() const {
+    return data_;
+  }
+
+  inline const_iterator end() const {
+    return data_ + size_;
+  }
+
+  inline size_type size() const {
+    return size_;
+  }
+
+  inline size_type capacity() const {
+    return capacity_;
+  }
+
+  inline bool empty() const {
+    return size_ == 0;
+  }
+
+  // Returns true if the elements are held inside the object rather than on the heap.
+  inline bool is_inline() const {
+    return data_ == inline_data();
+  }
+
+  inline T &operator[](size_type index) {
+    return data_[index];
+  }
+
+  inline const T &operator[](size_type index) const {
+    return data_[index];
+  }
+
+  inline T &back() {
+    return data_[size_ - 1];
+  }
+
+  inline const T &back() const {
+    return data_[size_ - 1];
+  }
+
+  void reserve(size_type capacity) {
+    if (capacity <= capacity_)
+      return;
+    T *data = static_cast<T *>(::operator new(sizeof(T) * capacity));
+    for (size_type i = 0; i < size_; ++i) {
+      new(data + i) T(std::move(data_[i]));
+      data_[i].~T();
+    }
+    FreeStorage();
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+  void push_back(const T &value) {
+    if (size_ == capacity_) {
+      // <value> may refer to an existing element, so copy it before the storage moves.
+      T copy(value);
+      Grow();
+      new(data_ + size_) T(std::move(copy));
+    } else {
+      new(data_ + size_) T(value);
+    }
+    ++size_;
+  }
+
+  void push_back(T &&value) {
+    if (size_ == capacity_) {
+      T copy(std::move(value));
+      Grow();
+      new(data_ + size_) T(std::move(copy));
+    } else {
+      new(data_ + size_) T(std::move(value));
+    }
+    ++size_;
+  }
+
+  void pop_back() {
+    data_[--size_].~T();
+  }
+
+  // Insert <value> before <pos>, returning an iterator to the new element.
+  iterator insert(iterator pos, T &&value) {
+    size_type index = pos - data_;
+    if (index == size_) {
+      push_back(std::move(value));
+      return data_ + index;
+    }
+    T copy(std::move(value));
+    if (size_ == capacity_)
+      Grow();
+    new(data_ + size_) T(std::move(data_[size_ - 1]));
+    std::move_backward(data_ + index, data_ + size_ - 1, data_ + size_);
+    data_[index] = std::move(copy);
+    ++size_;
+    return data_ + index;
+  }
+
+  iterator insert(iterator pos, const T &value) {
+    return insert(pos, T(value));
+  }
+
+  // Remove the element at <pos>, returning an iterator to the element that followed it.
+  iterator erase(iterator pos) {
+    std::move(pos + 1, end(), pos);
+    pop_back();
+    return pos;
+  }
+
+  void clear() {
+    Destroy(begin(), end());
+    size_ = 0;
+  }
+
+  void swap(SmallVector &other) {
+    SmallVector temp(std::move(other));
+    other = std::move(*this);
+    *this = std::move(temp);
+  }
+
+  bool operator==(const SmallVector &other) const {
+    return size_ == other.size_ && std::equal(begin(), end(), other.begin());
+  }
+
+  bool operator!=(const SmallVector &other) const {
+    return !operator==(other);
+  }
+
+ private:
+  inline T *inline_data() {
+    return reinterpret_cast<T *>(inline_.address());
+  }
+
+  inline const T *inline_data() const {
+    return reinterpret_cast<const T *>(inline_.address());
+  }
+
+  void Grow() {
+    reserve(capacity_ * 2);
+  }
+
+  static void Destroy(T *first, T *last) {
+    for (; first != last; ++first)
+      first->~T();
+  }
+
+  void FreeStorage() {
+    if (!is_inline())
+      ::operator delete(data_);
+    data_ = inline_data();
+    capacity_ = N;
+  }
+
+  // Take the contents of <other>, which must be empty afterwards. This object must be empty.
+  void MoveFrom(SmallVector *other) {
+    if (!other->is_inline()) {
+      // Steal the heap storage outright.
+      FreeStorage();
+      data_ = other->data_;
+      size_ = other->size_;
+      capacity_ = other->capacity_;
+      other->data_ = other->inline_data();
+      other->size_ = 0;
+      other->capacity_ = N;
+      return;
+    }
+    for (size_type i = 0; i < other->size_; ++i)
+      new(data_ + i) T(std::move(other->data_[i]));
+    size_ = other->size_;
+    other->clear();
+  }
+
+  T *data_;
+  size_type size_;
+  size_type capacity_;
+  boost::aligned_storage<sizeof(T) * N, boost::alignment_of<T>::value> inline_;
+};
+
+}  // namespace openinstrument
+
+#endif  // _OPENINSTRUMENT_LIB_SMALL_VECTOR_H_
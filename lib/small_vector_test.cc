@@ -0,0 +1,105 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "lib/common.h"
+#include "lib/small_vector.h"
+#include "lib/string.h"
+
+namespace openinstrument {
+
+class SmallVectorTest : public ::testing::Test {};
+
+TEST_F(SmallVectorTest, Inline) {
+  SmallVector<string, 4> vec;
+  EXPECT_TRUE(vec.empty());
+  EXPECT_TRUE(vec.is_inline());
+  for (int i = 0; i < 4; i++)
+    vec.push_back(StringPrintf("value %d", i));
+  EXPECT_EQ(4U, vec.size());
+  EXPECT_TRUE(vec.is_inline());
+  EXPECT_EQ("value 0", vec[0]);
+  EXPECT_EQ("value 3", vec.back());
+
+  vec.push_back("value 4");
+  EXPECT_FALSE(vec.is_inline());
+  EXPECT_EQ(5U, vec.size());
+  for (int i = 0; i < 5; i++)
+    EXPECT_EQ(StringPrintf("value %d", i), vec[i]);
+
+  vec.clear();
+  EXPECT_TRUE(vec.empty());
+}
+
+TEST_F(SmallVectorTest, PushBackSelf) {
+  SmallVector<string, 2> vec;
+  vec.push_back("first");
+  vec.push_back("second");
+  // Growing the storage must not invalidate the element being copied.
+  vec.push_back(vec[0]);
+  EXPECT_EQ(3U, vec.size());
+  EXPECT_EQ("first", vec[2]);
+}
+
+TEST_F(SmallVectorTest, InsertErase) {
+  SmallVector<int, 4> vec;
+  vector<int> expected;
+  srand(42);
+  for (int i = 0; i < 1000; i++) {
+    if (!expected.empty() && rand() % 3 == 0) {
+      uint32_t index = rand() % expected.size();
+      expected.erase(expected.begin() + index);
+      vec.erase(vec.begin() + index);
+    } else {
+      uint32_t index = rand() % (expected.size() + 1);
+      expected.insert(expected.begin() + index, i);
+      EXPECT_EQ(i, *vec.insert(vec.begin() + index, i));
+    }
+    ASSERT_EQ(expected.size(), vec.size());
+    for (uint32_t j = 0; j < expected.size(); j++)
+      ASSERT_EQ(expected[j], vec[j]);
+  }
+}
+
+TEST_F(SmallVectorTest, CopyAndMove) {
+  SmallVector<string, 2> small, large;
+  small.push_back("a");
+  for (int i = 0; i < 10; i++)
+    large.push_back(StringPrintf("%d", i));
+
+  SmallVector<string, 2> copy(small);
+  EXPECT_TRUE(copy == small);
+  copy = large;
+  EXPECT_TRUE(copy == large);
+  copy = small;
+  EXPECT_TRUE(copy == small);
+  EXPECT_TRUE(copy != large);
+
+  SmallVector<string, 2> moved(std::move(large));
+  EXPECT_EQ(10U, moved.size());
+  EXPECT_TRUE(large.empty());
+  EXPECT_TRUE(large.is_inline());
+
+  moved.swap(small);
+  EXPECT_EQ(1U, moved.size());
+  EXPECT_EQ("a", moved[0]);
+  EXPECT_EQ(10U, small.size());
+  EXPECT_EQ("9", small.back());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
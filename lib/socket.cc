@@ -14,12 +14,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ifaddrs.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <stdexcept>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "lib/common.h"
 #include "lib/socket.h"
@@ -27,6 +29,14 @@
 
 namespace openinstrument {
 
+namespace {
+
+// Smallest and largest amount of data to ask for in a single read.
+const uint64_t kMinReadSize = 16 * 1024;
+const uint64_t kMaxReadSize = 4 * 1024 * 1024;
+
+}  // namespace
+
 vector<Socket::Address> Socket::Resolve(const char *hostname) {
   struct addrinfo *result;
   int s = getaddrinfo(hostname, NULL, NULL, &result);
@@ -93,19 +103,25 @@ vector<Socket::Address> Socket::LocalAddresses() {
   return ret;
 }
 
-void Socket::Listen(const Socket::Address &addr) {
+void Socket::Listen(const Socket::Address &addr, bool reuse_port) {
   local_ = addr;
   if ((fd_ = ::socket(local_.address_.ss_family, SOCK_STREAM, 0)) <= 0)
     throw runtime_error(StringPrintf("Can't create socket: %s", strerror(errno)));
   int on = 1;
   setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (reuse_port && setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    throw runtime_error(StringPrintf("Can't set SO_REUSEPORT on socket: %s", strerror(errno)));
 
   if (::bind(fd_, (sockaddr *)local_.sockaddr_v4(), sizeof(local_.address_)) < 0)
     throw runtime_error(StringPrintf("Can't bind socket: %s", strerror(errno)));
 
-  if (::listen(fd_, 100) < 0)
+  if (::listen(fd_, SOMAXCONN) < 0)
     throw runtime_error(StringPrintf("Can't listen on socket: %s", strerror(errno)));
 
+  socklen_t addrlen = sizeof(local_.address_);
+  if (getsockname(fd_, reinterpret_cast<struct sockaddr *>(&local_.address_), &addrlen) != 0)
+    LOG(WARNING) << "getsockname() failed, can't get local port: " << strerror(errno);
+
   VLOG(1) << "Listening on " << local_.ToString();
 }
 
@@ -151,41 +167,57 @@ Socket *Socket::Accept(int timeout) const {
   }
 }
 
+ssize_t Socket::SendBuffered() {
+  write_iov_.clear();
+  Cord::iterator i = write_buffer_.begin();
+  for (; i != write_buffer_.end() && write_iov_.size() < IOV_MAX; ++i) {
+    if (!i->size())
+      continue;
+    struct iovec vec = { const_cast<char *>(i->buffer()), i->size() };
+    write_iov_.push_back(vec);
+  }
+  if (write_iov_.empty()) {
+    write_buffer_.clear();
+    return 0;
+  }
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &write_iov_[0];
+  msg.msg_iovlen = write_iov_.size();
+  int flags = MSG_NOSIGNAL;
+  if (i != write_buffer_.end())
+    flags |= MSG_MORE;
+  ssize_t ret = ::sendmsg(fd_, &msg, flags);
+  if (ret > 0) {
+    // Releasing sent buffers must not clobber errno for the caller.
+    int saved_errno = errno;
+    write_buffer_.Consume(ret, NULL);
+    errno = saved_errno;
+  }
+  return ret;
+}
+
 void Socket::AttemptFlush(int timeout) {
   if (!fd_) {
     // Not connected
     return;
   }
   while (write_buffer_.size()) {
-    if (!PollWrite(timeout)) {
-      // Not ready to write
-      return;
-    }
-    CordBuffer &buf = write_buffer_.front();
-    if (!buf.size()) {
-      write_buffer_.pop_front();
+    ssize_t ret = SendBuffered();
+    if (ret >= 0)
       continue;
-    }
-    for (const char *p = buf.buffer(); p < buf.buffer() + buf.size();) {
-      int flags = 0;
-      int64_t bytesleft = (buf.buffer() + buf.size() - p);
-      if (bytesleft < 0) {
-        LOG(ERROR) << "This is probably bad, and indicates an off-by-one error.";
-        break;
-      }
-      if (write_buffer_.size() > static_cast<uint64_t>(bytesleft))
-        flags |= MSG_MORE;
-      ssize_t ret = ::send(fd_, p, bytesleft, flags);
-      if (ret < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-          continue;
-        }
-        Abort();
-        throw runtime_error(StringPrintf("send() returned error: %s", strerror(errno)));
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // Wait for the kernel to make room rather than retrying straight away.
+      if (!PollWrite(timeout)) {
+        // Not ready to write
+        return;
       }
-      p += ret;
+      continue;
     }
-    write_buffer_.pop_front();
+    Abort();
+    throw runtime_error(StringPrintf("sendmsg() returned error: %s", strerror(errno)));
   }
 }
 
@@ -235,32 +267,81 @@ bool Socket::Poll(int timeout, uint16_t events) const {
   }
 }
 
+ssize_t Socket::ReadIntoBuffer() {
+  read_buffer_.GetAppendBufs(std::min(kMaxReadSize, std::max(kMinReadSize, expected_read_)), &read_iov_);
+  ssize_t ret = ::readv(fd_, &read_iov_[0], read_iov_.size());
+  // Releasing unused buffers must not clobber errno for the caller.
+  int saved_errno = errno;
+  read_buffer_.CommitAppend(ret > 0 ? ret : 0);
+  if (ret > 0)
+    expected_read_ -= std::min(expected_read_, static_cast<uint64_t>(ret));
+  errno = saved_errno;
+  return ret;
+}
+
 uint64_t Socket::Read(int timeout) {
   if (!fd_) {
     // Not connected
     return 0;
   }
-  scoped_array<char> buf(new char[4096]);
   uint64_t bytes_read = 0;
   while (PollRead(timeout)) {
-    ssize_t ret = recv(fd_, buf.get(), 4096, 0);
+    ssize_t ret = ReadIntoBuffer();
     if (ret < 0) {
       if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
         continue;
       Close();
-      throw runtime_error(StringPrintf("recv() returned error: %s", strerror(errno)));
+      throw runtime_error(StringPrintf("readv() returned error: %s", strerror(errno)));
     }
     if (ret == 0) {
       Abort();
       break;
     }
     bytes_read += ret;
-    read_buffer_.CopyFrom(buf.get(), ret);
     break;
   }
   return bytes_read;
 }
 
+uint64_t Socket::ReadAvailable(bool *eof, uint64_t limit) {
+  *eof = false;
+  if (!fd_) {
+    *eof = true;
+    return 0;
+  }
+  uint64_t bytes_read = 0;
+  while (!limit || read_buffer_.size() < limit) {
+    ssize_t ret = ReadIntoBuffer();
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      throw runtime_error(StringPrintf("readv() returned error: %s", strerror(errno)));
+    }
+    if (ret == 0) {
+      *eof = true;
+      break;
+    }
+    bytes_read += ret;
+  }
+  return bytes_read;
+}
+
+bool Socket::WriteAvailable() {
+  while (write_buffer_.size()) {
+    ssize_t ret = SendBuffered();
+    if (ret >= 0)
+      continue;
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return false;
+    throw runtime_error(StringPrintf("sendmsg() returned error: %s", strerror(errno)));
+  }
+  return true;
+}
+
 void Socket::Connect(Address addr, int timeout) {
   if (fd_) {
     // Close any already open connections
@@ -273,7 +354,7 @@ void Socket::Connect(Address addr, int timeout) {
   while (::connect(fd_, reinterpret_cast<struct sockaddr *>(&addr.address_), sizeof(addr.address_)) < 0) {
     if (errno == EINPROGRESS || errno == EINTR) {
       // Non-blocking connect
-      if (!PollWrite(1000)) {
+      if (!PollWrite(timeout < 0 ? 1000 : timeout)) {
         throw runtime_error(StringPrintf("Can't connect to %s: timeout", addr.AddressToString().c_str()));
       } else {
         int optval;
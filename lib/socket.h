@@ -13,6 +13,7 @@
 #include <string>
 #include <vector>
 #include <netinet/in.h>
+#include <sys/uio.h>
 #include "lib/common.h"
 #include "lib/cord.h"
 #include "lib/string.h"
@@ -78,8 +79,8 @@ class Socket : private noncopyable {
     struct sockaddr_storage address_;
   };
 
-  Socket() : fd_(0) {}
-  explicit Socket(int fd) : fd_(fd) {}
+  Socket() : fd_(0), expected_read_(0) {}
+  explicit Socket(int fd) : fd_(fd), expected_read_(0) {}
 
   ~Socket() {
     Close();
@@ -89,12 +90,32 @@ class Socket : private noncopyable {
   static vector<string> ReverseResolve(const Address &address);
   static vector<Address> LocalAddresses();
 
-  void Listen(const Address &addr);
+  // Listen on <addr>. If <reuse_port> is set, other sockets may listen on the same address and port, and the kernel
+  // spreads incoming connections across them. If the port is 0, local() is set to the port which was chosen.
+  void Listen(const Address &addr, bool reuse_port = false);
   Socket *Accept(int timeout = -1) const;
   void SetNonblocking(bool nonblocking = true);
   void AttemptFlush(int timeout = 0);
   uint64_t Read(int timeout = -1);
+
+  // Read everything which is available on a non-blocking socket into the read buffer, without waiting. Returns the
+  // number of bytes read, and sets <eof> if the other end has closed the connection.
+  // If <limit> is non-zero, reading stops once the read buffer holds at least <limit> bytes, even if more is available.
+  uint64_t ReadAvailable(bool *eof, uint64_t limit = 0);
+
+  // Send as much of the write buffer as possible on a non-blocking socket, without waiting. Returns true once the
+  // write buffer is empty.
+  bool WriteAvailable();
+
+  // Tell the socket that another <bytes> bytes are expected, such as the rest of a body with a known Content-Length.
+  // Reads are sized to fetch that much in as few system calls as possible, rather than a small block at a time.
+  inline void ExpectRead(uint64_t bytes) {
+    expected_read_ = bytes;
+  }
+
   void Abort();
+  // Connect to <addr>, waiting up to <timeout> ms for the connection to be made, or 1 second if <timeout> is negative.
+  // Throws runtime_error if the connection can't be made in time.
   void Connect(Address addr, int timeout = -1);
   void Connect(const string &address, uint16_t port, int timeout = -1);
 
@@ -126,6 +147,13 @@ class Socket : private noncopyable {
     Read(0);
   }
 
+  // Send the contents of <cord>, which is left empty. The buffers are moved rather than copied.
+  inline void Write(Cord *cord) {
+    write_buffer_.Splice(cord);
+    AttemptFlush();
+    Read(0);
+  }
+
   inline bool PollRead(int timeout) const;
   inline bool PollWrite(int timeout) const;
 
@@ -141,6 +169,15 @@ class Socket : private noncopyable {
     return &read_buffer_;
   }
 
+  // Data waiting to be sent by AttemptFlush() or WriteAvailable().
+  Cord *write_buffer() {
+    return &write_buffer_;
+  }
+
+  inline int fd() const {
+    return fd_;
+  }
+
   // Return the current hostname
   static string Hostname();
 
@@ -150,9 +187,19 @@ class Socket : private noncopyable {
   Address remote_;
   Cord write_buffer_;
   Cord read_buffer_;
+  uint64_t expected_read_;
+  vector<struct iovec> read_iov_;
+  vector<struct iovec> write_iov_;
 
   bool Poll(int timeout, uint16_t events) const;
 
+  // Read directly into free space at the end of the read buffer with a single readv(). Returns the result of readv().
+  ssize_t ReadIntoBuffer();
+
+  // Send as much of the write buffer as will fit in a single sendmsg(), gathered straight from the buffers. Returns the
+  // result of sendmsg().
+  ssize_t SendBuffered();
+
   Address *mutable_remote() {
     return &remote_;
   }
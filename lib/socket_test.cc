@@ -109,6 +109,32 @@ TEST_F(SocketTest, Listen) {
   EXPECT_FALSE(client.get());
 }
 
+TEST_F(SocketTest, GatherWrite) {
+  Socket listener;
+  listener.Listen(Socket::Address("127.0.0.1", 0));
+  Socket client;
+  client.Connect("127.0.0.1", listener.local().port(), 5000);
+  scoped_ptr<Socket> server(listener.Accept(5000));
+  ASSERT_TRUE(server.get());
+
+  // More buffers than can be sent in a single sendmsg()
+  vector<string> pieces;
+  string expected;
+  for (int i = 0; i < 5000; ++i) {
+    pieces.push_back(StringPrintf("piece %d\n", i));
+    expected += pieces.back();
+  }
+  Cord output;
+  for (const string &piece : pieces)
+    output.Append(piece);
+  server->Write(&output);
+  EXPECT_TRUE(output.empty());
+  server->Flush();
+
+  while (client.read_buffer()->size() < expected.size() && client.Read(5000) > 0) {}
+  EXPECT_EQ(expected, client.read_buffer()->ToString());
+}
+
 }  // namespace
 
 int main(int argc, char **argv) {
@@ -8,17 +8,25 @@
 */
 
 #include <google/protobuf/message.h>
+#include <algorithm>
+#include <map>
 #include <string>
+#include <utility>
+#include <vector>
+#include "lib/closure.h"
 #include "lib/common.h"
 #include "lib/exported_vars.h"
 #include "lib/http_client.h"
+#include "lib/hyperloglog.h"
 #include "lib/openinstrument.pb.h"
 #include "lib/protobuf.h"
+#include "lib/rpc_client.h"
 #include "lib/socket.h"
 #include "lib/store_client.h"
 #include "lib/store_config.h"
 #include "lib/string.h"
 #include "lib/uri.h"
+#include "lib/variable.h"
 
 namespace openinstrument {
 
@@ -27,17 +35,59 @@ using http::HttpReply;
 using http::HttpRequest;
 using http::Uri;
 
+namespace {
+
+bool MostSeriesFirst(const std::pair<uint64_t, string> &a, const std::pair<uint64_t, string> &b) {
+  if (a.first != b.first)
+    return a.first > b.first;
+  return a.second < b.second;
+}
+
+bool MostValuesFirst(const proto::LabelStats &a, const proto::LabelStats &b) {
+  if (a.distinct_values() != b.distinct_values())
+    return a.distinct_values() > b.distinct_values();
+  return a.label() < b.label();
+}
+
+// Put the variables in <page> in the order ListIterator merges them, by name and then by key.
+void SortListPage(proto::ListResponse *page) {
+  typedef std::pair<std::pair<string, string>, int> Entry;
+  vector<Entry> entries;
+  entries.reserve(page->stream_size());
+  for (int i = 0; i < page->stream_size(); i++) {
+    Variable variable(page->stream(i).variable());
+    entries.push_back(Entry(std::make_pair(variable.variable(), variable.ToString()), i));
+  }
+  if (std::is_sorted(entries.begin(), entries.end()))
+    return;
+  std::sort(entries.begin(), entries.end());
+  google::protobuf::RepeatedPtrField<proto::ValueStream> sorted;
+  for (const Entry &entry : entries)
+    sorted.Add()->Swap(page->mutable_stream(entry.second));
+  page->mutable_stream()->Swap(&sorted);
+}
+
+}  // namespace
+
 // Preferred method of connecting to the storage server cluster.
 // The caller is responsible for deleting the config object.
 StoreClient::StoreClient()
-  : request_timer_("/openinstrument/client/store/all-requests") {}
+  : rpc_port_(0),
+    request_timer_("/openinstrument/client/store/all-requests") {}
 
 // Connect to a single storage server
 StoreClient::StoreClient(const string &address)
-  : hostname_(address),
+  : rpc_port_(0),
+    hostname_(address),
     request_timer_("/openinstrument/client/store/all-requests") {}
 StoreClient::StoreClient(const Socket::Address &address)
   : address_(address),
+    rpc_port_(0),
+    request_timer_("/openinstrument/client/store/all-requests") {}
+StoreClient::StoreClient(const proto::StoreServer &server)
+  : address_(server.address()),
+    rpc_port_(server.rpc_port()),
+    hostname_(server.address()),
     request_timer_("/openinstrument/client/store/all-requests") {}
 
 void StoreClient::SendRequestToHost(const Socket::Address &address, const string &path,
@@ -64,29 +114,52 @@ void StoreClient::SendRequestToHost(const Socket::Address &address, const string
     throw runtime_error("Invalid response from the server");
 }
 
-template<typename ResponseType>
-void StoreClient::SendRequest(const string &path, const google::protobuf::Message &request, ResponseType *response) {
-  if (address_.valid())
-    return SendRequestToHost(address_, path, request, response);
+void StoreClient::SendRequestToServer(const proto::StoreServer &server, const string &path,
+                                      const google::protobuf::Message &request, google::protobuf::Message *response) {
+  Socket::Address address(server.address());
+  if (address.valid())
+    return SendRequestToAddress(address, server.rpc_port(), path, request, response);
+  SendRequestToHostname(server.address(), server.rpc_port(), path, request, response);
+}
 
-  int pos = hostname_.find_last_of(':');
+void StoreClient::SendRequestToAddress(const Socket::Address &address, uint16_t rpc_port, const string &path,
+                                       const google::protobuf::Message &request, google::protobuf::Message *response) {
+  if (!rpc_port)
+    return SendRequestToHost(address, path, request, response);
+  ScopedExportTimer t(&request_timer_);
+  Socket::Address rpc_address(address);
+  rpc_address.set_port(rpc_port);
+  rpc::RpcClient::Get(rpc_address)->Call(path, request, response);
+}
+
+void StoreClient::SendRequestToHostname(const string &hostname, uint16_t rpc_port, const string &path,
+                                        const google::protobuf::Message &request,
+                                        google::protobuf::Message *response) {
+  int pos = hostname.find_last_of(':');
   if (pos < 0)
-    throw runtime_error(StringPrintf("Invalid host:port %s", hostname_.c_str()));
+    throw runtime_error(StringPrintf("Invalid host:port %s", hostname.c_str()));
 
-  vector<Socket::Address> addrs = Socket::Resolve(hostname_.substr(0, pos).c_str());
+  vector<Socket::Address> addrs = Socket::Resolve(hostname.substr(0, pos).c_str());
   if (!addrs.size())
-    throw runtime_error(StringPrintf("No addresses found for %s", hostname_.c_str()));
+    throw runtime_error(StringPrintf("No addresses found for %s", hostname.c_str()));
 
   for (Socket::Address &addr : addrs) {
-    addr.set_port(lexical_cast<uint16_t>(hostname_.substr(pos + 1)));
+    addr.set_port(lexical_cast<uint16_t>(hostname.substr(pos + 1)));
     try {
-      return SendRequestToHost(addr, path, request, response);
+      return SendRequestToAddress(addr, rpc_port, path, request, response);
     } catch (runtime_error) {
       LOG(WARNING) << "Connection to " << addr.ToString() << " failed";
       continue;
     }
   }
-  throw runtime_error(StringPrintf("Unable to connect to %s", hostname_.c_str()));
+  throw runtime_error(StringPrintf("Unable to connect to %s", hostname.c_str()));
+}
+
+template<typename ResponseType>
+void StoreClient::SendRequest(const string &path, const google::protobuf::Message &request, ResponseType *response) {
+  if (address_.valid())
+    return SendRequestToAddress(address_, rpc_port_, path, request, response);
+  SendRequestToHostname(hostname_, rpc_port_, path, request, response);
 }
 
 proto::AddResponse *StoreClient::Add(const proto::AddRequest &req) {
@@ -98,32 +171,44 @@ proto::AddResponse *StoreClient::Add(const proto::AddRequest &req) {
 }
 
 proto::ListResponse *StoreClient::List(const proto::ListRequest &req) {
+  ListIterator it(this, req);
+  scoped_ptr<proto::ListResponse> output(new proto::ListResponse());
+  proto::StreamVariable variable;
+  while (it.Next(&variable))
+    output->add_stream()->mutable_variable()->CopyFrom(variable);
+  output->set_success(it.success());
+  if (!it.success())
+    output->set_errormessage(it.errormessage().empty() ? "No responses" : it.errormessage());
+  return output.release();
+}
+
+proto::GetResponse *StoreClient::Get(const proto::GetRequest &req) {
   auto &config = StoreConfig::get();
   // Send request to all storage servers
-  vector<proto::ListResponse *> responses;
+  vector<proto::GetResponse *> responses;
   BackgroundExecutor executor;
-  for (auto &server : config.server()) {
-    proto::ListResponse *response = new proto::ListResponse();
+  for (int i = 0; i < config.server_size(); i++) {
+    const proto::StoreServer &server = config.server(i);
+    proto::GetResponse *response = new proto::GetResponse();
     responses.push_back(response);
-    executor.Add(bind(&StoreClient::SendRequestToHost, this, Socket::Address(server.address()), "/list", req,
-                      response));
+    executor.Add(bind(&StoreClient::SendRequestToServer, this, server, "/get", req, response));
   }
   executor.JoinThreads();
 
-  scoped_ptr<proto::ListResponse> output(new proto::ListResponse());
+  scoped_ptr<proto::GetResponse> output(new proto::GetResponse());
   output->set_success(false);
   output->set_errormessage("No responses");
-  for (vector<proto::ListResponse *>::iterator i = responses.begin(); i != responses.end(); ++i) {
-    proto::ListResponse *response = *i;
+  for (vector<proto::GetResponse *>::iterator i = responses.begin(); i != responses.end(); ++i) {
+    proto::GetResponse *response = *i;
     if (response->success()) {
       output->set_success(true);
     } else {
       output->set_errormessage(response->errormessage());
     }
     // Copy streams from response
-    for (auto &istream : response->stream()) {
+    for (int j = 0; j < response->stream_size(); j++) {
       proto::ValueStream *stream = output->add_stream();
-      stream->CopyFrom(istream);
+      stream->CopyFrom(response->stream(j));
     }
     delete response;
     if (output->success())
@@ -132,39 +217,126 @@ proto::ListResponse *StoreClient::List(const proto::ListRequest &req) {
   return output.release();
 }
 
-proto::GetResponse *StoreClient::Get(const proto::GetRequest &req) {
+proto::LabelStatsResponse *StoreClient::LabelStats(const proto::LabelStatsRequest &req) {
   auto &config = StoreConfig::get();
   // Send request to all storage servers
-  vector<proto::GetResponse *> responses;
+  // Every server needs to send its sketch so that distinct values can be estimated across them.
+  proto::LabelStatsRequest server_req(req);
+  server_req.set_include_value_sketch(true);
+  vector<proto::LabelStatsResponse *> responses;
   BackgroundExecutor executor;
-  for (int i = 0; i < config.server_size(); i++) {
-    const proto::StoreServer &server = config.server(i);
-    proto::GetResponse *response = new proto::GetResponse();
+  for (auto &server : config.server()) {
+    proto::LabelStatsResponse *response = new proto::LabelStatsResponse();
     responses.push_back(response);
-    executor.Add(bind(&StoreClient::SendRequestToHost, this, Socket::Address(server.address()), "/get", req,
-                      response));
+    executor.Add(bind(&StoreClient::SendRequestToServer, this, server, "/label_stats", server_req, response));
   }
   executor.JoinThreads();
 
-  scoped_ptr<proto::GetResponse> output(new proto::GetResponse());
+  // Each series is only stored on one server, so series counts can be added together. Distinct values may be shared
+  // between servers, so those are estimated by merging each server's sketch.
+  struct Merged {
+    Merged() : series(0), distinct_values(0), servers(0) {}
+    uint64_t series;
+    uint64_t distinct_values;
+    uint32_t servers;
+    HyperLogLog sketch;
+    unordered_map<string, uint64_t> values;
+  };
+  unordered_map<string, Merged> labels;
+  scoped_ptr<proto::LabelStatsResponse> output(new proto::LabelStatsResponse());
   output->set_success(false);
   output->set_errormessage("No responses");
-  for (vector<proto::GetResponse *>::iterator i = responses.begin(); i != responses.end(); ++i) {
-    proto::GetResponse *response = *i;
+  for (proto::LabelStatsResponse *response : responses) {
     if (response->success()) {
       output->set_success(true);
     } else {
       output->set_errormessage(response->errormessage());
     }
-    // Copy streams from response
-    for (int j = 0; j < response->stream_size(); j++) {
-      proto::ValueStream *stream = output->add_stream();
-      stream->CopyFrom(response->stream(j));
+    for (auto &stats : response->label()) {
+      Merged &merged = labels[stats.label()];
+      merged.series += stats.series();
+      merged.distinct_values = stats.distinct_values();
+      ++merged.servers;
+      try {
+        HyperLogLog sketch;
+        sketch.FromString(stats.value_sketch());
+        merged.sketch.Merge(sketch);
+      } catch (exception &e) {
+        LOG(WARNING) << "Invalid value sketch for label " << stats.label() << ": " << e.what();
+      }
+      for (auto &value : stats.value())
+        merged.values[value.value()] += value.series();
     }
     delete response;
     if (output->success())
       output->clear_errormessage();
   }
+
+  for (auto &i : labels) {
+    proto::LabelStats *stats = output->add_label();
+    stats->set_label(i.first);
+    stats->set_series(i.second.series);
+    stats->set_distinct_values(i.second.servers == 1 ? i.second.distinct_values : i.second.sketch.Estimate());
+    if (req.include_value_sketch())
+      stats->set_value_sketch(i.second.sketch.registers());
+    vector<std::pair<uint64_t, string>> values;
+    for (auto &value : i.second.values)
+      values.push_back(std::make_pair(value.second, value.first));
+    std::sort(values.begin(), values.end(), MostSeriesFirst);
+    if (values.size() > req.max_values())
+      values.resize(req.max_values());
+    for (auto &value : values) {
+      proto::LabelValueStats *value_stats = stats->add_value();
+      value_stats->set_value(value.second);
+      value_stats->set_series(value.first);
+    }
+  }
+  std::sort(output->mutable_label()->begin(), output->mutable_label()->end(), MostValuesFirst);
+  if (req.max_labels()) {
+    while (static_cast<uint32_t>(output->label_size()) > req.max_labels())
+      output->mutable_label()->RemoveLast();
+  }
+  return output.release();
+}
+
+proto::LabelValuesResponse *StoreClient::LabelValues(const proto::LabelValuesRequest &req) {
+  auto &config = StoreConfig::get();
+  // Send request to all storage servers
+  vector<proto::LabelValuesResponse *> responses;
+  BackgroundExecutor executor;
+  for (auto &server : config.server()) {
+    proto::LabelValuesResponse *response = new proto::LabelValuesResponse();
+    responses.push_back(response);
+    executor.Add(bind(&StoreClient::SendRequestToServer, this, server, "/label_values", req, response));
+  }
+  executor.JoinThreads();
+
+  // Each series is only stored on one server, so the counts for a value can be added together. Every server returns
+  // its first max_values values in order, which includes any of the overall first max_values that it has, so the
+  // merged list is complete.
+  std::map<string, uint64_t> values;
+  scoped_ptr<proto::LabelValuesResponse> output(new proto::LabelValuesResponse());
+  output->set_success(false);
+  output->set_errormessage("No responses");
+  for (proto::LabelValuesResponse *response : responses) {
+    if (response->success()) {
+      output->set_success(true);
+    } else {
+      output->set_errormessage(response->errormessage());
+    }
+    for (auto &value : response->value())
+      values[value.value()] += value.series();
+    delete response;
+    if (output->success())
+      output->clear_errormessage();
+  }
+  for (std::map<string, uint64_t>::const_iterator i = values.begin(); i != values.end(); ++i) {
+    if (req.max_values() && static_cast<uint64_t>(output->value_size()) >= req.max_values())
+      break;
+    proto::LabelValueStats *value = output->add_value();
+    value->set_value(i->first);
+    value->set_series(i->second);
+  }
   return output.release();
 }
 
@@ -174,4 +346,188 @@ proto::StoreConfig *StoreClient::GetStoreConfig() {
   return response.release();
 }
 
+ListIterator::ListIterator(StoreClient *client, const proto::ListRequest &req)
+  : client_(client),
+    request_(req),
+    limit_(req.max_variables()),
+    returned_(0),
+    success_(false) {
+  // The total is limited here, each server is only asked for a page at a time. max_variables is left in the request
+  // for servers which don't support paging, they return everything up to it at once.
+  uint64_t page_size = request_.page_size() ? request_.page_size() : kDefaultPageSize;
+  if (limit_ && limit_ < page_size)
+    page_size = limit_;
+  request_.set_page_size(page_size);
+  request_.clear_continuation_token();
+
+  BackgroundExecutor executor;
+  for (auto &server_config : StoreConfig::get().server()) {
+    shared_ptr<Server> server(new Server());
+    server->config = server_config;
+    servers_.push_back(server);
+    executor.Add(bind(&ListIterator::FetchPage, this, server.get()));
+  }
+  executor.JoinThreads();
+  for (auto &server : servers_) {
+    CheckPage(*server);
+    Fill(server.get());
+  }
+}
+
+void ListIterator::FetchPage(Server *server) {
+  proto::ListRequest req(request_);
+  if (server->page.has_continuation_token())
+    req.set_continuation_token(server->page.continuation_token());
+  server->page.Clear();
+  server->position = 0;
+  try {
+    client_->SendRequestToServer(server->config, "/list", req, &server->page);
+  } catch (exception &e) {
+    server->page.Clear();
+    server->page.set_success(false);
+    server->page.set_errormessage(e.what());
+  }
+  if (!server->page.success() || !server->page.has_continuation_token()) {
+    server->done = true;
+    // A server which doesn't support paging returns a single page without a continuation token, which may not be in
+    // the order the pages are merged in.
+    SortListPage(&server->page);
+  }
+}
+
+void ListIterator::CheckPage(const Server &server) {
+  if (server.page.success())
+    success_ = true;
+  else
+    errormessage_ = server.page.errormessage();
+}
+
+bool ListIterator::Fill(Server *server) {
+  while (server->position >= server->page.stream_size()) {
+    if (server->done)
+      return false;
+    FetchPage(server);
+    CheckPage(*server);
+  }
+  Variable variable(server->page.stream(server->position).variable());
+  server->name = variable.variable();
+  server->key = variable.ToString();
+  return true;
+}
+
+bool ListIterator::Next(proto::StreamVariable *variable) {
+  while (!limit_ || returned_ < limit_) {
+    Server *next = NULL;
+    for (auto &server : servers_) {
+      if (server->position >= server->page.stream_size())
+        continue;
+      if (!next || server->name < next->name || (server->name == next->name && server->key < next->key))
+        next = server.get();
+    }
+    if (!next)
+      return false;
+    variable->CopyFrom(next->page.stream(next->position).variable());
+    bool duplicate = returned_ && next->key == last_key_;
+    last_key_.swap(next->key);
+    ++next->position;
+    Fill(next);
+    if (duplicate)
+      continue;
+    ++returned_;
+    return true;
+  }
+  return false;
+}
+
+AddSession::AddSession(StoreClient *client)
+  : client_(client),
+    epoch_(0),
+    registered_streams_("/openinstrument/client/store/registered-streams"),
+    reregistered_streams_("/openinstrument/client/store/reregistered-streams") {}
+
+void AddSession::Reset() {
+  epoch_ = 0;
+  series_ids_.clear();
+}
+
+bool AddSession::CanSendById(const proto::ValueStream &stream) const {
+  if (stream.mutation_size())
+    return false;
+  for (auto &value : stream.value()) {
+    if (!value.has_double_value() || value.has_string_value() || value.has_end_timestamp())
+      return false;
+  }
+  return true;
+}
+
+void AddSession::Add(const proto::AddRequest &req) {
+  vector<const proto::ValueStream *> streams;
+  streams.reserve(req.stream_size());
+  for (auto &stream : req.stream())
+    streams.push_back(&stream);
+  SendStreams(streams);
+}
+
+void AddSession::SendStreams(const vector<const proto::ValueStream *> &streams) {
+  proto::AddRequest req;
+  req.set_register_streams(true);
+  req.set_series_epoch(epoch_);
+  // Keys of the streams sent in full, in the same order as the IDs will be returned.
+  vector<string> registering;
+  // Streams sent by ID, so they can be sent again in full if the server doesn't know the ID.
+  unordered_map<uint64_t, const proto::ValueStream *> by_id;
+  for (const proto::ValueStream *stream : streams) {
+    string key = Variable(stream->variable()).ToString();
+    unordered_map<string, uint64_t>::const_iterator it = series_ids_.find(key);
+    if (it != series_ids_.end() && CanSendById(*stream)) {
+      by_id[it->second] = stream;
+      for (auto &value : stream->value()) {
+        req.add_series_id(it->second);
+        req.add_timestamp(value.timestamp());
+        req.add_double_value(value.double_value());
+      }
+      continue;
+    }
+    req.add_stream()->CopyFrom(*stream);
+    registering.push_back(key);
+  }
+  if (!req.stream_size() && !req.series_id_size())
+    return;
+
+  proto::AddResponse response;
+  client_->SendRequest("/add", req, &response);
+
+  if (response.series_epoch() != epoch_) {
+    // The server has a new set of IDs, everything that was registered before is no longer valid.
+    series_ids_.clear();
+    epoch_ = response.series_epoch();
+  }
+  for (int i = 0; i < response.series_id_size() && i < static_cast<int>(registering.size()); i++) {
+    if (!response.series_id(i))
+      continue;
+    series_ids_[registering[i]] = response.series_id(i);
+    ++registered_streams_;
+  }
+
+  // Streams with unknown IDs are sent again even if something else failed, but the failure is still reported.
+  if (response.unknown_series_id_size()) {
+    vector<const proto::ValueStream *> retry;
+    for (uint64_t id : response.unknown_series_id()) {
+      unordered_map<uint64_t, const proto::ValueStream *>::const_iterator it = by_id.find(id);
+      if (it == by_id.end())
+        continue;
+      series_ids_.erase(Variable(it->second->variable()).ToString());
+      retry.push_back(it->second);
+      by_id.erase(id);
+    }
+    VLOG(1) << "Server doesn't know " << retry.size() << " series, registering them again";
+    reregistered_streams_ += retry.size();
+    // The unknown series have been forgotten, so this will send them all in full. Any failure is thrown from here.
+    if (!retry.empty())
+      SendStreams(retry);
+  }
+  if (!response.success())
+    throw runtime_error(StringPrintf("Server Error: %s", response.errormessage().c_str()));
+}
+
 }  // namespace openinstrument
@@ -9,6 +9,7 @@
 
 #include <google/protobuf/message.h>
 #include <string>
+#include <vector>
 #include "lib/common.h"
 #include "lib/exported_vars.h"
 #include "lib/openinstrument.pb.h"
@@ -28,23 +29,136 @@ class StoreClient : private noncopyable {
   explicit StoreClient(const string &address);
   explicit StoreClient(const Socket::Address &address);
 
+  // Connect to a single storage server from the store config, using RPC if the server has an RPC port. The server's
+  // address may be a hostname.
+  explicit StoreClient(const proto::StoreServer &server);
+
   void SendRequestToHost(const Socket::Address &address, const string &path, const google::protobuf::Message &request,
                          google::protobuf::Message *response);
 
+  // Send a request to a server from the store config. This uses the server's RPC port if it has one, otherwise HTTP.
+  void SendRequestToServer(const proto::StoreServer &server, const string &path,
+                           const google::protobuf::Message &request, google::protobuf::Message *response);
+
+  // Send a request to <address>, or to <rpc_port> at the same address if it isn't 0.
+  void SendRequestToAddress(const Socket::Address &address, uint16_t rpc_port, const string &path,
+                            const google::protobuf::Message &request, google::protobuf::Message *response);
+
+  // Send a request to a "host:port" which may be a hostname, trying each of its addresses until one succeeds.
+  void SendRequestToHostname(const string &hostname, uint16_t rpc_port, const string &path,
+                             const google::protobuf::Message &request, google::protobuf::Message *response);
+
   template<typename ResponseType>
   void SendRequest(const string &path, const google::protobuf::Message &request, ResponseType *response);
 
   proto::AddResponse *Add(const proto::AddRequest &req);
+  // List up to req.max_variables() variables (or every variable if it is 0) from every storage server, merged in name
+  // and key order. The variables are fetched a page at a time with a ListIterator.
   proto::ListResponse *List(const proto::ListRequest &req);
   proto::GetResponse *Get(const proto::GetRequest &req);
+  // Label cardinality statistics combined across every storage server.
+  proto::LabelStatsResponse *LabelStats(const proto::LabelStatsRequest &req);
+  // Distinct values of a label combined across every storage server.
+  proto::LabelValuesResponse *LabelValues(const proto::LabelValuesRequest &req);
   proto::StoreConfig *GetStoreConfig();
 
  private:
   Socket::Address address_;
+  // RPC port of the server at address_, or 0 to use HTTP.
+  uint16_t rpc_port_;
   string hostname_;
   ExportedTimer request_timer_;
 };
 
+// Lists the variables matching a ListRequest across every storage server, merged into name and then key order.
+//
+// Each server is asked for a page of variables at a time, and its next page is only requested once everything from
+// the previous one has been returned, so memory use and the latency of the first result depend on the page size rather
+// than on how many variables match. If the request sets max_variables, no more than that many are returned in total.
+class ListIterator : private noncopyable {
+ public:
+  // Page size used when the request doesn't set one.
+  static const uint32_t kDefaultPageSize = 1000;
+
+  // The first page is requested from every server in parallel.
+  ListIterator(StoreClient *client, const proto::ListRequest &req);
+
+  // Set <variable> to the next variable. Returns false when there are no more.
+  bool Next(proto::StreamVariable *variable);
+
+  // True if at least one server responded successfully.
+  inline bool success() const {
+    return success_;
+  }
+
+  // The last error returned by a server.
+  inline const string &errormessage() const {
+    return errormessage_;
+  }
+
+ private:
+  struct Server {
+    Server() : position(0), done(false) {}
+    proto::StoreServer config;
+    proto::ListResponse page;
+    int position;
+    // Set once the server has no more pages.
+    bool done;
+    // Name and key of the variable at <position>, used to merge the servers.
+    string name;
+    string key;
+  };
+
+  // Request the next page from <server>. Errors are stored in the page.
+  void FetchPage(Server *server);
+
+  // Make sure the variable at <server>'s position is loaded, fetching another page if the current one has been used
+  // up. Returns false if the server has no more variables.
+  bool Fill(Server *server);
+
+  // Record whether the last page from <server> was successful.
+  void CheckPage(const Server &server);
+
+  StoreClient *client_;
+  proto::ListRequest request_;
+  // Maximum number of variables to return, 0 for no limit.
+  uint64_t limit_;
+  uint64_t returned_;
+  vector<shared_ptr<Server>> servers_;
+  bool success_;
+  string errormessage_;
+  // Key of the last variable returned, so that variables returned by more than one server are only returned once.
+  string last_key_;
+};
+
+// Sends values to a single storage server using registered series IDs.
+//
+// The first time a variable is sent, the full ValueStream is sent and the server returns an ID for it. After that only
+// the ID, timestamp and value are sent, which is much smaller than the full variable and labels. If the server no
+// longer recognises an ID (e.g. it has been restarted), the affected streams are sent again in full and re-registered.
+//
+// Only streams made up entirely of double values are sent by ID, anything else is always sent in full.
+class AddSession : private noncopyable {
+ public:
+  explicit AddSession(StoreClient *client);
+
+  // Send a batch of streams to the server. Throws runtime_error if the server can't be reached or reports an error.
+  void Add(const proto::AddRequest &req);
+
+  // Forget all registered IDs, so every stream is sent in full next time.
+  void Reset();
+
+ private:
+  void SendStreams(const vector<const proto::ValueStream *> &streams);
+  bool CanSendById(const proto::ValueStream &stream) const;
+
+  StoreClient *client_;
+  uint64_t epoch_;
+  unordered_map<string, uint64_t> series_ids_;
+  ExportedInteger registered_streams_;
+  ExportedInteger reregistered_streams_;
+};
+
 }  // namespace openinstrument
 
 #endif  // OPENINSTRUMENT_LIB_STORE_CLIENT_H_
@@ -0,0 +1,190 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/http_reply.h"
+#include "lib/http_request.h"
+#include "lib/http_server.h"
+#include "lib/openinstrument.pb.h"
+#include "lib/rpc_server.h"
+#include "lib/socket.h"
+#include "lib/store_client.h"
+#include "lib/threadpool.h"
+#include "lib/variable.h"
+
+namespace openinstrument {
+
+using http::HttpReply;
+using http::HttpRequest;
+
+class AddSessionTest : public ::testing::Test {
+ protected:
+  AddSessionTest()
+    : policy_(2, 4),
+      thread_pool_("store_client_test", policy_),
+      server_("127.0.0.1", 0, &thread_pool_),
+      epoch_(1),
+      failures_(0) {
+    server_.request_handler()->AddPath("/add$", &AddSessionTest::HandleAdd, this);
+  }
+
+  // A minimal /add handler which registers series IDs like a real store server does.
+  bool HandleAdd(const HttpRequest &request, HttpReply *reply) {
+    proto::AddRequest req;
+    if (!rpc::ParseRequest(request, &req)) {
+      reply->SetStatus(HttpReply::BAD_REQUEST);
+      return true;
+    }
+    proto::AddResponse response;
+    response.set_success(true);
+    {
+      MutexLock lock(mutex_);
+      requests_.push_back(req);
+      response.set_series_epoch(epoch_);
+      for (auto &stream : req.stream()) {
+        string key = Variable(stream.variable()).ToString();
+        uint64_t &id = ids_[key];
+        if (!id)
+          id = ids_.size();
+        if (req.register_streams())
+          response.add_series_id(id);
+        values_[key] += stream.value_size();
+      }
+      for (int i = 0; i < req.series_id_size(); i++) {
+        string key;
+        for (auto &id : ids_) {
+          if (id.second == req.series_id(i))
+            key = id.first;
+        }
+        if (key.empty() || req.series_epoch() != epoch_)
+          response.add_unknown_series_id(req.series_id(i));
+        else
+          ++values_[key];
+      }
+      if (failures_) {
+        --failures_;
+        response.set_success(false);
+        response.set_errormessage("Failed");
+      }
+    }
+    reply->SetStatus(HttpReply::OK);
+    rpc::SerializeReply(request, response, reply);
+    return true;
+  }
+
+  // Simulate the server restarting, so every ID it has handed out is unknown.
+  void Restart() {
+    MutexLock lock(mutex_);
+    ids_.clear();
+    ++epoch_;
+  }
+
+  static proto::AddRequest NewRequest(int num_streams, uint64_t timestamp) {
+    proto::AddRequest req;
+    for (int i = 0; i < num_streams; i++) {
+      proto::ValueStream *stream = req.add_stream();
+      Variable(StringPrintf("/test/add{stream=%d}", i)).ToProtobuf(stream->mutable_variable());
+      proto::Value *value = stream->add_value();
+      value->set_timestamp(timestamp);
+      value->set_double_value(i);
+    }
+    return req;
+  }
+
+  DefaultThreadPoolPolicy policy_;
+  ThreadPool thread_pool_;
+  http::HttpServer server_;
+  Mutex mutex_;
+  uint64_t epoch_;
+  // Number of requests still to fail.
+  int failures_;
+  unordered_map<string, uint64_t> ids_;
+  // Number of values received for each variable.
+  unordered_map<string, uint64_t> values_;
+  vector<proto::AddRequest> requests_;
+};
+
+TEST_F(AddSessionTest, AssignsIds) {
+  StoreClient client(server_.address());
+  AddSession session(&client);
+  session.Add(NewRequest(2, 1000));
+  ASSERT_EQ(1U, requests_.size());
+  EXPECT_TRUE(requests_[0].register_streams());
+  EXPECT_EQ(2, requests_[0].stream_size());
+  EXPECT_EQ(0, requests_[0].series_id_size());
+
+  // Once registered, only the IDs and values are sent.
+  session.Add(NewRequest(2, 2000));
+  ASSERT_EQ(2U, requests_.size());
+  EXPECT_EQ(0, requests_[1].stream_size());
+  ASSERT_EQ(2, requests_[1].series_id_size());
+  EXPECT_NE(requests_[1].series_id(0), requests_[1].series_id(1));
+  EXPECT_EQ(2000U, requests_[1].timestamp(0));
+  EXPECT_EQ(1.0, requests_[1].double_value(1));
+  EXPECT_EQ(2U, values_["/test/add{stream=0}"]);
+  EXPECT_EQ(2U, values_["/test/add{stream=1}"]);
+
+  // After Reset() every stream is sent in full again.
+  session.Reset();
+  session.Add(NewRequest(2, 3000));
+  ASSERT_EQ(3U, requests_.size());
+  EXPECT_EQ(2, requests_[2].stream_size());
+}
+
+TEST_F(AddSessionTest, RetriesUnknownIds) {
+  StoreClient client(server_.address());
+  AddSession session(&client);
+  session.Add(NewRequest(2, 1000));
+  Restart();
+
+  // The IDs are rejected, so the streams are registered again and no values are lost.
+  session.Add(NewRequest(2, 2000));
+  ASSERT_EQ(3U, requests_.size());
+  EXPECT_EQ(2, requests_[1].series_id_size());
+  EXPECT_EQ(2, requests_[2].stream_size());
+  EXPECT_EQ(2U, values_["/test/add{stream=0}"]);
+  EXPECT_EQ(2U, values_["/test/add{stream=1}"]);
+
+  // The new IDs are used from then on.
+  session.Add(NewRequest(2, 3000));
+  ASSERT_EQ(4U, requests_.size());
+  EXPECT_EQ(2, requests_[3].series_id_size());
+  EXPECT_EQ(3U, values_["/test/add{stream=1}"]);
+}
+
+TEST_F(AddSessionTest, ServerFailure) {
+  StoreClient client(server_.address());
+  AddSession session(&client);
+  failures_ = 1;
+  EXPECT_THROW(session.Add(NewRequest(1, 1000)), runtime_error);
+  session.Add(NewRequest(1, 2000));
+
+  // A failure when the unknown series are sent again is passed back.
+  Restart();
+  failures_ = 2;
+  EXPECT_THROW(session.Add(NewRequest(1, 3000)), runtime_error);
+
+  // So is a failure of the request with the unknown IDs, even though sending them again works.
+  session.Add(NewRequest(1, 4000));
+  Restart();
+  failures_ = 1;
+  size_t num_requests = requests_.size();
+  EXPECT_THROW(session.Add(NewRequest(1, 5000)), runtime_error);
+  EXPECT_EQ(num_requests + 2, requests_.size());
+}
+
+}  // namespace openinstrument
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
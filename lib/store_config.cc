@@ -40,7 +40,8 @@ StoreConfig &StoreConfig::get_manager() {
 }
 
 StoreConfig::StoreConfig(const string &filename)
-  : config_file_(filename),
+  : generation_(0),
+    config_file_(filename),
     config_thread_(NULL),
     shutdown_(false),
     config_stat_("/dev/null"),
@@ -73,12 +74,14 @@ void StoreConfig::RunCallbacks() {
 
 void StoreConfig::set_config(const proto::StoreConfig &config) {
   config_.CopyFrom(config);
+  ++generation_;
 }
 
 void StoreConfig::HandleNewConfig(const proto::StoreConfig &config) {
   VLOG(1) << "Loaded new configuration with changes";
   MutexLock lock(mutex_);
   config_.CopyFrom(config);
+  ++generation_;
   UpdateHashRing();
   RunCallbacks();
 }
@@ -47,12 +47,18 @@ class StoreConfig : private noncopyable {
   string DumpConfig() const;
   proto::StoreConfig &config();
 
+  // Incremented every time a new configuration is loaded, so users can tell when to rebuild anything derived from it.
+  inline uint64_t generation() const {
+    return generation_;
+  }
+
  private:
   StoreConfig(const string &filename);
   void ConfigThread();
   void KillConfigThread();
 
   proto::StoreConfig config_;
+  volatile uint64_t generation_;
   string config_file_;
   mutable Mutex mutex_;
   scoped_ptr<thread> config_thread_;
@@ -22,6 +22,7 @@ using std::string;
 
 class StringPiece {
  public:
+  StringPiece() : ptr_(NULL), size_(0), str_(NULL) {}
   explicit StringPiece(const string &str) : ptr_(str.data()), size_(str.size()), str_(NULL) {}
   StringPiece(const char *ptr, uint64_t size) : ptr_(ptr), size_(size), str_(NULL) {}
   StringPiece(const StringPiece &a) : ptr_(a.ptr_), size_(a.size_), str_(NULL) {}
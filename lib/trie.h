@@ -1,5 +1,12 @@
 /*
- *  -
+ * Ordered string map implemented as an adaptive radix tree.
+ *
+ * Each inner node is one of four sizes (4, 16, 48 or 256 children) and is grown or shrunk as children are added and
+ * removed, so sparse nodes stay small while dense nodes get direct indexing. Runs of bytes with only a single child
+ * are collapsed into a prefix stored on the node below them (path compression), so a long key with a unique suffix
+ * costs a single node rather than one per character.
+ *
+ * Iteration is in lexicographic key order, and find_prefix() iterates over only the keys starting with a prefix.
  *
  * Copyright 2011 David Parrish <david@dparrish.com>
  *
@@ -10,7 +17,8 @@
 #ifndef OPENINSTRUMENT_LIB_TRIE_H_
 #define OPENINSTRUMENT_LIB_TRIE_H_
 
-#include <list>
+#include <string.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include "lib/common.h"
@@ -19,7 +27,7 @@
 namespace openinstrument {
 
 template<typename T>
-class Trie {
+class Trie : private noncopyable {
  public:
   typedef string key_type;
   typedef T mapped_type;
@@ -30,284 +38,340 @@ class Trie {
   typedef const T * const_pointer;
   typedef size_t size_type;
 
+ private:
+  enum NodeType {
+    NODE4,
+    NODE16,
+    NODE48,
+    NODE256,
+  };
 
-  class TrieNode {
-   public:
-    typedef list<TrieNode *> list_type;
-    typedef typename list_type::iterator iterator;
+  struct Node {
+    explicit Node(NodeType type) : type(type), num_children(0), value(NULL) {}
 
-    TrieNode(TrieNode *parent = NULL, unsigned char character = '\0')
-      : parent(parent),
-        character(character),
-        value(NULL) {
-    }
+    const uint8_t type;
+    uint16_t num_children;
+    // Compressed path, the bytes between the parent's child pointer and this node.
+    string prefix;
+    // Value for the key which ends at this node, if there is one.
+    value_type *value;
+  };
 
-    ~TrieNode() {
-      clear();
-    }
+  // Node4 and Node16 keep their keys sorted, with the child for keys[i] in children[i].
+  struct Node4 : public Node {
+    Node4() : Node(NODE4) {}
+    unsigned char keys[4];
+    Node *children[4];
+  };
 
-    void clear() {
-      for (auto node : child_nodes)
-        delete node;
-      child_nodes.clear();
-      if (value)
-        delete value;
-      value = NULL;
-    }
+  struct Node16 : public Node {
+    Node16() : Node(NODE16) {}
+    unsigned char keys[16];
+    Node *children[16];
+  };
 
-    inline bool set_value(value_type *value) {
-      bool ret = false;
-      if (this->value) {
-        delete this->value;
-        ret = true;
-      }
-      this->value = value;
-      return ret;
+  // index[c] is one more than the position in children of the child for byte c, or 0 if there is no child.
+  struct Node48 : public Node {
+    Node48() : Node(NODE48) {
+      memset(index, 0, sizeof(index));
+      memset(children, 0, sizeof(children));
     }
+    unsigned char index[256];
+    Node *children[48];
+  };
 
-    inline TrieNode *get_node(unsigned char c) {
-      iterator i;
-      for (i = child_nodes.begin(); i != child_nodes.end(); ++i) {
-        if ((*i)->character == c)
-          return (*i);
-        if ((*i)->character > c) {
-          TrieNode *node = new TrieNode(this, c);
-          child_nodes.insert(i, node);
-          return node;
-        }
-      }
-      TrieNode *node = new TrieNode(this, c);
-      child_nodes.push_back(node);
-      return node;
+  struct Node256 : public Node {
+    Node256() : Node(NODE256) {
+      memset(children, 0, sizeof(children));
     }
-
-    TrieNode *parent;
-    const unsigned char character;
-    value_type *value;
-    list_type child_nodes;
-
-    friend class TrieIterator;
+    Node *children[256];
   };
 
-
+ public:
   class TrieIterator {
    public:
     typedef T value_type;
     typedef ptrdiff_t difference_type;
     typedef T * pointer;
-    typedef T reference;
+    typedef T & reference;
     typedef std::forward_iterator_tag iterator_category;
 
-    explicit TrieIterator(TrieNode *curr, string key = "")
-      : curr_(curr),
-        returned_value(false) {
-      if (!curr)
-        return;
-      if (curr_->character)
-        key_ = curr_->character;
-      if (key.size())
-        key_ = key;
-      child_nodes_iterator = curr_->child_nodes.begin();
-      // Find the first leaf if the current node isn't a leaf
-      if (!curr->value)
-        ++(*this);
-    }
+    TrieIterator() : curr_(NULL) {}
 
     void operator++() {
-      while (curr_) {
-        if (!returned_value && child_nodes_iterator == curr_->child_nodes.begin() && curr_->value) {
-          returned_value = true;
-          break;
-        }
-        if (child_nodes_iterator == curr_->child_nodes.end()) {
-          // Move back up the tree
-          curr_ = curr_->parent;
-          if (!curr_ || !iterators.size()) {
-            // Gone all the way back to the tree root, there's nothing left
-            curr_ = NULL;
-            iterators.clear();
-            key_ = "";
-            break;
-          }
-          child_nodes_iterator = iterators.back();
-          ++child_nodes_iterator;
-          iterators.pop_back();
-          key_.resize(key_.size() - 1);
-          continue;
-        }
-        TrieNode *nextnode = *child_nodes_iterator;
-        if (nextnode) {
-          curr_ = nextnode;
-          iterators.push_back(child_nodes_iterator);
-          child_nodes_iterator = curr_->child_nodes.begin();
-          key_ += curr_->character;
-          returned_value = false;
-          continue;
-        } else {
-          ++child_nodes_iterator;
-        }
-      }
+      Next();
     }
 
-    bool operator==(const TrieIterator &other) {
-      if (curr_ == other.curr_ && key_ == other.key_)
-        return true;
-      return false;
+    bool operator==(const TrieIterator &other) const {
+      return curr_ == other.curr_;
     }
 
-    bool operator!=(const TrieIterator &other) {
-      if (curr_ == other.curr_ && key_ == other.key_)
-        return false;
-      return true;
+    bool operator!=(const TrieIterator &other) const {
+      return curr_ != other.curr_;
     }
 
     const string &key() const {
       return key_;
     }
 
-    T &operator*() {
+    T &operator*() const {
       if (!curr_ || !curr_->value)
         throw out_of_range("No current value");
       return *curr_->value;
     }
 
-    T *operator->() {
+    T *operator->() const {
       if (!curr_)
         return NULL;
       return curr_->value;
     }
 
    private:
-    void erase() {
-      if (!curr_)
+    struct Frame {
+      Node *node;
+      // Position of the next child to visit. For Node4 and Node16 this is an index into the children, for Node48 and
+      // Node256 it is the next key byte.
+      int position;
+      // Length of the key up to and including this node's prefix.
+      size_t key_size;
+    };
+
+    // Start iterating at <node>, whose key up to but not including its prefix is <key>. Only keys in the subtree below
+    // <node> are visited.
+    TrieIterator(Node *node, const string &key) : curr_(NULL), key_(key) {
+      if (!node)
         return;
-      curr_->set_value(NULL);
+      if (!Descend(node))
+        Next();
     }
 
-    TrieNode *curr_;
-    typename TrieNode::iterator child_nodes_iterator;
-    list<typename TrieNode::iterator> iterators;
+    // Push <node> onto the stack. Returns true if the node has a value, making it the current item.
+    bool Descend(Node *node) {
+      key_ += node->prefix;
+      Frame frame = { node, 0, key_.size() };
+      stack_.push_back(frame);
+      if (node->value) {
+        curr_ = node;
+        return true;
+      }
+      return false;
+    }
+
+    void Next() {
+      curr_ = NULL;
+      while (!stack_.empty()) {
+        Frame &frame = stack_.back();
+        unsigned char byte;
+        Node *child = NextChild(frame.node, &frame.position, &byte);
+        if (!child) {
+          stack_.pop_back();
+          continue;
+        }
+        key_.resize(frame.key_size);
+        key_ += byte;
+        if (Descend(child))
+          return;
+      }
+      key_.clear();
+    }
+
+    vector<Frame> stack_;
+    Node *curr_;
     string key_;
-    bool returned_value;
 
     friend class Trie;
   };
 
+  typedef TrieIterator iterator;
+  typedef TrieIterator const_iterator;
+
+  Trie() : size_(0), root_(new Node4()) {}
 
-  Trie()
-    : size_(0),
-      root_(NULL, 0) {
+  ~Trie() {
+    FreeNode(root_);
   }
 
-  typedef TrieIterator iterator;
-  typedef const iterator const_iterator;
-
   T &operator[](const key_type &key) {
-    iterator it = find(key);
-    if (it == end())
+    Node *node = FindNode(key);
+    if (!node)
       throw out_of_range("Key not found in Trie");
-    return *it;
+    return *node->value;
   }
 
+  // Add a new value, replacing any existing value with the same key.
   void insert(const key_type &key, const_reference val) {
-    list<unsigned char> keychars;
-    for (unsigned char c : key)
-      keychars.push_back(c);
-    TrieNode *p = &root_;
-    while (keychars.size() && p) {
-      if (keychars.size() == 1) {
-        p = p->get_node(keychars.front());
-        if (!p->set_value(new value_type(val)))
+    Node **ref = &root_;
+    size_t depth = 0;
+    while (true) {
+      Node *node = *ref;
+      size_t match = 0;
+      while (match < node->prefix.size() && depth + match < key.size() && node->prefix[match] == key[depth + match])
+        ++match;
+
+      if (match < node->prefix.size()) {
+        // The key diverges part way through this node's prefix, so split the prefix with a new parent node.
+        Node4 *parent = new Node4();
+        parent->prefix = node->prefix.substr(0, match);
+        unsigned char byte = node->prefix[match];
+        node->prefix.erase(0, match + 1);
+        InsertChild(parent, byte, node);
+        *ref = parent;
+        depth += match;
+        if (depth == key.size())
+          parent->value = new value_type(val);
+        else
+          AddChild(ref, key[depth], NewLeaf(key, depth + 1, val));
+        ++size_;
+        return;
+      }
+
+      depth += match;
+      if (depth == key.size()) {
+        if (node->value) {
+          *node->value = val;
+        } else {
+          node->value = new value_type(val);
           ++size_;
+        }
         return;
-      } else {
-        p = p->get_node(keychars.front());
       }
-      keychars.pop_front();
+
+      Node **child = FindChild(node, key[depth]);
+      if (!child) {
+        AddChild(ref, key[depth], NewLeaf(key, depth + 1, val));
+        ++size_;
+        return;
+      }
+      ref = child;
+      ++depth;
     }
-    throw runtime_error("Trie::insert fell through the loop");
   }
 
   void erase(const key_type &key) {
-    iterator it = find(key);
-    if (it != end())
-      erase(it);
+    if (Erase(&root_, key, 0))
+      --size_;
   }
 
   void erase(iterator &it) {
     if (it == end())
       return;
-    it.erase();
-    --size_;
+    string key = it.key();
+    it = end();
+    erase(key);
   }
 
   void clear() {
-    root_.clear();
+    FreeNode(root_);
+    root_ = new Node4();
     size_ = 0;
   }
 
-  iterator find(const key_type &key) {
-    size_t key_index = 0;
-    TrieNode *curr = &root_;
-    while (curr) {
-      if (key_index == key.size()) {
-        // Last character
-        if (!curr->value)
-          return end();
-        // key_index has already been incremented past the end of the string
-        if (curr->character == key[key_index - 1])
-          return TrieIterator(curr, key);
+  // Return an iterator to the item with <key>. Incrementing the iterator continues through the rest of the keys in
+  // order.
+  iterator find(const key_type &key) const {
+    iterator it;
+    Node *node = root_;
+    size_t depth = 0;
+    while (true) {
+      if (key.compare(depth, node->prefix.size(), node->prefix) != 0)
         return end();
-      }
-      typename TrieNode::iterator i;
-      for (i = curr->child_nodes.begin(); i != curr->child_nodes.end(); ++i) {
-        if ((*i)->character > key[key_index])
+      it.key_ += node->prefix;
+      depth += node->prefix.size();
+      typename iterator::Frame frame = { node, 0, it.key_.size() };
+      if (depth == key.size()) {
+        if (!node->value)
           return end();
-        if ((*i)->character == key[key_index])
-          break;
+        it.stack_.push_back(frame);
+        it.curr_ = node;
+        return it;
       }
-      if (i == curr->child_nodes.end())
+      unsigned char byte = key[depth];
+      Node **child = FindChild(node, byte);
+      if (!child)
         return end();
-      curr = (*i);
-      key_index++;
+      frame.position = ChildPosition(node, byte) + 1;
+      it.stack_.push_back(frame);
+      it.key_ += byte;
+      node = *child;
+      ++depth;
+    }
+  }
+
+  // Return an iterator to the first item with a key which is not less than <key>, or end() if there is none.
+  // Incrementing the iterator continues through the rest of the keys in order.
+  iterator lower_bound(const key_type &key) const {
+    iterator it;
+    Node *node = root_;
+    size_t depth = 0;
+    while (true) {
+      int cmp = key.compare(depth, node->prefix.size(), node->prefix);
+      if (cmp < 0) {
+        // Every key below this node is greater than <key>.
+        if (!it.Descend(node))
+          it.Next();
+        return it;
+      }
+      if (cmp > 0) {
+        // Every key below this node is less than <key>, carry on with the parent's following children.
+        it.Next();
+        return it;
+      }
+      it.key_ += node->prefix;
+      depth += node->prefix.size();
+      typename iterator::Frame frame = { node, 0, it.key_.size() };
+      if (depth == key.size()) {
+        it.stack_.push_back(frame);
+        if (node->value)
+          it.curr_ = node;
+        else
+          it.Next();
+        return it;
+      }
+      unsigned char byte = key[depth];
+      Node **child = FindChild(node, byte);
+      frame.position = ChildPosition(node, byte) + (child ? 1 : 0);
+      it.stack_.push_back(frame);
+      if (!child) {
+        it.Next();
+        return it;
+      }
+      it.key_ += byte;
+      node = *child;
+      ++depth;
     }
-    return end();
   }
 
   // Return an iterator to the first item where the key starts with <prefix>.
   // The iterator will only iterate through the branch that contains the prefix so every returned item should match the
   // prefix.
-  iterator find_prefix(const key_type &prefix) {
-    size_t key_index = 0;
-    TrieNode *curr = &root_;
-    while (curr) {
-      if (key_index == prefix.size()) {
-        // key_index has already been incremented past the end of the string
-        if (curr->character == prefix[key_index - 1])
-          return TrieIterator(curr, prefix);
-        return end();
-      }
-      typename TrieNode::iterator i;
-      for (i = curr->child_nodes.begin(); i != curr->child_nodes.end(); ++i) {
-        if ((*i)->character > prefix[key_index])
+  iterator find_prefix(const key_type &prefix) const {
+    Node *node = root_;
+    size_t depth = 0;
+    while (true) {
+      size_t remaining = prefix.size() - depth;
+      if (remaining <= node->prefix.size()) {
+        // The prefix ends within this node, so everything below it matches.
+        if (prefix.compare(depth, remaining, node->prefix, 0, remaining) != 0)
           return end();
-        if ((*i)->character == prefix[key_index])
-          break;
+        return TrieIterator(node, prefix.substr(0, depth));
       }
-      if (i == curr->child_nodes.end())
+      if (prefix.compare(depth, node->prefix.size(), node->prefix) != 0)
+        return end();
+      depth += node->prefix.size();
+      Node **child = FindChild(node, prefix[depth]);
+      if (!child)
         return end();
-      curr = (*i);
-      key_index++;
+      node = *child;
+      ++depth;
     }
-    return end();
   }
 
   iterator begin() const {
-    return TrieIterator(&root_);
+    return TrieIterator(root_, "");
   }
 
   iterator end() const {
-    return TrieIterator(NULL);
+    return TrieIterator();
   }
 
   inline bool empty() const {
@@ -319,11 +383,299 @@ class Trie {
   }
 
  private:
+  // Create a node with no children holding <val>, for the part of <key> after <depth>.
+  static Node *NewLeaf(const key_type &key, size_t depth, const_reference val) {
+    Node4 *leaf = new Node4();
+    leaf->prefix = key.substr(depth);
+    leaf->value = new value_type(val);
+    return leaf;
+  }
+
+  // Delete a node and everything below it.
+  static void FreeNode(Node *node) {
+    if (!node)
+      return;
+    int position = 0;
+    unsigned char byte;
+    while (Node *child = NextChild(node, &position, &byte))
+      FreeNode(child);
+    delete node->value;
+    DeleteNode(node);
+  }
+
+  // Delete a single node without touching its children.
+  static void DeleteNode(Node *node) {
+    switch (node->type) {
+      case NODE4:
+        delete static_cast<Node4 *>(node);
+        break;
+      case NODE16:
+        delete static_cast<Node16 *>(node);
+        break;
+      case NODE48:
+        delete static_cast<Node48 *>(node);
+        break;
+      case NODE256:
+        delete static_cast<Node256 *>(node);
+        break;
+    }
+  }
+
+  // Move the prefix, value and children of <from> to the empty node <to>, then delete <from>.
+  template<typename NodeT>
+  static NodeT *MoveNode(Node *from, NodeT *to) {
+    to->prefix.swap(from->prefix);
+    to->value = from->value;
+    from->value = NULL;
+    int position = 0;
+    unsigned char byte;
+    while (Node *child = NextChild(from, &position, &byte))
+      InsertChild(to, byte, child);
+    DeleteNode(from);
+    return to;
+  }
+
+  // Return the location of the pointer to the child for <byte>, or NULL if there is none.
+  static Node **FindChild(Node *node, unsigned char byte) {
+    switch (node->type) {
+      case NODE4: {
+        Node4 *n = static_cast<Node4 *>(node);
+        for (int i = 0; i < n->num_children; i++) {
+          if (n->keys[i] == byte)
+            return &n->children[i];
+        }
+        return NULL;
+      }
+      case NODE16: {
+        Node16 *n = static_cast<Node16 *>(node);
+        unsigned char *pos = std::lower_bound(n->keys, n->keys + n->num_children, byte);
+        if (pos == n->keys + n->num_children || *pos != byte)
+          return NULL;
+        return &n->children[pos - n->keys];
+      }
+      case NODE48: {
+        Node48 *n = static_cast<Node48 *>(node);
+        if (!n->index[byte])
+          return NULL;
+        return &n->children[n->index[byte] - 1];
+      }
+      case NODE256: {
+        Node256 *n = static_cast<Node256 *>(node);
+        if (!n->children[byte])
+          return NULL;
+        return &n->children[byte];
+      }
+    }
+    return NULL;
+  }
+
+  // Return the iteration position of the existing child for <byte>, as used by NextChild().
+  static int ChildPosition(Node *node, unsigned char byte) {
+    if (node->type == NODE4 || node->type == NODE16) {
+      unsigned char *keys = node->type == NODE4 ? static_cast<Node4 *>(node)->keys : static_cast<Node16 *>(node)->keys;
+      return std::lower_bound(keys, keys + node->num_children, byte) - keys;
+    }
+    return byte;
+  }
+
+  // Return the next child at or after <position> in key order, updating <position> to point after it and setting
+  // <byte> to its key. Returns NULL when there are no more children.
+  static Node *NextChild(Node *node, int *position, unsigned char *byte) {
+    switch (node->type) {
+      case NODE4: {
+        Node4 *n = static_cast<Node4 *>(node);
+        if (*position >= n->num_children)
+          return NULL;
+        *byte = n->keys[*position];
+        return n->children[(*position)++];
+      }
+      case NODE16: {
+        Node16 *n = static_cast<Node16 *>(node);
+        if (*position >= n->num_children)
+          return NULL;
+        *byte = n->keys[*position];
+        return n->children[(*position)++];
+      }
+      case NODE48: {
+        Node48 *n = static_cast<Node48 *>(node);
+        while (*position < 256) {
+          int i = (*position)++;
+          if (n->index[i]) {
+            *byte = i;
+            return n->children[n->index[i] - 1];
+          }
+        }
+        return NULL;
+      }
+      case NODE256: {
+        Node256 *n = static_cast<Node256 *>(node);
+        while (*position < 256) {
+          int i = (*position)++;
+          if (n->children[i]) {
+            *byte = i;
+            return n->children[i];
+          }
+        }
+        return NULL;
+      }
+    }
+    return NULL;
+  }
+
+  // Insert into a sorted key array. The caller must make sure there is room.
+  template<typename NodeT>
+  static void InsertSorted(NodeT *n, unsigned char byte, Node *child) {
+    int pos = std::lower_bound(n->keys, n->keys + n->num_children, byte) - n->keys;
+    memmove(n->keys + pos + 1, n->keys + pos, n->num_children - pos);
+    memmove(n->children + pos + 1, n->children + pos, (n->num_children - pos) * sizeof(Node *));
+    n->keys[pos] = byte;
+    n->children[pos] = child;
+    ++n->num_children;
+  }
+
+  // Add a child to a node which is known to have room for it.
+  static void InsertChild(Node *node, unsigned char byte, Node *child) {
+    switch (node->type) {
+      case NODE4:
+        InsertSorted(static_cast<Node4 *>(node), byte, child);
+        break;
+      case NODE16:
+        InsertSorted(static_cast<Node16 *>(node), byte, child);
+        break;
+      case NODE48: {
+        Node48 *n = static_cast<Node48 *>(node);
+        int slot = 0;
+        while (n->children[slot])
+          ++slot;
+        n->children[slot] = child;
+        n->index[byte] = slot + 1;
+        ++n->num_children;
+        break;
+      }
+      case NODE256:
+        static_cast<Node256 *>(node)->children[byte] = child;
+        ++node->num_children;
+        break;
+    }
+  }
+
+  // Add a child to the node at <ref>, replacing it with a larger node if it is full.
+  static void AddChild(Node **ref, unsigned char byte, Node *child) {
+    Node *node = *ref;
+    if (node->type == NODE4 && node->num_children == 4)
+      node = MoveNode(node, new Node16());
+    else if (node->type == NODE16 && node->num_children == 16)
+      node = MoveNode(node, new Node48());
+    else if (node->type == NODE48 && node->num_children == 48)
+      node = MoveNode(node, new Node256());
+    *ref = node;
+    InsertChild(node, byte, child);
+  }
+
+  // Remove the child for <byte> from the node at <ref>, replacing it with a smaller node if it has become sparse.
+  static void RemoveChild(Node **ref, unsigned char byte) {
+    Node *node = *ref;
+    switch (node->type) {
+      case NODE4:
+      case NODE16: {
+        unsigned char *keys = node->type == NODE4 ? static_cast<Node4 *>(node)->keys :
+                                                    static_cast<Node16 *>(node)->keys;
+        Node **children = node->type == NODE4 ? static_cast<Node4 *>(node)->children :
+                                                static_cast<Node16 *>(node)->children;
+        int pos = std::lower_bound(keys, keys + node->num_children, byte) - keys;
+        memmove(keys + pos, keys + pos + 1, node->num_children - pos - 1);
+        memmove(children + pos, children + pos + 1, (node->num_children - pos - 1) * sizeof(Node *));
+        --node->num_children;
+        if (node->type == NODE16 && node->num_children <= 3)
+          *ref = MoveNode(node, new Node4());
+        break;
+      }
+      case NODE48: {
+        Node48 *n = static_cast<Node48 *>(node);
+        n->children[n->index[byte] - 1] = NULL;
+        n->index[byte] = 0;
+        --n->num_children;
+        if (n->num_children <= 12)
+          *ref = MoveNode(node, new Node16());
+        break;
+      }
+      case NODE256: {
+        Node256 *n = static_cast<Node256 *>(node);
+        n->children[byte] = NULL;
+        --n->num_children;
+        if (n->num_children <= 37)
+          *ref = MoveNode(node, new Node48());
+        break;
+      }
+    }
+  }
+
+  // Remove <key> from the subtree at <ref>, which starts at <depth> in the key. Returns false if the key wasn't found.
+  // Nodes left with no value and no children are deleted (leaving *ref NULL), and nodes left with no value and a
+  // single child are merged into that child.
+  bool Erase(Node **ref, const key_type &key, size_t depth) {
+    Node *node = *ref;
+    if (key.compare(depth, node->prefix.size(), node->prefix) != 0)
+      return false;
+    depth += node->prefix.size();
+    if (depth == key.size()) {
+      if (!node->value)
+        return false;
+      delete node->value;
+      node->value = NULL;
+    } else {
+      unsigned char byte = key[depth];
+      Node **child = FindChild(node, byte);
+      if (!child || !Erase(child, key, depth + 1))
+        return false;
+      if (!*child)
+        RemoveChild(ref, byte);
+    }
+
+    node = *ref;
+    if (node == root_ || node->value || node->num_children > 1)
+      return true;
+    if (!node->num_children) {
+      DeleteNode(node);
+      *ref = NULL;
+      return true;
+    }
+    int position = 0;
+    unsigned char byte;
+    Node *child = NextChild(node, &position, &byte);
+    string prefix;
+    prefix.reserve(node->prefix.size() + 1 + child->prefix.size());
+    prefix += node->prefix;
+    prefix += byte;
+    prefix += child->prefix;
+    child->prefix.swap(prefix);
+    DeleteNode(node);
+    *ref = child;
+    return true;
+  }
+
+  Node *FindNode(const key_type &key) const {
+    Node *node = root_;
+    size_t depth = 0;
+    while (node) {
+      if (key.compare(depth, node->prefix.size(), node->prefix) != 0)
+        return NULL;
+      depth += node->prefix.size();
+      if (depth == key.size())
+        return node->value ? node : NULL;
+      Node **child = FindChild(node, key[depth]);
+      if (!child)
+        return NULL;
+      node = *child;
+      ++depth;
+    }
+    return NULL;
+  }
+
   size_type size_;
-  TrieNode root_;
+  Node *root_;
 };
 
-
 }  // namespace openinstrument
 
-#endif  // _OPENINSTRUMENT_LIB_PROTOBUF_H_
+#endif  // OPENINSTRUMENT_LIB_TRIE_H_
@@ -7,6 +7,7 @@
  *
  */
 
+#include <map>
 #include <string>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
@@ -114,6 +115,116 @@ TEST_F(TrieTest, SquareBrackets) {
   EXPECT_THROW(trie["test value 1"], out_of_range);
 }
 
+TEST_F(TrieTest, PrefixKeys) {
+  // Keys which are prefixes of other keys, and keys which split compressed paths
+  Trie<string> trie;
+  trie.insert("/openinstrument/test/key10", "10");
+  trie.insert("/openinstrument/test/key1", "1");
+  trie.insert("/openinstrument/test/key", "key");
+  trie.insert("/openinstrument/test/kez", "kez");
+  trie.insert("", "empty");
+  EXPECT_EQ(5UL, trie.size());
+  EXPECT_EQ("empty", trie[""]);
+  EXPECT_EQ("key", trie["/openinstrument/test/key"]);
+  EXPECT_EQ("1", trie["/openinstrument/test/key1"]);
+  EXPECT_EQ("10", trie["/openinstrument/test/key10"]);
+  EXPECT_TRUE(trie.find("/openinstrument/test/ke") == trie.end());
+  EXPECT_TRUE(trie.find("/openinstrument/test/key100") == trie.end());
+
+  string keys;
+  for (Trie<string>::iterator i = trie.begin(); i != trie.end(); ++i)
+    keys += "[" + i.key() + "]";
+  EXPECT_EQ("[][/openinstrument/test/key][/openinstrument/test/key1][/openinstrument/test/key10]"
+            "[/openinstrument/test/kez]", keys);
+
+  // Iteration continues in order from a found key
+  Trie<string>::iterator it = trie.find("/openinstrument/test/key1");
+  ++it;
+  EXPECT_EQ("/openinstrument/test/key10", it.key());
+  ++it;
+  EXPECT_EQ("/openinstrument/test/kez", it.key());
+  ++it;
+  EXPECT_TRUE(it == trie.end());
+
+  // A prefix ending part way through a compressed path
+  keys.clear();
+  for (Trie<string>::iterator i = trie.find_prefix("/openinstrument/te"); i != trie.end(); ++i)
+    keys += "[" + *i + "]";
+  EXPECT_EQ("[key][1][10][kez]", keys);
+  EXPECT_TRUE(trie.find_prefix("/openinstrument/tx") == trie.end());
+  EXPECT_TRUE(trie.find_prefix("/openinstrument/test/key100") == trie.end());
+
+  trie.erase("/openinstrument/test/key1");
+  EXPECT_EQ(4UL, trie.size());
+  EXPECT_EQ("10", trie["/openinstrument/test/key10"]);
+  trie.erase("/openinstrument/test/key");
+  trie.erase("/openinstrument/test/kez");
+  EXPECT_EQ(2UL, trie.size());
+  EXPECT_EQ("10", trie["/openinstrument/test/key10"]);
+  EXPECT_EQ("empty", trie[""]);
+}
+
+TEST_F(TrieTest, MatchesMap) {
+  // Insert and erase enough keys to grow and shrink every node size, and check against std::map
+  Trie<int> trie;
+  std::map<string, int> map;
+  uint32_t seed = 1;
+  for (int i = 0; i < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    string key = StringPrintf("/openinstrument/%c/%u", static_cast<char>(seed >> 24), (seed >> 8) % 500);
+    if ((seed >> 4) % 3 == 0) {
+      trie.erase(key);
+      map.erase(key);
+    } else {
+      trie.insert(key, i);
+      map[key] = i;
+    }
+  }
+  ASSERT_EQ(map.size(), trie.size());
+  std::map<string, int>::const_iterator m = map.begin();
+  for (Trie<int>::iterator i = trie.begin(); i != trie.end(); ++i, ++m) {
+    ASSERT_TRUE(m != map.end());
+    EXPECT_EQ(m->first, i.key());
+    EXPECT_EQ(m->second, *i);
+  }
+  EXPECT_TRUE(m == map.end());
+
+  for (m = map.begin(); m != map.end(); ++m)
+    trie.erase(m->first);
+  EXPECT_EQ(0UL, trie.size());
+  EXPECT_TRUE(trie.begin() == trie.end());
+}
+
+TEST_F(TrieTest, LowerBound) {
+  Trie<int> trie;
+  std::map<string, int> map;
+  uint32_t seed = 1;
+  for (int i = 0; i < 2000; i++) {
+    seed = seed * 1103515245 + 12345;
+    string key = StringPrintf("/openinstrument/%c/%u", static_cast<char>('a' + (seed >> 24) % 60), (seed >> 8) % 50);
+    trie.insert(key, i);
+    map[key] = i;
+  }
+  EXPECT_TRUE(trie.lower_bound("") == trie.begin());
+  EXPECT_TRUE(trie.lower_bound("/openinstrument0") == trie.end());
+
+  // Search for keys which are present, keys between others and keys which end part way through a compressed path,
+  // then check the rest of the iteration matches std::map.
+  for (int i = 0; i < 500; i++) {
+    seed = seed * 1103515245 + 12345;
+    string key = StringPrintf("/openinstrument/%c/%u", static_cast<char>('a' + (seed >> 24) % 64), (seed >> 8) % 60);
+    key.resize(key.size() - (seed >> 4) % 4);
+    Trie<int>::iterator t = trie.lower_bound(key);
+    std::map<string, int>::const_iterator m = map.lower_bound(key);
+    for (; m != map.end(); ++m, ++t) {
+      ASSERT_TRUE(t != trie.end()) << key;
+      ASSERT_EQ(m->first, t.key()) << key;
+      EXPECT_EQ(m->second, *t);
+    }
+    EXPECT_TRUE(t == trie.end()) << key;
+  }
+}
+
 }  // namespace
 
 int main(int argc, char **argv) {
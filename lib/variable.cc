@@ -7,65 +7,107 @@
  *
  */
 
+#include <string.h>
 #include <map>
 #include <string>
-#include <boost/tokenizer.hpp>
 #include "lib/common.h"
+#include "lib/hash.h"
 #include "lib/openinstrument.pb.h"
 #include "lib/protobuf.h"
 #include "lib/string.h"
 #include "lib/variable.h"
+#include "lib/variable_matcher.h"
 
 namespace openinstrument {
 
-void Variable::FromString(const string &input) {
-  size_t pos = input.find('{');
-  if (pos == string::npos) {
-    variable_ = input;
-    labels_.empty();
+void Variable::FromString(const StringPiece &input) {
+  const char *p = input.data();
+  const char *end = p + input.size();
+  const char *brace = static_cast<const char *>(memchr(p, '{', input.size()));
+  labels_.clear();
+  if (!brace) {
+    variable_.assign(p, end);
+    UpdateKey();
     return;
   }
-  variable_ = input.substr(0, pos);
+  variable_.assign(p, brace);
   type_ = proto::StreamVariable::UNKNOWN;
-  string labelstring = input.substr(pos + 1, input.size() - pos - 2);  // Lose the trailing }
+  p = brace + 1;
+  if (end > p)
+    --end;  // Lose the trailing }
 
-  typedef boost::tokenizer<boost::escaped_list_separator<char>> Tokenizer;
-  Tokenizer tokens(labelstring);
-  for (Tokenizer::iterator it = tokens.begin(); it != tokens.end(); ++it) {
-    string lv(*it);
-    size_t pos = lv.find("=");
-    if (pos == string::npos) {
-      LOG(WARNING) << "Invalid variable label \"" << lv << "\", does not contain '='";
+  // Each comma-separated item is split on its first '=' into the label and value, which are built up directly so that
+  // quotes and escapes can be dropped without any intermediate strings.
+  string label, value;
+  bool more = p < end;
+  while (more) {
+    more = false;
+    label.clear();
+    value.clear();
+    string *output = &label;
+    bool quoted = false;
+    for (; p < end; ++p) {
+      char c = *p;
+      if (c == '\\') {
+        c = ++p == end ? '\0' : *p;
+        if (c == 'n') {
+          c = '\n';
+        } else if (c != '"' && c != ',' && c != '\\') {
+          // Leave the variable consistent with whatever was parsed before the error.
+          UpdateKey();
+          throw runtime_error(p == end ? "Invalid variable, cannot end with escape" :
+                                         "Invalid variable, unknown escape sequence");
+        }
+        output->push_back(c);
+      } else if (c == ',' && !quoted) {
+        // A trailing comma still means there is another (empty) item.
+        ++p;
+        more = true;
+        break;
+      } else if (c == '"') {
+        quoted = !quoted;
+      } else if (c == '=' && output == &label) {
+        output = &value;
+      } else {
+        output->push_back(c);
+      }
+    }
+    if (output == &label) {
+      LOG(WARNING) << "Invalid variable label \"" << label << "\", does not contain '='";
       continue;
     }
-    string label = lv.substr(0, pos);
-    string value = lv.substr(pos + 1);
-    SetLabel(label, value);
+    labels_[label].swap(value);
   }
+  UpdateKey();
 }
 
-const string Variable::ToString() const {
-  string output = variable_;
+void Variable::UpdateKey() {
+  size_t size = variable_.size() + 2;
+  for (MapType::const_iterator i = labels_.begin(); i != labels_.end(); ++i)
+    size += i->first.size() + i->second.size() + 4;
+  key_.clear();
+  key_.reserve(size);
+  key_ += variable_;
   if (labels_.size()) {
-    output += "{";
+    key_ += "{";
     for (MapType::const_iterator i = labels_.begin(); i != labels_.end(); ++i) {
       if (i->second.empty())
         continue;
       if (i != labels_.begin())
-        output += ",";
-      output += i->first;
-      output += "=";
+        key_ += ",";
+      key_ += i->first;
+      key_ += "=";
       if (ShouldQuoteValue(i->second)) {
-        output += "\"";
-        output += QuoteValue(i->second);
-        output += "\"";
+        key_ += "\"";
+        QuoteValue(i->second, &key_);
+        key_ += "\"";
       } else {
-        output += i->second;
+        key_ += i->second;
       }
     }
-    output += "}";
+    key_ += "}";
   }
-  return output;
+  hash_ = key_.empty() ? 0 : Hash::Hash64(key_);
 }
 
 bool Variable::IsValueChar(const char p) const {
@@ -88,62 +130,26 @@ bool Variable::ShouldQuoteValue(const string &input) const {
   return false;
 }
 
-string Variable::QuoteValue(const string &input) const {
-  string output;
-  output.reserve(input.size());
+void Variable::QuoteValue(const string &input, string *output) const {
   for (const char *p = input.data(); p < input.data() + input.size(); p++) {
     if (IsValueChar(*p)) {
-      output += *p;
+      *output += *p;
     } else if (IsValueQuoteChar(*p)) {
-      output += '\\';
-      output += *p;
+      *output += '\\';
+      *output += *p;
     } else {
-      output += *p;
+      *output += *p;
     }
   }
-  return output;
 }
 
 bool Variable::Matches(const Variable &search) const {
-  if (search.variable_[search.variable_.size() - 1] == '*') {
-    // Compare up to the trailing *
-    if (variable_.substr(0, search.variable_.size() - 1) != search.variable_.substr(0, search.variable_.size() - 1))
-      return false;
-  } else {
-    if (search.variable_ != variable_)
-      return false;
-  }
-  for (MapType::const_iterator i = search.labels_.begin(); i != search.labels_.end(); ++i) {
-    if (i->second == "*") {
-      if (!HasLabel(i->first))
-        return false;
-    } else if (i->second[0] == '/' && i->second[i->second.size() - 1] == '/' && i->second.size() > 2) {
-      // It's a regex match
-      boost::regex regex(i->second.substr(1, i->second.size() - 2));
-      if (!boost::regex_match(GetLabel(i->first), regex))
-        return false;
-    } else if (i->second != GetLabel(i->first)) {
-      // Straight string match
-      return false;
-    }
-  }
-  return true;
+  // Callers checking one search against many variables should keep a VariableMatcher instead.
+  return VariableMatcher(search).Matches(*this);
 }
 
-bool Variable::equals(const Variable &search) const {
-  if (search.variable_ != variable_)
-    return false;
-  if (search.labels_.size() != labels_.size())
-    return false;
-  for (MapType::const_iterator i = search.labels_.begin(); i != search.labels_.end(); ++i) {
-    if (GetLabel(i->first) != i->second)
-      return false;
-  }
-  for (MapType::const_iterator i = labels_.begin(); i != labels_.end(); ++i) {
-    if (search.GetLabel(i->first) != i->second)
-      return false;
-  }
-  return true;
+bool Variable::HasValidName() const {
+  return variable_.size() >= 2 && variable_[0] == '/' && variable_.find_first_of("\n\t ") == string::npos;
 }
 
 void Variable::FromProtobuf(const proto::StreamVariable &protobuf) {
@@ -155,6 +161,7 @@ void Variable::FromProtobuf(const proto::StreamVariable &protobuf) {
     const proto::Label &label = protobuf.label(i);
     labels_[label.label()] = label.value();
   }
+  UpdateKey();
 }
 
 void Variable::ToProtobuf(proto::StreamVariable *protobuf) const {
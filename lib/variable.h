@@ -10,15 +10,143 @@
 #ifndef _OPENINSTRUMENT_LIB_VARIABLE_H_
 #define _OPENINSTRUMENT_LIB_VARIABLE_H_
 
-#include <map>
+#include <string.h>
+#include <algorithm>
+#include <functional>
 #include <string>
+#include <utility>
 #include "lib/common.h"
 #include "lib/openinstrument.pb.h"
 #include "lib/protobuf.h"
+#include "lib/small_vector.h"
 #include "lib/string.h"
 
 namespace openinstrument {
 
+// Label to value map for a Variable, kept as a vector of pairs sorted by label.
+// Variables usually only have a handful of labels, which fit in the inline storage, so copying a LabelMap is one
+// contiguous copy and lookups are a short binary search instead of a walk through map nodes. Each inline slot is a pair
+// of strings, so the inline count is kept small to keep Variable itself small; more labels than that move to the heap.
+// Iterators are invalidated by any insertion or removal.
+class LabelMap {
+ public:
+  typedef std::pair<string, string> value_type;
+  typedef SmallVector<value_type, 4> VectorType;
+  typedef VectorType::iterator iterator;
+  typedef VectorType::const_iterator const_iterator;
+
+  inline iterator begin() {
+    return labels_.begin();
+  }
+
+  inline iterator end() {
+    return labels_.end();
+  }
+
+  inline const_iterator begin() const {
+    return labels_.begin();
+  }
+
+  inline const_iterator end() const {
+    return labels_.end();
+  }
+
+  inline uint32_t size() const {
+    return labels_.size();
+  }
+
+  inline bool empty() const {
+    return labels_.empty();
+  }
+
+  inline void clear() {
+    labels_.clear();
+  }
+
+  inline const_iterator find(const StringPiece &label) const {
+    const_iterator it = lower_bound(label);
+    return it != end() && Compare(it->first, label) == 0 ? it : end();
+  }
+
+  inline const_iterator find(const string &label) const {
+    return find(StringPiece(label));
+  }
+
+  inline iterator find(const StringPiece &label) {
+    iterator it = lower_bound(label);
+    return it != end() && Compare(it->first, label) == 0 ? it : end();
+  }
+
+  inline iterator find(const string &label) {
+    return find(StringPiece(label));
+  }
+
+  // Returns the value for <label>, inserting an empty value if it doesn't exist.
+  string &operator[](const StringPiece &label) {
+    iterator it = lower_bound(label);
+    if (it != end() && Compare(it->first, label) == 0)
+      return it->second;
+    return labels_.insert(it, value_type(label.ToString(), string()))->second;
+  }
+
+  inline string &operator[](const string &label) {
+    return operator[](StringPiece(label));
+  }
+
+  // Removes <label>, returning the number of labels removed.
+  uint32_t erase(const StringPiece &label) {
+    iterator it = find(label);
+    if (it == end())
+      return 0;
+    labels_.erase(it);
+    return 1;
+  }
+
+  inline uint32_t erase(const string &label) {
+    return erase(StringPiece(label));
+  }
+
+  inline bool operator==(const LabelMap &other) const {
+    return labels_ == other.labels_;
+  }
+
+  inline bool operator!=(const LabelMap &other) const {
+    return labels_ != other.labels_;
+  }
+
+  // Bytes allocated outside the object itself, for RAM accounting.
+  uint64_t HeapSize() const {
+    uint64_t size = labels_.is_inline() ? 0 : labels_.capacity() * sizeof(value_type);
+    for (const_iterator i = begin(); i != end(); ++i)
+      size += i->first.capacity() + i->second.capacity();
+    return size;
+  }
+
+ private:
+  // Lexicographic comparison, matching std::string ordering.
+  static inline int Compare(const string &a, const StringPiece &b) {
+    size_t len = std::min(static_cast<uint64_t>(a.size()), b.size());
+    int cmp = len ? memcmp(a.data(), b.data(), len) : 0;
+    if (cmp)
+      return cmp;
+    return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+  }
+
+  static inline bool LabelLess(const value_type &a, const StringPiece &b) {
+    return Compare(a.first, b) < 0;
+  }
+
+  inline const_iterator lower_bound(const StringPiece &label) const {
+    return std::lower_bound(begin(), end(), label, LabelLess);
+  }
+
+  inline iterator lower_bound(const StringPiece &label) {
+    return std::lower_bound(begin(), end(), label, LabelLess);
+  }
+
+  VectorType labels_;
+};
+
 // Container for variable names
 // Acceptable formats are:
 //    <variable>
@@ -30,26 +158,54 @@ namespace openinstrument {
 // Acceptable characters for label are:
 //    a-z A-Z 0-9  . _ - / *
 // Acceptable characters for value are any UTF-8 character except NULL
+//
+// The canonical string form and its hash are rebuilt whenever the variable is modified, so comparing and hashing
+// Variables is cheap. Use SetLabels() to change several labels with a single rebuild.
 class Variable {
  public:
-  typedef std::map<string, string> MapType;
+  typedef LabelMap MapType;
 
-  Variable() : type_(proto::StreamVariable::UNKNOWN) {}
+  Variable() : hash_(0), type_(proto::StreamVariable::UNKNOWN) {}
 
-  Variable(const char *input) : type_(proto::StreamVariable::UNKNOWN) {
+  Variable(const char *input) : hash_(0), type_(proto::StreamVariable::UNKNOWN) {
     FromString(string(input));
   }
 
-  Variable(const string &input) : type_(proto::StreamVariable::UNKNOWN)  {
+  Variable(const string &input) : hash_(0), type_(proto::StreamVariable::UNKNOWN)  {
     FromString(input);
   }
 
-  explicit Variable(const proto::StreamVariable &proto) : type_(proto::StreamVariable::UNKNOWN)  {
+  explicit Variable(const StringPiece &input) : hash_(0), type_(proto::StreamVariable::UNKNOWN)  {
+    FromString(input);
+  }
+
+  explicit Variable(const proto::StreamVariable &proto) : hash_(0), type_(proto::StreamVariable::UNKNOWN)  {
     FromProtobuf(proto);
   }
 
-  void FromString(const string &input);
-  const string ToString() const;
+  inline void FromString(const string &input) {
+    FromString(StringPiece(input));
+  }
+
+  // Parse <input> in a single pass, replacing the name and all labels.
+  // Label values may be quoted with "" to include commas. A backslash escapes a following ", comma or backslash, and
+  // \n is a newline.
+  // Throws runtime_error for an unknown escape sequence or a trailing backslash.
+  void FromString(const StringPiece &input);
+
+  inline const string ToString() const {
+    return key();
+  }
+
+  // The canonical string form of the variable, without copying it.
+  inline const string &key() const {
+    return key_;
+  }
+
+  // 64-bit hash of key().
+  inline uint64_t hash() const {
+    return hash_;
+  }
 
   void FromProtobuf(const proto::StreamVariable &protobuf);
   void FromValueStream(const proto::ValueStream &stream) {
@@ -61,7 +217,12 @@ class Variable {
   }
 
   inline bool operator<(const Variable &b) const {
-    return ToString() < b.ToString();
+    if (key() != b.key())
+      return key() < b.key();
+    // The keys of variables which only differ by labels with empty values are the same, see equals().
+    if (variable_ != b.variable_)
+      return variable_ < b.variable_;
+    return std::lexicographical_compare(labels_.begin(), labels_.end(), b.labels_.begin(), b.labels_.end());
   }
 
   inline const string &variable() const {
@@ -70,15 +231,36 @@ class Variable {
 
   inline void set_variable(const string &variable) {
     variable_ = variable;
+    UpdateKey();
   }
 
   inline void SetLabel(const string &label, const string &value) {
     labels_[label] = value;
+    UpdateKey();
+  }
+
+  inline void SetLabel(const StringPiece &label, const StringPiece &value) {
+    string &output = labels_[label];
+    output.assign(value.data(), value.size());
+    UpdateKey();
+  }
+
+  // Set every label in [begin, end), which must point to pairs of label and value, rebuilding the key only once.
+  template<typename Iterator>
+  void SetLabels(Iterator begin, Iterator end) {
+    for (; begin != end; ++begin) {
+      StringPiece value(begin->second);
+      labels_[StringPiece(begin->first)].assign(value.data(), value.size());
+    }
+    UpdateKey();
   }
 
   inline bool HasLabel(const string &label) const {
-    MapType::const_iterator it = labels_.find(label);
-    return it != labels_.end();
+    return HasLabel(StringPiece(label));
+  }
+
+  inline bool HasLabel(const StringPiece &label) const {
+    return labels_.find(label) != labels_.end();
   }
 
   const MapType &labels() const {
@@ -92,6 +274,10 @@ class Variable {
   }
 
   inline const string &GetLabel(const string &label) const {
+    return GetLabel(StringPiece(label));
+  }
+
+  inline const string &GetLabel(const StringPiece &label) const {
     static string emptystring;
     MapType::const_iterator it = labels_.find(label);
     if (it == labels_.end())
@@ -123,8 +309,13 @@ class Variable {
     type_ = proto::StreamVariable::RATE;
   }
 
+  // Returns true if this variable matches the search pattern <search>. See VariableMatcher for the rules.
   bool Matches(const Variable &search) const;
 
+  // Returns true if the name can be stored: it must start with a / followed by at least one character, and must not
+  // contain any whitespace.
+  bool HasValidName() const;
+
   inline bool operator!=(const Variable &search) const {
     return !equals(search);
   }
@@ -133,28 +324,49 @@ class Variable {
     return equals(search);
   }
 
-  bool equals(const Variable &search) const;
+  // The key leaves out labels with empty values, so the hash only rules variables out and the name and labels are
+  // compared directly.
+  inline bool equals(const Variable &search) const {
+    return hash() == search.hash() && variable_ == search.variable_ && labels_ == search.labels_;
+  }
 
   // Used to keep track of how much data is in RAM
   inline uint64_t RamSize() const {
-    uint64_t size = sizeof(labels_) + variable_.capacity();
-    for (MapType::const_iterator i = labels_.begin(); i != labels_.end(); ++i) {
-      size += i->first.capacity() + i->second.capacity();
-    }
-    return size;
+    return sizeof(labels_) + labels_.HeapSize() + variable_.capacity() + key_.capacity();
   }
 
  private:
+  // Rebuild key_ and hash_ from the name and labels. Must be called after every modification.
+  void UpdateKey();
   bool ShouldQuoteValue(const string &input) const;
-  string QuoteValue(const string &input) const;
+  // Append <input> to <output>, escaping any characters which need it inside a quoted value.
+  void QuoteValue(const string &input, string *output) const;
   bool IsValueChar(const char p) const;
   bool IsValueQuoteChar(const char p) const;
 
   string variable_;
   MapType labels_;
+  string key_;
+  uint64_t hash_;
   proto::StreamVariable::ValueType type_;
 };
 
+// Allow Variable to be used as a key in boost::unordered_map.
+inline size_t hash_value(const Variable &variable) {
+  return variable.hash();
+}
+
 }  // namespace openinstrument
 
+namespace std {
+
+template<>
+struct hash<openinstrument::Variable> {
+  size_t operator()(const openinstrument::Variable &variable) const {
+    return variable.hash();
+  }
+};
+
+}  // namespace std
+
 #endif  // _OPENINSTRUMENT_LIB_VARIABLE_H_
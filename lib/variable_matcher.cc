@@ -0,0 +1,71 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <string>
+#include <vector>
+#include <boost/regex.hpp>
+#include "lib/common.h"
+#include "lib/variable.h"
+#include "lib/variable_matcher.h"
+
+namespace openinstrument {
+
+void VariableMatcher::Compile(const Variable &search) {
+  search_ = search;
+  terms_.clear();
+  const string &name = search.variable();
+  prefix_ = !name.empty() && name[name.size() - 1] == '*';
+  name_ = prefix_ ? name.substr(0, name.size() - 1) : name;
+
+  terms_.reserve(search.labels().size());
+  for (Variable::MapType::const_iterator i = search.labels().begin(); i != search.labels().end(); ++i) {
+    terms_.push_back(LabelTerm());
+    LabelTerm &term = terms_.back();
+    term.label = i->first;
+    const string &value = i->second;
+    if (value == "*") {
+      term.type = LabelTerm::PRESENT;
+    } else if (value.size() > 2 && value[0] == '/' && value[value.size() - 1] == '/') {
+      term.type = LabelTerm::REGEX;
+      term.regex.assign(value.begin() + 1, value.end() - 1);
+    } else {
+      term.type = LabelTerm::LITERAL;
+      term.value = value;
+    }
+  }
+}
+
+bool VariableMatcher::Matches(const Variable &variable) const {
+  const string &name = variable.variable();
+  if (prefix_) {
+    if (name.compare(0, name_.size(), name_) != 0)
+      return false;
+  } else if (name != name_) {
+    return false;
+  }
+  for (const LabelTerm &term : terms_) {
+    switch (term.type) {
+      case LabelTerm::PRESENT:
+        if (!variable.HasLabel(term.label))
+          return false;
+        break;
+      case LabelTerm::REGEX:
+        if (!boost::regex_match(variable.GetLabel(term.label), term.regex))
+          return false;
+        break;
+      case LabelTerm::LITERAL:
+        if (variable.GetLabel(term.label) != term.value)
+          return false;
+        break;
+    }
+  }
+  return true;
+}
+
+}  // namespace openinstrument
@@ -0,0 +1,71 @@
+/*
+ * Precompiled matcher for Variable search patterns.
+ *
+ * Variable::Matches() has to parse the search pattern and build any regular expressions every time it is called.
+ * A VariableMatcher does that work once, so a single search can be checked against many variables cheaply.
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef _OPENINSTRUMENT_LIB_VARIABLE_MATCHER_H_
+#define _OPENINSTRUMENT_LIB_VARIABLE_MATCHER_H_
+
+#include <string>
+#include <vector>
+#include <boost/regex.hpp>
+#include "lib/common.h"
+#include "lib/variable.h"
+
+namespace openinstrument {
+
+// Matches variables against a search Variable, with the same rules as Variable::Matches():
+//   - A variable name ending in * matches any name with the same prefix, otherwise the name must be identical.
+//   - A label value of * matches any variable that has that label.
+//   - A label value of /regex/ must match the entire value of the label, which is empty if the label is missing.
+//   - Any other label value must be identical.
+//
+// A VariableMatcher is immutable once compiled and may be shared between threads.
+class VariableMatcher {
+ public:
+  VariableMatcher() : prefix_(false) {}
+
+  explicit VariableMatcher(const Variable &search) : prefix_(false) {
+    Compile(search);
+  }
+
+  // Replace the current search. Throws boost::regex_error if any of the regular expressions are invalid.
+  void Compile(const Variable &search);
+
+  bool Matches(const Variable &variable) const;
+
+  inline const Variable &search() const {
+    return search_;
+  }
+
+ private:
+  struct LabelTerm {
+    enum Type {
+      LITERAL,
+      PRESENT,
+      REGEX,
+    };
+
+    Type type;
+    string label;
+    string value;
+    boost::regex regex;
+  };
+
+  Variable search_;
+  // The variable name, or only the prefix if prefix_ is set.
+  string name_;
+  bool prefix_;
+  vector<LabelTerm> terms_;
+};
+
+}  // namespace openinstrument
+
+#endif  // _OPENINSTRUMENT_LIB_VARIABLE_MATCHER_H_
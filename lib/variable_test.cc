@@ -8,7 +8,9 @@
  */
 
 #include <iostream>
+#include <map>
 #include <string>
+#include <boost/tokenizer.hpp>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include "lib/common.h"
@@ -18,6 +20,7 @@
 #include "lib/string.h"
 #include "lib/timer.h"
 #include "lib/variable.h"
+#include "lib/variable_matcher.h"
 
 namespace openinstrument {
 
@@ -62,6 +65,218 @@ TEST_F(VariableTest, VariableMatches) {
   EXPECT_FALSE(input.equals("/test/variable/1{label1=foobar,label2=barfoo,label3=1219827391,label4=yay}"));
 }
 
+TEST_F(VariableTest, VariableMatcher) {
+  VariableMatcher matcher("/test/varia*{label1=/foo.*/,label2=*,label3=1219827391}");
+  EXPECT_TRUE(matcher.Matches("/test/variable/1{label1=foobar,label2=barfoo,label3=1219827391}"));
+  EXPECT_TRUE(matcher.Matches("/test/variable/2{label1=foo,label2=,label3=1219827391}"));
+  EXPECT_FALSE(matcher.Matches("/test/vari{label1=foobar,label2=barfoo,label3=1219827391}"));
+  EXPECT_FALSE(matcher.Matches("/test/variable/1{label1=barfoo,label2=barfoo,label3=1219827391}"));
+  EXPECT_FALSE(matcher.Matches("/test/variable/1{label1=foobar,label3=1219827391}"));
+  EXPECT_FALSE(matcher.Matches("/test/variable/1{label1=foobar,label2=barfoo,label3=1}"));
+
+  // A regex is matched against an empty string when the label is missing
+  matcher.Compile("/test/variable/1{label4=/(yay)?/}");
+  EXPECT_TRUE(matcher.Matches("/test/variable/1"));
+  EXPECT_TRUE(matcher.Matches("/test/variable/1{label4=yay}"));
+  EXPECT_FALSE(matcher.Matches("/test/variable/1{label4=nay}"));
+  EXPECT_FALSE(matcher.Matches("/test/variable/11"));
+  EXPECT_EQ("/test/variable/1", matcher.search().variable());
+
+  matcher.Compile("*");
+  EXPECT_TRUE(matcher.Matches("/test/variable/1{label1=foobar}"));
+  EXPECT_TRUE(matcher.Matches("/"));
+}
+
+TEST_F(VariableTest, KeyAndHash) {
+  Variable a("/test/variable/1{label2=barfoo,label1=foobar}");
+  Variable b("/test/variable/1{label1=foobar,label2=barfoo}");
+  EXPECT_EQ("/test/variable/1{label1=foobar,label2=barfoo}", a.key());
+  EXPECT_EQ(a.hash(), b.hash());
+  EXPECT_TRUE(a == b);
+  EXPECT_FALSE(a < b || b < a);
+  EXPECT_EQ(std::hash<Variable>()(a), std::hash<Variable>()(b));
+
+  // The key and hash follow any changes to the variable
+  b.SetLabel("label3", "quoted, value");
+  EXPECT_EQ("/test/variable/1{label1=foobar,label2=barfoo,label3=\"quoted\\, value\"}", b.key());
+  EXPECT_NE(a.hash(), b.hash());
+  EXPECT_TRUE(a != b);
+  EXPECT_TRUE(b < a);
+  b.FromString("/test/variable/1{label1=foobar,label2=barfoo}");
+  EXPECT_TRUE(a == b);
+  b.set_variable("/test/variable/0");
+  EXPECT_EQ("/test/variable/0{label1=foobar,label2=barfoo}", b.key());
+  EXPECT_TRUE(b < a);
+  EXPECT_FALSE(a < b);
+
+  // Several labels set at once, with a copy made beforehand.
+  Variable c;
+  c.set_variable("/test/variable/1");
+  c.SetLabel("label2", "foo");
+  Variable d(c);
+  std::map<string, string> labels;
+  labels["label1"] = "foobar";
+  labels["label2"] = "barfoo";
+  c.SetLabels(labels.begin(), labels.end());
+  EXPECT_TRUE(a == c);
+  EXPECT_EQ(a.hash(), c.hash());
+  EXPECT_EQ(a.key(), c.key());
+  EXPECT_EQ("/test/variable/1{label2=foo}", d.ToString());
+
+  proto::StreamVariable protobuf;
+  a.ToProtobuf(&protobuf);
+  EXPECT_EQ(a.hash(), Variable(protobuf).hash());
+  EXPECT_EQ(0UL, Variable().hash());
+
+  unordered_map<Variable, int> map;
+  map[a] = 1;
+  map[b] = 2;
+  EXPECT_EQ(1, map[Variable("/test/variable/1{label1=foobar,label2=barfoo}")]);
+  EXPECT_EQ(2UL, map.size());
+}
+
+TEST_F(VariableTest, EmptyLabels) {
+  // Labels with empty values aren't in the key, but still make variables different.
+  Variable a("/test/empty");
+  a.SetLabel("x", "");
+  Variable b("/test/empty");
+  b.SetLabel("z", "");
+  EXPECT_EQ(a.key(), b.key());
+  EXPECT_FALSE(a == b);
+  EXPECT_TRUE(a != b);
+  EXPECT_TRUE(a < b || b < a);
+  EXPECT_FALSE(a < b && b < a);
+
+  unordered_map<Variable, int> map;
+  map[a] = 1;
+  map[b] = 2;
+  EXPECT_EQ(2UL, map.size());
+  EXPECT_EQ(1, map[a]);
+}
+
+// The original tokenizer based parser, used as a reference for the single pass parser.
+string ParseWithTokenizer(const string &input, Variable::MapType *labels) {
+  labels->clear();
+  size_t pos = input.find('{');
+  if (pos == string::npos)
+    return input;
+  string labelstring = input.substr(pos + 1, input.size() - pos - 2);
+  typedef boost::tokenizer<boost::escaped_list_separator<char>> Tokenizer;
+  Tokenizer tokens(labelstring);
+  for (Tokenizer::iterator it = tokens.begin(); it != tokens.end(); ++it) {
+    string lv(*it);
+    size_t pos = lv.find("=");
+    if (pos == string::npos)
+      continue;
+    (*labels)[lv.substr(0, pos)] = lv.substr(pos + 1);
+  }
+  return input.substr(0, pos);
+}
+
+TEST_F(VariableTest, ParseQuoting) {
+  Variable var("/test{a=\"x, y\",b=foo\\,bar,c=say \\\"hi\\\",d=\"multi\\nline\",e=back\\\\slash}");
+  EXPECT_EQ("/test", var.variable());
+  EXPECT_EQ("x, y", var.GetLabel("a"));
+  EXPECT_EQ("foo,bar", var.GetLabel("b"));
+  EXPECT_EQ("say \"hi\"", var.GetLabel("c"));
+  EXPECT_EQ("multi\nline", var.GetLabel("d"));
+  EXPECT_EQ("back\\slash", var.GetLabel("e"));
+
+  // Items without '=' are ignored, and later labels replace earlier ones
+  var.FromString("/test{a=1,nothing,,a=2,b==3}");
+  EXPECT_EQ(2UL, var.labels().size());
+  EXPECT_EQ("2", var.GetLabel("a"));
+  EXPECT_EQ("=3", var.GetLabel("b"));
+
+  EXPECT_THROW(var.FromString("/test{a=\\x}"), runtime_error);
+  EXPECT_THROW(var.FromString("/test{a=\\}"), runtime_error);
+  EXPECT_EQ("/test", var.key());
+}
+
+TEST_F(VariableTest, ParseEquivalence) {
+  // Random strings made up mostly of the characters that matter to the parser must give the same result as the
+  // tokenizer based parser, including throwing for the same inputs.
+  const char alphabet[] = "ab=,\"\\{}n ";
+  uint32_t seed = 12345;
+  for (int i = 0; i < 100000; i++) {
+    string input("/x{");
+    seed = seed * 1103515245 + 12345;
+    int length = (seed >> 16) % 16;
+    for (int j = 0; j < length; j++) {
+      seed = seed * 1103515245 + 12345;
+      input += alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+    }
+    if (i % 2)
+      input += "}";
+
+    Variable::MapType expected;
+    string expected_name;
+    bool expected_throw = false;
+    try {
+      expected_name = ParseWithTokenizer(input, &expected);
+    } catch (const boost::escaped_list_error &) {
+      expected_throw = true;
+    }
+
+    Variable var;
+    try {
+      var.FromString(input);
+      ASSERT_FALSE(expected_throw) << input;
+      ASSERT_EQ(expected_name, var.variable()) << input;
+      ASSERT_TRUE(expected == var.labels()) << input;
+    } catch (const runtime_error &) {
+      ASSERT_TRUE(expected_throw) << input;
+    }
+  }
+}
+
+TEST_F(VariableTest, LabelMap) {
+  // Random insertions and removals should leave the labels in the same order as a std::map.
+  LabelMap labels;
+  std::map<string, string> expected;
+  srand(42);
+  for (int i = 0; i < 10000; i++) {
+    string label = StringPrintf("label%d", rand() % 20);
+    if (rand() % 3 == 0) {
+      EXPECT_EQ(expected.erase(label), labels.erase(label));
+    } else {
+      string value = StringPrintf("%d", i);
+      expected[label] = value;
+      labels[label] = value;
+    }
+    ASSERT_EQ(expected.size(), labels.size());
+    LabelMap::const_iterator l = labels.begin();
+    for (std::map<string, string>::const_iterator e = expected.begin(); e != expected.end(); ++e, ++l) {
+      ASSERT_EQ(e->first, l->first);
+      ASSERT_EQ(e->second, l->second);
+    }
+  }
+
+  LabelMap copy(labels);
+  EXPECT_TRUE(copy == labels);
+  copy["label0"] = "changed";
+  EXPECT_TRUE(copy != labels);
+}
+
+TEST_F(VariableTest, StringPieceLabels) {
+  string input("/test{host=db1,job=backup}");
+  Variable var;
+  var.FromString(StringPiece(input));
+  EXPECT_EQ("/test", var.variable());
+
+  string buffer("hostjobnone");
+  EXPECT_TRUE(var.HasLabel(StringPiece(buffer.data(), 4)));
+  EXPECT_TRUE(var.HasLabel(StringPiece(buffer.data() + 4, 3)));
+  EXPECT_FALSE(var.HasLabel(StringPiece(buffer.data() + 7, 4)));
+  EXPECT_FALSE(var.HasLabel(StringPiece(buffer.data(), 3)));
+  EXPECT_EQ("db1", var.GetLabel(StringPiece(buffer.data(), 4)));
+  EXPECT_EQ("", var.GetLabel(StringPiece(buffer.data() + 7, 4)));
+
+  var.SetLabel(StringPiece(buffer.data() + 7, 4), StringPiece(buffer.data(), 4));
+  EXPECT_EQ("/test{host=db1,job=backup,none=host}", var.ToString());
+  EXPECT_TRUE(var == Variable("/test{none=host,job=backup,host=db1}"));
+}
+
 TEST_F(VariableTest, Protobuf) {
   proto::StreamVariable protobuf;
 
@@ -7,106 +7,395 @@
  *
  */
 
+#include <algorithm>
 #include <vector>
 #include <string>
 #include "lib/common.h"
+#include "lib/exported_vars.h"
 #include "lib/file.h"
 #include "lib/protobuf.h"
 #include "lib/string.h"
 #include "lib/timer.h"
 #include "server/disk_datastore.h"
 #include "server/indexed_store_file.h"
+#include "server/label_index.h"
 #include "server/record_log.h"
+#include "server/series_registry.h"
+
+DEFINE_int32(datastore_shards, 16, "Number of independently locked shards to split the in-memory datastore into");
+DEFINE_int32(series_expiry_hours, 720, "Series with no values written for this many hours are dropped from the "
+             "in-memory indexes, so they are no longer listed or found by searches. Set to 0 to keep every series "
+             "indexed.");
+DEFINE_int32(reorder_window, 300000, "Values which are up to this many ms older than the newest value in a series are "
+             "inserted in timestamp order. Older values are kept separately and merged when the series is read.");
 
 namespace openinstrument {
 
+namespace {
+
+// The newest timestamp covered by <value>, including any run-length encoded repeats.
+inline uint64_t LastTimestamp(const proto::Value &value) {
+  return std::max(value.timestamp(), value.end_timestamp());
+}
+
+inline bool SameValue(const proto::Value &a, const proto::Value &b) {
+  if (a.has_double_value())
+    return b.has_double_value() && a.double_value() == b.double_value();
+  if (a.has_string_value())
+    return b.has_string_value() && a.string_value() == b.string_value();
+  return false;
+}
+
+inline bool TimestampLess(uint64_t timestamp, const proto::Value &value) {
+  return timestamp < value.timestamp();
+}
+
+inline bool InRange(const proto::Value &value, const Timestamp &start, const Timestamp &end) {
+  return value.timestamp() >= static_cast<uint64_t>(start.ms()) &&
+         ((end.ms() && value.timestamp() < static_cast<uint64_t>(end.ms())) || !end.ms());
+}
+
+// Returns true if a value in <stream> starts at <timestamp> or is a run which includes it.
+inline bool CoversTimestamp(const proto::ValueStream &stream, uint64_t timestamp) {
+  int pos = std::upper_bound(stream.value().begin(), stream.value().end(), timestamp, TimestampLess) -
+            stream.value().begin();
+  return pos > 0 && LastTimestamp(stream.value(pos - 1)) >= timestamp;
+}
+
+// Move the last value in <values> back to <position>, keeping the order of everything else.
+void MoveLastValueTo(google::protobuf::RepeatedPtrField<proto::Value> *values, int position) {
+  for (int i = values->size() - 1; i > position; i--)
+    values->SwapElements(i, i - 1);
+}
+
+}  // namespace
+
 DiskDatastore::DiskDatastore(const string &basedir)
-  : basedir_(basedir),
-    record_log_(basedir_) {
+  : registry_(SeriesRegistry::get()),
+    index_(&registry_),
+    basedir_(basedir),
+    record_log_(basedir_),
+    reordered_values_("/openinstrument/store/datastore/reordered-values"),
+    out_of_order_values_("/openinstrument/store/datastore/out-of-order-values"),
+    expired_series_("/openinstrument/store/datastore/expired-series"),
+    shutdown_(false),
+    expiry_thread_(NULL) {
+  uint32_t num_shards = std::max(FLAGS_datastore_shards, 1);
+  for (uint32_t i = 0; i < num_shards; ++i)
+    shards_.push_back(shared_ptr<Shard>(new Shard()));
   ReplayRecordLog();
+  if (FLAGS_series_expiry_hours > 0)
+    expiry_thread_.reset(new thread(bind(&DiskDatastore::ExpiryThread, this)));
 }
 
 DiskDatastore::~DiskDatastore() {
-  live_data_.clear();
+  {
+    MutexLock lock(expiry_mutex_);
+    shutdown_ = true;
+    expiry_condvar_.notify_all();
+  }
+  if (expiry_thread_.get())
+    expiry_thread_->join();
+  shards_.clear();
+}
+
+void DiskDatastore::ExpiryThread() {
+  MutexLock lock(expiry_mutex_);
+  while (!shutdown_) {
+    expiry_condvar_.timed_wait(lock, boost::posix_time::seconds(60));
+    if (shutdown_)
+      break;
+    lock.unlock();
+    Timestamp before(Timestamp::Now() - static_cast<int64_t>(FLAGS_series_expiry_hours) * 3600 * 1000);
+    uint64_t expired = ExpireSeries(before);
+    if (expired)
+      LOG(INFO) << "Removed " << expired << " series with no values written since " << before.GmTime()
+                << " from the index";
+    lock.lock();
+  }
+}
+
+uint64_t DiskDatastore::ExpireSeries(const Timestamp &before) {
+  PostingsList ids = last_seen_.Expire(before.ms());
+  if (ids.empty())
+    return 0;
+  vector<vector<const Series *>> by_shard(shards_.size());
+  for (SeriesId id : ids) {
+    const Series *series = registry_.Find(id);
+    if (series)
+      by_shard[ShardFor(series)].push_back(series);
+  }
+  uint64_t expired = 0;
+  vector<const Series *> unindexed;
+  for (uint32_t i = 0; i < shards_.size(); ++i) {
+    if (by_shard[i].empty())
+      continue;
+    unindexed.clear();
+    Shard &shard = *shards_[i];
+    // The index entries are removed with the shard lock held, so a value written at the same time can't be left out of
+    // the index.
+    ExclusiveLock lock(shard.mutex);
+    for (const Series *series : by_shard[i]) {
+      MapType::iterator it = shard.live_data.find(series->id());
+      if (it == shard.live_data.end() || !it->second.indexed)
+        continue;
+      // A value written after the series was taken out of the last seen index has put it back there.
+      if (it->second.last_write >= static_cast<uint64_t>(before.ms()))
+        continue;
+      it->second.indexed = false;
+      unindexed.push_back(series);
+    }
+    index_.Remove(unindexed);
+    expired += unindexed.size();
+  }
+  expired_series_ += expired;
+  return expired;
+}
+
+vector<const Series *> DiskDatastore::ListVariables(const Variable &variable, uint64_t limit, uint64_t max_age,
+                                                    const string &start_after) const {
+  uint64_t now = Timestamp::Now();
+  if (!max_age || max_age >= now)
+    return index_.FindSorted(variable, limit, NULL, start_after);
+  PostingsFilter filter;
+  filter.exclude = !last_seen_.SelectSince(now - max_age, &filter.ids);
+  return index_.FindSorted(variable, limit, &filter, start_after);
 }
 
 Datastore::iterator DiskDatastore::find(const Variable &search, const Timestamp &start, const Timestamp &end) {
   Datastore::iterator it(bind(&Datastore::iterator::IncludeBetweenTimestamps, start, end, _1));
-  for (auto &variable : FindVariables(search))
-    it.AddStream(GetValueStream(variable));
+  // The iterator includes values at <end>, GetRange() doesn't.
+  Timestamp range_end(end.ms() ? end.ms() + 1 : 0);
+  for (auto &variable : FindVariables(search)) {
+    // Writer threads keep changing the live streams after the shard lock is released, so the iterator gets a copy.
+    shared_ptr<proto::ValueStream> stream(new proto::ValueStream());
+    GetRange(variable, start, range_end, stream.get());
+    if (stream->value_size())
+      it.AddStream(stream);
+  }
   return ++it;
 }
 
 void DiskDatastore::GetRange(const Variable &variable, const Timestamp &start, const Timestamp &end,
                              proto::ValueStream *outstream) {
-  try {
-    proto::ValueStream *instream = GetValueStream(variable);
-    if (!instream->value_size())
-      return;
-    outstream->mutable_variable()->CopyFrom(instream->variable());
-    for (auto &value : instream->value()) {
-      if (value.timestamp() >= static_cast<uint64_t>(start.ms()) &&
-          ((end.ms() && value.timestamp() < static_cast<uint64_t>(end.ms())) || !end.ms())) {
-        proto::Value *val = outstream->add_value();
-        val->CopyFrom(value);
-      }
-    }
-  } catch (exception) {
+  const Series *series = registry_.Find(variable);
+  if (!series)
+    return;
+  Shard &shard = GetShard(series);
+  SharedLock lock(shard.mutex);
+  MapType::iterator it = shard.live_data.find(series->id());
+  if (it == shard.live_data.end())
     return;
+  const proto::ValueStream *instream = it->second.stream;
+  const proto::ValueStream *late = it->second.out_of_order;
+  if (!instream->value_size() && !late)
+    return;
+  outstream->mutable_variable()->CopyFrom(instream->variable());
+  // Both streams are sorted, so merge them.
+  int i = 0, j = 0;
+  int late_size = late ? late->value_size() : 0;
+  while (i < instream->value_size() || j < late_size) {
+    const proto::Value *value;
+    if (j >= late_size || (i < instream->value_size() && instream->value(i).timestamp() <= late->value(j).timestamp()))
+      value = &instream->value(i++);
+    else
+      value = &late->value(j++);
+    if (InRange(*value, start, end))
+      outstream->add_value()->CopyFrom(*value);
   }
 }
 
 set<Variable> DiskDatastore::FindVariables(const Variable &variable) {
   set<Variable> vars;
-  for (MapType::iterator i = live_data_.begin(); i != live_data_.end(); ++i) {
-    if (Variable(i->first).Matches(variable))
-      vars.insert(Variable(i->first));
+  for (SeriesId id : index_.Find(variable)) {
+    const Series *series = registry_.Find(id);
+    if (series)
+      vars.insert(series->variable());
   }
   return vars;
 }
 
-proto::ValueStream *DiskDatastore::GetOrCreateVariable(const Variable &variable) {
-  try {
-    proto::ValueStream *stream = GetValueStream(variable);
-    return stream;
-  } catch (exception) {
-    return CreateVariable(variable);
+DiskDatastore::LiveStream &DiskDatastore::GetOrCreateVariable(Shard &shard, const Series *series) {
+  // The caller must hold an exclusive lock on the shard.
+  LiveStream &live = shard.live_data[series->id()];
+  if (!live.stream) {
+    live.series = series;
+    live.stream = new proto::ValueStream();
+    live.stream->mutable_variable()->CopyFrom(series->proto());
   }
+  if (!live.indexed) {
+    index_.Add(series);
+    live.indexed = true;
+  }
+  return live;
+}
+
+bool DiskDatastore::GetValueStream(const Variable &variable, proto::ValueStream *stream) {
+  stream->Clear();
+  GetRange(variable, Timestamp(0), Timestamp(0), stream);
+  return stream->value_size() > 0;
 }
 
-proto::ValueStream *DiskDatastore::GetValueStream(const Variable &variable) {
-  MapType::iterator it = live_data_.find(variable.ToString());
-  if (it == live_data_.end())
-    throw out_of_range("Variable not found");
-  return it->second;
+void DiskDatastore::Record(const Variable &variable, Timestamp timestamp, const proto::Value &value) {
+  Record(registry_.Intern(variable), timestamp, value);
+}
+
+void DiskDatastore::Record(const Series *series, Timestamp timestamp, const proto::Value &value) {
+  proto::ValueStream logstream;
+  uint64_t last_seen = 0;
+  {
+    Shard &shard = GetShard(series);
+    ExclusiveLock lock(shard.mutex);
+    vector<const proto::Value *> changed;
+    last_seen = Timestamp::Now();
+    RecordNoLog(shard, series, timestamp, value, last_seen, &changed);
+    if (changed.empty())
+      return;
+    logstream.mutable_variable()->CopyFrom(series->proto());
+    for (const proto::Value *val : changed)
+      logstream.add_value()->CopyFrom(*val);
+  }
+  last_seen_.Add(series->id(), last_seen);
+  record_log_.Add(logstream);
+}
+
+void DiskDatastore::RecordBatch(uint32_t shard_index, const vector<DatastorePoint *> &points) {
+  CHECK(shard_index < shards_.size());
+  Shard &shard = *shards_[shard_index];
+  vector<proto::ValueStream> log_streams;
+  log_streams.reserve(points.size());
+  vector<LastSeenIndex::Update> last_seen;
+  vector<const proto::Value *> changed;
+  uint64_t now = Timestamp::Now();
+  {
+    ExclusiveLock lock(shard.mutex);
+    const Series *last_series = NULL;
+    for (DatastorePoint *point : points) {
+      const Series *series = point->series;
+      changed.clear();
+      RecordNoLog(shard, series, point->value.timestamp(), point->value, now, &changed);
+      if (changed.empty())
+        continue;
+      // Consecutive values for the same series are grouped into a single record log entry.
+      if (series != last_series) {
+        log_streams.push_back(proto::ValueStream());
+        log_streams.back().mutable_variable()->CopyFrom(series->proto());
+        last_series = series;
+        last_seen.push_back(LastSeenIndex::Update(series->id(), now));
+      }
+      for (const proto::Value *val : changed)
+        log_streams.back().add_value()->CopyFrom(*val);
+    }
+  }
+  last_seen_.Add(last_seen);
+  record_log_.Add(log_streams);
 }
 
-proto::ValueStream *DiskDatastore::CreateVariable(const Variable &variable) {
-  proto::ValueStream *stream = new proto::ValueStream();
-  variable.ToValueStream(stream);
-  live_data_[variable.ToString()] = stream;
-  return stream;
+bool DiskDatastore::FlushRecordLog() {
+  return record_log_.Flush();
 }
 
-proto::Value *DiskDatastore::RecordNoLog(const Variable &variable, Timestamp timestamp, const proto::Value &value) {
-  proto::ValueStream *stream = GetOrCreateVariable(variable);
+void DiskDatastore::RecordNoLog(Shard &shard, const Series *series, Timestamp timestamp, const proto::Value &value,
+                                uint64_t now, vector<const proto::Value *> *changed) {
+  LiveStream &live = GetOrCreateVariable(shard, series);
+  live.last_write = now;
+  proto::ValueStream *stream = live.stream;
+  uint64_t ts = timestamp.ms();
   if (stream->value_size()) {
     proto::Value *last_value = stream->mutable_value(stream->value_size() - 1);
-    if (value.has_double_value() && last_value->double_value() == value.double_value()) {
-      last_value->set_double_value(value.double_value());
-      last_value->set_end_timestamp(timestamp.ms());
-      return last_value;
+    uint64_t last_timestamp = LastTimestamp(*last_value);
+    if (ts <= last_timestamp) {
+      // A value which falls within one already in the stream, including a run, goes into the stream however old it is
+      // so that it is deduplicated or splits the run, and no timestamp is ever in both streams.
+      if (last_timestamp - ts > static_cast<uint64_t>(FLAGS_reorder_window) && !CoversTimestamp(*stream, ts)) {
+        // Too old to insert into the stream, keep it aside until the stream is read.
+        ++out_of_order_values_;
+        if (!live.out_of_order) {
+          live.out_of_order = new proto::ValueStream();
+          live.out_of_order->mutable_variable()->CopyFrom(series->proto());
+        }
+        InsertValue(live.out_of_order, ts, value, changed);
+        return;
+      }
+      ++reordered_values_;
+      InsertValue(stream, ts, value, changed);
+      return;
     }
-    if (value.has_string_value() && last_value->string_value() == value.string_value()) {
-      last_value->set_string_value(value.string_value());
-      last_value->set_end_timestamp(timestamp.ms());
-      return last_value;
+    if (SameValue(*last_value, value)) {
+      last_value->set_end_timestamp(std::max(ts, value.end_timestamp()));
+      changed->push_back(last_value);
+      return;
     }
   }
   proto::Value *val = stream->add_value();
   val->CopyFrom(value);
-  val->set_timestamp(timestamp.ms());
-  return val;
+  val->set_timestamp(ts);
+  changed->push_back(val);
+}
+
+void DiskDatastore::InsertValue(proto::ValueStream *stream, uint64_t timestamp, const proto::Value &value,
+                                vector<const proto::Value *> *changed) {
+  // Values in a RepeatedPtrField don't move when elements are added or swapped, so the pointers added to <changed>
+  // stay valid.
+  google::protobuf::RepeatedPtrField<proto::Value> *values = stream->mutable_value();
+  // Find the first value that starts after the new one.
+  int pos = std::upper_bound(values->begin(), values->end(), timestamp, TimestampLess) - values->begin();
+  if (pos > 0) {
+    proto::Value *prev = values->Mutable(pos - 1);
+    if (SameValue(*prev, value)) {
+      // This is either a duplicate of a value already in the stream, or it can extend its run.
+      if (std::max(timestamp, value.end_timestamp()) <= LastTimestamp(*prev))
+        return;
+      prev->set_end_timestamp(std::max(timestamp, value.end_timestamp()));
+      changed->push_back(prev);
+      return;
+    }
+    if (timestamp <= LastTimestamp(*prev)) {
+      // The new value falls within a run of a different value, so the run has to be split around it.
+      uint64_t run_end = LastTimestamp(*prev);
+      proto::Value *tail = NULL;
+      if (run_end > timestamp) {
+        tail = values->Add();
+        tail->CopyFrom(*prev);
+        tail->set_timestamp(run_end);
+        tail->clear_end_timestamp();
+        MoveLastValueTo(values, pos);
+      }
+      if (prev->timestamp() == timestamp) {
+        // Replace the existing value.
+        prev->CopyFrom(value);
+        prev->set_timestamp(timestamp);
+        changed->push_back(prev);
+        if (tail)
+          changed->push_back(tail);
+        return;
+      }
+      prev->clear_end_timestamp();
+      changed->push_back(prev);
+      if (tail)
+        changed->push_back(tail);
+    }
+  }
+  proto::Value *val = values->Add();
+  val->CopyFrom(value);
+  val->set_timestamp(timestamp);
+  MoveLastValueTo(values, pos);
+  changed->push_back(val);
+}
+
+void DiskDatastore::ReplayValue(Shard &shard, const Series *series, const proto::Value &value) {
+  // Every value which is created or changed is logged as it ends up, so a logged value replaces whatever value
+  // starts at the same time rather than being merged with it. Out of order values are put straight into the stream,
+  // which reads the same as keeping them aside because no timestamp is ever in both streams.
+  LiveStream &live = GetOrCreateVariable(shard, series);
+  google::protobuf::RepeatedPtrField<proto::Value> *values = live.stream->mutable_value();
+  int pos = std::upper_bound(values->begin(), values->end(), value.timestamp(), TimestampLess) - values->begin();
+  if (pos > 0 && values->Get(pos - 1).timestamp() == value.timestamp()) {
+    values->Mutable(pos - 1)->CopyFrom(value);
+    return;
+  }
+  values->Add()->CopyFrom(value);
+  MoveLastValueTo(values, pos);
 }
 
 void DiskDatastore::ReplayRecordLog() {
@@ -114,11 +403,22 @@ void DiskDatastore::ReplayRecordLog() {
     VLOG(1) << "Replaying record log";
     proto::ValueStream stream;
     uint64_t num_points = 0, num_streams = 0;
+    uint64_t now = Timestamp::Now();
     while (record_log_.ReplayLog(&stream)) {
+      const Series *series = registry_.Intern(Variable(stream.variable()));
+      Shard &shard = GetShard(series);
+      ExclusiveLock lock(shard.mutex);
+      // The record log doesn't hold the time values were written, so the newest value timestamp is the best guess.
+      uint64_t last_seen = 0;
       for (auto &value : stream.value()) {
-        RecordNoLog(Variable(stream.variable()), value.timestamp(), value);
+        ReplayValue(shard, series, value);
+        last_seen = std::max(last_seen, LastTimestamp(value));
         num_points++;
       }
+      last_seen = std::min(last_seen, now);
+      LiveStream &live = shard.live_data[series->id()];
+      live.last_write = std::max(live.last_write, last_seen);
+      last_seen_.Add(series->id(), last_seen);
       num_streams++;
     }
     LOG(INFO) << "Replayed record log, got " << num_points << " points" << " in " << num_streams << " streams";
@@ -14,13 +14,18 @@
 #include <string>
 #include <boost/iterator/iterator_facade.hpp>
 #include "lib/common.h"
+#include "lib/exported_vars.h"
 #include "lib/file.h"
 #include "lib/protobuf.h"
 #include "lib/string.h"
 #include "lib/timer.h"
 #include "lib/variable.h"
+#include "lib/variable_matcher.h"
 #include "server/indexed_store_file.h"
+#include "server/label_index.h"
+#include "server/last_seen_index.h"
 #include "server/record_log.h"
+#include "server/series_registry.h"
 
 namespace openinstrument {
 
@@ -52,6 +57,12 @@ class Datastore : private noncopyable {
       stream_pos_.push_back(0);
     }
 
+    // Add a stream which the iterator keeps alive for as long as it, or any copy of it, exists.
+    void AddStream(shared_ptr<proto::ValueStream> stream) {
+      owned_streams_.push_back(stream);
+      AddStream(stream.get());
+    }
+
     iterator end() {
       return iterator();
     }
@@ -75,6 +86,7 @@ class Datastore : private noncopyable {
     value_type nodecopy_;
     vector<proto::ValueStream *> streams_;
     vector<int> stream_pos_;
+    vector<shared_ptr<proto::ValueStream>> owned_streams_;
     callback include_callback_;
   };
 
@@ -91,8 +103,9 @@ class Datastore : private noncopyable {
   // List all variables in the store matching the supplied search criteria.
   virtual set<Variable> FindVariables(const Variable &variable) = 0;
 
-  // Return the original ValueStream for a single variable.
-  virtual proto::ValueStream *GetValueStream(const Variable &variable) = 0;
+  // Copy every value for a single variable into <stream>.
+  // Returns false if there are no values for the variable.
+  virtual bool GetValueStream(const Variable &variable, proto::ValueStream *stream) = 0;
 
   // Iterate over variable values matching a search critera and start/end timestamps.
   virtual iterator find(const Variable &search, const Timestamp &start, const Timestamp &end) = 0;
@@ -156,15 +169,14 @@ class BasicDatastore : public Datastore {
   BasicDatastore() {}
   ~BasicDatastore() {}
 
-  virtual proto::ValueStream *GetValueStream(const Variable &variable) {
-    for (proto::ValueStream *stream : streams_) {
-      if (Variable(stream->variable()) == variable)
-        return stream;
+  virtual bool GetValueStream(const Variable &variable, proto::ValueStream *stream) {
+    for (proto::ValueStream *i : streams_) {
+      if (Variable(i->variable()) == variable) {
+        stream->CopyFrom(*i);
+        return true;
+      }
     }
-    auto stream = new proto::ValueStream();
-    variable.ToProtobuf(stream->mutable_variable());
-    streams_.push_back(stream);
-    return stream;
+    return false;
   }
 
   virtual void Record(const Variable &variable, Timestamp timestamp, const proto::Value &value) {
@@ -185,8 +197,9 @@ class BasicDatastore : public Datastore {
 
   virtual set<Variable> FindVariables(const Variable &variable) {
     set<Variable> vars;
+    VariableMatcher matcher(variable);
     for (auto i : streams_) {
-      if (Variable(i->variable()).Matches(variable))
+      if (matcher.Matches(Variable(i->variable())))
         vars.insert(Variable(i->variable()));
     }
     return vars;
@@ -195,8 +208,9 @@ class BasicDatastore : public Datastore {
   virtual iterator find(const Variable &search, const Timestamp &start, const Timestamp &end) {
     iterator it(bind(&iterator::IncludeBetweenTimestamps, start, end, _1));
     int counter = 0;
+    VariableMatcher matcher(search);
     for (auto stream : streams_) {
-      if (!Variable(stream->variable()).Matches(search))
+      if (!matcher.Matches(Variable(stream->variable())))
         continue;
       if (!stream->value_size())
         continue;
@@ -215,35 +229,131 @@ class BasicDatastore : public Datastore {
   vector<proto::ValueStream *> streams_;
 };
 
+// A single value waiting to be written to a DiskDatastore.
+struct DatastorePoint {
+  DatastorePoint() : series(NULL) {}
+  const Series *series;
+  proto::Value value;
+};
+
 class DiskDatastore : public Datastore {
  public:
-  typedef unordered_map<string, proto::ValueStream *> MapType;
+  struct LiveStream {
+    LiveStream() : series(NULL), stream(NULL), out_of_order(NULL), indexed(false), last_write(0) {}
+    const Series *series;
+    // Values sorted by timestamp.
+    proto::ValueStream *stream;
+    // Values which arrived too late to be inserted into <stream>, also sorted by timestamp. This is NULL until the
+    // first late value arrives, and is merged with <stream> whenever the series is read.
+    proto::ValueStream *out_of_order;
+    // Whether the series is in the label index. It is taken out when the series expires, and put back by the next
+    // value written.
+    bool indexed;
+    // Wall clock time in ms when a value was last written, which is unrelated to the timestamps of the values.
+    uint64_t last_write;
+  };
+  typedef unordered_map<SeriesId, LiveStream> MapType;
 
   explicit DiskDatastore(const string &basedir);
   ~DiskDatastore();
 
-  Datastore::iterator find(const Variable &search, const Timestamp &start, const Timestamp &end) ;
+  // The iterator works on copies of the matching values, so it is unaffected by values which are written or expired
+  // while it is in use.
+  Datastore::iterator find(const Variable &search, const Timestamp &start, const Timestamp &end);
   void GetRange(const Variable &variable, const Timestamp &start, const Timestamp &end, proto::ValueStream *outstream);
   Datastore::iterator GetRange(const Variable &variable, const Timestamp &start, const Timestamp &end);
   set<Variable> FindVariables(const Variable &variable);
 
-  virtual void Record(const Variable &variable, Timestamp timestamp, const proto::Value &value) {
-    proto::Value *val = RecordNoLog(variable, timestamp, value);
-    if (val)
-      record_log_.Add(variable, *val);
+  // Return the series matching <variable>, ordered by name and then by variable. At most <limit> series are returned
+  // if <limit> is non-zero. If <max_age> is non-zero, only series with a value in the last <max_age> ms are returned.
+  // If <start_after> is set, the list starts after the series with that key.
+  vector<const Series *> ListVariables(const Variable &variable, uint64_t limit, uint64_t max_age,
+                                       const string &start_after = "") const;
+
+  // Remove every series which has had no values written since <before> from the in-memory indexes, so that it is no
+  // longer found by searches or listed. This goes by the time values were written rather than their timestamps, so
+  // backfilled values don't make a series expire. The values are kept, as memory is the only place they can be read
+  // from, and can still be read by exact variable. A series is indexed again as soon as a new value is written to it.
+  // Returns the number of series removed.
+  uint64_t ExpireSeries(const Timestamp &before);
+
+  virtual void Record(const Variable &variable, Timestamp timestamp, const proto::Value &value);
+  void Record(const Series *series, Timestamp timestamp, const proto::Value &value);
+
+  // Record a batch of values which all belong to <shard>.
+  // The shard lock is taken once for the whole batch and every resulting value is added to the record log in a single
+  // call, which is much cheaper than calling Record() for each value.
+  // Each value must already have its timestamp set.
+  void RecordBatch(uint32_t shard, const vector<DatastorePoint *> &points);
+
+  // Force all values added so far to be written to the record log on disk.
+  // Returns false if the record log could not be written.
+  bool FlushRecordLog();
+
+  bool GetValueStream(const Variable &variable, proto::ValueStream *stream);
+
+  // The in-memory data is split into a number of independently locked shards, so that values for different variables
+  // can be written in parallel.
+  inline uint32_t num_shards() const {
+    return shards_.size();
   }
 
-  proto::ValueStream *GetValueStream(const Variable &variable);
+  // Returns the shard that contains <series>.
+  inline uint32_t ShardFor(const Series *series) const {
+    return series->hash() % shards_.size();
+  }
+
+  inline SeriesRegistry &registry() {
+    return registry_;
+  }
+
+  // Index of every series that has values in the datastore.
+  inline const LabelIndex &index() const {
+    return index_;
+  }
+
+  // When each indexed series last had a value written.
+  inline const LastSeenIndex &last_seen() const {
+    return last_seen_;
+  }
 
  private:
-  proto::ValueStream *GetOrCreateVariable(const Variable &variable);
-  proto::ValueStream *CreateVariable(const Variable &variable);
-  proto::Value *RecordNoLog(const Variable &variable, Timestamp timestamp, const proto::Value &value);
+  struct Shard {
+    SharedMutex mutex;
+    MapType live_data;
+  };
+
+  inline Shard &GetShard(const Series *series) {
+    return *shards_[ShardFor(series)];
+  }
+  LiveStream &GetOrCreateVariable(Shard &shard, const Series *series);
+  // Add a value to the in-memory streams for <series>. Every value which is created or changed as a result, of which
+  // there may be several when a run is split, is appended to <changed> so that all of them can be logged. <now> is the
+  // wall clock time of the write.
+  void RecordNoLog(Shard &shard, const Series *series, Timestamp timestamp, const proto::Value &value, uint64_t now,
+                   vector<const proto::Value *> *changed);
+  // Insert a value into the correct position in a sorted stream, appending every value created or changed to
+  // <changed>.
+  void InsertValue(proto::ValueStream *stream, uint64_t timestamp, const proto::Value &value,
+                   vector<const proto::Value *> *changed);
+  // Apply a value read from the record log.
+  void ReplayValue(Shard &shard, const Series *series, const proto::Value &value);
   void ReplayRecordLog();
+  void ExpiryThread();
 
+  SeriesRegistry &registry_;
+  LabelIndex index_;
+  LastSeenIndex last_seen_;
   string basedir_;
-  MapType live_data_;
+  vector<shared_ptr<Shard>> shards_;
   RecordLog record_log_;
+  ExportedInteger reordered_values_;
+  ExportedInteger out_of_order_values_;
+  ExportedInteger expired_series_;
+  bool shutdown_;
+  Mutex expiry_mutex_;
+  boost::condition_variable expiry_condvar_;
+  scoped_ptr<thread> expiry_thread_;
 };
 
 }  // namespace
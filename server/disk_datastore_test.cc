@@ -0,0 +1,242 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/file.h"
+#include "lib/openinstrument.pb.h"
+#include "lib/timer.h"
+#include "lib/variable.h"
+#include "server/disk_datastore.h"
+#include "server/series_registry.h"
+
+DECLARE_int32(reorder_window);
+
+namespace openinstrument {
+
+class DiskDatastoreTest : public ::testing::Test {
+ protected:
+  DiskDatastoreTest() : datastore_(NULL) {}
+
+  void SetUp() {
+    char dir[] = "/tmp/disk_datastore_testXXXXXX";
+    ASSERT_TRUE(mkdtemp(dir));
+    dir_ = dir;
+    datastore_.reset(new DiskDatastore(dir_));
+  }
+
+  void TearDown() {
+    datastore_.reset();
+    for (auto &filename : Glob(dir_ + "/*"))
+      unlink(filename.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  // Close the datastore and open it again, so that it is rebuilt from the record log.
+  void Reopen() {
+    ASSERT_TRUE(datastore_->FlushRecordLog());
+    datastore_.reset();
+    datastore_.reset(new DiskDatastore(dir_));
+  }
+
+  static proto::Value NewValue(double double_value) {
+    proto::Value value;
+    value.set_double_value(double_value);
+    return value;
+  }
+
+  // Return the values of <variable> as "timestamp=value" strings, with "-end" appended for runs.
+  vector<string> Values(const string &variable) {
+    vector<string> values;
+    proto::ValueStream stream;
+    if (!datastore_->GetValueStream(Variable(variable), &stream))
+      return values;
+    for (auto &value : stream.value()) {
+      string str = StringPrintf("%lu=%g", value.timestamp(), value.double_value());
+      if (value.has_end_timestamp())
+        str += StringPrintf("-%lu", value.end_timestamp());
+      values.push_back(str);
+    }
+    return values;
+  }
+
+  string dir_;
+  scoped_ptr<DiskDatastore> datastore_;
+};
+
+TEST_F(DiskDatastoreTest, ExpireSeriesRemovesIndexEntries) {
+  uint64_t now = Timestamp::Now();
+  Variable old_variable("/test/expire{state=old}");
+  Variable new_variable("/test/expire{state=new}");
+  // Expiry goes by when values were written, so a backfilled value doesn't make the series stale.
+  datastore_->Record(old_variable, Timestamp(now - 7200000), NewValue(1));
+  EXPECT_EQ(0U, datastore_->ExpireSeries(Timestamp(now - 3600000)));
+  EXPECT_EQ(1U, datastore_->FindVariables(Variable("/test/expire")).size());
+
+  EXPECT_EQ(1U, datastore_->ExpireSeries(Timestamp(Timestamp::Now() + 1)));
+  datastore_->Record(new_variable, Timestamp(now), NewValue(2));
+  const Series *old_series = datastore_->registry().Find(old_variable);
+  ASSERT_TRUE(old_series);
+  SeriesId old_id = old_series->id();
+  EXPECT_EQ(1U, datastore_->FindVariables(Variable("/test/expire")).size());
+  EXPECT_EQ(1U, datastore_->ListVariables(Variable("/test/expire"), 0, 0).size());
+  EXPECT_EQ(0U, datastore_->last_seen().Get(old_id));
+  // The values are still there.
+  EXPECT_EQ(1U, Values(old_variable.ToString()).size());
+  EXPECT_EQ(1U, Values(new_variable.ToString()).size());
+
+  // A new value puts the same series back in the index.
+  datastore_->Record(old_variable, Timestamp(now), NewValue(3));
+  EXPECT_EQ(old_id, datastore_->registry().Find(old_variable)->id());
+  EXPECT_EQ(2U, Values(old_variable.ToString()).size());
+  EXPECT_EQ(2U, datastore_->FindVariables(Variable("/test/expire")).size());
+  EXPECT_LT(0U, datastore_->last_seen().Get(old_id));
+}
+
+TEST_F(DiskDatastoreTest, IteratorSurvivesExpiry) {
+  uint64_t start = Timestamp::Now() - 7200000;
+  Variable variable("/test/iterator");
+  for (int i = 0; i < 10; ++i)
+    datastore_->Record(variable, Timestamp(start + i), NewValue(i));
+  Datastore::iterator it = datastore_->find(variable, Timestamp(start + 2), Timestamp(start + 5));
+  EXPECT_EQ(1U, datastore_->ExpireSeries(Timestamp(Timestamp::Now() + 1)));
+  // Writing more values doesn't change what the iterator returns either.
+  datastore_->Record(variable, Timestamp(start + 3), NewValue(100));
+
+  vector<uint64_t> timestamps;
+  for (; it != it.end(); ++it)
+    timestamps.push_back(it->timestamp());
+  ASSERT_EQ(4U, timestamps.size());
+  EXPECT_EQ(start + 2, timestamps.front());
+  EXPECT_EQ(start + 5, timestamps.back());
+}
+
+TEST_F(DiskDatastoreTest, InsertValueKeepsOrder) {
+  uint64_t start = Timestamp::Now();
+  Variable variable("/test/insert");
+  datastore_->Record(variable, Timestamp(start + 10), NewValue(1));
+  datastore_->Record(variable, Timestamp(start + 30), NewValue(3));
+  datastore_->Record(variable, Timestamp(start + 20), NewValue(2));
+  datastore_->Record(variable, Timestamp(start + 5), NewValue(0));
+  // A duplicate doesn't change anything.
+  datastore_->Record(variable, Timestamp(start + 20), NewValue(2));
+  vector<string> values = Values(variable.ToString());
+  ASSERT_EQ(4U, values.size());
+  EXPECT_EQ(StringPrintf("%lu=0", start + 5), values[0]);
+  EXPECT_EQ(StringPrintf("%lu=1", start + 10), values[1]);
+  EXPECT_EQ(StringPrintf("%lu=2", start + 20), values[2]);
+  EXPECT_EQ(StringPrintf("%lu=3", start + 30), values[3]);
+}
+
+TEST_F(DiskDatastoreTest, InsertValueSplitsRun) {
+  uint64_t start = Timestamp::Now();
+  Variable variable("/test/split");
+  for (int i = 0; i <= 10; ++i)
+    datastore_->Record(variable, Timestamp(start + i * 10), NewValue(1));
+  ASSERT_EQ(1U, Values(variable.ToString()).size());
+
+  // A different value in the middle of the run splits it in two.
+  datastore_->Record(variable, Timestamp(start + 45), NewValue(2));
+  vector<string> values = Values(variable.ToString());
+  ASSERT_EQ(3U, values.size());
+  EXPECT_EQ(StringPrintf("%lu=1", start), values[0]);
+  EXPECT_EQ(StringPrintf("%lu=2", start + 45), values[1]);
+  EXPECT_EQ(StringPrintf("%lu=1", start + 100), values[2]);
+
+  // A different value at the start of a run replaces it.
+  datastore_->Record(variable, Timestamp(start + 45), NewValue(3));
+  values = Values(variable.ToString());
+  ASSERT_EQ(3U, values.size());
+  EXPECT_EQ(StringPrintf("%lu=3", start + 45), values[1]);
+
+  // Both halves of a split run survive a restart.
+  Reopen();
+  EXPECT_EQ(values, Values(variable.ToString()));
+}
+
+TEST_F(DiskDatastoreTest, OutOfOrderValuesAreMerged) {
+  int32_t old_window = FLAGS_reorder_window;
+  FLAGS_reorder_window = 100;
+  uint64_t start = Timestamp::Now();
+  Variable variable("/test/late");
+  datastore_->Record(variable, Timestamp(start + 1000), NewValue(10));
+  datastore_->Record(variable, Timestamp(start + 2000), NewValue(20));
+  // These are well outside the reorder window.
+  datastore_->Record(variable, Timestamp(start + 1500), NewValue(15));
+  datastore_->Record(variable, Timestamp(start + 500), NewValue(5));
+  // This replaces a value in the stream, so it doesn't go to the out of order values.
+  datastore_->Record(variable, Timestamp(start + 1000), NewValue(11));
+  FLAGS_reorder_window = old_window;
+
+  vector<string> values = Values(variable.ToString());
+  ASSERT_EQ(4U, values.size());
+  EXPECT_EQ(StringPrintf("%lu=5", start + 500), values[0]);
+  EXPECT_EQ(StringPrintf("%lu=11", start + 1000), values[1]);
+  EXPECT_EQ(StringPrintf("%lu=15", start + 1500), values[2]);
+  EXPECT_EQ(StringPrintf("%lu=20", start + 2000), values[3]);
+
+  Reopen();
+  EXPECT_EQ(values, Values(variable.ToString()));
+}
+
+TEST_F(DiskDatastoreTest, LateValuesWithinRunAreMerged) {
+  int32_t old_window = FLAGS_reorder_window;
+  FLAGS_reorder_window = 1000;
+  uint64_t start = Timestamp::Now();
+  Variable variable("/test/laterun");
+  datastore_->Record(variable, Timestamp(start + 10000), NewValue(5));
+  datastore_->Record(variable, Timestamp(start + 20000), NewValue(5));
+  datastore_->Record(variable, Timestamp(start + 30000), NewValue(5));
+  vector<string> values = Values(variable.ToString());
+  ASSERT_EQ(1U, values.size());
+  EXPECT_EQ(StringPrintf("%lu=5-%lu", start + 10000, start + 30000), values[0]);
+
+  // A late retry of a value inside the run is a duplicate.
+  datastore_->Record(variable, Timestamp(start + 15000), NewValue(5));
+  EXPECT_EQ(values, Values(variable.ToString()));
+
+  // A late value which differs from the run splits it.
+  datastore_->Record(variable, Timestamp(start + 16000), NewValue(7));
+  FLAGS_reorder_window = old_window;
+  values = Values(variable.ToString());
+  ASSERT_EQ(3U, values.size());
+  EXPECT_EQ(StringPrintf("%lu=5", start + 10000), values[0]);
+  EXPECT_EQ(StringPrintf("%lu=7", start + 16000), values[1]);
+  EXPECT_EQ(StringPrintf("%lu=5", start + 30000), values[2]);
+
+  Reopen();
+  EXPECT_EQ(values, Values(variable.ToString()));
+}
+
+TEST_F(DiskDatastoreTest, ReplayMatchesMemory) {
+  uint64_t start = Timestamp::Now();
+  Variable variable("/test/replay");
+  // A long run, which is logged with its end much later than its start.
+  for (int i = 0; i < 100; ++i)
+    datastore_->Record(variable, Timestamp(start + i * 10000), NewValue(1));
+  datastore_->Record(variable, Timestamp(start + 995000), NewValue(2));
+  // One value out of order and one which splits the run.
+  datastore_->Record(variable, Timestamp(start + 500000), NewValue(3));
+  datastore_->Record(variable, Timestamp(start + 985000), NewValue(4));
+  vector<string> values = Values(variable.ToString());
+  ASSERT_EQ(5U, values.size());
+
+  Reopen();
+  EXPECT_EQ(values, Values(variable.ToString()));
+}
+
+}  // namespace openinstrument
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -14,6 +14,8 @@
 #include "lib/file.h"
 #include "lib/string.h"
 #include "lib/timer.h"
+#include "lib/variable.h"
+#include "lib/variable_matcher.h"
 #include "server/indexed_store_file.h"
 
 DECLARE_string(datastore);
@@ -59,9 +61,10 @@ void IndexedStoreFile::Clear() {
 
 bool IndexedStoreFile::GetVariable(const Variable &variable, vector<proto::ValueStream> *results) {
   VLOG(2) << "Reading variable " << variable.ToString() << " from " << filename;
+  VariableMatcher matcher(variable);
   for (auto &index : header_.index()) {
     Variable index_var(index.variable());
-    if (variable.Matches(index_var)) {
+    if (matcher.Matches(index_var)) {
       VLOG(2) << "Seeking to " << index.offset();
       reader_->fh()->SeekAbs(index.offset());
       proto::ValueStream stream;
@@ -70,7 +73,7 @@ bool IndexedStoreFile::GetVariable(const Variable &variable, vector<proto::Value
         break;
       }
       Variable stream_var(stream.variable());
-      if (!stream_var.Matches(index_var)) {
+      if (stream_var != index_var) {
         LOG(WARNING) << "Variable at " << index.offset() << " in " << filename << " does not match header";
         continue;
       }
@@ -36,6 +36,7 @@ class IndexedStoreFile : private noncopyable, public Refcountable {
     delete this;
   }
 
+  // Append every stream in the file that matches the search <variable> to <results>.
   bool GetVariable(const Variable &variable, vector<proto::ValueStream> *results);
 
   vector<proto::ValueStream> GetVariable(const Variable &variable) {
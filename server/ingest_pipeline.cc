@@ -0,0 +1,240 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/exported_vars.h"
+#include "lib/openinstrument.pb.h"
+#include "lib/ring_buffer.h"
+#include "lib/string.h"
+#include "lib/timer.h"
+#include "server/disk_datastore.h"
+#include "server/ingest_pipeline.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+namespace {
+
+// Counts a thread as being inside IngestPipeline::Add() for as long as it is in scope.
+class ScopedProducer : private noncopyable {
+ public:
+  explicit ScopedProducer(volatile uint32_t *count) : count_(count) {
+    // This is a full barrier, so the shutdown check which follows can't be done before the count is incremented.
+    __sync_fetch_and_add(count_, 1);
+  }
+
+  ~ScopedProducer() {
+    __sync_fetch_and_sub(count_, 1);
+  }
+
+ private:
+  volatile uint32_t *count_;
+};
+
+}  // namespace
+
+bool IngestPipeline::Ticket::Wait() {
+  MutexLock lock(mutex_);
+  while (pending_)
+    condvar_.wait(lock);
+  return !failed_;
+}
+
+void IngestPipeline::Ticket::Add() {
+  MutexLock lock(mutex_);
+  ++pending_;
+}
+
+void IngestPipeline::Ticket::Done(bool success) {
+  // Notify while holding the lock, as the waiting thread may destroy the ticket as soon as it can take the lock.
+  MutexLock lock(mutex_);
+  if (!success)
+    failed_ = true;
+  if (--pending_ == 0)
+    condvar_.notify_all();
+}
+
+IngestPipeline::IngestPipeline(DiskDatastore *datastore, AckMode ack_mode, uint64_t queue_size, uint64_t batch_size)
+  : datastore_(datastore),
+    ack_mode_(ack_mode),
+    batch_size_(std::max(batch_size, static_cast<uint64_t>(1))),
+    shutdown_(false),
+    stopping_(false),
+    producers_(0),
+    commit_stopping_(false),
+    committer_(NULL),
+    values_written_("/openinstrument/store/ingest/values-written"),
+    batches_written_("/openinstrument/store/ingest/batches-written"),
+    queue_full_waits_("/openinstrument/store/ingest/queue-full-waits"),
+    record_log_syncs_("/openinstrument/store/ingest/record-log-syncs") {
+  for (uint32_t i = 0; i < datastore_->num_shards(); ++i)
+    shards_.push_back(shared_ptr<Shard>(new Shard(queue_size)));
+  if (ack_mode_ == ACK_ON_COMMIT)
+    committer_.reset(new thread(bind(&IngestPipeline::CommitThread, this)));
+  for (uint32_t i = 0; i < shards_.size(); ++i)
+    shards_[i]->writer.reset(new thread(bind(&IngestPipeline::WriterThread, this, i)));
+}
+
+IngestPipeline::~IngestPipeline() {
+  Shutdown();
+}
+
+IngestPipeline::AckMode IngestPipeline::ParseAckMode(const string &mode) {
+  if (mode == "enqueue")
+    return ACK_ON_ENQUEUE;
+  if (mode == "commit")
+    return ACK_ON_COMMIT;
+  throw runtime_error(StringPrintf("Invalid ingest ack mode \"%s\", must be \"enqueue\" or \"commit\"", mode.c_str()));
+}
+
+void IngestPipeline::Add(const Series *series, const proto::Value &value, Ticket *ticket) {
+  ScopedProducer producer(&producers_);
+  if (shutdown_)
+    throw runtime_error("Ingest pipeline has been shut down");
+  Shard *shard = shards_[datastore_->ShardFor(series)].get();
+  Item item;
+  item.point.series = series;
+  item.point.value = value;
+  if (ticket && ack_mode_ == ACK_ON_COMMIT) {
+    item.ticket = ticket;
+    ticket->Add();
+  }
+
+  if (!shard->queue.TryPush(item)) {
+    ++queue_full_waits_;
+    Deadline deadline(5000);
+    while (!shard->queue.TryPush(item)) {
+      WakeWriter(shard);
+      if (!static_cast<uint64_t>(deadline)) {
+        if (item.ticket)
+          item.ticket->Done(false);
+        throw runtime_error("Ingest queue is full");
+      }
+      boost::this_thread::yield();
+    }
+  }
+  WakeWriter(shard);
+}
+
+void IngestPipeline::WakeWriter(Shard *shard) {
+  __sync_synchronize();
+  if (!shard->sleeping)
+    return;
+  MutexLock lock(shard->mutex);
+  shard->condvar.notify_one();
+}
+
+void IngestPipeline::Shutdown() {
+  if (shutdown_)
+    return;
+  shutdown_ = true;
+  __sync_synchronize();
+  // Any thread still in Add() saw shutdown_ unset, so wait for it to queue its value before stopping the writers.
+  while (producers_)
+    boost::this_thread::yield();
+  stopping_ = true;
+  for (auto &shard : shards_) {
+    WakeWriter(shard.get());
+    if (shard->writer.get())
+      shard->writer->join();
+  }
+  // The writers have handed over every ticket, so the commit thread can finish once it has synced them.
+  {
+    MutexLock lock(commit_mutex_);
+    commit_stopping_ = true;
+    commit_condvar_.notify_one();
+  }
+  if (committer_.get())
+    committer_->join();
+}
+
+void IngestPipeline::WriterThread(uint32_t shard_index) {
+  Shard &shard = *shards_[shard_index];
+  vector<Item> batch;
+  vector<DatastorePoint *> points;
+  batch.reserve(batch_size_);
+  points.reserve(batch_size_);
+  while (true) {
+    // Once stopping_ is set nothing more is queued, so an empty queue after that means the writer is finished.
+    bool stopping = stopping_;
+    __sync_synchronize();
+    batch.clear();
+    shard.queue.PopBatch(&batch, batch_size_);
+    if (batch.empty()) {
+      if (stopping)
+        break;
+      MutexLock lock(shard.mutex);
+      shard.sleeping = true;
+      __sync_synchronize();
+      // Producers only signal a sleeping writer, so time out in case a signal raced with going to sleep.
+      if (shard.queue.empty())
+        shard.condvar.timed_wait(lock, boost::posix_time::milliseconds(10));
+      shard.sleeping = false;
+      continue;
+    }
+
+    points.clear();
+    for (Item &item : batch)
+      points.push_back(&item.point);
+
+    bool success = true;
+    try {
+      datastore_->RecordBatch(shard_index, points);
+    } catch (exception &e) {
+      LOG(WARNING) << "Error writing " << points.size() << " values to datastore shard " << shard_index << ": "
+                   << e.what();
+      success = false;
+    }
+    if (success) {
+      // The values are in the record log, but aren't committed until the commit thread has synced it.
+      MutexLock lock(commit_mutex_);
+      bool was_empty = commit_tickets_.empty();
+      for (Item &item : batch) {
+        if (item.ticket)
+          commit_tickets_.push_back(item.ticket);
+      }
+      if (was_empty && !commit_tickets_.empty())
+        commit_condvar_.notify_one();
+    } else {
+      for (Item &item : batch) {
+        if (item.ticket)
+          item.ticket->Done(false);
+      }
+    }
+    values_written_ += points.size();
+    ++batches_written_;
+  }
+}
+
+void IngestPipeline::CommitThread() {
+  vector<Ticket *> tickets;
+  while (true) {
+    {
+      MutexLock lock(commit_mutex_);
+      while (commit_tickets_.empty() && !commit_stopping_)
+        commit_condvar_.wait(lock);
+      if (commit_tickets_.empty())
+        break;
+      tickets.swap(commit_tickets_);
+    }
+    // Everything that arrived while the last sync was running is committed by this one.
+    bool success = datastore_->FlushRecordLog();
+    if (!success)
+      LOG(WARNING) << "Error flushing record log";
+    ++record_log_syncs_;
+    for (Ticket *ticket : tickets)
+      ticket->Done(success);
+    tickets.clear();
+  }
+}
+
+}  // namespace openinstrument
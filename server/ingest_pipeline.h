@@ -0,0 +1,129 @@
+/*
+ * Staged ingest pipeline for the datastore server.
+ *
+ * HTTP threads validate incoming values and push them onto a bounded lock-free queue, one per datastore shard. A
+ * dedicated writer thread per shard drains its queue in batches into the datastore and the record log, so request
+ * threads never contend on the datastore locks. When values are acknowledged on commit, the writers hand their tickets
+ * to a single commit thread, which syncs the record log once for everything that is waiting.
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef OPENINSTRUMENT_SERVER_INGEST_PIPELINE_H_
+#define OPENINSTRUMENT_SERVER_INGEST_PIPELINE_H_
+
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/exported_vars.h"
+#include "lib/openinstrument.pb.h"
+#include "lib/ring_buffer.h"
+#include "server/disk_datastore.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+class IngestPipeline : private noncopyable {
+ public:
+  enum AckMode {
+    // Values are acknowledged as soon as they have been queued.
+    ACK_ON_ENQUEUE,
+    // Values are acknowledged once they are in the datastore and the record log has been flushed to disk.
+    ACK_ON_COMMIT,
+  };
+
+  // Tracks a group of values added by a single request, so that the request can wait for all of them to be committed.
+  // A Ticket must not be destroyed until Wait() has returned.
+  class Ticket : private noncopyable {
+   public:
+    Ticket() : pending_(0), failed_(false) {}
+
+    // Block until every value added with this ticket has been committed.
+    // Returns false if any of the values could not be written.
+    bool Wait();
+
+   private:
+    void Add();
+    void Done(bool success);
+
+    uint64_t pending_;
+    bool failed_;
+    Mutex mutex_;
+    boost::condition_variable condvar_;
+
+    friend class IngestPipeline;
+  };
+
+  // Create one queue and one writer thread for every shard in <datastore>.
+  // Each queue holds up to <queue_size> values, and writer threads write at most <batch_size> values at a time.
+  IngestPipeline(DiskDatastore *datastore, AckMode ack_mode, uint64_t queue_size, uint64_t batch_size);
+  ~IngestPipeline();
+
+  // Queue a single value to be written. The value must have its timestamp set.
+  // If <ticket> is supplied and the pipeline acknowledges on commit, the ticket will track this value.
+  // If the shard queue is full this will wait for space, and throws runtime_error if none becomes available.
+  void Add(const Series *series, const proto::Value &value, Ticket *ticket);
+
+  // Stop accepting values, write everything that is queued and stop the writer threads.
+  // Add() either throws or has queued its value by the time this returns, so every ticket is eventually completed.
+  void Shutdown();
+
+  inline AckMode ack_mode() const {
+    return ack_mode_;
+  }
+
+  // Parse "enqueue" or "commit" into an AckMode, throwing runtime_error for anything else.
+  static AckMode ParseAckMode(const string &mode);
+
+ private:
+  struct Item {
+    Item() : ticket(NULL) {}
+    DatastorePoint point;
+    Ticket *ticket;
+  };
+
+  struct Shard {
+    explicit Shard(uint64_t queue_size) : queue(queue_size), sleeping(false), writer(NULL) {}
+    MpscRingBuffer<Item> queue;
+    Mutex mutex;
+    boost::condition_variable condvar;
+    volatile bool sleeping;
+    scoped_ptr<thread> writer;
+  };
+
+  void WriterThread(uint32_t shard_index);
+  void WakeWriter(Shard *shard);
+  void CommitThread();
+
+  DiskDatastore *datastore_;
+  const AckMode ack_mode_;
+  const uint64_t batch_size_;
+  // Set when Shutdown() is called, after which Add() throws.
+  volatile bool shutdown_;
+  // Set once every Add() that got past the shutdown check has queued its value, so the writers can stop as soon as
+  // their queues are empty.
+  volatile bool stopping_;
+  // Number of threads inside Add().
+  volatile uint32_t producers_;
+  vector<shared_ptr<Shard>> shards_;
+
+  // Tickets of values which are in the datastore and waiting for the record log to be synced, one entry per value.
+  vector<Ticket *> commit_tickets_;
+  Mutex commit_mutex_;
+  boost::condition_variable commit_condvar_;
+  // Set once the writers have stopped, so the commit thread can stop when it has nothing left to sync.
+  bool commit_stopping_;
+  scoped_ptr<thread> committer_;
+
+  ExportedInteger values_written_;
+  ExportedInteger batches_written_;
+  ExportedInteger queue_full_waits_;
+  ExportedInteger record_log_syncs_;
+};
+
+}  // namespace openinstrument
+
+#endif  // OPENINSTRUMENT_SERVER_INGEST_PIPELINE_H_
@@ -0,0 +1,188 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/file.h"
+#include "lib/openinstrument.pb.h"
+#include "lib/string.h"
+#include "lib/timer.h"
+#include "server/disk_datastore.h"
+#include "server/ingest_pipeline.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+class IngestPipelineTest : public ::testing::Test {
+ protected:
+  IngestPipelineTest() : datastore_(NULL) {}
+
+  void SetUp() {
+    char dir[] = "/tmp/ingest_pipeline_testXXXXXX";
+    ASSERT_TRUE(mkdtemp(dir));
+    dir_ = dir;
+    datastore_.reset(new DiskDatastore(dir_));
+  }
+
+  void TearDown() {
+    datastore_.reset();
+    for (auto &filename : Glob(dir_ + "/*"))
+      unlink(filename.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  const Series *Intern(const string &variable) {
+    return datastore_->registry().Intern(Variable(variable));
+  }
+
+  static proto::Value NewValue(uint64_t timestamp, double double_value) {
+    proto::Value value;
+    value.set_timestamp(timestamp);
+    value.set_double_value(double_value);
+    return value;
+  }
+
+  string dir_;
+  scoped_ptr<DiskDatastore> datastore_;
+};
+
+// Add <count> increasing values to each of <series>, interleaving the series.
+void AddValues(IngestPipeline *pipeline, const vector<const Series *> &series, uint64_t start, int count) {
+  for (int i = 0; i < count; ++i) {
+    for (const Series *s : series) {
+      proto::Value value;
+      value.set_timestamp(start + i);
+      value.set_double_value(i);
+      pipeline->Add(s, value, NULL);
+    }
+  }
+}
+
+// Add values with <ticket> until the pipeline is shut down, then wait for all of them to be committed.
+void AddUntilShutdown(IngestPipeline *pipeline, const Series *series, uint64_t start, uint64_t *added, bool *success) {
+  IngestPipeline::Ticket ticket;
+  try {
+    while (true) {
+      proto::Value value;
+      value.set_timestamp(start + *added);
+      value.set_double_value(*added);
+      pipeline->Add(series, value, &ticket);
+      ++*added;
+    }
+  } catch (runtime_error &e) {
+  }
+  *success = ticket.Wait();
+}
+
+TEST_F(IngestPipelineTest, ValuesFromEachProducerStayInOrder) {
+  // A small queue makes the producers wait for the writers.
+  IngestPipeline pipeline(datastore_.get(), IngestPipeline::ACK_ON_ENQUEUE, 16, 8);
+  uint64_t start = Timestamp::Now();
+  vector<shared_ptr<thread>> threads;
+  vector<vector<const Series *>> series(4);
+  for (size_t i = 0; i < series.size(); ++i) {
+    for (int j = 0; j < 4; ++j)
+      series[i].push_back(Intern(StringPrintf("/test/ordering{producer=%lu,series=%d}", i, j)));
+    threads.push_back(shared_ptr<thread>(new thread(bind(&AddValues, &pipeline, series[i], start, 1000))));
+  }
+  for (auto &t : threads)
+    t->join();
+  pipeline.Shutdown();
+
+  for (auto &producer : series) {
+    for (const Series *s : producer) {
+      proto::ValueStream stream;
+      ASSERT_TRUE(datastore_->GetValueStream(s->variable(), &stream));
+      ASSERT_EQ(1000, stream.value_size());
+      for (int i = 0; i < stream.value_size(); ++i) {
+        EXPECT_EQ(start + i, stream.value(i).timestamp());
+        EXPECT_EQ(i, stream.value(i).double_value());
+      }
+    }
+  }
+}
+
+TEST_F(IngestPipelineTest, TicketWaitsForCommit) {
+  IngestPipeline pipeline(datastore_.get(), IngestPipeline::ACK_ON_COMMIT, 1024, 16);
+  const Series *series = Intern("/test/ticket");
+  uint64_t start = Timestamp::Now();
+  IngestPipeline::Ticket ticket;
+  for (int i = 0; i < 100; ++i)
+    pipeline.Add(series, NewValue(start + i, i), &ticket);
+  EXPECT_TRUE(ticket.Wait());
+
+  // Everything is in the datastore and the record log as soon as the wait returns.
+  proto::ValueStream stream;
+  ASSERT_TRUE(datastore_->GetValueStream(series->variable(), &stream));
+  EXPECT_EQ(100, stream.value_size());
+  EXPECT_TRUE(FileStat(dir_ + "/recordlog").exists());
+
+  // A ticket with nothing added to it doesn't wait.
+  IngestPipeline::Ticket empty;
+  EXPECT_TRUE(empty.Wait());
+}
+
+TEST_F(IngestPipelineTest, TicketFailsIfRecordLogCantBeWritten) {
+  IngestPipeline pipeline(datastore_.get(), IngestPipeline::ACK_ON_COMMIT, 1024, 16);
+  const Series *series = Intern("/test/unwritable");
+  uint64_t start = Timestamp::Now();
+  // A directory in place of the record log can't be opened for writing.
+  unlink((dir_ + "/recordlog").c_str());
+  ASSERT_EQ(0, mkdir((dir_ + "/recordlog").c_str(), 0755));
+  IngestPipeline::Ticket ticket;
+  for (int i = 0; i < 10; ++i)
+    pipeline.Add(series, NewValue(start + i, i), &ticket);
+  EXPECT_FALSE(ticket.Wait());
+
+  // The values are kept, and written by the next flush that succeeds.
+  rmdir((dir_ + "/recordlog").c_str());
+  EXPECT_TRUE(datastore_->FlushRecordLog());
+  EXPECT_LT(0, FileStat(dir_ + "/recordlog").size());
+}
+
+TEST_F(IngestPipelineTest, ShutdownCompletesTickets) {
+  IngestPipeline pipeline(datastore_.get(), IngestPipeline::ACK_ON_COMMIT, 64, 16);
+  uint64_t start = Timestamp::Now();
+  const int num_producers = 4;
+  vector<const Series *> series;
+  vector<uint64_t> added(num_producers, 0);
+  bool success[num_producers];
+  vector<shared_ptr<thread>> threads;
+  for (int i = 0; i < num_producers; ++i) {
+    series.push_back(Intern(StringPrintf("/test/shutdown{producer=%d}", i)));
+    threads.push_back(shared_ptr<thread>(new thread(bind(&AddUntilShutdown, &pipeline, series[i], start, &added[i],
+                                                         &success[i]))));
+  }
+  usleep(100000);
+  pipeline.Shutdown();
+  // Each producer only returns once every value it added has been committed.
+  for (int i = 0; i < num_producers; ++i) {
+    threads[i]->join();
+    EXPECT_TRUE(success[i]);
+    EXPECT_LT(0U, added[i]);
+    proto::ValueStream stream;
+    ASSERT_TRUE(datastore_->GetValueStream(series[i]->variable(), &stream));
+    EXPECT_EQ(added[i], static_cast<uint64_t>(stream.value_size()));
+  }
+
+  IngestPipeline::Ticket ticket;
+  EXPECT_THROW(pipeline.Add(series[0], NewValue(start, 1), &ticket), runtime_error);
+  EXPECT_TRUE(ticket.Wait());
+}
+
+}  // namespace openinstrument
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
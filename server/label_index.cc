@@ -0,0 +1,552 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/regex.hpp>
+#include "lib/common.h"
+#include "lib/hyperloglog.h"
+#include "lib/trie.h"
+#include "lib/variable.h"
+#include "lib/variable_matcher.h"
+#include "server/label_index.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+namespace {
+
+// A wildcard term is checked against each candidate instead of being resolved when it is estimated to match more than
+// this many times as many series as there are candidates.
+const uint64_t kFilterRatio = 8;
+
+// The next ID to merge from a postings list in Union(), and the end of the list.
+typedef std::pair<PostingsList::const_iterator, PostingsList::const_iterator> PostingsCursor;
+
+// Heap order for Union(), putting the list with the smallest next ID on top.
+inline bool CursorAfter(const PostingsCursor &a, const PostingsCursor &b) {
+  return *a.first > *b.first;
+}
+
+inline bool SeriesKeyLess(const Series *a, const Series *b) {
+  return a->key() < b->key();
+}
+
+inline bool SeriesKeyNotAfter(const Series *series, const string &key) {
+  return series->key() <= key;
+}
+
+}  // namespace
+
+bool LabelIndex::TermEstimateLess(const Term &a, const Term &b) {
+  return a.estimate < b.estimate;
+}
+
+bool LabelIndex::MostValuesFirst(const LabelEntry &a, const LabelEntry &b) {
+  if (a.second->values.size() != b.second->values.size())
+    return a.second->values.size() > b.second->values.size();
+  return *a.first < *b.first;
+}
+
+bool LabelIndex::MostSeriesFirst(const ValueMap::const_iterator &a, const ValueMap::const_iterator &b) {
+  if (a->second.size() != b->second.size())
+    return a->second.size() > b->second.size();
+  return a->first < b->first;
+}
+
+bool LabelIndex::AddToPostings(SeriesId id, PostingsList *postings) {
+  if (postings->empty() || postings->back() < id) {
+    postings->push_back(id);
+    return true;
+  }
+  PostingsList::iterator it = std::lower_bound(postings->begin(), postings->end(), id);
+  if (it != postings->end() && *it == id)
+    return false;
+  postings->insert(it, id);
+  return true;
+}
+
+void LabelIndex::Add(const Series *series) {
+  ExclusiveLock lock(mutex_);
+  AddToPostings(series->id(), &all_);
+  const string &name = series->variable().variable();
+  Trie<PostingsList>::iterator it = names_.find(name);
+  if (it == names_.end()) {
+    names_.insert(name, PostingsList());
+    it = names_.find(name);
+  }
+  AddToPostings(series->id(), &*it);
+  const Variable::MapType &labels = series->variable().labels();
+  for (Variable::MapType::const_iterator i = labels.begin(); i != labels.end(); ++i) {
+    LabelInfo &info = labels_[i->first];
+    ValueMap::iterator value = info.values.find(i->second);
+    if (value == info.values.end()) {
+      value = info.values.insert(ValueMap::value_type(i->second, PostingsList())).first;
+    }
+    if (AddToPostings(series->id(), &value->second))
+      ++info.series;
+  }
+}
+
+void LabelIndex::RemoveFromPostings(const PostingsList &ids, PostingsList *postings) {
+  PostingsList temp;
+  Difference(*postings, ids, &temp);
+  postings->swap(temp);
+}
+
+void LabelIndex::Remove(const vector<const Series *> &series) {
+  if (series.empty())
+    return;
+  // Group the IDs by the postings lists they are in, so that each list is only rewritten once.
+  PostingsList ids;
+  unordered_map<string, PostingsList> names;
+  std::map<std::pair<string, string>, PostingsList> label_values;
+  for (const Series *removed : series) {
+    ids.push_back(removed->id());
+    names[removed->variable().variable()].push_back(removed->id());
+    const Variable::MapType &labels = removed->variable().labels();
+    for (Variable::MapType::const_iterator i = labels.begin(); i != labels.end(); ++i)
+      label_values[*i].push_back(removed->id());
+  }
+  std::sort(ids.begin(), ids.end());
+
+  ExclusiveLock lock(mutex_);
+  RemoveFromPostings(ids, &all_);
+  for (auto &name : names) {
+    Trie<PostingsList>::iterator it = names_.find(name.first);
+    if (it == names_.end())
+      continue;
+    std::sort(name.second.begin(), name.second.end());
+    RemoveFromPostings(name.second, &*it);
+    if (it->empty())
+      names_.erase(name.first);
+  }
+  for (auto &label_value : label_values) {
+    unordered_map<string, LabelInfo>::iterator info = labels_.find(label_value.first.first);
+    if (info == labels_.end())
+      continue;
+    ValueMap::iterator value = info->second.values.find(label_value.first.second);
+    if (value == info->second.values.end())
+      continue;
+    std::sort(label_value.second.begin(), label_value.second.end());
+    uint64_t before = value->second.size();
+    RemoveFromPostings(label_value.second, &value->second);
+    info->second.series -= before - value->second.size();
+    if (value->second.empty()) {
+      info->second.values.erase(value);
+      if (info->second.values.empty())
+        labels_.erase(info);
+    }
+  }
+}
+
+uint64_t LabelIndex::size() const {
+  SharedLock lock(mutex_);
+  return all_.size();
+}
+
+void LabelIndex::Intersect(const PostingsList &a, const PostingsList &b, PostingsList *output) {
+  output->clear();
+  const PostingsList &small = a.size() <= b.size() ? a : b;
+  const PostingsList &large = a.size() <= b.size() ? b : a;
+  if (small.empty())
+    return;
+  if (large.size() / small.size() < 8) {
+    // Similar sizes, a linear merge is fastest.
+    std::set_intersection(small.begin(), small.end(), large.begin(), large.end(), std::back_inserter(*output));
+    return;
+  }
+  PostingsList::const_iterator pos = large.begin();
+  for (SeriesId id : small) {
+    // Gallop forward to find a range containing <id>, then binary search within it.
+    size_t step = 1;
+    PostingsList::const_iterator hi = pos;
+    while (hi != large.end() && *hi < id) {
+      pos = hi;
+      if (static_cast<size_t>(large.end() - hi) <= step) {
+        hi = large.end();
+        break;
+      }
+      hi += step;
+      step <<= 1;
+    }
+    pos = std::lower_bound(pos, hi, id);
+    if (pos == large.end())
+      break;
+    if (*pos == id)
+      output->push_back(id);
+  }
+}
+
+void LabelIndex::Difference(const PostingsList &a, const PostingsList &b, PostingsList *output) {
+  output->clear();
+  output->reserve(a.size());
+  std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(*output));
+}
+
+void LabelIndex::Union(const vector<const PostingsList *> &lists, PostingsList *output) {
+  output->clear();
+  if (lists.size() == 1) {
+    *output = *lists[0];
+    return;
+  }
+  uint64_t total = 0;
+  for (const PostingsList *list : lists)
+    total += list->size();
+  output->reserve(total);
+  if (lists.size() == 2) {
+    std::set_union(lists[0]->begin(), lists[0]->end(), lists[1]->begin(), lists[1]->end(),
+                   std::back_inserter(*output));
+    return;
+  }
+  // Every list is already sorted, so merge them with a heap holding the next ID from each list, smallest on top.
+  vector<PostingsCursor> heap;
+  heap.reserve(lists.size());
+  for (const PostingsList *list : lists) {
+    if (!list->empty())
+      heap.push_back(PostingsCursor(list->begin(), list->end()));
+  }
+  std::make_heap(heap.begin(), heap.end(), CursorAfter);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), CursorAfter);
+    PostingsCursor &cursor = heap.back();
+    if (output->empty() || output->back() != *cursor.first)
+      output->push_back(*cursor.first);
+    if (++cursor.first == cursor.second)
+      heap.pop_back();
+    else
+      std::push_heap(heap.begin(), heap.end(), CursorAfter);
+  }
+}
+
+bool LabelIndex::PlanTerm(const string &label, const string &value, Term *term) const {
+  if (value.empty()) {
+    // Only series without the label match an empty value.
+    return false;
+  }
+  term->label = &label;
+  term->value = &value;
+  unordered_map<string, LabelInfo>::const_iterator info = labels_.find(label);
+  term->info = info == labels_.end() ? NULL : &info->second;
+  if (value == "*") {
+    // Any series with the label
+    term->type = Term::ANY;
+    term->estimate = term->info ? term->info->series : 0;
+    return true;
+  }
+  if (value.size() > 2 && value[0] == '/' && value[value.size() - 1] == '/') {
+    term->type = Term::REGEX;
+    term->regex.reset(new boost::regex(value.substr(1, value.size() - 2)));
+    if (boost::regex_match("", *term->regex))
+      return false;
+    term->estimate = term->info ? term->info->series : 0;
+    return true;
+  }
+  term->type = Term::LITERAL;
+  if (term->info) {
+    ValueMap::const_iterator postings = term->info->values.find(value);
+    if (postings != term->info->values.end())
+      term->postings = &postings->second;
+  }
+  term->estimate = term->postings ? term->postings->size() : 0;
+  return true;
+}
+
+void LabelIndex::ResolveTerm(const Term &term, PostingsList *output) const {
+  output->clear();
+  if (term.postings) {
+    *output = *term.postings;
+    return;
+  }
+  if (!term.info)
+    return;
+  // Wildcards are evaluated once against each distinct value of the label.
+  vector<const PostingsList *> lists;
+  for (ValueMap::const_iterator i = term.info->values.begin(); i != term.info->values.end(); ++i) {
+    if (term.type == Term::ANY || boost::regex_match(i->first, *term.regex))
+      lists.push_back(&i->second);
+  }
+  if (!lists.empty())
+    Union(lists, output);
+}
+
+void LabelIndex::FilterTerm(const Term &term, PostingsList *candidates) const {
+  PostingsList::iterator output = candidates->begin();
+  for (SeriesId id : *candidates) {
+    const Series *series = registry_->Find(id);
+    if (!series)
+      continue;
+    const string &value = series->variable().GetLabel(*term.label);
+    if (value.empty())
+      continue;
+    if (term.type == Term::REGEX && !boost::regex_match(value, *term.regex))
+      continue;
+    if (term.type == Term::LITERAL && value != *term.value)
+      continue;
+    *output++ = id;
+  }
+  candidates->erase(output, candidates->end());
+}
+
+bool LabelIndex::FindLabels(const Variable &search, const PostingsList *candidates, PostingsList *output,
+                            bool *exact, bool *constrained) const {
+  output->clear();
+  vector<Term> terms;
+  if (candidates) {
+    if (candidates->empty())
+      return false;
+    terms.push_back(Term());
+    terms.back().postings = candidates;
+    terms.back().estimate = candidates->size();
+  }
+  const Variable::MapType &labels = search.labels();
+  for (Variable::MapType::const_iterator i = labels.begin(); i != labels.end(); ++i) {
+    terms.push_back(Term());
+    if (!PlanTerm(i->first, i->second, &terms.back())) {
+      terms.pop_back();
+      *exact = false;
+      continue;
+    }
+    if (!terms.back().estimate)
+      return false;
+  }
+  *constrained = !terms.empty();
+  if (terms.empty())
+    return true;
+
+  // Start with the most selective term so the intermediate results stay small. Wildcards which match far more series
+  // than are left are then checked against the remaining candidates rather than being resolved.
+  std::sort(terms.begin(), terms.end(), TermEstimateLess);
+  ResolveTerm(terms[0], output);
+  PostingsList resolved, temp;
+  for (size_t i = 1; i < terms.size() && !output->empty(); i++) {
+    const Term &term = terms[i];
+    if (!term.postings && term.estimate / kFilterRatio > output->size()) {
+      FilterTerm(term, output);
+      continue;
+    }
+    const PostingsList *list = term.postings;
+    if (!list) {
+      ResolveTerm(term, &resolved);
+      list = &resolved;
+    }
+    Intersect(*output, *list, &temp);
+    output->swap(temp);
+  }
+  return !output->empty();
+}
+
+void LabelIndex::GetLabelStats(const proto::LabelStatsRequest &request, proto::LabelStatsResponse *response) const {
+  SharedLock lock(mutex_);
+  vector<LabelEntry> entries;
+  for (unordered_map<string, LabelInfo>::const_iterator i = labels_.begin(); i != labels_.end(); ++i) {
+    if (request.has_label() && i->first != request.label())
+      continue;
+    entries.push_back(LabelEntry(&i->first, &i->second));
+  }
+  uint64_t num_labels = entries.size();
+  if (request.max_labels() && request.max_labels() < num_labels)
+    num_labels = request.max_labels();
+  std::partial_sort(entries.begin(), entries.begin() + num_labels, entries.end(), MostValuesFirst);
+
+  vector<ValueMap::const_iterator> values;
+  for (uint64_t i = 0; i < num_labels; i++) {
+    const LabelInfo &info = *entries[i].second;
+    proto::LabelStats *stats = response->add_label();
+    stats->set_label(*entries[i].first);
+    stats->set_series(info.series);
+    stats->set_distinct_values(info.values.size());
+    if (request.include_value_sketch()) {
+      // The sketch is only needed so that other servers' statistics can be merged with these, so it is built from the
+      // exact values here rather than kept up to date as series come and go.
+      HyperLogLog sketch;
+      for (ValueMap::const_iterator v = info.values.begin(); v != info.values.end(); ++v)
+        sketch.Add(v->first);
+      stats->set_value_sketch(sketch.registers());
+    }
+
+    uint64_t num_values = std::min(static_cast<uint64_t>(request.max_values()),
+                                   static_cast<uint64_t>(info.values.size()));
+    if (!num_values)
+      continue;
+    values.clear();
+    for (ValueMap::const_iterator v = info.values.begin(); v != info.values.end(); ++v)
+      values.push_back(v);
+    std::partial_sort(values.begin(), values.begin() + num_values, values.end(), MostSeriesFirst);
+    for (uint64_t v = 0; v < num_values; v++) {
+      proto::LabelValueStats *value = stats->add_value();
+      value->set_value(values[v]->first);
+      value->set_series(values[v]->second.size());
+    }
+  }
+}
+
+proto::LabelStatsRequest LabelIndex::StatusLabelStatsRequest() {
+  proto::LabelStatsRequest request;
+  request.set_max_labels(20);
+  request.set_max_values(5);
+  return request;
+}
+
+void LabelIndex::GetLabelValues(const proto::LabelValuesRequest &request, proto::LabelValuesResponse *response) const {
+  PostingsList selected;
+  if (request.has_selector())
+    selected = Find(Variable(request.selector()));
+  SharedLock lock(mutex_);
+  unordered_map<string, LabelInfo>::const_iterator info = labels_.find(request.label());
+  if (info == labels_.end() || (request.has_selector() && selected.empty()))
+    return;
+  const ValueMap &values = info->second.values;
+  uint64_t max_values = request.max_values() ? request.max_values() : values.size();
+
+  if (request.has_selector() && selected.size() * kFilterRatio < info->second.series) {
+    // Far fewer series were selected than have the label, so look up each one's value rather than intersecting the
+    // selection with the postings of every value.
+    std::map<string, uint64_t> counts;
+    for (SeriesId id : selected) {
+      const Series *series = registry_->Find(id);
+      if (!series)
+        continue;
+      const string &value = series->variable().GetLabel(request.label());
+      if (!value.empty())
+        ++counts[value];
+    }
+    for (std::map<string, uint64_t>::const_iterator i = counts.begin();
+         i != counts.end() && static_cast<uint64_t>(response->value_size()) < max_values; ++i) {
+      proto::LabelValueStats *value = response->add_value();
+      value->set_value(i->first);
+      value->set_series(i->second);
+    }
+    return;
+  }
+
+  PostingsList matches;
+  for (ValueMap::const_iterator i = values.begin();
+       i != values.end() && static_cast<uint64_t>(response->value_size()) < max_values; ++i) {
+    uint64_t series = i->second.size();
+    if (request.has_selector()) {
+      Intersect(i->second, selected, &matches);
+      series = matches.size();
+      if (!series)
+        continue;
+    }
+    proto::LabelValueStats *value = response->add_value();
+    value->set_value(i->first);
+    value->set_series(series);
+  }
+}
+
+PostingsList LabelIndex::Find(const Variable &search) const {
+  SharedLock lock(mutex_);
+  const string &name = search.variable();
+  PostingsList prefix_postings;
+  const PostingsList *name_postings = NULL;
+  if (!name.empty() && name[name.size() - 1] == '*') {
+    // A bare "*" places no restriction on the name.
+    if (name.size() > 1) {
+      vector<const PostingsList *> lists;
+      for (Trie<PostingsList>::iterator it = names_.find_prefix(name.substr(0, name.size() - 1)); it != names_.end();
+           ++it) {
+        lists.push_back(&*it);
+      }
+      Union(lists, &prefix_postings);
+      name_postings = &prefix_postings;
+    }
+  } else {
+    Trie<PostingsList>::iterator it = names_.find(name);
+    if (it == names_.end())
+      return PostingsList();
+    name_postings = &*it;
+  }
+
+  bool exact = true, constrained = false;
+  PostingsList result;
+  if (!FindLabels(search, name_postings, &result, &exact, &constrained))
+    return PostingsList();
+  if (!constrained)
+    result = all_;
+  if (exact)
+    return result;
+
+  // Some terms couldn't be answered by the index, check those candidates directly.
+  lock.unlock();
+  VariableMatcher matcher(search);
+  PostingsList filtered;
+  for (SeriesId id : result) {
+    const Series *series = registry_->Find(id);
+    if (series && matcher.Matches(series->variable()))
+      filtered.push_back(id);
+  }
+  return filtered;
+}
+
+vector<const Series *> LabelIndex::FindSorted(const Variable &search, uint64_t limit, const PostingsFilter *filter,
+                                              const string &start_after) const {
+  vector<const Series *> output;
+  SharedLock lock(mutex_);
+  bool exact = true, constrained = false;
+  PostingsList label_postings;
+  const PostingsList *candidates = filter && !filter->exclude ? &filter->ids : NULL;
+  if (!FindLabels(search, candidates, &label_postings, &exact, &constrained))
+    return output;
+  const PostingsList *excluded = filter && filter->exclude && !filter->ids.empty() ? &filter->ids : NULL;
+  scoped_ptr<VariableMatcher> matcher(exact ? NULL : new VariableMatcher(search));
+
+  const string &name = search.variable();
+  bool prefix = !name.empty() && name[name.size() - 1] == '*';
+  string stem = prefix ? name.substr(0, name.size() - 1) : name;
+  // Series are returned ordered by name and then by key, so a search resuming after <start_after> seeks straight to
+  // its name and skips only the series in that name which were already returned.
+  string start_name = start_after.empty() ? "" : Variable(start_after).variable();
+  Trie<PostingsList>::iterator it;
+  if (prefix)
+    it = names_.lower_bound(std::max(stem, start_name));
+  else if (start_name <= name)
+    it = names_.find(name);
+  else
+    it = names_.end();
+  PostingsList matches, remaining;
+  vector<const Series *> group;
+  for (; it != names_.end() && (!limit || output.size() < limit); ++it) {
+    // lower_bound() continues past the end of the prefix, and find() on to the following names.
+    if (it.key().compare(0, stem.size(), stem) != 0 || (!prefix && it.key().size() != stem.size()))
+      break;
+    const PostingsList *ids = &*it;
+    if (constrained) {
+      Intersect(*ids, label_postings, &matches);
+      ids = &matches;
+    }
+    if (excluded) {
+      Difference(*ids, *excluded, &remaining);
+      ids = &remaining;
+    }
+    group.clear();
+    for (SeriesId id : *ids) {
+      const Series *series = registry_->Find(id);
+      if (series && (!matcher.get() || matcher->Matches(series->variable())))
+        group.push_back(series);
+    }
+    // Only the series after <start_after>, and only as many of them as are still needed, have to be put in order.
+    // Sorting just those keeps each page of a name with many series from costing a sort of all of them.
+    vector<const Series *>::iterator first = group.begin();
+    if (!start_after.empty() && it.key() == start_name)
+      first = std::partition(group.begin(), group.end(), bind(&SeriesKeyNotAfter, _1, start_after));
+    vector<const Series *>::iterator last = group.end();
+    if (limit && static_cast<uint64_t>(last - first) > limit - output.size())
+      last = first + (limit - output.size());
+    std::partial_sort(first, last, group.end(), SeriesKeyLess);
+    output.insert(output.end(), first, last);
+  }
+  return output;
+}
+
+}  // namespace openinstrument
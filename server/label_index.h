@@ -0,0 +1,164 @@
+/*
+ * Inverted index of series names and labels.
+ *
+ * Every series is added to a postings list for its name and for each of its (label, value) pairs. Postings lists are
+ * sorted vectors of SeriesId, so a search is resolved by intersecting the lists for each term in the search variable
+ * rather than by comparing every series against it.
+ *
+ * The index also keeps per-label cardinality statistics, which are used to plan searches and are exported to show
+ * which labels are responsible for large numbers of series.
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef OPENINSTRUMENT_SERVER_LABEL_INDEX_H_
+#define OPENINSTRUMENT_SERVER_LABEL_INDEX_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/regex.hpp>
+#include "lib/common.h"
+#include "lib/openinstrument.pb.h"
+#include "lib/trie.h"
+#include "lib/variable.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+typedef vector<SeriesId> PostingsList;
+
+// Restricts a search to part of the index.
+struct PostingsFilter {
+  PostingsFilter() : exclude(false) {}
+  // Sorted series IDs.
+  PostingsList ids;
+  // If set, <ids> are the series to leave out, rather than the only series to include.
+  bool exclude;
+};
+
+class LabelIndex : private noncopyable {
+ public:
+  // <registry> is used to look up the series for search terms which can't be answered by the index alone.
+  explicit LabelIndex(const SeriesRegistry *registry) : registry_(registry) {}
+
+  // Add a series to the index. Adding a series more than once has no effect.
+  void Add(const Series *series);
+
+  // Remove a batch of series from the index. Series which aren't in the index are ignored.
+  void Remove(const vector<const Series *> &series);
+
+  // Return the sorted IDs of every series in the index which matches <search>, using the same rules as
+  // Variable::Matches().
+  PostingsList Find(const Variable &search) const;
+
+  // Like Find(), but returns the matching series ordered by name and then by key. If <limit> is non-zero, at most
+  // <limit> series are returned, and names after the limit is reached are never examined. If <filter> is set, only
+  // series it allows are returned. If <start_after> is set, the results start with the first series after the one with
+  // that key, so a search can be continued a page at a time without visiting the names already returned.
+  vector<const Series *> FindSorted(const Variable &search, uint64_t limit, const PostingsFilter *filter = NULL,
+                                    const string &start_after = "") const;
+
+  // Number of series in the index.
+  uint64_t size() const;
+
+  // Fill <response> with the cardinality statistics requested by <request>. Labels are ordered by the number of
+  // distinct values and values by the number of series, both largest first.
+  void GetLabelStats(const proto::LabelStatsRequest &request, proto::LabelStatsResponse *response) const;
+
+  // The request used for the label summary on the status page. It asks for the labels with the most distinct values
+  // and doesn't ask for value sketches, as the page never merges them.
+  static proto::LabelStatsRequest StatusLabelStatsRequest();
+
+  // Fill <response> with the distinct values of request.label() and the number of series with each one, ordered by
+  // value. If the request has a selector, only the series matching it are counted, and values with none are left out.
+  void GetLabelValues(const proto::LabelValuesRequest &request, proto::LabelValuesResponse *response) const;
+
+  // Set <output> to the IDs which are in both <a> and <b>.
+  // When one list is much shorter than the other, the longer one is searched with an exponential (galloping) search
+  // rather than stepped through one element at a time.
+  static void Intersect(const PostingsList &a, const PostingsList &b, PostingsList *output);
+
+  // Set <output> to the IDs which are in <a> but not in <b>.
+  static void Difference(const PostingsList &a, const PostingsList &b, PostingsList *output);
+
+  // Set <output> to the IDs which are in any of <lists>.
+  static void Union(const vector<const PostingsList *> &lists, PostingsList *output);
+
+ private:
+  typedef std::map<string, PostingsList> ValueMap;
+
+  struct LabelInfo {
+    LabelInfo() : series(0) {}
+    ValueMap values;
+    // Number of series with the label.
+    uint64_t series;
+  };
+
+  // A single label term of a search.
+  struct Term {
+    enum Type {
+      LITERAL,
+      ANY,
+      REGEX,
+    };
+    Term() : type(LITERAL), label(NULL), value(NULL), info(NULL), postings(NULL), estimate(0) {}
+    Type type;
+    const string *label;
+    const string *value;
+    shared_ptr<boost::regex> regex;
+    const LabelInfo *info;
+    // Set if the term resolves to an existing postings list without any work.
+    const PostingsList *postings;
+    // Upper bound on the number of series matching the term.
+    uint64_t estimate;
+  };
+
+  typedef std::pair<const string *, const LabelInfo *> LabelEntry;
+
+  static bool TermEstimateLess(const Term &a, const Term &b);
+  static bool MostValuesFirst(const LabelEntry &a, const LabelEntry &b);
+  static bool MostSeriesFirst(const ValueMap::const_iterator &a, const ValueMap::const_iterator &b);
+
+  // Remove the sorted <ids> from a postings list.
+  static void RemoveFromPostings(const PostingsList &ids, PostingsList *postings);
+
+  // Add <id> to a sorted postings list. IDs are almost always added in increasing order so this is usually an append.
+  // Returns false if the list already contained <id>.
+  static bool AddToPostings(SeriesId id, PostingsList *postings);
+
+  // Build and estimate the term for a single label search. Returns false if the term also matches series which don't
+  // have the label at all (e.g. a regex which matches an empty string), in which case the term can't be answered from
+  // the index.
+  bool PlanTerm(const string &label, const string &value, Term *term) const;
+
+  // Set <output> to the postings matching <term>.
+  void ResolveTerm(const Term &term, PostingsList *output) const;
+
+  // Remove the entries of <candidates> which don't match <term>, by checking each series' labels directly. This is
+  // cheaper than resolving a wildcard term which matches many more series than there are candidates.
+  void FilterTerm(const Term &term, PostingsList *candidates) const;
+
+  // Resolve every label term of <search> and intersect them into <output>, along with <candidates> if it is set.
+  // Terms are evaluated in order of their estimated size, so the intermediate results stay small. Returns false if no
+  // series can match. <exact> is cleared if any term couldn't be answered from the index, and <constrained> is set if
+  // <output> restricts the result at all.
+  bool FindLabels(const Variable &search, const PostingsList *candidates, PostingsList *output, bool *exact,
+                  bool *constrained) const;
+
+  const SeriesRegistry *registry_;
+  mutable SharedMutex mutex_;
+  PostingsList all_;
+  // Ordered by name, so trailing-* searches only visit the names under the prefix.
+  Trie<PostingsList> names_;
+  // label -> value -> postings. The values for each label are the dictionary searched by regex terms.
+  unordered_map<string, LabelInfo> labels_;
+};
+
+}  // namespace openinstrument
+
+#endif  // OPENINSTRUMENT_SERVER_LABEL_INDEX_H_
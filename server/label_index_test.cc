@@ -0,0 +1,409 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "lib/common.h"
+#include "lib/hyperloglog.h"
+#include "lib/openinstrument.pb.h"
+#include "lib/string.h"
+#include "lib/variable.h"
+#include "server/label_index.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+class LabelIndexTest : public ::testing::Test {
+ protected:
+  LabelIndexTest() : index_(&registry_) {}
+
+  void Add(const string &variable) {
+    index_.Add(registry_.Intern(Variable(variable)));
+  }
+
+  // Returns the variables matching <search>, sorted and joined with spaces.
+  string Find(const string &search) {
+    vector<string> keys;
+    for (SeriesId id : index_.Find(Variable(search))) {
+      const Series *series = registry_.Find(id);
+      if (!series) {
+        ADD_FAILURE() << "Unknown series " << id;
+        continue;
+      }
+      EXPECT_TRUE(series->variable().Matches(Variable(search))) << series->key() << " does not match " << search;
+      keys.push_back(series->key());
+    }
+    std::sort(keys.begin(), keys.end());
+    string output;
+    for (const string &key : keys) {
+      if (!output.empty())
+        output += " ";
+      output += key;
+    }
+    return output;
+  }
+
+  virtual void SetUp() {
+    Add("/test/a{host=a,job=web}");
+    Add("/test/a{host=b,job=web}");
+    Add("/test/a{host=c,job=db}");
+    Add("/test/b{host=a,job=web}");
+    Add("/test/b{host=b}");
+    Add("/other{host=a}");
+  }
+
+  SeriesRegistry registry_;
+  LabelIndex index_;
+};
+
+TEST_F(LabelIndexTest, Name) {
+  EXPECT_EQ(6UL, index_.size());
+  EXPECT_EQ("/test/a{host=a,job=web} /test/a{host=b,job=web} /test/a{host=c,job=db}", Find("/test/a"));
+  EXPECT_EQ("", Find("/test"));
+  EXPECT_EQ("", Find("/nothing"));
+  // Adding the same series twice doesn't change anything
+  Add("/other{host=a}");
+  EXPECT_EQ(6UL, index_.size());
+  EXPECT_EQ("/other{host=a}", Find("/other"));
+}
+
+TEST_F(LabelIndexTest, Prefix) {
+  EXPECT_EQ("/test/a{host=a,job=web} /test/a{host=b,job=web} /test/a{host=c,job=db} /test/b{host=a,job=web} "
+            "/test/b{host=b}", Find("/test/*"));
+  EXPECT_EQ(6UL, index_.Find(Variable("*")).size());
+}
+
+TEST_F(LabelIndexTest, Labels) {
+  EXPECT_EQ("/test/a{host=a,job=web} /test/b{host=a,job=web}", Find("/test/*{host=a}"));
+  EXPECT_EQ("/test/a{host=a,job=web}", Find("/test/a{host=a,job=web}"));
+  EXPECT_EQ("", Find("/test/a{host=a,job=db}"));
+  EXPECT_EQ("", Find("/test/a{missing=a}"));
+  EXPECT_EQ("/test/b{host=a,job=web}", Find("/test/b{job=*}"));
+}
+
+TEST_F(LabelIndexTest, Regex) {
+  EXPECT_EQ("/test/a{host=a,job=web} /test/a{host=b,job=web}", Find("/test/a{host=/[ab]/}"));
+  EXPECT_EQ("/test/a{host=c,job=db}", Find("/test/*{job=/d.*/}"));
+  // This regex also matches series without the label, which the index can't answer by itself.
+  EXPECT_EQ("/test/b{host=a,job=web} /test/b{host=b}", Find("/test/b{job=/(web)?/}"));
+}
+
+TEST_F(LabelIndexTest, SelectiveFirst) {
+  // Many series with a wildcard-matched label and only a couple with the selective one, so the wildcard terms are
+  // checked against the few candidates rather than resolved.
+  for (int i = 0; i < 1000; i++)
+    Add(StringPrintf("/many{host=h%d,job=web}", i));
+  Add("/many{host=h5,job=web,rack=r1}");
+  Add("/many{host=x,rack=r1}");
+  EXPECT_EQ("/many{host=h5,job=web,rack=r1}", Find("/many{rack=r1,host=/h.*/,job=*}"));
+  EXPECT_EQ("/many{host=h5,job=web,rack=r1} /many{host=x,rack=r1}", Find("/many{rack=r1,host=*}"));
+  EXPECT_EQ("", Find("/many{rack=r1,job=db}"));
+  EXPECT_EQ("/many{host=h5,job=web,rack=r1} /many{host=h5,job=web}", Find("*{host=h5,job=*}"));
+}
+
+TEST_F(LabelIndexTest, LabelStats) {
+  proto::LabelStatsRequest request;
+  request.set_include_value_sketch(true);
+  proto::LabelStatsResponse response;
+  index_.GetLabelStats(request, &response);
+  ASSERT_EQ(2, response.label_size());
+  // host has the most distinct values, so comes first.
+  const proto::LabelStats &host = response.label(0);
+  EXPECT_EQ("host", host.label());
+  EXPECT_EQ(6UL, host.series());
+  EXPECT_EQ(3UL, host.distinct_values());
+  ASSERT_EQ(3, host.value_size());
+  EXPECT_EQ("a", host.value(0).value());
+  EXPECT_EQ(3UL, host.value(0).series());
+  EXPECT_EQ("b", host.value(1).value());
+  EXPECT_EQ(2UL, host.value(1).series());
+  EXPECT_EQ("c", host.value(2).value());
+  EXPECT_EQ(1UL, host.value(2).series());
+  HyperLogLog sketch;
+  sketch.FromString(host.value_sketch());
+  EXPECT_EQ(3UL, sketch.Estimate());
+
+  const proto::LabelStats &job = response.label(1);
+  EXPECT_EQ("job", job.label());
+  EXPECT_EQ(4UL, job.series());
+  EXPECT_EQ(2UL, job.distinct_values());
+
+  // Re-adding a series doesn't change the counts.
+  Add("/test/a{host=a,job=web}");
+  response.Clear();
+  request.set_label("job");
+  request.set_max_values(1);
+  index_.GetLabelStats(request, &response);
+  ASSERT_EQ(1, response.label_size());
+  EXPECT_EQ(4UL, response.label(0).series());
+  ASSERT_EQ(1, response.label(0).value_size());
+  EXPECT_EQ("web", response.label(0).value(0).value());
+  EXPECT_EQ(3UL, response.label(0).value(0).series());
+}
+
+TEST_F(LabelIndexTest, StatusLabelStats) {
+  // The status page doesn't merge statistics, so it shouldn't pay for building the sketches.
+  proto::LabelStatsResponse response;
+  index_.GetLabelStats(LabelIndex::StatusLabelStatsRequest(), &response);
+  ASSERT_EQ(2, response.label_size());
+  EXPECT_EQ("host", response.label(0).label());
+  EXPECT_EQ(3UL, response.label(0).distinct_values());
+  for (auto &stats : response.label()) {
+    EXPECT_FALSE(stats.has_value_sketch());
+    EXPECT_LE(stats.value_size(), 5);
+  }
+}
+
+TEST_F(LabelIndexTest, FindSorted) {
+  Add("/test{host=z}");
+  Add("/test/a/b{host=a}");
+  vector<const Series *> found = index_.FindSorted(Variable("/test*{host=a}"), 0);
+  ASSERT_EQ(3UL, found.size());
+  EXPECT_EQ("/test/a{host=a,job=web}", found[0]->key());
+  EXPECT_EQ("/test/a/b{host=a}", found[1]->key());
+  EXPECT_EQ("/test/b{host=a,job=web}", found[2]->key());
+
+  found = index_.FindSorted(Variable("/test/*"), 2);
+  ASSERT_EQ(2UL, found.size());
+  EXPECT_EQ("/test/a{host=a,job=web}", found[0]->key());
+  EXPECT_EQ("/test/a{host=b,job=web}", found[1]->key());
+
+  // An exact name doesn't include the names which follow it
+  found = index_.FindSorted(Variable("/test"), 0);
+  ASSERT_EQ(1UL, found.size());
+  EXPECT_EQ("/test{host=z}", found[0]->key());
+
+  found = index_.FindSorted(Variable("*{job=/(web)?/}"), 0);
+  EXPECT_EQ(7UL, found.size());
+  EXPECT_EQ("/other{host=a}", found[0]->key());
+  EXPECT_TRUE(index_.FindSorted(Variable("/test/*{host=x}"), 0).empty());
+}
+
+TEST_F(LabelIndexTest, Remove) {
+  vector<const Series *> removed;
+  removed.push_back(registry_.Intern(Variable("/test/a{host=c,job=db}")));
+  removed.push_back(registry_.Intern(Variable("/other{host=a}")));
+  removed.push_back(registry_.Intern(Variable("/notindexed{host=q}")));
+  index_.Remove(removed);
+  EXPECT_EQ(4UL, index_.size());
+  EXPECT_EQ("/test/a{host=a,job=web} /test/a{host=b,job=web}", Find("/test/a"));
+  EXPECT_EQ("", Find("/other"));
+  EXPECT_EQ("", Find("*{job=db}"));
+  EXPECT_EQ("", Find("*{host=c}"));
+  EXPECT_TRUE(index_.FindSorted(Variable("/o*"), 0).empty());
+
+  proto::LabelStatsRequest request;
+  request.set_include_value_sketch(true);
+  proto::LabelStatsResponse response;
+  index_.GetLabelStats(request, &response);
+  ASSERT_EQ(2, response.label_size());
+  EXPECT_EQ("host", response.label(0).label());
+  EXPECT_EQ(4UL, response.label(0).series());
+  EXPECT_EQ(2UL, response.label(0).distinct_values());
+  // The sketch only covers the values that are left.
+  HyperLogLog sketch;
+  sketch.FromString(response.label(0).value_sketch());
+  EXPECT_EQ(2UL, sketch.Estimate());
+  EXPECT_EQ(3UL, response.label(1).series());
+  EXPECT_EQ(1UL, response.label(1).distinct_values());
+
+  // Series can be added back after being removed.
+  Add("/other{host=a}");
+  EXPECT_EQ("/other{host=a}", Find("/other"));
+}
+
+TEST_F(LabelIndexTest, FindSortedFilter) {
+  PostingsFilter filter;
+  filter.ids.push_back(registry_.Intern(Variable("/test/a{host=b,job=web}"))->id());
+  filter.ids.push_back(registry_.Intern(Variable("/test/b{host=b}"))->id());
+  std::sort(filter.ids.begin(), filter.ids.end());
+
+  vector<const Series *> found = index_.FindSorted(Variable("/test/*"), 0, &filter);
+  ASSERT_EQ(2UL, found.size());
+  EXPECT_EQ("/test/a{host=b,job=web}", found[0]->key());
+  EXPECT_EQ("/test/b{host=b}", found[1]->key());
+
+  filter.exclude = true;
+  found = index_.FindSorted(Variable("/test/*{host=b}"), 0, &filter);
+  EXPECT_TRUE(found.empty());
+  found = index_.FindSorted(Variable("/test/a"), 0, &filter);
+  ASSERT_EQ(2UL, found.size());
+  EXPECT_EQ("/test/a{host=a,job=web}", found[0]->key());
+  EXPECT_EQ("/test/a{host=c,job=db}", found[1]->key());
+}
+
+TEST_F(LabelIndexTest, FindSortedPages) {
+  Add("/test{host=z}");
+  Add("/test/a/b{host=a}");
+  vector<const Series *> all = index_.FindSorted(Variable("/test*"), 0);
+  ASSERT_EQ(7UL, all.size());
+
+  // Reading two at a time, continuing after the last key of each page, gives the same results as a single search.
+  vector<const Series *> paged;
+  string start_after;
+  while (true) {
+    vector<const Series *> page = index_.FindSorted(Variable("/test*"), 2, NULL, start_after);
+    if (page.empty())
+      break;
+    EXPECT_GE(2UL, page.size());
+    paged.insert(paged.end(), page.begin(), page.end());
+    start_after = page.back()->key();
+  }
+  EXPECT_TRUE(all == paged);
+
+  vector<const Series *> found = index_.FindSorted(Variable("/test/a"), 0, NULL, "/test/a{host=a,job=web}");
+  ASSERT_EQ(2UL, found.size());
+  EXPECT_EQ("/test/a{host=b,job=web}", found[0]->key());
+  EXPECT_TRUE(index_.FindSorted(Variable("/test/a"), 0, NULL, "/test/b").empty());
+
+  // A key which is no longer in the index, or is before the prefix, still continues from the right place.
+  found = index_.FindSorted(Variable("/test/*"), 0, NULL, "/test/a/a{host=q}");
+  ASSERT_EQ(3UL, found.size());
+  EXPECT_EQ("/test/a/b{host=a}", found[0]->key());
+  found = index_.FindSorted(Variable("/test/*"), 1, NULL, "/aaa");
+  ASSERT_EQ(1UL, found.size());
+  EXPECT_EQ("/test/a{host=a,job=web}", found[0]->key());
+
+  // Pages part way through a name with many series.
+  for (int i = 0; i < 50; ++i)
+    Add(StringPrintf("/many{id=%02d}", (i * 37) % 50));
+  all = index_.FindSorted(Variable("/many"), 0);
+  ASSERT_EQ(50UL, all.size());
+  for (size_t i = 1; i < all.size(); ++i)
+    EXPECT_LT(all[i - 1]->key(), all[i]->key());
+  paged.clear();
+  start_after.clear();
+  while (true) {
+    vector<const Series *> page = index_.FindSorted(Variable("/many"), 3, NULL, start_after);
+    if (page.empty())
+      break;
+    EXPECT_GE(3UL, page.size());
+    paged.insert(paged.end(), page.begin(), page.end());
+    start_after = page.back()->key();
+  }
+  EXPECT_TRUE(all == paged);
+}
+
+TEST_F(LabelIndexTest, LabelValues) {
+  proto::LabelValuesRequest request;
+  request.set_label("host");
+  proto::LabelValuesResponse response;
+  index_.GetLabelValues(request, &response);
+  ASSERT_EQ(3, response.value_size());
+  EXPECT_EQ("a", response.value(0).value());
+  EXPECT_EQ(3UL, response.value(0).series());
+  EXPECT_EQ("b", response.value(1).value());
+  EXPECT_EQ(2UL, response.value(1).series());
+  EXPECT_EQ("c", response.value(2).value());
+  EXPECT_EQ(1UL, response.value(2).series());
+
+  // Only the series matching the selector are counted.
+  response.Clear();
+  Variable("/test/*{job=web}").ToProtobuf(request.mutable_selector());
+  index_.GetLabelValues(request, &response);
+  ASSERT_EQ(2, response.value_size());
+  EXPECT_EQ("a", response.value(0).value());
+  EXPECT_EQ(2UL, response.value(0).series());
+  EXPECT_EQ("b", response.value(1).value());
+  EXPECT_EQ(1UL, response.value(1).series());
+
+  // A selector much smaller than the label looks up each series instead, with the same results.
+  for (int i = 0; i < 100; i++)
+    Add(StringPrintf("/many{host=h%d}", i));
+  response.Clear();
+  Variable("/test/b").ToProtobuf(request.mutable_selector());
+  index_.GetLabelValues(request, &response);
+  ASSERT_EQ(2, response.value_size());
+  EXPECT_EQ("a", response.value(0).value());
+  EXPECT_EQ(1UL, response.value(0).series());
+  EXPECT_EQ("b", response.value(1).value());
+  EXPECT_EQ(1UL, response.value(1).series());
+
+  response.Clear();
+  request.clear_selector();
+  request.set_max_values(2);
+  index_.GetLabelValues(request, &response);
+  ASSERT_EQ(2, response.value_size());
+  EXPECT_EQ("a", response.value(0).value());
+  EXPECT_EQ("b", response.value(1).value());
+
+  response.Clear();
+  request.set_label("nothing");
+  index_.GetLabelValues(request, &response);
+  EXPECT_EQ(0, response.value_size());
+}
+
+TEST_F(LabelIndexTest, Intersect) {
+  PostingsList small, large, output;
+  for (SeriesId i = 0; i < 1000; i++)
+    large.push_back(i * 3);
+  small.push_back(0);
+  small.push_back(4);
+  small.push_back(300);
+  small.push_back(301);
+  small.push_back(2997);
+  small.push_back(5000);
+  LabelIndex::Intersect(small, large, &output);
+  ASSERT_EQ(3UL, output.size());
+  EXPECT_EQ(0UL, output[0]);
+  EXPECT_EQ(300UL, output[1]);
+  EXPECT_EQ(2997UL, output[2]);
+  LabelIndex::Intersect(large, large, &output);
+  EXPECT_EQ(1000UL, output.size());
+}
+
+TEST_F(LabelIndexTest, Union) {
+  PostingsList a, b, output;
+  a.push_back(1);
+  a.push_back(5);
+  b.push_back(2);
+  b.push_back(5);
+  b.push_back(9);
+  vector<const PostingsList *> lists;
+  lists.push_back(&a);
+  lists.push_back(&b);
+  LabelIndex::Union(lists, &output);
+  ASSERT_EQ(4UL, output.size());
+  EXPECT_EQ(1UL, output[0]);
+  EXPECT_EQ(2UL, output[1]);
+  EXPECT_EQ(5UL, output[2]);
+  EXPECT_EQ(9UL, output[3]);
+}
+
+TEST_F(LabelIndexTest, UnionMany) {
+  // Lists of multiples of 2, 3, 5 and nothing, merged with the heap and checked against a sort.
+  vector<PostingsList> inputs(4);
+  PostingsList expected;
+  for (SeriesId id = 1; id <= 100; ++id) {
+    if (id % 2 == 0)
+      inputs[0].push_back(id);
+    if (id % 3 == 0)
+      inputs[1].push_back(id);
+    if (id % 5 == 0)
+      inputs[2].push_back(id);
+    if (id % 2 == 0 || id % 3 == 0 || id % 5 == 0)
+      expected.push_back(id);
+  }
+  vector<const PostingsList *> lists;
+  for (const PostingsList &input : inputs)
+    lists.push_back(&input);
+  PostingsList output;
+  LabelIndex::Union(lists, &output);
+  EXPECT_EQ(expected, output);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
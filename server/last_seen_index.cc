@@ -0,0 +1,110 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "lib/common.h"
+#include "server/label_index.h"
+#include "server/last_seen_index.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+void LastSeenIndex::AddLocked(SeriesId id, uint64_t timestamp) {
+  uint64_t &last_seen = last_seen_[id];
+  if (timestamp <= last_seen)
+    return;
+  if (last_seen) {
+    if (Bucket(last_seen) == Bucket(timestamp)) {
+      last_seen = timestamp;
+      return;
+    }
+    by_time_.erase(std::make_pair(Bucket(last_seen), id));
+  }
+  by_time_.insert(std::make_pair(Bucket(timestamp), id));
+  last_seen = timestamp;
+}
+
+void LastSeenIndex::Add(SeriesId id, uint64_t timestamp) {
+  ExclusiveLock lock(mutex_);
+  AddLocked(id, timestamp);
+}
+
+void LastSeenIndex::Add(const vector<Update> &updates) {
+  if (updates.empty())
+    return;
+  ExclusiveLock lock(mutex_);
+  for (const Update &update : updates)
+    AddLocked(update.first, update.second);
+}
+
+uint64_t LastSeenIndex::Get(SeriesId id) const {
+  SharedLock lock(mutex_);
+  unordered_map<SeriesId, uint64_t>::const_iterator it = last_seen_.find(id);
+  return it == last_seen_.end() ? 0 : it->second;
+}
+
+uint64_t LastSeenIndex::size() const {
+  SharedLock lock(mutex_);
+  return last_seen_.size();
+}
+
+bool LastSeenIndex::SelectSince(uint64_t since, PostingsList *ids) const {
+  ids->clear();
+  SharedLock lock(mutex_);
+  uint64_t boundary = Bucket(since);
+  OrderType::const_iterator split = by_time_.lower_bound(std::make_pair(boundary, static_cast<SeriesId>(0)));
+
+  // Usually most series are either active or stale, so collect the inactive ones first and give up if they turn out to
+  // be the larger set.
+  bool active = false;
+  for (OrderType::const_iterator it = by_time_.begin(); it != split; ++it) {
+    if (ids->size() > by_time_.size() / 2) {
+      active = true;
+      break;
+    }
+    ids->push_back(it->second);
+  }
+  if (active) {
+    ids->clear();
+    for (OrderType::const_iterator it = split; it != by_time_.end(); ++it) {
+      if (it->first != boundary || last_seen_.find(it->second)->second >= since)
+        ids->push_back(it->second);
+    }
+  } else {
+    // The boundary interval holds a mixture of both.
+    for (OrderType::const_iterator it = split; it != by_time_.end() && it->first == boundary; ++it) {
+      if (last_seen_.find(it->second)->second < since)
+        ids->push_back(it->second);
+    }
+  }
+  std::sort(ids->begin(), ids->end());
+  return active;
+}
+
+PostingsList LastSeenIndex::Expire(uint64_t before) {
+  PostingsList expired;
+  ExclusiveLock lock(mutex_);
+  OrderType::iterator it = by_time_.begin();
+  while (it != by_time_.end() && it->first <= Bucket(before)) {
+    unordered_map<SeriesId, uint64_t>::iterator last_seen = last_seen_.find(it->second);
+    if (last_seen->second >= before) {
+      ++it;
+      continue;
+    }
+    expired.push_back(it->second);
+    last_seen_.erase(last_seen);
+    by_time_.erase(it++);
+  }
+  std::sort(expired.begin(), expired.end());
+  return expired;
+}
+
+}  // namespace openinstrument
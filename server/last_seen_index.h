@@ -0,0 +1,70 @@
+/*
+ * Index of the time each series last had a value written.
+ *
+ * Series are kept ordered by the time they were last seen, so both the series which have been active within a recent
+ * window and the series which have gone stale can be found without looking at every series.
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef OPENINSTRUMENT_SERVER_LAST_SEEN_INDEX_H_
+#define OPENINSTRUMENT_SERVER_LAST_SEEN_INDEX_H_
+
+#include <algorithm>
+#include <set>
+#include <utility>
+#include <vector>
+#include "lib/common.h"
+#include "server/label_index.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+class LastSeenIndex : private noncopyable {
+ public:
+  typedef std::pair<SeriesId, uint64_t> Update;
+
+  // The time ordering is kept to a granularity of <resolution> ms, so a series only moves within the ordering the first
+  // time it is written in each interval.
+  explicit LastSeenIndex(uint64_t resolution = 60000) : resolution_(std::max(resolution, static_cast<uint64_t>(1))) {}
+
+  // Record that <id> had a value at <timestamp>. Timestamps older than the one already recorded are ignored.
+  void Add(SeriesId id, uint64_t timestamp);
+
+  // Add a batch of (id, timestamp) updates, taking the lock only once.
+  void Add(const vector<Update> &updates);
+
+  // The newest timestamp recorded for <id>, or 0 if it has never been seen.
+  uint64_t Get(SeriesId id) const;
+
+  // Find the series seen at or after <since>. Whichever of the active or inactive series is the smaller set is put into
+  // <ids>, sorted. Returns true if <ids> holds the active series, or false if it holds the inactive ones.
+  bool SelectSince(uint64_t since, PostingsList *ids) const;
+
+  // Remove every series last seen before <before>, returning their sorted IDs.
+  PostingsList Expire(uint64_t before);
+
+  uint64_t size() const;
+
+ private:
+  // (time bucket, id), so iteration is in order of last seen time.
+  typedef std::set<std::pair<uint64_t, SeriesId>> OrderType;
+
+  inline uint64_t Bucket(uint64_t timestamp) const {
+    return timestamp - timestamp % resolution_;
+  }
+
+  void AddLocked(SeriesId id, uint64_t timestamp);
+
+  const uint64_t resolution_;
+  mutable SharedMutex mutex_;
+  unordered_map<SeriesId, uint64_t> last_seen_;
+  OrderType by_time_;
+};
+
+}  // namespace openinstrument
+
+#endif  // OPENINSTRUMENT_SERVER_LAST_SEEN_INDEX_H_
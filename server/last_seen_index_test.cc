@@ -0,0 +1,87 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <vector>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "lib/common.h"
+#include "server/label_index.h"
+#include "server/last_seen_index.h"
+
+namespace openinstrument {
+
+class LastSeenIndexTest : public ::testing::Test {};
+
+TEST_F(LastSeenIndexTest, Add) {
+  LastSeenIndex index(1000);
+  EXPECT_EQ(0UL, index.Get(1));
+  index.Add(1, 5000);
+  index.Add(1, 4000);
+  EXPECT_EQ(5000UL, index.Get(1));
+  index.Add(1, 5500);
+  EXPECT_EQ(5500UL, index.Get(1));
+
+  vector<LastSeenIndex::Update> updates;
+  updates.push_back(LastSeenIndex::Update(2, 7000));
+  updates.push_back(LastSeenIndex::Update(1, 9000));
+  index.Add(updates);
+  EXPECT_EQ(9000UL, index.Get(1));
+  EXPECT_EQ(7000UL, index.Get(2));
+  EXPECT_EQ(2UL, index.size());
+}
+
+TEST_F(LastSeenIndexTest, SelectSince) {
+  LastSeenIndex index(1000);
+  for (SeriesId id = 1; id <= 10; id++)
+    index.Add(id, id * 500);
+
+  // Only a few series are active, so those are returned.
+  PostingsList ids;
+  EXPECT_TRUE(index.SelectSince(4200, &ids));
+  ASSERT_EQ(2UL, ids.size());
+  EXPECT_EQ(9UL, ids[0]);
+  EXPECT_EQ(10UL, ids[1]);
+
+  // Most series are active, so the inactive ones are returned instead. The boundary falls in the middle of an interval.
+  EXPECT_FALSE(index.SelectSince(1500, &ids));
+  ASSERT_EQ(2UL, ids.size());
+  EXPECT_EQ(1UL, ids[0]);
+  EXPECT_EQ(2UL, ids[1]);
+
+  EXPECT_FALSE(index.SelectSince(0, &ids));
+  EXPECT_TRUE(ids.empty());
+  EXPECT_TRUE(index.SelectSince(100000, &ids));
+  EXPECT_TRUE(ids.empty());
+}
+
+TEST_F(LastSeenIndexTest, Expire) {
+  LastSeenIndex index(1000);
+  for (SeriesId id = 1; id <= 10; id++)
+    index.Add(id, id * 500);
+  // Series 3 is seen again, so it no longer expires.
+  index.Add(3, 8000);
+
+  PostingsList expired = index.Expire(2600);
+  ASSERT_EQ(4UL, expired.size());
+  EXPECT_EQ(1UL, expired[0]);
+  EXPECT_EQ(2UL, expired[1]);
+  EXPECT_EQ(4UL, expired[2]);
+  EXPECT_EQ(5UL, expired[3]);
+  EXPECT_EQ(0UL, index.Get(1));
+  EXPECT_EQ(8000UL, index.Get(3));
+  EXPECT_EQ(6UL, index.size());
+  EXPECT_TRUE(index.Expire(2600).empty());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,406 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/exported_vars.h"
+#include "lib/line_protocol.h"
+#include "lib/socket.h"
+#include "lib/string.h"
+#include "lib/timer.h"
+#include "lib/variable.h"
+#include "server/disk_datastore.h"
+#include "server/line_protocol_listener.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+// Maximum size of a single line, or of a single UDP datagram.
+static const uint64_t kMaxLineSize = 65536;
+
+// Maximum number of entries in each series cache before it is cleared. The caches for all UDP sources together are
+// limited to this many entries as well.
+static const uint64_t kMaxCacheSize = 100000;
+
+// Maximum number of UDP sources with a series cache before all of them are cleared.
+static const uint64_t kMaxUdpSources = 10000;
+
+// Maximum number of events handled for each call to epoll_wait().
+static const int kMaxEvents = 256;
+
+// Maximum number of values that will be batched up before sending them to the callback.
+static const uint64_t kMaxBatchSize = 1024;
+
+// Maximum number of batches waiting for each callback before further batches are dropped.
+static const uint64_t kMaxPendingBatches = 256;
+
+LineProtocolListener::LineProtocolListener(SeriesRegistry *registry, const BatchCallback &callback)
+  : registry_(registry),
+    callback_(callback),
+    shutdown_(false),
+    udp_fd_(-1),
+    epoll_fd_(-1),
+    udp_thread_(NULL),
+    tcp_thread_(NULL),
+    callback_dispatcher_(kMaxPendingBatches),
+    forward_dispatcher_(kMaxPendingBatches),
+    lines_received_("/openinstrument/store/line-protocol/lines-received"),
+    invalid_lines_("/openinstrument/store/line-protocol/invalid-lines"),
+    datagrams_received_("/openinstrument/store/line-protocol/datagrams-received"),
+    connections_accepted_("/openinstrument/store/line-protocol/connections-accepted"),
+    dropped_values_("/openinstrument/store/line-protocol/dropped-values") {}
+
+LineProtocolListener::~LineProtocolListener() {
+  Shutdown();
+}
+
+void LineProtocolListener::SetForwarding(const LocalCallback &is_local, const ForwardCallback &forward) {
+  is_local_ = is_local;
+  forward_ = forward;
+}
+
+void LineProtocolListener::ListenUdp(const Socket::Address &address) {
+  Socket::Address local(address);
+  if ((udp_fd_ = ::socket(local.address_.ss_family, SOCK_DGRAM, 0)) < 0)
+    throw runtime_error(StringPrintf("Can't create UDP socket: %s", strerror(errno)));
+  int on = 1;
+  setsockopt(udp_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (::bind(udp_fd_, reinterpret_cast<sockaddr *>(&local.address_), sizeof(local.address_)) < 0)
+    throw runtime_error(StringPrintf("Can't bind UDP socket: %s", strerror(errno)));
+  socklen_t len = sizeof(local.address_);
+  if (getsockname(udp_fd_, reinterpret_cast<sockaddr *>(&local.address_), &len) != 0)
+    LOG(WARNING) << "getsockname() failed, can't get local UDP port: " << strerror(errno);
+  udp_address_ = local;
+  LOG(INFO) << "Listening for line protocol values on UDP " << local.ToString();
+  udp_thread_.reset(new thread(bind(&LineProtocolListener::UdpThread, this, udp_fd_)));
+}
+
+void LineProtocolListener::ListenTcp(const Socket::Address &address) {
+  tcp_socket_.Listen(address);
+  tcp_socket_.SetNonblocking(true);
+  if ((epoll_fd_ = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    throw runtime_error(StringPrintf("Can't create epoll set: %s", strerror(errno)));
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = tcp_socket_.fd();
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, tcp_socket_.fd(), &event) < 0)
+    throw runtime_error(StringPrintf("Can't add to epoll set: %s", strerror(errno)));
+  LOG(INFO) << "Listening for line protocol values on TCP " << tcp_socket_.local().ToString();
+  tcp_thread_.reset(new thread(bind(&LineProtocolListener::TcpThread, this)));
+}
+
+void LineProtocolListener::Shutdown() {
+  if (shutdown_)
+    return;
+  shutdown_ = true;
+  if (udp_thread_.get())
+    udp_thread_->join();
+  if (udp_fd_ >= 0)
+    ::close(udp_fd_);
+  udp_fd_ = -1;
+  if (tcp_thread_.get())
+    tcp_thread_->join();
+  if (epoll_fd_ >= 0)
+    ::close(epoll_fd_);
+  epoll_fd_ = -1;
+  // Nothing else can be queued once the readers have stopped.
+  callback_dispatcher_.Shutdown();
+  forward_dispatcher_.Shutdown();
+}
+
+LineProtocolListener::Dispatcher::Dispatcher(uint64_t max_pending)
+  : max_pending_(max_pending),
+    shutdown_(false),
+    thread_(new thread(bind(&Dispatcher::Run, this))) {}
+
+LineProtocolListener::Dispatcher::~Dispatcher() {
+  Shutdown();
+}
+
+bool LineProtocolListener::Dispatcher::Add(const Callback &callback) {
+  MutexLock lock(mutex_);
+  if (shutdown_ || pending_.size() >= max_pending_)
+    return false;
+  pending_.push_back(callback);
+  cond_.notify_one();
+  return true;
+}
+
+void LineProtocolListener::Dispatcher::Shutdown() {
+  {
+    MutexLock lock(mutex_);
+    if (shutdown_)
+      return;
+    shutdown_ = true;
+    cond_.notify_one();
+  }
+  thread_->join();
+}
+
+void LineProtocolListener::Dispatcher::Run() {
+  while (true) {
+    Callback callback;
+    {
+      MutexLock lock(mutex_);
+      while (!shutdown_ && pending_.empty())
+        cond_.wait(lock);
+      if (pending_.empty())
+        return;
+      callback = pending_.front();
+      pending_.pop_front();
+    }
+    callback();
+  }
+}
+
+void LineProtocolListener::UdpThread(int fd) {
+  scoped_array<char> buffer(new char[kMaxLineSize + 1]);
+  unordered_map<string, SeriesCache> caches;
+  // Total number of entries in <caches>.
+  uint64_t cached = 0;
+  Batch batch;
+  while (!shutdown_) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ret = ::poll(&pfd, 1, 1000);
+    if (ret <= 0)
+      continue;
+    Socket::Address source;
+    socklen_t len = sizeof(source.address_);
+    ssize_t size = ::recvfrom(fd, buffer.get(), kMaxLineSize, 0, reinterpret_cast<sockaddr *>(&source.address_), &len);
+    if (size <= 0)
+      continue;
+    ++datagrams_received_;
+    // The last line in a datagram doesn't need a trailing newline.
+    if (buffer[size - 1] != '\n')
+      buffer[size++] = '\n';
+    string source_address = source.AddressToString();
+    SeriesCache &cache = caches[source_address];
+    cached -= cache.size();
+    ParseLines(buffer.get(), size, source_address, &cache, &batch);
+    cached += cache.size();
+    SendBatch(&batch);
+    // Many sources each sending many series could otherwise use an unlimited amount of memory between them.
+    if (cached > kMaxCacheSize || caches.size() > kMaxUdpSources) {
+      caches.clear();
+      cached = 0;
+    }
+  }
+}
+
+LineProtocolListener::TcpConnection::TcpConnection(Socket *socket)
+  : socket(socket),
+    source(socket->remote().AddressToString()),
+    // One spare byte so the parser can always terminate the last token in the buffer.
+    buffer(new char[kMaxLineSize + 1]),
+    used(0) {}
+
+void LineProtocolListener::TcpThread() {
+  TcpConnectionMap connections;
+  Batch batch;
+  epoll_event events[kMaxEvents];
+  while (!shutdown_) {
+    int num_events = epoll_wait(epoll_fd_, events, kMaxEvents, 1000);
+    if (num_events < 0) {
+      if (errno == EINTR)
+        continue;
+      LOG(ERROR) << "epoll_wait() returned error: " << strerror(errno);
+      break;
+    }
+    for (int i = 0; i < num_events; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == tcp_socket_.fd()) {
+        AcceptConnections(&connections);
+        continue;
+      }
+      TcpConnectionMap::iterator it = connections.find(fd);
+      if (it == connections.end())
+        continue;
+      if (!ReadConnection(it->second.get(), &batch)) {
+        // Closing the socket also removes it from the epoll set.
+        connections.erase(it);
+      }
+    }
+  }
+  connections.clear();
+  tcp_socket_.Abort();
+}
+
+void LineProtocolListener::AcceptConnections(TcpConnectionMap *connections) {
+  while (true) {
+    scoped_ptr<Socket> client(NULL);
+    try {
+      client.reset(tcp_socket_.Accept(0));
+    } catch (exception &e) {
+      LOG(WARNING) << "Error accepting line protocol connection: " << e.what();
+      return;
+    }
+    if (!client.get())
+      return;
+    ++connections_accepted_;
+    // Connections are level-triggered, each event reads as much as fits in the line buffer.
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = client->fd();
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client->fd(), &event) < 0) {
+      LOG(WARNING) << "Can't add line protocol connection to epoll set: " << strerror(errno);
+      continue;
+    }
+    int fd = client->fd();
+    (*connections)[fd].reset(new TcpConnection(client.release()));
+  }
+}
+
+bool LineProtocolListener::ReadConnection(TcpConnection *connection, Batch *batch) {
+  ssize_t size = ::recv(connection->socket->fd(), connection->buffer.get() + connection->used,
+                        kMaxLineSize - connection->used, 0);
+  if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return true;
+  if (size <= 0)
+    return false;
+  connection->used += size;
+  uint64_t consumed = ParseLines(connection->buffer.get(), connection->used, connection->source, &connection->cache,
+                                 batch);
+  SendBatch(batch);
+  if (consumed == 0 && connection->used == kMaxLineSize) {
+    LOG(WARNING) << "Line protocol client " << connection->source << " sent a line longer than " << kMaxLineSize
+                 << " bytes, closing connection";
+    return false;
+  }
+  // Keep any partial line for the next read.
+  memmove(connection->buffer.get(), connection->buffer.get() + consumed, connection->used - consumed);
+  connection->used -= consumed;
+  return true;
+}
+
+uint64_t LineProtocolListener::ParseLines(char *buffer, uint64_t size, const string &source, SeriesCache *cache,
+                                          Batch *batch) {
+  LineProtocolLine line;
+  Timestamp now;
+  const Series *series;
+  shared_ptr<const Variable> forward;
+  char *start = buffer;
+  char *end = buffer + size;
+  while (start < end) {
+    char *newline = static_cast<char *>(memchr(start, '\n', end - start));
+    if (!newline)
+      break;
+    uint64_t length = newline - start;
+    char *next = newline + 1;
+    if (length == 0 || (length == 1 && *start == '\r')) {
+      start = next;
+      continue;
+    }
+    ++lines_received_;
+    // The newline itself is the writable byte after the line that the parser may use.
+    if (!ParseLineProtocol(start, length, &line)) {
+      ++invalid_lines_;
+      VLOG(1) << "Invalid line protocol line from " << source;
+      start = next;
+      continue;
+    }
+    if (!LookupSeries(line, source, cache, &series, &forward)) {
+      ++invalid_lines_;
+      VLOG(1) << "Invalid variable name in line protocol line from " << source;
+      start = next;
+      continue;
+    }
+    proto::Value *value;
+    if (series) {
+      batch->points.push_back(DatastorePoint());
+      batch->points.back().series = series;
+      value = &batch->points.back().value;
+    } else {
+      batch->forwarded.push_back(ForwardedValue());
+      batch->forwarded.back().variable = forward;
+      value = &batch->forwarded.back().value;
+    }
+    value->set_timestamp(line.timestamp ? line.timestamp : now.ms());
+    value->set_double_value(line.value);
+    if (batch->size() >= kMaxBatchSize)
+      SendBatch(batch);
+    start = next;
+  }
+  return start - buffer;
+}
+
+bool LineProtocolListener::LookupSeries(const LineProtocolLine &line, const string &source, SeriesCache *cache,
+                                        const Series **series, shared_ptr<const Variable> *forward) {
+  *series = NULL;
+  forward->reset();
+  if (!line.escaped) {
+    SeriesCache::const_iterator it = cache->find(line.key, KeyHash(), KeyEqual());
+    if (it != cache->end()) {
+      *series = it->second.series;
+      *forward = it->second.forward;
+      return true;
+    }
+  }
+  shared_ptr<Variable> variable(new Variable());
+  line.ToVariable(variable.get());
+  // The same check as for values added over HTTP.
+  if (!variable->HasValidName())
+    return false;
+  if (variable->GetLabel("hostname").empty())
+    variable->SetLabel("hostname", source);
+  CacheEntry entry;
+  if (is_local_ && !is_local_(*variable)) {
+    *forward = entry.forward = variable;
+  } else {
+    *series = entry.series = registry_->Intern(*variable);
+  }
+  if (!line.escaped) {
+    if (cache->size() > kMaxCacheSize)
+      cache->clear();
+    (*cache)[line.key.ToString()] = entry;
+  }
+  return true;
+}
+
+void LineProtocolListener::SendBatch(Batch *batch) {
+  // The values are swapped out of the batch rather than copied, which also leaves it empty for the next values.
+  if (!batch->points.empty()) {
+    shared_ptr<vector<DatastorePoint>> points(new vector<DatastorePoint>());
+    points->swap(batch->points);
+    if (!callback_dispatcher_.Add(bind(&LineProtocolListener::RunCallback, this, points)))
+      dropped_values_ += points->size();
+  }
+  if (!batch->forwarded.empty()) {
+    shared_ptr<vector<ForwardedValue>> values(new vector<ForwardedValue>());
+    values->swap(batch->forwarded);
+    if (!forward_dispatcher_.Add(bind(&LineProtocolListener::RunForward, this, values)))
+      dropped_values_ += values->size();
+  }
+}
+
+void LineProtocolListener::RunCallback(shared_ptr<vector<DatastorePoint>> points) {
+  try {
+    callback_(*points);
+  } catch (exception &e) {
+    LOG(WARNING) << "Error adding " << points->size() << " line protocol values: " << e.what();
+  }
+}
+
+void LineProtocolListener::RunForward(shared_ptr<vector<ForwardedValue>> values) {
+  try {
+    forward_(*values);
+  } catch (exception &e) {
+    LOG(WARNING) << "Error forwarding " << values->size() << " line protocol values: " << e.what();
+  }
+}
+
+}  // namespace openinstrument
@@ -0,0 +1,198 @@
+/*
+ * Accepts values in the plaintext line protocol (see lib/line_protocol.h) over UDP and TCP.
+ *
+ * This is much cheaper for clients that only have a few values to send than a HTTP request containing a protobuf. A
+ * UDP datagram may contain any number of lines, as may a TCP connection. UDP datagrams are read by one thread, and all
+ * TCP connections are read by another from a single epoll set, so an idle connection costs a socket and a line buffer
+ * rather than a thread.
+ *
+ * Parsed values are handed to the callbacks by separate threads, so that neither a full ingest queue nor a slow server
+ * being forwarded to stops the sockets being read. If the callbacks can't keep up, values are dropped.
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef OPENINSTRUMENT_SERVER_LINE_PROTOCOL_LISTENER_H_
+#define OPENINSTRUMENT_SERVER_LINE_PROTOCOL_LISTENER_H_
+
+#include <deque>
+#include <string>
+#include <vector>
+#include "lib/closure.h"
+#include "lib/common.h"
+#include "lib/exported_vars.h"
+#include "lib/line_protocol.h"
+#include "lib/openinstrument.pb.h"
+#include "lib/socket.h"
+#include "lib/string.h"
+#include "lib/variable.h"
+#include "server/disk_datastore.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+class LineProtocolListener : private noncopyable {
+ public:
+  // A value for a variable stored on another server. These variables aren't interned, every value for the same line
+  // shares a single copy of the variable instead.
+  struct ForwardedValue {
+    shared_ptr<const Variable> variable;
+    proto::Value value;
+  };
+
+  // Called with each batch of values received. Each callback is only run from one thread at a time, but the two are run
+  // from different threads.
+  typedef boost::function<void(const vector<DatastorePoint> &)> BatchCallback;
+  typedef boost::function<void(const vector<ForwardedValue> &)> ForwardCallback;
+  // Returns true if values for <variable> are stored on this server.
+  typedef boost::function<bool(const Variable &)> LocalCallback;
+
+  LineProtocolListener(SeriesRegistry *registry, const BatchCallback &callback);
+  ~LineProtocolListener();
+
+  // Values for variables that <is_local> returns false for are passed to <forward> without being interned in the
+  // registry, as they would never be recorded here and series are kept for the life of the registry. Without this
+  // every variable is interned and passed to the batch callback. This must be called before listening.
+  void SetForwarding(const LocalCallback &is_local, const ForwardCallback &forward);
+
+  // Start receiving datagrams on a UDP socket bound to <address>.
+  void ListenUdp(const Socket::Address &address);
+
+  // Start accepting TCP connections on <address>.
+  void ListenTcp(const Socket::Address &address);
+
+  // Stop all listeners and close any open connections.
+  void Shutdown();
+
+  // The addresses being listened on, which include the port chosen if port 0 was requested.
+  inline const Socket::Address &udp_address() const {
+    return udp_address_;
+  }
+
+  inline const Socket::Address &tcp_address() const {
+    return tcp_socket_.local();
+  }
+
+ private:
+  struct KeyHash {
+    inline size_t operator()(const StringPiece &key) const {
+      return boost::hash_range(key.data(), key.data() + key.size());
+    }
+    inline size_t operator()(const string &key) const {
+      return boost::hash_range(key.begin(), key.end());
+    }
+  };
+
+  struct KeyEqual {
+    inline bool operator()(const StringPiece &a, const string &b) const {
+      return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+    }
+    inline bool operator()(const string &a, const StringPiece &b) const {
+      return operator()(b, a);
+    }
+    inline bool operator()(const string &a, const string &b) const {
+      return a == b;
+    }
+  };
+
+  // Where values for a line go, either an interned series or the variable to forward them with.
+  struct CacheEntry {
+    CacheEntry() : series(NULL) {}
+    const Series *series;
+    shared_ptr<const Variable> forward;
+  };
+
+  // Maps the variable as it appears on the line to where its values go, so that the same line doesn't have to be
+  // turned into a Variable every time it's seen. Each cache is only used by a single thread.
+  typedef unordered_map<string, CacheEntry, KeyHash, KeyEqual> SeriesCache;
+
+  // Runs callbacks in order on its own thread. At most <max_pending> callbacks are queued at once.
+  class Dispatcher : private noncopyable {
+   public:
+    explicit Dispatcher(uint64_t max_pending);
+    ~Dispatcher();
+
+    // Queue <callback> to be run. Returns false without queueing it if there are already too many waiting.
+    bool Add(const Callback &callback);
+
+    // Run any callbacks still queued, then stop the thread.
+    void Shutdown();
+
+   private:
+    void Run();
+
+    uint64_t max_pending_;
+    bool shutdown_;
+    std::deque<Callback> pending_;
+    Mutex mutex_;
+    boost::condition_variable cond_;
+    scoped_ptr<thread> thread_;
+  };
+
+  // Values parsed but not yet passed to the callbacks.
+  struct Batch {
+    inline size_t size() const {
+      return points.size() + forwarded.size();
+    }
+    vector<DatastorePoint> points;
+    vector<ForwardedValue> forwarded;
+  };
+
+  // A TCP connection, with any partial line received so far.
+  struct TcpConnection {
+    explicit TcpConnection(Socket *socket);
+    scoped_ptr<Socket> socket;
+    string source;
+    scoped_array<char> buffer;
+    uint64_t used;
+    SeriesCache cache;
+  };
+  typedef unordered_map<int, shared_ptr<TcpConnection>> TcpConnectionMap;
+
+  void UdpThread(int fd);
+  void TcpThread();
+  void AcceptConnections(TcpConnectionMap *connections);
+  // Read and parse whatever is available on <connection>. Returns false if the connection should be closed.
+  bool ReadConnection(TcpConnection *connection, Batch *batch);
+
+  // Parse every complete line in <buffer>, adding the values to <batch>. Lines with an invalid variable are skipped.
+  // Returns the number of bytes consumed, which will not include a trailing partial line.
+  uint64_t ParseLines(char *buffer, uint64_t size, const string &source, SeriesCache *cache, Batch *batch);
+  // Find where values for <line> go, setting either <series> or <forward>. Returns false if the variable name is not
+  // valid.
+  bool LookupSeries(const LineProtocolLine &line, const string &source, SeriesCache *cache, const Series **series,
+                    shared_ptr<const Variable> *forward);
+  // Queue the values in <batch> for the callbacks, leaving it empty.
+  void SendBatch(Batch *batch);
+  void RunCallback(shared_ptr<vector<DatastorePoint>> points);
+  void RunForward(shared_ptr<vector<ForwardedValue>> values);
+
+  SeriesRegistry *registry_;
+  BatchCallback callback_;
+  LocalCallback is_local_;
+  ForwardCallback forward_;
+  volatile bool shutdown_;
+  int udp_fd_;
+  Socket::Address udp_address_;
+  Socket tcp_socket_;
+  // epoll set holding the TCP listening socket and every TCP connection.
+  int epoll_fd_;
+  scoped_ptr<thread> udp_thread_;
+  scoped_ptr<thread> tcp_thread_;
+  // Separate so that values for this server aren't held up by forwarding.
+  Dispatcher callback_dispatcher_;
+  Dispatcher forward_dispatcher_;
+
+  ExportedInteger lines_received_;
+  ExportedInteger invalid_lines_;
+  ExportedInteger datagrams_received_;
+  ExportedInteger connections_accepted_;
+  ExportedInteger dropped_values_;
+};
+
+}  // namespace openinstrument
+
+#endif  // OPENINSTRUMENT_SERVER_LINE_PROTOCOL_LISTENER_H_
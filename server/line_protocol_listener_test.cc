@@ -0,0 +1,189 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/socket.h"
+#include "lib/string.h"
+#include "lib/timer.h"
+#include "server/disk_datastore.h"
+#include "server/line_protocol_listener.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+class LineProtocolListenerTest : public ::testing::Test {
+ protected:
+  LineProtocolListenerTest()
+    : stall_forwarding_(false),
+      listener_(&registry_, bind(&LineProtocolListenerTest::AddValues, this, _1)) {
+    listener_.SetForwarding(bind(&LineProtocolListenerTest::IsLocal, this, _1),
+                            bind(&LineProtocolListenerTest::ForwardValues, this, _1));
+    listener_.ListenUdp(Socket::Address("127.0.0.1", 0));
+    listener_.ListenTcp(Socket::Address("127.0.0.1", 0));
+  }
+
+  void AddValues(const vector<DatastorePoint> &points) {
+    MutexLock lock(mutex_);
+    for (const DatastorePoint &point : points)
+      values_.push_back(StringPrintf("%s %g", point.series->key().c_str(), point.value.double_value()));
+    cond_.notify_all();
+  }
+
+  // Variables under /test/remote belong to another server.
+  bool IsLocal(const Variable &variable) {
+    return variable.variable().find("/test/remote") != 0;
+  }
+
+  void ForwardValues(const vector<LineProtocolListener::ForwardedValue> &values) {
+    MutexLock lock(mutex_);
+    // Like a server being forwarded to that doesn't respond.
+    while (stall_forwarding_)
+      cond_.wait(lock);
+    for (const LineProtocolListener::ForwardedValue &value : values)
+      values_.push_back(StringPrintf("forward %s %g", value.variable->key().c_str(), value.value.double_value()));
+    cond_.notify_all();
+  }
+
+  // Wait for at least <count> values to arrive, and return every value received so far in order.
+  vector<string> WaitForValues(size_t count) {
+    Deadline deadline(5000);
+    MutexLock lock(mutex_);
+    while (values_.size() < count && deadline)
+      cond_.timed_wait(lock, boost::posix_time::milliseconds(100));
+    vector<string> values(values_);
+    std::sort(values.begin(), values.end());
+    return values;
+  }
+
+  void StallForwarding(bool stall) {
+    MutexLock lock(mutex_);
+    stall_forwarding_ = stall;
+    cond_.notify_all();
+  }
+
+  void SendUdp(const string &datagram) {
+    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_LE(0, fd);
+    Socket::Address address(listener_.udp_address());
+    EXPECT_EQ(static_cast<ssize_t>(datagram.size()),
+              ::sendto(fd, datagram.data(), datagram.size(), 0, reinterpret_cast<sockaddr *>(&address.address_),
+                       sizeof(address.address_)));
+    ::close(fd);
+  }
+
+  SeriesRegistry registry_;
+  Mutex mutex_;
+  boost::condition_variable cond_;
+  vector<string> values_;
+  bool stall_forwarding_;
+  LineProtocolListener listener_;
+};
+
+TEST_F(LineProtocolListenerTest, Udp) {
+  // The last line doesn't need a newline, and the source address is added as the hostname.
+  SendUdp("/test/udp{job=a} 1\n/test/udp{hostname=b} 2 1325376000000");
+  vector<string> values = WaitForValues(2);
+  ASSERT_EQ(2U, values.size());
+  EXPECT_EQ("/test/udp{hostname=127.0.0.1,job=a} 1", values[0]);
+  EXPECT_EQ("/test/udp{hostname=b} 2", values[1]);
+}
+
+TEST_F(LineProtocolListenerTest, InvalidNames) {
+  // Names are checked the same way as for values added over HTTP.
+  SendUdp("test/udp 1\n/ 2\nnot a line\n/test/valid 3\n");
+  vector<string> values = WaitForValues(1);
+  ASSERT_EQ(1U, values.size());
+  EXPECT_EQ("/test/valid{hostname=127.0.0.1} 3", values[0]);
+  EXPECT_FALSE(registry_.FindKey("test/udp{hostname=127.0.0.1}"));
+}
+
+TEST_F(LineProtocolListenerTest, Forwarding) {
+  // The same line twice, so the second is found in the cache.
+  SendUdp("/test/remote{job=a} 1\n/test/local 2\n/test/remote{job=a} 3\n");
+  vector<string> values = WaitForValues(3);
+  ASSERT_EQ(3U, values.size());
+  EXPECT_EQ("/test/local{hostname=127.0.0.1} 2", values[0]);
+  EXPECT_EQ("forward /test/remote{hostname=127.0.0.1,job=a} 1", values[1]);
+  EXPECT_EQ("forward /test/remote{hostname=127.0.0.1,job=a} 3", values[2]);
+  // Only the local series is interned.
+  EXPECT_TRUE(registry_.FindKey("/test/local{hostname=127.0.0.1}"));
+  EXPECT_FALSE(registry_.FindKey("/test/remote{hostname=127.0.0.1,job=a}"));
+}
+
+TEST_F(LineProtocolListenerTest, StalledForwarding) {
+  StallForwarding(true);
+  SendUdp("/test/remote 1\n");
+  // Values for this server are still read and added while forwarding is stuck.
+  SendUdp("/test/local 2\n");
+  SendUdp("/test/local 3\n");
+  vector<string> values = WaitForValues(2);
+  StallForwarding(false);
+  ASSERT_EQ(2U, values.size());
+  EXPECT_EQ("/test/local{hostname=127.0.0.1} 2", values[0]);
+  EXPECT_EQ("/test/local{hostname=127.0.0.1} 3", values[1]);
+
+  values = WaitForValues(3);
+  ASSERT_EQ(3U, values.size());
+  EXPECT_EQ("forward /test/remote{hostname=127.0.0.1} 1", values[2]);
+}
+
+TEST_F(LineProtocolListenerTest, ManyTcpConnections) {
+  // All the connections are open at once, and each sends a line in two parts.
+  vector<shared_ptr<Socket>> sockets;
+  for (int i = 0; i < 50; ++i) {
+    shared_ptr<Socket> sock(new Socket());
+    sock->Connect(listener_.tcp_address(), 5000);
+    sock->Write(StringPrintf("/test/tcp{conn=%02d} ", i));
+    sock->Flush();
+    sockets.push_back(sock);
+  }
+  for (int i = 0; i < 50; ++i) {
+    sockets[i]->Write(StringPrintf("%d\n", i));
+    sockets[i]->Flush();
+  }
+  vector<string> values = WaitForValues(50);
+  ASSERT_EQ(50U, values.size());
+  EXPECT_EQ("/test/tcp{conn=00,hostname=127.0.0.1} 0", values[0]);
+  EXPECT_EQ("/test/tcp{conn=49,hostname=127.0.0.1} 49", values[49]);
+}
+
+TEST_F(LineProtocolListenerTest, TcpLineTooLong) {
+  Socket sock;
+  sock.Connect(listener_.tcp_address(), 5000);
+  sock.Write("/test/long{label=" + string(70000, 'x'));
+  sock.Flush();
+  // The server closes the connection without a value being added.
+  sock.SetNonblocking(true);
+  Deadline deadline(5000);
+  bool eof = false;
+  while (!eof && deadline) {
+    try {
+      sock.ReadAvailable(&eof);
+    } catch (exception) {
+      // A reset is just as good as a close.
+      eof = true;
+    }
+    usleep(10000);
+  }
+  EXPECT_TRUE(eof);
+  EXPECT_TRUE(WaitForValues(0).empty());
+}
+
+}  // namespace openinstrument
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
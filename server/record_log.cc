@@ -9,6 +9,7 @@
 
 #include <string>
 #include <libgen.h>
+#include <unistd.h>
 #include "lib/common.h"
 #include "lib/openinstrument.pb.h"
 #include "lib/protobuf.h"
@@ -41,6 +42,16 @@ void RecordLog::Add(const proto::ValueStream &stream) {
   log_.back().CopyFrom(stream);
 }
 
+void RecordLog::Add(const vector<proto::ValueStream> &streams) {
+  if (streams.empty())
+    return;
+  MutexLock locker(mutex_);
+  for (const proto::ValueStream &stream : streams) {
+    log_.push_back(proto::ValueStream());
+    log_.back().CopyFrom(stream);
+  }
+}
+
 // Helper method to add a single Value.
 // This creates a temporary ValueStream and adds it to the log.
 void RecordLog::Add(const Variable &variable, const proto::Value &value) {
@@ -51,33 +62,45 @@ void RecordLog::Add(const Variable &variable, const proto::Value &value) {
   return Add(newstream);
 }
 
-// Flush as many streams as possible to the record log.
+// Write every stream in memory to the record log and sync it to disk.
 // No attempt is made to re-order or compress the streams so this is a very inefficient (and fast) way of recording
 // the data.
-// Returns false if there are more streams left to flush, returns true if the whole log has been flushed to disk.
+// Returns true only if every stream that was in memory when Flush() was called is on disk.
 bool RecordLog::Flush() {
-  if (!streams())
+  MutexLock flush_locker(flush_mutex_);
+  deque<proto::ValueStream> pending;
+  {
+    // Streams can be added while the file is being written and synced.
+    MutexLock locker(mutex_);
+    pending.swap(log_);
+  }
+  if (pending.empty())
     return true;
-  MutexLock locker(mutex_);
+  uint64_t done_streams = 0;
   try {
     ProtoStreamWriter writer(filename());
-    uint64_t done_streams = 0;
-    for (proto::ValueStream &stream : log_) {
+    for (proto::ValueStream &stream : pending) {
       if (!writer.Write(stream)) {
         LOG(ERROR) << "Couldn't write stream to recordlog";
         break;
       }
       done_streams++;
     }
-    if (done_streams) {
-      log_.erase(log_.begin(), log_.begin() + done_streams);
+    if (done_streams == pending.size() && fsync(writer.fh()->fd()) < 0) {
+      LOG(ERROR) << "Couldn't sync recordlog: " << strerror(errno);
+      // The streams may or may not be on disk, writing them again is harmless as replaying a value is idempotent.
+      done_streams = 0;
     }
-    VLOG(1) << "Flushed " << done_streams << " to recordlog, there are " << streams() << " streams left";
   } catch (exception &e) {
     LOG(ERROR) << "Can't write to recordlog: " << e.what();
-    return false;
   }
-  return true;
+  VLOG(1) << "Flushed " << done_streams << " streams to recordlog";
+  if (done_streams == pending.size())
+    return true;
+  // Put back whatever wasn't written, ahead of anything added since.
+  MutexLock locker(mutex_);
+  log_.insert(log_.begin(), pending.begin() + done_streams, pending.end());
+  return false;
 }
 
 void RecordLog::RotateRecordLog() {
@@ -85,7 +108,7 @@ void RecordLog::RotateRecordLog() {
   if (!stat.exists())
     return;
   if (stat.size() >= (FLAGS_recordlog_max_log_size * 1024 * 1024)) {
-    MutexLock locker(mutex_);
+    MutexLock locker(flush_mutex_);
     string newfilename = StringPrintf("%s.%s", filename().c_str(), Timestamp().GmTime("%Y-%m-%d-%H-%M-%S.%.").c_str());
     if (::rename(filename().c_str(), newfilename.c_str()) < 0) {
       LOG(WARNING) << "Error renaming " << filename() << " to " << newfilename << ": " << strerror(errno);
@@ -144,28 +167,22 @@ bool RecordLog::ReindexRecordLogFile(const string &input, MapType *log_data) con
   proto::ValueStream stream;
   while (reader.Next(&stream)) {
     Variable variable(stream.variable());
-    if (variable.ToString().empty())
+    if (variable.key().empty())
       continue;
-    MapType::iterator it = log_data->find(variable.ToString());
+    MapType::iterator it = log_data->find(variable.key());
     if (it == log_data->end()) {
-      proto::ValueStream &newstream = (*log_data)[variable.ToString()] = proto::ValueStream();
+      proto::ValueStream &newstream = (*log_data)[variable.key()] = proto::ValueStream();
       variable.ToProtobuf(newstream.mutable_variable());
-      it = log_data->find(variable.ToString());
+      it = log_data->find(variable.key());
     }
     CHECK(it != log_data->end());
-    for (auto &oldvalue : stream.value()) {
-      proto::Value *lastvalue = it->second.mutable_value(it->second.value_size() - 1);
-      if (it->second.value_size() &&
-          ((lastvalue->has_string_value() && lastvalue->string_value() == oldvalue.string_value()) ||
-          (lastvalue->has_double_value() && lastvalue->double_value() == oldvalue.double_value()))) {
-        // Candidate for RLE
-        lastvalue->set_end_timestamp(oldvalue.timestamp());
-        continue;
-      }
-      proto::Value *value = it->second.add_value();
-      value->CopyFrom(oldvalue);
-    }
+    for (auto &oldvalue : stream.value())
+      it->second.add_value()->CopyFrom(oldvalue);
   }
+  // Values may have been logged out of order, so sort them before writing the indexed file. This also applies the
+  // run-length encoding.
+  for (MapType::iterator it = log_data->begin(); it != log_data->end(); ++it)
+    SortValueStream(&it->second);
   return true;
 }
 
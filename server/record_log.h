@@ -57,19 +57,25 @@ class RecordLog : private noncopyable {
   }
 
   // Add a ValueStream to the log.
+  // The stream must carry its full variable rather than a series ID, as IDs are only valid for the lifetime of the
+  // SeriesRegistry that assigned them and the log is replayed into a new one.
   // At some point in the future this will be flushed to disk, but a successful return from Add() does not guarantee
   // that it is written to disk.
   // Call Flush() until the return is true to force disk output.
   void Add(const proto::ValueStream &stream);
 
+  // Add a batch of ValueStreams to the log, taking the lock only once.
+  void Add(const vector<proto::ValueStream> &streams);
+
   // Helper method to add a single Value.
   // This creates a temporary ValueStream and adds it to the log.
   void Add(const Variable &variable, const proto::Value &value);
 
-  // Flush as many streams as possible to the record log.
+  // Write every stream in memory to the record log and sync it to disk.
   // No attempt is made to re-order or compress the streams so this is a very inefficient (and fast) way of recording
   // the data.
-  // Returns false if there are more streams left to flush, returns true if the whole log has been flushed to disk.
+  // Returns true only if every stream added before the call is on disk. Streams which couldn't be written are kept and
+  // retried by the next Flush().
   bool Flush();
 
   const string filename() const {
@@ -99,7 +105,10 @@ class RecordLog : private noncopyable {
 
   const string basedir_;
   deque<proto::ValueStream> log_;
+  // Protects log_ and the replay state.
   Mutex mutex_;
+  // Held while writing to or rotating the log file, so that streams can still be added while a flush is syncing.
+  Mutex flush_mutex_;
   bool shutdown_;
   scoped_ptr<thread> admin_thread_;
 
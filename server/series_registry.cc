@@ -0,0 +1,91 @@
+/*
+ *  -
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/hash.h"
+#include "lib/openinstrument.pb.h"
+#include "lib/timer.h"
+#include "lib/variable.h"
+#include "server/series_registry.h"
+
+namespace openinstrument {
+
+SeriesRegistry *SeriesRegistry::global_registry_ = NULL;
+Mutex SeriesRegistry::global_registry_mutex_;
+
+Series::Series(SeriesId id, const Variable &variable)
+  : id_(id),
+    variable_(variable),
+    hash_(Hash::Hash32(variable.key())) {
+  variable_.ToProtobuf(&proto_);
+}
+
+SeriesRegistry::SeriesRegistry()
+  : epoch_(Timestamp::Now()),
+    next_id_(1) {}
+
+SeriesRegistry::~SeriesRegistry() {
+  for (auto &i : by_id_)
+    delete i.second;
+}
+
+SeriesRegistry &SeriesRegistry::get() {
+  MutexLock lock(global_registry_mutex_);
+  if (!global_registry_)
+    global_registry_ = new SeriesRegistry();
+  return *global_registry_;
+}
+
+const Series *SeriesRegistry::Intern(const Variable &variable) {
+  const string &key = variable.key();
+  {
+    SharedLock lock(mutex_);
+    MapType::const_iterator it = by_key_.find(key);
+    if (it != by_key_.end())
+      return it->second;
+  }
+  ExclusiveLock lock(mutex_);
+  // Another thread may have added the series while the lock was released.
+  MapType::const_iterator it = by_key_.find(key);
+  if (it != by_key_.end())
+    return it->second;
+  Series *series = new Series(next_id_++, variable);
+  by_id_[series->id()] = series;
+  by_key_[key] = series;
+  return series;
+}
+
+const Series *SeriesRegistry::Find(const Variable &variable) const {
+  return FindKey(variable.key());
+}
+
+const Series *SeriesRegistry::FindKey(const string &key) const {
+  SharedLock lock(mutex_);
+  MapType::const_iterator it = by_key_.find(key);
+  if (it == by_key_.end())
+    return NULL;
+  return it->second;
+}
+
+const Series *SeriesRegistry::Find(SeriesId id) const {
+  SharedLock lock(mutex_);
+  unordered_map<SeriesId, Series *>::const_iterator it = by_id_.find(id);
+  if (it == by_id_.end())
+    return NULL;
+  return it->second;
+}
+
+uint64_t SeriesRegistry::size() const {
+  SharedLock lock(mutex_);
+  return by_key_.size();
+}
+
+}  // namespace openinstrument
@@ -0,0 +1,108 @@
+/*
+ * Registry of every series known to the datastore server.
+ *
+ * Each distinct canonical variable is interned once and assigned a dense 64-bit ID. The canonical string key, its hash
+ * and the StreamVariable protobuf are computed at the same time and cached, so that the storage, record log and
+ * forwarding paths never need to rebuild them for every value.
+ *
+ * Copyright 2011 David Parrish <david@dparrish.com>
+ *
+ * vim: sw=2 tw=120
+ *
+ */
+
+#ifndef OPENINSTRUMENT_SERVER_SERIES_REGISTRY_H_
+#define OPENINSTRUMENT_SERVER_SERIES_REGISTRY_H_
+
+#include <string>
+#include <vector>
+#include "lib/common.h"
+#include "lib/openinstrument.pb.h"
+#include "lib/timer.h"
+#include "lib/variable.h"
+
+namespace openinstrument {
+
+typedef uint64_t SeriesId;
+
+// A single interned series. Series are never removed from the registry, so a pointer to one stays valid for as long as
+// the registry exists and may be kept in queues and caches. Keep the ID to refer to a series from outside the process.
+class Series : private noncopyable {
+ public:
+  inline SeriesId id() const {
+    return id_;
+  }
+
+  // The canonical string form of the variable, as returned by Variable::ToString().
+  inline const string &key() const {
+    return variable_.key();
+  }
+
+  // Hash32 of key(). This is used for sharding and for the consistent hash ring.
+  inline uint32_t hash() const {
+    return hash_;
+  }
+
+  inline const Variable &variable() const {
+    return variable_;
+  }
+
+  inline const proto::StreamVariable &proto() const {
+    return proto_;
+  }
+
+ private:
+  Series(SeriesId id, const Variable &variable);
+
+  const SeriesId id_;
+  const Variable variable_;
+  const uint32_t hash_;
+  proto::StreamVariable proto_;
+
+  friend class SeriesRegistry;
+};
+
+class SeriesRegistry : private noncopyable {
+ public:
+  SeriesRegistry();
+  ~SeriesRegistry();
+
+  // Returns the registry shared by the whole process.
+  static SeriesRegistry &get();
+
+  // Return the series for <variable>, creating it if it does not already exist.
+  const Series *Intern(const Variable &variable);
+
+  // Return the series for <variable>, or NULL if it has never been interned.
+  const Series *Find(const Variable &variable) const;
+  const Series *FindKey(const string &key) const;
+
+  // Return the series with the given ID, or NULL if there is no such series.
+  const Series *Find(SeriesId id) const;
+
+  // Number of series that are currently interned.
+  uint64_t size() const;
+
+  // Series IDs are only valid for the lifetime of a registry. Clients holding IDs must check that the epoch has not
+  // changed before using them.
+  inline uint64_t epoch() const {
+    return epoch_;
+  }
+
+ private:
+  typedef unordered_map<string, Series *> MapType;
+
+  const uint64_t epoch_;
+  mutable SharedMutex mutex_;
+  MapType by_key_;
+  unordered_map<SeriesId, Series *> by_id_;
+  // IDs are never reused, and ID 0 is never assigned.
+  SeriesId next_id_;
+
+  static SeriesRegistry *global_registry_;
+  static Mutex global_registry_mutex_;
+};
+
+}  // namespace openinstrument
+
+#endif  // OPENINSTRUMENT_SERVER_SERIES_REGISTRY_H_
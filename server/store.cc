@@ -19,18 +19,23 @@
 #include "lib/atomic.h"
 #include "lib/common.h"
 #include "lib/counter.h"
+#include "lib/hash.h"
 #include "lib/http_server.h"
 #include "lib/http_static_dir.h"
 #include "lib/openinstrument.pb.h"
 #include "lib/protobuf.h"
 #include "lib/retention_policy_manager.h"
+#include "lib/rpc_server.h"
 #include "lib/store_config.h"
 #include "lib/string.h"
 #include "lib/threadpool.h"
 #include "lib/timer.h"
 #include "server/disk_datastore.h"
 #include "server/indexed_store_file.h"
+#include "server/ingest_pipeline.h"
+#include "server/line_protocol_listener.h"
 #include "server/record_log.h"
+#include "server/series_registry.h"
 #include "server/store_file_manager.h"
 
 DECLARE_string(config_file);
@@ -40,6 +45,14 @@ DEFINE_int32(num_http_threads, 10, "Number of threads to create in the Http Serv
 DEFINE_int32(max_http_threads, 20, "Max of threads to create in the Http Server thread pool");
 DEFINE_string(datastore, "/home/services/openinstrument", "Base directory for datastore files");
 DEFINE_int32(store_max_ram, 200, "Maximum amount of datastore objects to cache in RAM");
+DEFINE_string(ingest_ack_mode, "commit", "When to acknowledge added values. \"enqueue\" acknowledges as soon as values "
+              "are queued for writing, \"commit\" waits until they are in the datastore and the record log is flushed");
+DEFINE_int32(ingest_queue_size, 65536, "Maximum number of values queued for each datastore shard");
+DEFINE_int32(ingest_batch_size, 1024, "Maximum number of values written to a datastore shard at once");
+DEFINE_int32(line_protocol_port, 0, "Port to accept plaintext line protocol values on, over both UDP and TCP. "
+             "Set to 0 to disable.");
+DEFINE_int32(rpc_port, 0, "Port to accept binary RPC connections on, serving the same requests as the HTTP port. "
+             "Set rpc_port for this server in the store config so other servers use it. Set to 0 to disable.");
 
 namespace openinstrument {
 
@@ -51,6 +64,8 @@ class DataStoreServer : private noncopyable {
  public:
   DataStoreServer(const string &addr, uint16_t port)
     : datastore(FLAGS_datastore),
+      ingest_pipeline_(&datastore, IngestPipeline::ParseAckMode(FLAGS_ingest_ack_mode), FLAGS_ingest_queue_size,
+                       FLAGS_ingest_batch_size),
       retention_policy_manager_(),
       store_file_manager_(retention_policy_manager_),
       thread_pool_policy_(FLAGS_num_http_threads, FLAGS_max_http_threads),
@@ -61,8 +76,11 @@ class DataStoreServer : private noncopyable {
       add_request_timer_("/openinstrument/store/add-requests"),
       list_request_timer_("/openinstrument/store/list-requests"),
       get_request_timer_("/openinstrument/store/get-requests"),
+      label_values_request_timer_("/openinstrument/store/label-values-requests"),
       forwarded_streams_ratio_("/openinstrument/store/forwarded-streams"),
-      retention_policy_drops_("/openinstrument/store/retention-policy/values-dropped") {
+      retention_policy_drops_("/openinstrument/store/retention-policy/values-dropped"),
+      line_protocol_listener_(NULL),
+      rpc_server_(NULL) {
     run_timer_.Start();
     StoreConfig &config = StoreConfig::get_manager();
     config.SetConfigFilename(StringPrintf("%s/%s", FLAGS_datastore.c_str(), FLAGS_config_file.c_str()));
@@ -75,7 +93,21 @@ class DataStoreServer : private noncopyable {
     server_.request_handler()->AddPath("/get_config$", &DataStoreServer::HandleGetConfig, this);
     server_.request_handler()->AddPath("/health$", &DataStoreServer::HandleHealth, this);
     server_.request_handler()->AddPath("/status$", &DataStoreServer::HandleStatus, this);
+    server_.request_handler()->AddPath("/label_stats$", &DataStoreServer::HandleLabelStats, this);
+    server_.request_handler()->AddPath("/label_values$", &DataStoreServer::HandleLabelValues, this);
     server_.AddExportHandler();
+    if (FLAGS_line_protocol_port) {
+      line_protocol_listener_.reset(new LineProtocolListener(
+          &datastore.registry(), bind(&DataStoreServer::AddLineProtocolValues, this, _1)));
+      line_protocol_listener_->SetForwarding(bind(&DataStoreServer::IsLocalVariable, this, _1),
+                                             bind(&DataStoreServer::ForwardLineProtocolValues, this, _1));
+      line_protocol_listener_->ListenUdp(Socket::Address(addr, FLAGS_line_protocol_port));
+      line_protocol_listener_->ListenTcp(Socket::Address(addr, FLAGS_line_protocol_port));
+    }
+    if (FLAGS_rpc_port) {
+      rpc_server_.reset(new rpc::RpcServer(server_.request_handler(), &thread_pool_));
+      rpc_server_->Listen(Socket::Address(addr, FLAGS_rpc_port));
+    }
     // Export stats every minute
     VariableExporter::GetGlobalExporter()->SetExportLabel("job", "datastore");
     VariableExporter::GetGlobalExporter()->SetExportLabel("hostname", Socket::Hostname());
@@ -85,8 +117,7 @@ class DataStoreServer : private noncopyable {
 
   bool HandleGetConfig(const HttpRequest &request, HttpReply *reply) {
     reply->SetStatus(HttpReply::OK);
-    reply->SetContentType("application/base64");
-    if (!SerializeProtobuf(StoreConfig::get(), reply->mutable_body())) {
+    if (!rpc::SerializeReply(request, StoreConfig::get(), reply)) {
       reply->SetStatus(HttpReply::INTERNAL_SERVER_ERROR);
       reply->mutable_body()->clear();
       reply->mutable_body()->CopyFrom("Error serializing protobuf\n");
@@ -106,7 +137,7 @@ class DataStoreServer : private noncopyable {
     ScopedExportTimer t(&get_request_timer_);
 
     proto::GetRequest req;
-    if (!UnserializeProtobuf(request.body(), &req)) {
+    if (!rpc::ParseRequest(request, &req)) {
       reply->SetStatus(HttpReply::BAD_REQUEST);
       reply->mutable_body()->clear();
       reply->mutable_body()->CopyFrom("Invalid Request\n");
@@ -153,12 +184,20 @@ class DataStoreServer : private noncopyable {
 
       // Perform any requested aggregation
       if (req.aggregation_size()) {
+        // Parse each stream's variable once, rather than for every comparison below.
+        vector<Variable> stream_vars;
+        stream_vars.reserve(streams.size());
+        for (auto &stream : streams)
+          stream_vars.push_back(Variable(stream.variable()));
+
         for (auto &varname : unique_vars) {
           // Get a list of all streams with the same variable name
           vector<proto::ValueStream> aggstreams;
-          for (auto &stream : streams) {
-            if (Variable(stream.variable()).variable() == varname) {
-              aggstreams.push_back(stream);
+          vector<const Variable *> aggvars;
+          for (size_t i = 0; i < streams.size(); i++) {
+            if (stream_vars[i].variable() == varname) {
+              aggstreams.push_back(streams[i]);
+              aggvars.push_back(&stream_vars[i]);
             }
           }
           for (auto &agg : req.aggregation()) {
@@ -167,8 +206,8 @@ class DataStoreServer : private noncopyable {
               sample_interval = 30000;
 
             Variable var;
-            if (aggstreams.size())
-              var.set_variable(Variable(aggstreams[0].variable()).variable());
+            if (aggvars.size())
+              var.set_variable(aggvars[0]->variable());
 
             if (!agg.label_size()) {
               // Aggregate by variable only, throw away all labels
@@ -190,10 +229,9 @@ class DataStoreServer : private noncopyable {
               for (const string &label : agg.label()) {
                 set<string> distinct_values;
 
-                for (auto &stream : aggstreams) {
-                  Variable tmpvar(stream.variable());
-                  if (tmpvar.HasLabel(label))
-                    distinct_values.insert(tmpvar.GetLabel(label));
+                for (const Variable *tmpvar : aggvars) {
+                  if (tmpvar->HasLabel(label))
+                    distinct_values.insert(tmpvar->GetLabel(label));
                 }
                 VLOG(2) << "Distinct values for " << label << ":";
                 for (const string &output_label : distinct_values) {
@@ -201,10 +239,10 @@ class DataStoreServer : private noncopyable {
                   vector<proto::ValueStream> tmpstreams;
                   unordered_map<string, int> other_label_counts;
                   unordered_map<string, string> other_label_values;
-                  for (auto &stream : aggstreams) {
-                    Variable tmpvar(stream.variable());
+                  for (size_t i = 0; i < aggstreams.size(); i++) {
+                    const Variable &tmpvar = *aggvars[i];
                     if (tmpvar.GetLabel(label) == output_label) {
-                      tmpstreams.push_back(stream);
+                      tmpstreams.push_back(aggstreams[i]);
                       for (Variable::MapType::const_iterator it = tmpvar.labels().begin(); it != tmpvar.labels().end();
                            ++it) {
                         if (other_label_values[it->first] != it->second) {
@@ -264,8 +302,8 @@ class DataStoreServer : private noncopyable {
     }
 
     reply->SetStatus(HttpReply::OK);
-    reply->SetContentType("application/base64");
-    if (!SerializeProtobuf(response, reply->mutable_body())) {
+    reply->set_compressible();
+    if (!rpc::SerializeReply(request, response, reply)) {
       reply->SetStatus(HttpReply::INTERNAL_SERVER_ERROR);
       reply->mutable_body()->clear();
       reply->mutable_body()->CopyFrom("Error serializing protobuf\n");
@@ -344,7 +382,7 @@ class DataStoreServer : private noncopyable {
 
     proto::ListRequest req;
     VLOG(2) << "HandleList received body: " << request.body().ToString();
-    if (!UnserializeProtobuf(request.body(), &req)) {
+    if (!rpc::ParseRequest(request, &req)) {
       reply->SetStatus(HttpReply::BAD_REQUEST);
       reply->mutable_body()->clear();
       reply->mutable_body()->CopyFrom("Invalid request\n");
@@ -358,19 +396,93 @@ class DataStoreServer : private noncopyable {
       return true;
     }
     proto::ListResponse response;
-    set<Variable> vars = datastore.FindVariables(Variable(req.prefix()));
+    response.set_success(true);
+    uint64_t limit = req.max_variables();
+    if (req.page_size() && (!limit || req.page_size() < limit))
+      limit = req.page_size();
+    if (limit) {
+      // The index returns the variables already sorted, and stops looking once it has enough. Series with no values
+      // in the last max_age ms are skipped. When paging, one extra series is fetched to find out whether there are
+      // more, and the key of the last one returned is where the next page starts.
+      if (!req.continuation_token().empty()) {
+        try {
+          Variable token(req.continuation_token());
+        } catch (exception &e) {
+          reply->SetStatus(HttpReply::BAD_REQUEST);
+          reply->mutable_body()->clear();
+          reply->mutable_body()->CopyFrom("Invalid continuation token\n");
+          return true;
+        }
+      }
+      vector<const Series *> found;
+      try {
+        found = datastore.ListVariables(Variable(req.prefix()), req.page_size() ? limit + 1 : limit, req.max_age(),
+                                        req.continuation_token());
+      } catch (exception &e) {
+        // Most likely an invalid regular expression in one of the label searches.
+        reply->SetStatus(HttpReply::BAD_REQUEST);
+        reply->mutable_body()->clear();
+        reply->mutable_body()->CopyFrom(StringPrintf("Invalid search: %s\n", e.what()));
+        return true;
+      }
+      if (found.size() > limit) {
+        found.resize(limit);
+        response.set_continuation_token(found.back()->key());
+      }
+      for (const Series *series : found)
+        response.add_stream()->mutable_variable()->CopyFrom(series->proto());
+    }
+    reply->SetStatus(HttpReply::OK);
+    reply->set_compressible();
+    if (!rpc::SerializeReply(request, response, reply)) {
+      reply->SetStatus(HttpReply::INTERNAL_SERVER_ERROR);
+      reply->mutable_body()->clear();
+      reply->mutable_body()->CopyFrom("Error serializing protobuf\n");
+    }
+    return true;
+  }
 
+  bool HandleLabelStats(const HttpRequest &request, HttpReply *reply) {
+    proto::LabelStatsRequest req;
+    if (!rpc::ParseRequest(request, &req)) {
+      reply->SetStatus(HttpReply::BAD_REQUEST);
+      reply->mutable_body()->clear();
+      reply->mutable_body()->CopyFrom("Invalid request\n");
+      return true;
+    }
+    proto::LabelStatsResponse response;
     response.set_success(true);
-    uint32_t varcounter = 0;
-    for (auto &var : vars) {
-      if (++varcounter > req.max_variables())
-        break;
-      proto::ValueStream *stream = response.add_stream();
-      var.ToValueStream(stream);
+    datastore.index().GetLabelStats(req, &response);
+    reply->SetStatus(HttpReply::OK);
+    if (!rpc::SerializeReply(request, response, reply)) {
+      reply->SetStatus(HttpReply::INTERNAL_SERVER_ERROR);
+      reply->mutable_body()->clear();
+      reply->mutable_body()->CopyFrom("Error serializing protobuf\n");
     }
+    return true;
+  }
+
+  bool HandleLabelValues(const HttpRequest &request, HttpReply *reply) {
+    ScopedExportTimer t(&label_values_request_timer_);
+
+    proto::LabelValuesRequest req;
+    if (!rpc::ParseRequest(request, &req)) {
+      reply->SetStatus(HttpReply::BAD_REQUEST);
+      reply->mutable_body()->clear();
+      reply->mutable_body()->CopyFrom("Invalid request\n");
+      return true;
+    }
+    if (req.label().empty()) {
+      reply->SetStatus(HttpReply::BAD_REQUEST);
+      reply->mutable_body()->clear();
+      reply->mutable_body()->CopyFrom("Empty label\n");
+      return true;
+    }
+    proto::LabelValuesResponse response;
+    response.set_success(true);
+    datastore.index().GetLabelValues(req, &response);
     reply->SetStatus(HttpReply::OK);
-    reply->SetContentType("application/base64");
-    if (!SerializeProtobuf(response, reply->mutable_body())) {
+    if (!rpc::SerializeReply(request, response, reply)) {
       reply->SetStatus(HttpReply::INTERNAL_SERVER_ERROR);
       reply->mutable_body()->clear();
       reply->mutable_body()->CopyFrom("Error serializing protobuf\n");
@@ -378,26 +490,138 @@ class DataStoreServer : private noncopyable {
     return true;
   }
 
+  // Validate a single value and queue it to be written to the datastore.
+  void AddValue(const Series *series, const proto::Value &value, const Timestamp &now, IngestPipeline::Ticket *ticket) {
+    Timestamp ts(value.timestamp());
+    if (retention_policy_manager_.ShouldDrop(*retention_policy_manager_.GetPolicy(series->variable(),
+                                                                                  now.ms() - ts.ms()))) {
+      // Retention policy says this variable should be dropped, so just ignore it
+      ++retention_policy_drops_;
+      return;
+    }
+    if (ts.ms() > now.ms() + 1000)
+      // Allow up to 1 second clock drift
+      throw runtime_error(StringPrintf("Attempt to set value in the future (t=%0.3f, now=%0.3f)", ts.seconds(),
+                                       now.seconds()));
+    if (ts.seconds() < now.seconds() - 86400 * 365)
+      LOG(WARNING) << "Adding very old data point for " << series->key();
+
+    ingest_pipeline_.Add(series, value, ticket);
+    VLOG(1) << "Adding value for " << series->key() << " = " << std::fixed << value.double_value();
+  }
+
+  // Send streams that belong on other storage servers. <forward_requests> is keyed by server address.
+  void ForwardRequests(const unordered_map<string, proto::AddRequest> &forward_requests) {
+    for (unordered_map<string, proto::AddRequest>::const_iterator i = forward_requests.begin();
+         i != forward_requests.end(); ++i) {
+      try {
+        // Use the server's RPC port if it has one.
+        const proto::StoreServer *server = StoreConfig::get_manager().server(i->first);
+        scoped_ptr<StoreClient> client(server ? new StoreClient(*server) : new StoreClient(i->first));
+        scoped_ptr<proto::AddResponse> response(client->Add(i->second));
+        VLOG(3) << "Forwarded " << i->second.stream_size() << " streams to " << i->first << ", response is "
+                << response->success();
+        forwarded_streams_ratio_.success();
+      } catch (exception e) {
+        LOG(WARNING) << "Attempt to forward " << i->second.stream_size() << " streams to " << i->first
+                     << " failed!";
+        forwarded_streams_ratio_.failure();
+      }
+    }
+  }
+
+  // Add values received by the line protocol listener. These are not acknowledged, so errors are only logged.
+  void AddLineProtocolValues(const vector<DatastorePoint> &points) {
+    unordered_map<string, proto::AddRequest> forward_requests;
+    unordered_map<SeriesId, proto::ValueStream *> forward_streams;
+    Timestamp now;
+    for (const DatastorePoint &point : points) {
+      try {
+        string node = StoreConfig::get_manager().hash_ring().GetNodeForHash(point.series->hash());
+        if (node != MyAddress()) {
+          // The hash ring has changed since the listener found where the series belongs.
+          proto::ValueStream *&forwardstream = forward_streams[point.series->id()];
+          if (!forwardstream) {
+            proto::AddRequest &forwardreq = forward_requests[node];
+            forwardreq.set_forwarded(true);
+            forwardstream = forwardreq.add_stream();
+            forwardstream->mutable_variable()->CopyFrom(point.series->proto());
+          }
+          forwardstream->add_value()->CopyFrom(point.value);
+          continue;
+        }
+        AddValue(point.series, point.value, now, NULL);
+      } catch (exception &e) {
+        VLOG(1) << "Dropping line protocol value for " << point.series->key() << ": " << e.what();
+      }
+    }
+    ForwardRequests(forward_requests);
+  }
+
+  // Uses the same hash as Series::hash(), so the variable doesn't have to be interned to find where it belongs.
+  bool IsLocalVariable(const Variable &variable) {
+    return StoreConfig::get_manager().hash_ring().GetNodeForHash(Hash::Hash32(variable.key())) == MyAddress();
+  }
+
+  // Forward line protocol values for variables stored on other servers, which haven't been interned here.
+  void ForwardLineProtocolValues(const vector<LineProtocolListener::ForwardedValue> &values) {
+    unordered_map<string, proto::AddRequest> forward_requests;
+    unordered_map<const Variable *, proto::ValueStream *> forward_streams;
+    Timestamp now;
+    for (const LineProtocolListener::ForwardedValue &value : values) {
+      const Variable &variable = *value.variable;
+      try {
+        string node = StoreConfig::get_manager().hash_ring().GetNodeForHash(Hash::Hash32(variable.key()));
+        if (node == MyAddress()) {
+          // The hash ring has changed since the listener found where the variable belongs.
+          AddValue(datastore.registry().Intern(variable), value.value, now, NULL);
+          continue;
+        }
+        proto::ValueStream *&forwardstream = forward_streams[&variable];
+        if (!forwardstream) {
+          proto::AddRequest &forwardreq = forward_requests[node];
+          forwardreq.set_forwarded(true);
+          forwardstream = forwardreq.add_stream();
+          variable.ToProtobuf(forwardstream->mutable_variable());
+        }
+        forwardstream->add_value()->CopyFrom(value.value);
+      } catch (exception &e) {
+        VLOG(1) << "Dropping line protocol value for " << variable.key() << ": " << e.what();
+      }
+    }
+    ForwardRequests(forward_requests);
+  }
+
   bool HandleAdd(const HttpRequest &request, HttpReply *reply) {
     ScopedExportTimer t(&add_request_timer_);
 
     proto::AddRequest req;
-    if (!UnserializeProtobuf(request.body(), &req)) {
+    if (!rpc::ParseRequest(request, &req)) {
       reply->SetStatus(HttpReply::BAD_REQUEST);
       reply->mutable_body()->clear();
       reply->mutable_body()->CopyFrom("Invalid request\n");
       return true;
     }
-    if (req.stream_size() <= 0) {
+    if (req.stream_size() <= 0 && req.series_id_size() <= 0) {
       reply->SetStatus(HttpReply::BAD_REQUEST);
       reply->mutable_body()->clear();
       reply->mutable_body()->CopyFrom("Empty proto::ValueStream\n");
       return true;
     }
+    if (req.series_id_size() != req.timestamp_size() || req.series_id_size() != req.double_value_size()) {
+      reply->SetStatus(HttpReply::BAD_REQUEST);
+      reply->mutable_body()->clear();
+      reply->mutable_body()->CopyFrom("Mismatched series_id, timestamp and double_value\n");
+      return true;
+    }
 
     proto::AddResponse response;
     response.set_success(true);
+    response.set_series_epoch(datastore.registry().epoch());
     unordered_map<string, proto::AddRequest> forward_requests;
+    // Values are validated here and handed to the ingest pipeline, which writes them to the datastore in the
+    // background. The ticket is used to wait for them to be committed before replying.
+    IngestPipeline::Ticket ticket;
     Timestamp now;
     for (int streamid = 0; streamid < req.stream_size(); streamid++) {
       proto::ValueStream *stream = req.mutable_stream(streamid);
@@ -407,41 +631,31 @@ class DataStoreServer : private noncopyable {
         // address is correct.
         var.SetLabel("hostname", request.source.AddressToString());
       }
-      // Canonicalize the variable name
-      var.ToValueStream(stream);
-      VLOG(1) << "Adding value for " << var.ToString();
       try {
-        if (var.variable().at(0) != '/' ||
-            var.variable().size() < 2 ||
-            var.variable().find_first_of("\n\t ") != string::npos) {
+        if (!var.HasValidName())
           throw runtime_error(StringPrintf("Invalid variable name %s", var.ToString().c_str()));
-        }
-        string node = StoreConfig::get_manager().hash_ring().GetNode(var.ToString());
+        // Uses the same hash as Series::hash(), so the series doesn't have to be interned to find where it belongs.
+        string node = StoreConfig::get_manager().hash_ring().GetNodeForHash(Hash::Hash32(var.key()));
         if (node != MyAddress() && !req.forwarded()) {
-          // This variable should be stored on another storage server, add it to the list of streams to forward
+          // This variable should be stored on another storage server, add it to the list of streams to forward. It
+          // isn't interned here, so it gets no ID and the client keeps sending it as a full stream.
+          if (req.register_streams())
+            response.add_series_id(0);
           proto::AddRequest &forwardreq = forward_requests[node];
           forwardreq.set_forwarded(true);
           proto::ValueStream *forwardstream = forwardreq.add_stream();
-          forwardstream->CopyFrom(*stream);
+          // Copy everything, including any mutations, and then replace the variable with the canonical one.
+          forwardstream->Swap(stream);
+          var.ToProtobuf(forwardstream->mutable_variable());
           continue;
         }
-        for (auto &value : stream->value()) {
-          Timestamp ts(value.timestamp());
-          if (retention_policy_manager_.ShouldDrop(retention_policy_manager_.GetPolicy(var, now.ms() - ts.ms()))) {
-            // Retention policy says this variable should be dropped, so just ignore it
-            ++retention_policy_drops_;
-            continue;
-          }
-          if (ts.ms() > now.ms() + 1000)
-            // Allow up to 1 second clock drift
-            throw runtime_error(StringPrintf("Attempt to set value in the future (t=%0.3f, now=%0.3f)", ts.seconds(),
-                                             now.seconds()));
-          if (ts.seconds() < now.seconds() - 86400 * 365)
-            LOG(WARNING) << "Adding very old data point for " << var.ToString();
-
-          datastore.Record(var, ts, value);
-          VLOG(1) << "Adding value for " << var.ToString() << " = " << std::fixed << value.double_value();
-        }
+        // Intern the series once, from here on the cached key, hash and protobuf are used instead of rebuilding them.
+        const Series *series = datastore.registry().Intern(var);
+        if (req.register_streams())
+          response.add_series_id(series->id());
+        VLOG(1) << "Adding value for " << series->key();
+        for (auto &value : stream->value())
+          AddValue(series, value, now, &ticket);
       } catch (exception &e) {
         LOG(WARNING) << e.what();
         response.set_success(false);
@@ -450,26 +664,55 @@ class DataStoreServer : private noncopyable {
       }
     }
 
-    // Forward on any streams that should go to other storage servers.
-    for (unordered_map<string, proto::AddRequest>::iterator i = forward_requests.begin(); i != forward_requests.end();
-         ++i) {
+    // Values for previously registered series. IDs from a previous registry are never valid, the client has to
+    // register them again.
+    bool epoch_valid = req.series_epoch() == datastore.registry().epoch();
+    unordered_map<SeriesId, proto::ValueStream *> forward_streams;
+    for (int i = 0; i < req.series_id_size() && response.success(); i++) {
+      const Series *series = epoch_valid ? datastore.registry().Find(req.series_id(i)) : NULL;
+      if (!series) {
+        if (!response.unknown_series_id_size() ||
+            response.unknown_series_id(response.unknown_series_id_size() - 1) != req.series_id(i)) {
+          response.add_unknown_series_id(req.series_id(i));
+        }
+        continue;
+      }
+      proto::Value value;
+      value.set_timestamp(req.timestamp(i));
+      value.set_double_value(req.double_value(i));
       try {
-        StoreClient client(i->first);
-        scoped_ptr<proto::AddResponse> response(client.Add(i->second));
-        VLOG(3) << "Forwarded " << i->second.stream_size() << " streams to " << i->first << ", response is "
-                << response->success();
-        forwarded_streams_ratio_.success();
-      } catch (exception e) {
-        LOG(WARNING) << "Attempt to forward " << i->second.stream_size() << " streams to " << i->first
-                     << " failed!";
-        forwarded_streams_ratio_.failure();
+        string node = StoreConfig::get_manager().hash_ring().GetNodeForHash(series->hash());
+        if (node != MyAddress() && !req.forwarded()) {
+          // Other servers don't know this ID, so forward a full stream.
+          proto::ValueStream *&forwardstream = forward_streams[series->id()];
+          if (!forwardstream) {
+            proto::AddRequest &forwardreq = forward_requests[node];
+            forwardreq.set_forwarded(true);
+            forwardstream = forwardreq.add_stream();
+            forwardstream->mutable_variable()->CopyFrom(series->proto());
+          }
+          forwardstream->add_value()->CopyFrom(value);
+          continue;
+        }
+        AddValue(series, value, now, &ticket);
+      } catch (exception &e) {
+        LOG(WARNING) << e.what();
+        response.set_success(false);
+        response.set_errormessage(e.what());
       }
     }
+    // Unknown series IDs are reported in unknown_series_id and don't make the request fail, so that success is only
+    // false when something the client can't fix by registering the series again has gone wrong.
+    if (!ticket.Wait() && response.success()) {
+      response.set_success(false);
+      response.set_errormessage("Error writing values to the datastore");
+    }
 
+    // Forward on any streams that should go to other storage servers.
+    ForwardRequests(forward_requests);
 
     reply->SetStatus(HttpReply::OK);
-    reply->SetContentType("application/base64");
-    if (!SerializeProtobuf(response, reply->mutable_body())) {
+    if (!rpc::SerializeReply(request, response, reply)) {
       reply->SetStatus(HttpReply::INTERNAL_SERVER_ERROR);
       reply->mutable_body()->clear();
       reply->mutable_body()->CopyFrom("Error serializing protobuf\n");
@@ -503,16 +746,19 @@ class DataStoreServer : private noncopyable {
     uint32_t total_variables = 0, total_values = 0, total_ram = 0;
 
     for (auto &variable : datastore.FindVariables(Variable("*"))) {
-      auto stream = datastore.GetValueStream(variable);
+      // The series may have expired since it was found.
+      proto::ValueStream stream;
+      if (!datastore.GetValueStream(variable, &stream))
+        continue;
       auto vdict = dict.AddSectionDictionary("LIVE_VARIABLE");
       uint32_t data_size = 0;
       vdict->SetValue("VARIABLE", variable.ToString());
-      vdict->SetIntValue("COUNTER", stream->value_size());
+      vdict->SetIntValue("COUNTER", stream.value_size());
       total_variables++;
-      total_values += stream->value_size();
-      if (stream->value_size()) {
-        const auto &front = stream->value(0);
-        const auto &back = stream->value(stream->value_size() - 1);
+      total_values += stream.value_size();
+      if (stream.value_size()) {
+        const auto &front = stream.value(0);
+        const auto &back = stream.value(stream.value_size() - 1);
         vdict->SetValue("FIRST", Duration(Timestamp::Now() - front.timestamp()).ToString(false));
         vdict->SetValue("LAST", Duration(Timestamp::Now() - back.timestamp()).ToString(false));
         if (front.has_double_value())
@@ -522,7 +768,7 @@ class DataStoreServer : private noncopyable {
         else
           vdict->SetValue("LATEST", "<em>none</em>");
       }
-      for (const auto &value : stream->value()) {
+      for (const auto &value : stream.value()) {
         if (value.has_double_value())
           data_size += sizeof(value.double_value());
         if (value.has_string_value())
@@ -532,6 +778,24 @@ class DataStoreServer : private noncopyable {
       total_ram += data_size;
     }
 
+    // Labels with the most distinct values are the ones responsible for large numbers of series.
+    proto::LabelStatsResponse label_stats;
+    datastore.index().GetLabelStats(LabelIndex::StatusLabelStatsRequest(), &label_stats);
+    dict.SetIntValue("TOTAL_SERIES", datastore.index().size());
+    for (auto &stats : label_stats.label()) {
+      auto ldict = dict.AddSectionDictionary("LABEL_STATS");
+      ldict->SetValue("LABEL", stats.label());
+      ldict->SetIntValue("SERIES", stats.series());
+      ldict->SetIntValue("DISTINCT_VALUES", stats.distinct_values());
+      string top_values;
+      for (auto &value : stats.value()) {
+        if (!top_values.empty())
+          top_values += ", ";
+        StringAppendf(&top_values, "%s (%lu)", value.value().c_str(), value.series());
+      }
+      ldict->SetValue("TOP_VALUES", top_values);
+    }
+
     dict.SetIntValue("TOTAL_RECORDLOG_VARIABLES", total_variables);
     dict.SetIntValue("TOTAL_RECORDLOG_VALUES", total_values);
     dict.SetValue("TOTAL_RAM", SiUnits(total_ram));
@@ -564,6 +828,7 @@ class DataStoreServer : private noncopyable {
   }
 
   DiskDatastore datastore;
+  IngestPipeline ingest_pipeline_;
   RetentionPolicyManager retention_policy_manager_;
   StoreFileManager store_file_manager_;
   DefaultThreadPoolPolicy thread_pool_policy_;
@@ -575,8 +840,11 @@ class DataStoreServer : private noncopyable {
   ExportedTimer add_request_timer_;
   ExportedTimer list_request_timer_;
   ExportedTimer get_request_timer_;
+  ExportedTimer label_values_request_timer_;
   ExportedRatio forwarded_streams_ratio_;
   ExportedInteger retention_policy_drops_;
+  scoped_ptr<LineProtocolListener> line_protocol_listener_;
+  scoped_ptr<rpc::RpcServer> rpc_server_;
   Timer run_timer_;
 };
 
@@ -121,7 +121,9 @@ void StoreFileManager::RunRetentionPolicy() {
           VLOG(1) << "  between " << Timestamp(front.timestamp()).GmTime() << " and "
                   << Timestamp(back.has_end_timestamp() ? back.end_timestamp() : back.timestamp()).GmTime();
           uint64_t end_timestamp = (back.has_end_timestamp() ?  back.end_timestamp() : back.timestamp());
-          auto &policy = retention_policy_manager_.GetPolicy(variable, Timestamp::Now() - end_timestamp);
+          shared_ptr<const proto::RetentionPolicyItem> policy_ref =
+              retention_policy_manager_.GetPolicy(variable, Timestamp::Now() - end_timestamp);
+          auto &policy = *policy_ref;
           string str = StringPrintf("  policy is to %s",
                                     policy.policy() == proto::RetentionPolicyItem::KEEP ? "keep" : "DROP");
           if (policy.mutation_size()) {
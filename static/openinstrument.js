@@ -46,6 +46,85 @@ StoreClient.prototype.List = function(request, success, error) {
   return response;
 }
 
+StoreClient.prototype.GetConfig = function(success, error) {
+  var response = new openinstrument.proto.StoreConfig();
+  $.ajax({
+    url: "/get_config",
+    type: 'POST',
+    data: "",
+    dataType: 'text',
+    success: function(text) {
+      response.ParseFromStream(new PROTO.Base64Stream(text));
+      success(response);
+    },
+    error: function(jqXHR, textStatus, errorThrown) {
+      if (error)
+        error(textStatus + errorThrown);
+      else
+        console.log("Error in /get_config request: " + errorThrown);
+    },
+  });
+  return response;
+}
+
+// Each series is only stored on one server, so the request is sent to every server and the counts for each value are
+// added together. Every server returns its first max_values values in order, so the merged list is complete.
+StoreClient.prototype.LabelValues = function(request, success, error) {
+  var client = this;
+  var output = new openinstrument.proto.LabelValuesResponse();
+  output.success = false;
+  output.errormessage = "No responses";
+  var fail = function(message) {
+    output.errormessage = message;
+    if (error)
+      error(output);
+  };
+  this.GetConfig(function(config) {
+    var pending = config.server.length;
+    var counts = {};
+    var finished = function() {
+      if (--pending > 0)
+        return;
+      var values = Object.keys(counts).sort();
+      if (request.max_values && values.length > request.max_values)
+        values = values.slice(0, request.max_values);
+      for (var i = 0; i < values.length; i++) {
+        var stats = new openinstrument.proto.LabelValueStats();
+        stats.value = values[i];
+        stats.series = PROTO.I64.fromNumber(counts[values[i]]);
+        output.value.push(stats);
+      }
+      if (output.success)
+        success(output);
+      else if (error)
+        error(output);
+    };
+    if (!pending) {
+      fail("No servers in store config");
+      return;
+    }
+    for (var i = 0; i < config.server.length; i++) {
+      var response = new openinstrument.proto.LabelValuesResponse();
+      client.SendRequest("http://" + config.server[i].address + "/label_values", request, response,
+        function(response) {
+          output.success = true;
+          output.errormessage = undefined;
+          for (var j = 0; j < response.value.length; j++) {
+            var value = response.value[j];
+            counts[value.value] = (counts[value.value] || 0) + value.series.toNumber();
+          }
+          finished();
+        },
+        function(response) {
+          if (!output.success)
+            output.errormessage = response.errormessage;
+          finished();
+        });
+    }
+  }, fail);
+  return output;
+}
+
 
 function ParseDuration(str) {
   var matches = str.match(/^(\d+)y$/);